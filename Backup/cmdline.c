@@ -38,6 +38,7 @@ static PPH_STRING CommandParameter;
 static PPH_STRING CommandParameter2;
 
 static BOOLEAN LastLineWasCr;
+static PH_QUEUED_LOCK ConsoleLock = PH_QUEUED_LOCK_INIT; // messages can come from several threads
 
 LONG BkRunCommandLine(
     VOID
@@ -73,6 +74,11 @@ LONG BkRunCommandLine(
         return 1;
     }
 
+    // Not listed in the help. Measures the pipe used to copy items between packages, so that
+    // changes to it can be compared. It doesn't need a configuration file.
+    if (PhEqualString2(Command, L"benchpipe", TRUE))
+        return BenchmarkPipe(CommandParameter);
+
     if (!ConfigFileName)
         ConfigFileName = PhCreateString(L"config.ini");
     //if (!Command)
@@ -85,6 +91,11 @@ LONG BkRunCommandLine(
         return 1;
     }
 
+    // Not listed in the help. Compares the compiled source filters with matching each pattern in
+    // turn, using the names of the files in the source directories.
+    if (PhEqualString2(Command, L"benchfilter", TRUE))
+        return BenchmarkFilters(config, CommandParameter);
+
     if (!config->DestinationDirectory)
     {
         wprintf(L"== Error: DestinationDirectory not specified in configuration file.\n");
@@ -341,6 +352,124 @@ LONG BkRunCommandLine(
             }
         }
     }
+    else if (PhEqualString2(Command, L"squash", TRUE))
+    {
+        ULONGLONG revisionId;
+        PEN_REVISION_RANGE ranges;
+        ULONG numberOfRanges;
+        PH_STRINGREF remainingPart;
+        PH_STRINGREF rangePart;
+        PH_STRINGREF firstPart;
+        PH_STRINGREF secondPart;
+        LONG64 first;
+        LONG64 last;
+        ULONG i;
+
+        if (CommandParameter)
+        {
+            // A list of ranges, e.g. "10:20,30:40".
+
+            numberOfRanges = 1;
+
+            for (i = 0; i < (ULONG)CommandParameter->Length / sizeof(WCHAR); i++)
+            {
+                if (CommandParameter->Buffer[i] == ',')
+                    numberOfRanges++;
+            }
+
+            ranges = PhAllocate(sizeof(EN_REVISION_RANGE) * numberOfRanges);
+            numberOfRanges = 0;
+            remainingPart = CommandParameter->sr;
+
+            while (remainingPart.Length != 0)
+            {
+                PhSplitStringRefAtChar(&remainingPart, ',', &rangePart, &remainingPart);
+
+                if (rangePart.Length == 0)
+                    continue;
+
+                if (!PhSplitStringRefAtChar(&rangePart, ':', &firstPart, &secondPart) ||
+                    !PhStringToInteger64(&firstPart, 10, &first) ||
+                    !PhStringToInteger64(&secondPart, 10, &last) ||
+                    first <= 0 || last <= 0)
+                {
+                    wprintf(L"== Error: invalid revision range '%.*s'\n", (ULONG)(rangePart.Length / sizeof(WCHAR)), rangePart.Buffer);
+                    return 1;
+                }
+
+                ranges[numberOfRanges].FirstRevisionId = first;
+                ranges[numberOfRanges].LastRevisionId = last;
+                numberOfRanges++;
+            }
+        }
+        else if (ParameterRevisionId != 0 && ParameterRevisionId2 != 0)
+        {
+            ranges = PhAllocate(sizeof(EN_REVISION_RANGE));
+            ranges[0].FirstRevisionId = ParameterRevisionId;
+            ranges[0].LastRevisionId = ParameterRevisionId2;
+            numberOfRanges = 1;
+        }
+        else
+        {
+            ranges = NULL;
+            numberOfRanges = 0;
+        }
+
+        if (numberOfRanges == 0)
+        {
+            wprintf(L"== Error: no revision range specified (use '-r first:last')\n");
+            wprintf(L"== Use 'bkc log' to see a list of revisions or use 'bkc --help squash'.\n");
+            return 1;
+        }
+
+        status = EnSquashRevisions(config, ranges, numberOfRanges, ConsoleMessageHandler, &revisionId);
+        RecoverAfterEngineMessages();
+        PhFree(ranges);
+
+        if (NT_SUCCESS(status))
+        {
+            wprintf(L"== At revision %I64u.\n", revisionId);
+        }
+        else
+        {
+            wprintf(L"== Error: 0x%x\n          %s\n", status, PhGetStringOrDefault(GetNtMessage(status), L"-"));
+            return 1;
+        }
+    }
+    else if (PhEqualString2(Command, L"recompress", TRUE))
+    {
+        ULONGLONG time;
+        LARGE_INTEGER maximumTimeStamp;
+        ULONG numberOfPackages;
+
+        time = ParameterTime;
+
+        if (time == 0)
+            time = (ULONGLONG)config->ColdAge * PH_TICKS_PER_DAY;
+
+        if (ParameterRevisionId == 0 && time == 0)
+        {
+            wprintf(L"== Error: no revision or time span specified (use '-r' or '-t')\n");
+            wprintf(L"== Use 'bkc --help recompress' for more information.\n");
+            return 1;
+        }
+
+        PhQuerySystemTime(&maximumTimeStamp);
+        maximumTimeStamp.QuadPart -= time;
+
+        status = EnRecompressRevisions(config, ParameterRevisionId, time != 0 ? &maximumTimeStamp : NULL, ConsoleMessageHandler, &numberOfPackages);
+        RecoverAfterEngineMessages();
+
+        if (NT_SUCCESS(status))
+        {
+            wprintf(L"== Recompressed %lu package(s).\n", numberOfPackages);
+        }
+        else
+        {
+            wprintf(L"== Error: 0x%x\n          %s\n", status, PhGetStringOrDefault(GetNtMessage(status), L"-"));
+            return 1;
+        }
+    }
     else if (PhEqualString2(Command, L"restore", TRUE))
     {
         PUNICODE_STRING currentDirectory;
@@ -665,6 +794,9 @@ static VOID ConsoleMessageHandler(
 {
     static ULONG ProgressCounter = 0;
 
+    // Package parts are created in parallel, so keep each message on its own line.
+    PhAcquireQueuedLockExclusive(&ConsoleLock);
+
     if (PhStartsWithString2(Message, L"Compressing: ", FALSE) ||
         PhStartsWithString2(Message, L"Extracting: ", FALSE))
     {
@@ -691,6 +823,8 @@ static VOID ConsoleMessageHandler(
         LastLineWasCr = FALSE;
     }
 
+    PhReleaseQueuedLockExclusive(&ConsoleLock);
+
     PhDereferenceObject(Message);
 }
 
@@ -837,6 +971,39 @@ static VOID PrintHelp(
                 );
             return;
         }
+        else if (PhEqualString2(Command, L"squash", TRUE))
+        {
+            wprintf(
+                L"Usage:\n\tbkc squash -r first:last [-c filename]\n"
+                L"\tbkc squash first:last[,first:last...] [-c filename]\n"
+                L"\tCombines each range of revisions into a single revision containing the files from the last revision in the range.\n"
+                L"\tRevisions after a range are renumbered so that revision IDs remain contiguous.\n"
+                L"\tRanges must be in ascending order and must not overlap.\n"
+                L"\n"
+                L"Examples:\n"
+                L"\t* The database contains revisions 4 .. 9. Running 'bkc squash -r 5:7' will combine revisions 5 to 7 into "
+                L"revision 5, and revisions 8 and 9 become revisions 6 and 7.\n"
+                L"\t* The database contains revisions 1 .. 20. Running 'bkc squash 2:5,10:19' will leave revisions 1 .. 8.\n"
+                );
+            return;
+        }
+        else if (PhEqualString2(Command, L"recompress", TRUE))
+        {
+            wprintf(
+                L"Usage:\n\tbkc recompress [-r revisionid] [-t timespec] [-c filename]\n"
+                L"\tRecompresses the packages of old revisions using the settings in [ColdCompression].\n"
+                L"\tIf a revision is specified using '-r', revisions up to and including that revision are recompressed.\n"
+                L"\tIf a time span is specified using '-t', revisions older than the time span are recompressed. "
+                L"If neither is specified, Age in [ColdCompression] is used.\n"
+                L"\tThe last revision is never recompressed. Revisions that have already been recompressed are skipped, "
+                L"so the command can be stopped at any time and run again later.\n"
+                L"\n"
+                L"Examples:\n"
+                L"\t* The database contains revisions 4 .. 9. Running 'bkc recompress -r 6' will recompress revisions 4 to 6.\n"
+                L"\t* Running 'bkc recompress -t 30d' will recompress all revisions created more than 30 days ago.\n"
+                );
+            return;
+        }
         else if (PhEqualString2(Command, L"restore", TRUE))
         {
             wprintf(
@@ -906,6 +1073,29 @@ static VOID PrintHelp(
                 L"\t\tIf set to 1, backups will be made using shadow copies.\n"
                 L"\t\tUse of this feature is recommended as locked files cannot be\n"
                 L"\t\tread otherwise.\n"
+                L"\tScanThreads = <number>\n"
+                L"\t\tSpecifies the number of directories that are listed at the\n"
+                L"\t\tsame time when looking for changes. The default is the number\n"
+                L"\t\tof processors. Set this to 1 to list directories one at a time.\n"
+                L"\tSkipUnchangedDirectories = 1 or 0\n"
+                L"\t\tIf set to 1, the files in a directory are not compared with the\n"
+                L"\t\tdatabase if the times of the directory and the names, times,\n"
+                L"\t\tsizes and attributes of its files are the same as in the\n"
+                L"\t\tprevious backup. These are combined into a single hash, and\n"
+                L"\t\ta file that could not be processed causes its directory to be\n"
+                L"\t\tcompared again. Not used when changes are read from\n"
+                L"\t\tChangeJournal.\n"
+                L"\t\tAll directories are compared again after [Map], the source\n"
+                L"\t\tdirectories and files or [SourceFilters] change.\n"
+                L"\tReadAheadSize = <megabytes>\n"
+                L"\t\tSpecifies the amount of memory used to read small files before\n"
+                L"\t\tthey are compressed. The default is 64. Set this to 0 to read\n"
+                L"\t\tfiles only when they are compressed.\n"
+                L"\tChangeJournal = <filename>\n"
+                L"\t\tSpecifies a file that another program appends the names of\n"
+                L"\t\tchanged files and directories to, one UTF-8 name per line.\n"
+                L"\t\tOnly directories containing these names are compared. If the\n"
+                L"\t\tjournal is replaced or truncated, all files are compared.\n"
                 L"\n"
                 L"[SourceFilters]\n"
                 L"\tInclude = <pattern>\n"
@@ -922,7 +1112,13 @@ static VOID PrintHelp(
                 L"\tExclude = <pattern>\n"
                 L"\tExcludeSize = <pattern>|<expression>\n"
                 L"\t\tSimilar to Include and IncludeSize, except that matching files\n"
-                L"\t\tare excluded.\n"
+                L"\t\tare excluded. Directories whose contents are excluded by a\n"
+                L"\t\tpattern ending in \"\\*\" are not listed at all.\n"
+                L"\tExcludeMarker = <filename>\n"
+                L"\t\tExcludes the contents of directories that contain a file with\n"
+                L"\t\tthis name, for example .nobackup. The directory itself is still\n"
+                L"\t\tbacked up. CACHEDIR.TAG files must contain the signature from\n"
+                L"\t\tthe Cache Directory Tagging Specification.\n"
                 L"\n"
                 L"[Destination]\n"
                 L"\tDirectory = <directoryname>\n"
@@ -936,6 +1132,88 @@ static VOID PrintHelp(
                 L"\t\tIf set to 1, any I/O errors during backup will cause the\n"
                 L"\t\tprogram to abort. If this option is enabled, UseTransactions\n"
                 L"\t\tshould also be enabled.\n"
+                L"\tMergeBufferSize = <megabytes>\n"
+                L"\t\tSpecifies the size of the buffer used to move files between\n"
+                L"\t\tpackages when revisions are trimmed. The default is 4 and the\n"
+                L"\t\tmaximum is 64.\n"
+                L"\n"
+                L"[Compression]\n"
+                L"\tLevel = 0 to 9\n"
+                L"\t\tSpecifies the compression level. 0 stores files without\n"
+                L"\t\tcompression and 9 gives the best compression.\n"
+                L"\tMethod = LZMA2, LZMA, PPMd or Copy\n"
+                L"\t\tSpecifies the compression method.\n"
+                L"\tDictionarySize = <megabytes>\n"
+                L"\t\tSpecifies the dictionary size (or the model size for PPMd).\n"
+                L"\tSolidBlockSize = <megabytes>\n"
+                L"\t\tSpecifies the solid block size. If set to 0, each file is\n"
+                L"\t\tcompressed separately.\n"
+                L"\tThreads = <number>\n"
+                L"\t\tSpecifies the number of compression threads.\n"
+                L"\tHeaderCompression = 1 or 0\n"
+                L"\t\tIf set to 1, package headers will be compressed.\n"
+                L"\tSortByType = 1 or 0\n"
+                L"\t\tIf set to 1, 7-Zip sorts files by extension before putting\n"
+                L"\t\tthem in solid blocks, which usually improves compression. If\n"
+                L"\t\tset to 0, 7-Zip sorts them by path, which keeps the files of a\n"
+                L"\t\tdirectory together and makes restoring a directory faster.\n"
+                L"\t\tThis is 7-Zip's own sort. Files are not grouped by name or\n"
+                L"\t\tsize similarity, and sorting by type can't be combined with\n"
+                L"\t\tkeeping directories together.\n"
+                L"\tParts = <number>\n"
+                L"\t\tSplits the files in each revision into this many packages,\n"
+                L"\t\twhich are compressed in parallel. The default is 1 and the\n"
+                L"\t\tmaximum is 14.\n"
+                L"\tChunkSize = <megabytes>\n"
+                L"\t\tFiles larger than this are split into chunks that are stored\n"
+                L"\t\tseparately, so that a large file can be compressed in parallel\n"
+                L"\t\twhen Parts is more than 1. The default is 0, which disables\n"
+                L"\t\tchunking.\n"
+                L"\tSmallFileSize = <kilobytes>\n"
+                L"\t\tFiles up to this size are compressed in a separate package\n"
+                L"\t\twith small solid blocks. No compression dictionary is trained\n"
+                L"\t\tor shared between blocks. Restoring one small file still\n"
+                L"\t\tdecompresses its whole solid block, up to SmallFileBlockSize,\n"
+                L"\t\tbut not the rest of the package. The default is 0, which\n"
+                L"\t\tdisables this.\n"
+                L"\tSmallFileBlockSize = <megabytes>\n"
+                L"\t\tSpecifies the solid block size used for small files. Smaller\n"
+                L"\t\tblocks make restoring a single file faster but compress less.\n"
+                L"\t\tThe default is 1.\n"
+                L"\tPipelineSize = <megabytes>\n"
+                L"\t\tStarts compressing new and modified files while the rest of\n"
+                L"\t\tthe source is still being compared. Each batch of about this\n"
+                L"\t\tsize is stored in a separate package, and at most 14 - Parts\n"
+                L"\t\tbatches are created. Files that are found after that,\n"
+                L"\t\tdirectories, small files and files that are stored without\n"
+                L"\t\tcompression are packaged after the comparison. The default is\n"
+                L"\t\t0, which disables this.\n"
+                L"\tStoreIncompressible = 1 or 0\n"
+                L"\t\tIf set to 1, files that are already compressed (such as\n"
+                L"\t\tarchives, images and videos) are stored without compression\n"
+                L"\t\tin a separate package. Files are recognized by their extension\n"
+                L"\t\tor by sampling their contents.\n"
+                L"\tStoreExtension = <extension>\n"
+                L"\t\tAdds an extension (e.g. .dat) to the list of extensions used\n"
+                L"\t\tby StoreIncompressible. You can specify this multiple times.\n"
+                L"\t\tSettings that are not specified use the 7-Zip defaults.\n"
+                L"\t\tCompressionLevel in [Destination] is the same as Level.\n"
+                L"\n"
+                L"[TrimCompression]\n"
+                L"\t\tSimilar to [Compression], except that the settings apply to\n"
+                L"\t\tpackages that are merged when revisions are trimmed or\n"
+                L"\t\tsquashed. Settings that are not specified are taken from\n"
+                L"\t\t[Compression].\n"
+                L"\n"
+                L"[ColdCompression]\n"
+                L"\t\tSimilar to [Compression], except that the settings apply to\n"
+                L"\t\tpackages that are recompressed by 'bkc recompress'. Use a\n"
+                L"\t\thigher level or a larger dictionary here to reduce the size of\n"
+                L"\t\trevisions that are rarely restored. Settings that are not\n"
+                L"\t\tspecified are taken from [TrimCompression].\n"
+                L"\tAge = <days>\n"
+                L"\t\tSpecifies the age of revisions that 'bkc recompress'\n"
+                L"\t\trecompresses when no revision or time span is given.\n"
                 L"\n"
                 L"Notes:\n"
                 L"\n"
@@ -963,6 +1241,8 @@ static VOID PrintHelp(
         L"\tbackup\t\tPerforms a backup.\n"
         L"\trevert\t\tReverts to a revision.\n"
         L"\ttrim\t\tDeletes old revisions.\n"
+        L"\tsquash\t\tCombines ranges of revisions.\n"
+        L"\trecompress\tRecompresses old revisions using stronger settings.\n"
         L"\trestore\t\tRestores a file or directory.\n"
         L"\tlist\t\tLists or searches for files in the database.\n"
         L"\tcompact\t\tAttempts to reduce the size of the database.\n"
@@ -1020,3 +1300,254 @@ static PPH_STRING FixMultipleBackslashes(
 
     return PhFinalStringBuilderString(&sb);
 }
+
+static LONG BenchmarkPipe(
+    _In_opt_ PPH_STRING SizeString
+    )
+{
+    ULONG64 sizeInMb;
+    ULONG bufferSize;
+    LARGE_INTEGER duration;
+    HRESULT result;
+
+    sizeInMb = 1024;
+
+    if (SizeString)
+        PhStringToInteger64(&SizeString->sr, 10, &sizeInMb);
+
+    if (sizeInMb == 0)
+        sizeInMb = 1024;
+
+    wprintf(L"Moving %I64u MB through the pipe.\n", sizeInMb);
+
+    for (bufferSize = PK_MINIMUM_PIPE_BUFFER_SIZE / 1024 / 1024; bufferSize <= PK_MAXIMUM_PIPE_BUFFER_SIZE / 1024 / 1024; bufferSize *= 2)
+    {
+        result = PkBenchmarkPipe(sizeInMb * 1024 * 1024, bufferSize, &duration);
+
+        if (!SUCCEEDED(result))
+        {
+            wprintf(L"== Error: 0x%x\n", result);
+            return 1;
+        }
+
+        // The duration is in 100ns units.
+        wprintf(L"%2lu MB buffer: %I64u ms, %I64u MB/s\n", bufferSize, duration.QuadPart / 10000,
+            duration.QuadPart != 0 ? sizeInMb * 10000000 / duration.QuadPart : 0);
+    }
+
+    return 0;
+}
+
+static BOOLEAN NTAPI BenchmarkFiltersEnumDirectoryFile(
+    _In_ PFILE_DIRECTORY_INFORMATION Information,
+    _In_opt_ PVOID Context
+    )
+{
+    static PH_STRINGREF backslashString = PH_STRINGREF_INIT(L"\\");
+
+    PBENCHMARK_FILTERS_CONTEXT context = Context;
+    PH_STRINGREF fileName;
+    PPH_STRING name;
+
+    fileName.Buffer = Information->FileName;
+    fileName.Length = Information->FileNameLength;
+
+    if (PhEqualStringRef2(&fileName, L".", FALSE) || PhEqualStringRef2(&fileName, L"..", FALSE))
+        return TRUE;
+
+    name = PhConcatStringRef3(&context->DirectoryName->sr, &backslashString, &fileName);
+    PhAddItemList(context->Names, name);
+
+    if ((Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(Information->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+    {
+        PhReferenceObject(name);
+        PhAddItemList(context->Directories, name);
+    }
+
+    return context->Names->Count < context->MaximumNames;
+}
+
+static BOOLEAN BenchmarkFiltersMatchLinear(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING FileName
+    )
+{
+    ULONG i;
+    BOOLEAN include;
+
+    // This is how file names were matched before the filters were compiled.
+
+    if (Config->IncludeList->Count != 0)
+    {
+        include = FALSE;
+
+        for (i = 0; i < Config->IncludeList->Count; i++)
+        {
+            if (PhMatchWildcards(((PPH_STRING)Config->IncludeList->Items[i])->Buffer, FileName->Buffer, TRUE))
+            {
+                include = TRUE;
+                break;
+            }
+        }
+
+        if (!include)
+            return FALSE;
+    }
+
+    for (i = 0; i < Config->ExcludeList->Count; i++)
+    {
+        if (PhMatchWildcards(((PPH_STRING)Config->ExcludeList->Items[i])->Buffer, FileName->Buffer, TRUE))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN BenchmarkFiltersMatchCompiled(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING FileName
+    )
+{
+    // The same as EnpMatchFileName.
+
+    if (Config->IncludeList->Count != 0 && !BkMatchFilterSet(&Config->IncludeFilterSet, FileName))
+        return FALSE;
+    if (BkMatchFilterSet(&Config->ExcludeFilterSet, FileName))
+        return FALSE;
+
+    return TRUE;
+}
+
+static LONG BenchmarkFilters(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PPH_STRING CountString
+    )
+{
+    NTSTATUS status;
+    BENCHMARK_FILTERS_CONTEXT context;
+    ULONG64 maximumNames;
+    PPH_STRING name;
+    HANDLE fileHandle;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
+    LONG64 linearDuration;
+    LONG64 compiledDuration;
+    ULONG linearMatches;
+    ULONG compiledMatches;
+    ULONG pass;
+    ULONG i;
+
+    maximumNames = BENCHMARK_FILTERS_DEFAULT_NAMES;
+
+    if (CountString)
+        PhStringToInteger64(&CountString->sr, 10, &maximumNames);
+
+    if (maximumNames == 0 || maximumNames > MAXLONG)
+        maximumNames = BENCHMARK_FILTERS_DEFAULT_NAMES;
+
+    context.Names = PhCreateList((ULONG)min(maximumNames, 65536));
+    context.Directories = PhCreateList(64);
+    context.MaximumNames = (ULONG)maximumNames;
+
+    for (i = 0; i < Config->SourceDirectoryList->Count; i++)
+    {
+        name = Config->SourceDirectoryList->Items[i];
+
+        if (PhEndsWithStringRef2(&name->sr, L"\\", FALSE))
+            name = PhCreateStringEx(name->Buffer, name->Length - sizeof(WCHAR));
+        else
+            PhReferenceObject(name);
+
+        PhAddItemList(context.Directories, name);
+    }
+
+    // List the source directories depth first until there are enough names.
+
+    while (context.Directories->Count != 0)
+    {
+        context.DirectoryName = context.Directories->Items[context.Directories->Count - 1];
+        PhRemoveItemList(context.Directories, context.Directories->Count - 1);
+
+        if (context.Names->Count < context.MaximumNames)
+        {
+            status = PhCreateFileWin32(
+                &fileHandle,
+                context.DirectoryName->Buffer,
+                FILE_LIST_DIRECTORY | SYNCHRONIZE,
+                0,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                FILE_OPEN,
+                FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT
+                );
+
+            if (NT_SUCCESS(status))
+            {
+                PhEnumDirectoryFile(fileHandle, NULL, BenchmarkFiltersEnumDirectoryFile, &context);
+                NtClose(fileHandle);
+            }
+        }
+
+        PhDereferenceObject(context.DirectoryName);
+    }
+
+    PhDereferenceObject(context.Directories);
+
+    if (context.Names->Count == 0)
+    {
+        wprintf(L"== Error: No files found in the source directories.\n");
+        PhDereferenceObject(context.Names);
+        return 1;
+    }
+
+    wprintf(L"Matching %lu names against %lu include and %lu exclude patterns, %lu times.\n",
+        context.Names->Count, Config->IncludeList->Count, Config->ExcludeList->Count, BENCHMARK_FILTERS_PASSES);
+    wprintf(L"%lu patterns are not in the trie and are checked one at a time.\n",
+        Config->IncludeFilterSet.NumberOfOtherFilters + Config->ExcludeFilterSet.NumberOfOtherFilters);
+
+    linearMatches = 0;
+    PhQuerySystemTime(&startTime);
+
+    for (pass = 0; pass < BENCHMARK_FILTERS_PASSES; pass++)
+    {
+        for (i = 0; i < context.Names->Count; i++)
+        {
+            if (BenchmarkFiltersMatchLinear(Config, context.Names->Items[i]))
+                linearMatches++;
+        }
+    }
+
+    PhQuerySystemTime(&endTime);
+    linearDuration = endTime.QuadPart - startTime.QuadPart;
+
+    compiledMatches = 0;
+    PhQuerySystemTime(&startTime);
+
+    for (pass = 0; pass < BENCHMARK_FILTERS_PASSES; pass++)
+    {
+        for (i = 0; i < context.Names->Count; i++)
+        {
+            if (BenchmarkFiltersMatchCompiled(Config, context.Names->Items[i]))
+                compiledMatches++;
+        }
+    }
+
+    PhQuerySystemTime(&endTime);
+    compiledDuration = endTime.QuadPart - startTime.QuadPart;
+
+    // The durations are in 100ns units.
+    wprintf(L"Linear:   %I64d ms, %I64d ns per name\n", linearDuration / 10000,
+        linearDuration * 100 / ((LONG64)context.Names->Count * BENCHMARK_FILTERS_PASSES));
+    wprintf(L"Compiled: %I64d ms, %I64d ns per name\n", compiledDuration / 10000,
+        compiledDuration * 100 / ((LONG64)context.Names->Count * BENCHMARK_FILTERS_PASSES));
+
+    PhDereferenceObject(context.Names);
+
+    if (linearMatches != compiledMatches)
+    {
+        wprintf(L"== Error: %lu names matched with the linear filters, but %lu with the compiled filters.\n",
+            linearMatches / BENCHMARK_FILTERS_PASSES, compiledMatches / BENCHMARK_FILTERS_PASSES);
+        return 1;
+    }
+
+    return 0;
+}
@@ -44,4 +44,39 @@ PPH_STRING FixMultipleBackslashes(
     _In_ PPH_STRINGREF String
     );
 
+LONG BenchmarkPipe(
+    _In_opt_ PPH_STRING SizeString
+    );
+
+#define BENCHMARK_FILTERS_DEFAULT_NAMES 100000
+#define BENCHMARK_FILTERS_PASSES 10
+
+typedef struct _BENCHMARK_FILTERS_CONTEXT
+{
+    PPH_LIST Names;
+    PPH_LIST Directories; // still to be listed
+    PPH_STRING DirectoryName;
+    ULONG MaximumNames;
+} BENCHMARK_FILTERS_CONTEXT, *PBENCHMARK_FILTERS_CONTEXT;
+
+BOOLEAN NTAPI BenchmarkFiltersEnumDirectoryFile(
+    _In_ PFILE_DIRECTORY_INFORMATION Information,
+    _In_opt_ PVOID Context
+    );
+
+BOOLEAN BenchmarkFiltersMatchLinear(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING FileName
+    );
+
+BOOLEAN BenchmarkFiltersMatchCompiled(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING FileName
+    );
+
+LONG BenchmarkFilters(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PPH_STRING CountString
+    );
+
 #endif
@@ -175,10 +175,253 @@ ULONG BkpSectionNameToNumber(
         return BK_CONFIG_SECTION_SOURCEFILTERS;
     if (PhEqualStringRef2(SectionName, L"Destination", TRUE))
         return BK_CONFIG_SECTION_DESTINATION;
+    if (PhEqualStringRef2(SectionName, L"Compression", TRUE))
+        return BK_CONFIG_SECTION_COMPRESSION;
+    if (PhEqualStringRef2(SectionName, L"TrimCompression", TRUE))
+        return BK_CONFIG_SECTION_TRIMCOMPRESSION;
+    if (PhEqualStringRef2(SectionName, L"ColdCompression", TRUE))
+        return BK_CONFIG_SECTION_COLDCOMPRESSION;
 
     return 0;
 }
 
+VOID BkpParseCompressionSetting(
+    _Inout_ PPK_COMPRESSION_SETTINGS Settings,
+    _In_ PPH_STRINGREF Name,
+    _In_ PPH_STRINGREF Value
+    )
+{
+    LONG64 integer;
+
+    if (PhEqualStringRef2(Name, L"Method", TRUE))
+    {
+        if (PhEqualStringRef2(Value, L"LZMA2", TRUE))
+            Settings->Method = PkLzma2Method;
+        else if (PhEqualStringRef2(Value, L"LZMA", TRUE))
+            Settings->Method = PkLzmaMethod;
+        else if (PhEqualStringRef2(Value, L"PPMd", TRUE))
+            Settings->Method = PkPpmdMethod;
+        else if (PhEqualStringRef2(Value, L"Copy", TRUE) || PhEqualStringRef2(Value, L"Store", TRUE))
+            Settings->Method = PkCopyMethod;
+    }
+    else if (PhStringToInteger64(Value, 10, &integer) && integer >= 0)
+    {
+        if (PhEqualStringRef2(Name, L"Level", TRUE))
+            Settings->Level = (ULONG)min(integer, 9);
+        else if (PhEqualStringRef2(Name, L"DictionarySize", TRUE))
+            Settings->DictionarySize = (ULONG)integer;
+        else if (PhEqualStringRef2(Name, L"SolidBlockSize", TRUE))
+            Settings->SolidBlockSize = (ULONG)integer;
+        else if (PhEqualStringRef2(Name, L"Threads", TRUE))
+            Settings->NumberOfThreads = (ULONG)integer;
+        else if (PhEqualStringRef2(Name, L"HeaderCompression", TRUE))
+            Settings->HeaderCompression = !!integer;
+        else if (PhEqualStringRef2(Name, L"SortByType", TRUE))
+            Settings->SortByType = !!integer;
+    }
+}
+
+ULONG64 BkpStringToSize(
+    _In_ PPH_STRINGREF String
+    )
+{
+    PH_STRINGREF string;
+    ULONG64 integer;
+    ULONG64 multiplier;
+
+    string = *String;
+    multiplier = 1;
+
+    if (PhEndsWithStringRef2(&string, L"KB", TRUE))
+    {
+        string.Length -= 2 * sizeof(WCHAR);
+        multiplier = 1024;
+    }
+    else if (PhEndsWithStringRef2(&string, L"MB", TRUE))
+    {
+        string.Length -= 2 * sizeof(WCHAR);
+        multiplier = 1024 * 1024;
+    }
+    else if (PhEndsWithStringRef2(&string, L"GB", TRUE))
+    {
+        string.Length -= 2 * sizeof(WCHAR);
+        multiplier = 1024 * 1024 * 1024;
+    }
+    else if (string.Length >= 2 * sizeof(WCHAR) &&
+        PhEndsWithStringRef2(&string, L"B", TRUE) &&
+        PhIsDigitCharacter(string.Buffer[string.Length / sizeof(WCHAR) - 2]))
+    {
+        string.Length -= sizeof(WCHAR);
+    }
+    else
+    {
+        return 0;
+    }
+
+    PhStringToInteger64(&string, 10, &integer);
+    integer *= multiplier;
+
+    return integer;
+}
+
+VOID BkpCompileFilter(
+    _Out_ PBK_FILTER Filter,
+    _In_ PPH_STRINGREF Pattern
+    )
+{
+    ULONG_PTR starIndex;
+    ULONG_PTR questionIndex;
+
+    if (Pattern->Length == 0)
+    {
+        // Matches every file.
+        Filter->Type = BK_FILTER_PREFIX;
+        Filter->Pattern = NULL;
+        PhInitializeEmptyStringRef(&Filter->Literal);
+        return;
+    }
+
+    Filter->Pattern = PhCreateStringEx(Pattern->Buffer, Pattern->Length);
+    Filter->Literal = Filter->Pattern->sr;
+
+    // Most patterns are a path followed by "*" or "*" followed by an extension. These can be
+    // matched with a single comparison instead of PhMatchWildcards.
+
+    starIndex = PhFindCharInStringRef(&Filter->Literal, '*', FALSE);
+    questionIndex = PhFindCharInStringRef(&Filter->Literal, '?', FALSE);
+
+    if (starIndex == -1 && questionIndex == -1)
+    {
+        Filter->Type = BK_FILTER_EXACT;
+    }
+    else if (questionIndex == -1 && starIndex == Filter->Literal.Length / sizeof(WCHAR) - 1)
+    {
+        Filter->Type = BK_FILTER_PREFIX;
+        Filter->Literal.Length -= sizeof(WCHAR);
+    }
+    else if (questionIndex == -1 && starIndex == 0 && PhFindLastCharInStringRef(&Filter->Literal, '*', FALSE) == 0)
+    {
+        Filter->Type = BK_FILTER_SUFFIX;
+        Filter->Literal.Buffer++;
+        Filter->Literal.Length -= sizeof(WCHAR);
+    }
+    else
+    {
+        // Files that don't start with the literal prefix can be rejected quickly.
+        Filter->Type = BK_FILTER_WILDCARDS;
+        Filter->Literal.Length = min(starIndex, questionIndex) * sizeof(WCHAR);
+    }
+}
+
+ULONG BkpAddFilterTrieNode(
+    _Inout_ PBK_FILTER_SET FilterSet,
+    _In_ ULONG Parent,
+    _In_ WCHAR Character
+    )
+{
+    ULONG index;
+    PBK_FILTER_TRIE_NODE node;
+
+    for (index = FilterSet->Nodes[Parent].Child; index != 0; index = FilterSet->Nodes[index].Next)
+    {
+        if (FilterSet->Nodes[index].Character == Character)
+            return index;
+    }
+
+    if (FilterSet->NumberOfNodes == FilterSet->AllocatedNodes)
+    {
+        FilterSet->AllocatedNodes *= 2;
+        FilterSet->Nodes = PhReAllocate(FilterSet->Nodes, sizeof(BK_FILTER_TRIE_NODE) * FilterSet->AllocatedNodes);
+    }
+
+    index = FilterSet->NumberOfNodes++;
+    node = &FilterSet->Nodes[index];
+    memset(node, 0, sizeof(BK_FILTER_TRIE_NODE));
+    node->Character = Character;
+    node->Next = FilterSet->Nodes[Parent].Child;
+    FilterSet->Nodes[Parent].Child = index;
+
+    return index;
+}
+
+VOID BkpInitializeFilterSet(
+    _Out_ PBK_FILTER_SET FilterSet,
+    _In_reads_(NumberOfFilters) PBK_FILTER Filters,
+    _In_ ULONG NumberOfFilters
+    )
+{
+    ULONG i;
+    ULONG index;
+    SIZE_T j;
+
+    FilterSet->AllocatedNodes = 64;
+    FilterSet->Nodes = PhAllocate(sizeof(BK_FILTER_TRIE_NODE) * FilterSet->AllocatedNodes);
+    FilterSet->NumberOfNodes = 1;
+    memset(&FilterSet->Nodes[0], 0, sizeof(BK_FILTER_TRIE_NODE));
+    FilterSet->OtherFilters = PhAllocate(sizeof(PBK_FILTER) * max(NumberOfFilters, 1));
+    FilterSet->NumberOfOtherFilters = 0;
+
+    for (i = 0; i < NumberOfFilters; i++)
+    {
+        if (Filters[i].Type != BK_FILTER_EXACT && Filters[i].Type != BK_FILTER_PREFIX)
+        {
+            FilterSet->OtherFilters[FilterSet->NumberOfOtherFilters++] = &Filters[i];
+            continue;
+        }
+
+        index = 0;
+
+        for (j = 0; j < Filters[i].Literal.Length / sizeof(WCHAR); j++)
+            index = BkpAddFilterTrieNode(FilterSet, index, RtlUpcaseUnicodeChar(Filters[i].Literal.Buffer[j]));
+
+        if (Filters[i].Type == BK_FILTER_EXACT)
+            FilterSet->Nodes[index].Exact = TRUE;
+        else
+            FilterSet->Nodes[index].Prefix = TRUE;
+    }
+}
+
+VOID BkpDeleteFilterSet(
+    _In_ PBK_FILTER_SET FilterSet
+    )
+{
+    PhFree(FilterSet->Nodes);
+    PhFree(FilterSet->OtherFilters);
+}
+
+VOID BkpCompileSizeFilter(
+    _Out_ PBK_SIZE_FILTER Filter,
+    _In_ PPH_STRINGREF String
+    )
+{
+    PH_STRINGREF filePart;
+    PH_STRINGREF string;
+
+    if (!PhSplitStringRefAtLastChar(String, '|', &filePart, &string))
+    {
+        PhInitializeEmptyStringRef(&filePart);
+        string = *String;
+    }
+
+    BkpCompileFilter(&Filter->Filter, &filePart);
+    Filter->Comparison = BK_SIZE_FILTER_NONE;
+    Filter->Size = 0;
+
+    if (string.Length == 0)
+        return;
+
+    if (string.Buffer[0] == '>')
+        Filter->Comparison = BK_SIZE_FILTER_GREATER;
+    else if (string.Buffer[0] == '<')
+        Filter->Comparison = BK_SIZE_FILTER_LESS;
+    else
+        return;
+
+    string.Buffer++;
+    string.Length -= sizeof(WCHAR);
+    Filter->Size = BkpStringToSize(&string);
+}
+
 BOOLEAN BkCreateConfigFromString(
     _In_ PPH_STRINGREF String,
     _Out_ PBK_CONFIG *Config
@@ -188,6 +431,7 @@ BOOLEAN BkCreateConfigFromString(
     PH_STRINGREF currentLine;
     PH_STRINGREF remainingString;
     ULONG currentSection;
+    ULONG i;
 
     config = PhAllocate(sizeof(BK_CONFIG));
     memset(config, 0, sizeof(BK_CONFIG));
@@ -199,6 +443,12 @@ BOOLEAN BkCreateConfigFromString(
     config->ExcludeList = PhCreateList(8);
     config->IncludeSizeList = PhCreateList(8);
     config->ExcludeSizeList = PhCreateList(8);
+    config->ExcludeMarkerList = PhCreateList(2);
+    config->StoreExtensionList = PhCreateList(8);
+    PkInitializeCompressionSettings(&config->Compression);
+    PkInitializeCompressionSettings(&config->TrimCompression);
+    PkInitializeCompressionSettings(&config->ColdCompression);
+    config->ReadAheadSize = BK_DEFAULT_READ_AHEAD_SIZE;
 
     remainingString = *String;
     currentSection = 0;
@@ -255,6 +505,31 @@ BOOLEAN BkCreateConfigFromString(
                         PhStringToInteger64(&rhs, 10, &integer);
                         config->UseShadowCopy = (ULONG)integer;
                     }
+                    else if (PhEqualStringRef2(&lhs, L"ScanThreads", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->ScanThreads = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"SkipUnchangedDirectories", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->SkipUnchangedDirectories = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"ReadAheadSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->ReadAheadSize = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"UnbufferedReads", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->UnbufferedReads = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"ChangeJournal", TRUE))
+                    {
+                        if (rhs.Length != 0)
+                            PhMoveReference(&config->ChangeJournal, PhCreateStringEx(rhs.Buffer, rhs.Length));
+                    }
                 }
                 break;
             case BK_CONFIG_SECTION_SOURCEFILTERS:
@@ -279,6 +554,11 @@ BOOLEAN BkCreateConfigFromString(
                         if (rhs.Length != 0)
                             PhAddItemList(config->ExcludeSizeList, PhCreateStringEx(rhs.Buffer, rhs.Length));
                     }
+                    else if (PhEqualStringRef2(&lhs, L"ExcludeMarker", TRUE))
+                    {
+                        if (rhs.Length != 0)
+                            PhAddItemList(config->ExcludeMarkerList, PhCreateStringEx(rhs.Buffer, rhs.Length));
+                    }
                 }
                 break;
             case BK_CONFIG_SECTION_DESTINATION:
@@ -289,8 +569,9 @@ BOOLEAN BkCreateConfigFromString(
                     }
                     else if (PhEqualStringRef2(&lhs, L"CompressionLevel", TRUE))
                     {
-                        PhStringToInteger64(&rhs, 10, &integer);
-                        config->CompressionLevel = (ULONG)integer;
+                        // Same as Level in [Compression].
+                        if (PhStringToInteger64(&rhs, 10, &integer) && integer >= 0)
+                            config->Compression.Level = (ULONG)min(integer, 9);
                     }
                     else if (PhEqualStringRef2(&lhs, L"UseTransactions", TRUE))
                     {
@@ -302,12 +583,155 @@ BOOLEAN BkCreateConfigFromString(
                         PhStringToInteger64(&rhs, 10, &integer);
                         config->Strict = (ULONG)integer;
                     }
+                    else if (PhEqualStringRef2(&lhs, L"MergeBufferSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->MergeBufferSize = (ULONG)integer;
+                    }
+                }
+                break;
+            case BK_CONFIG_SECTION_COMPRESSION:
+                {
+                    static PH_STRINGREF dotString = PH_STRINGREF_INIT(L".");
+
+                    if (PhEqualStringRef2(&lhs, L"StoreIncompressible", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->StoreIncompressible = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"Parts", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->NumberOfParts = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"ChunkSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->ChunkSize = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"SmallFileSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->SmallFileSize = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"SmallFileBlockSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->SmallFileBlockSize = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"PipelineSize", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->PipelineSize = (ULONG)integer;
+                    }
+                    else if (PhEqualStringRef2(&lhs, L"StoreExtension", TRUE))
+                    {
+                        if (rhs.Length != 0)
+                        {
+                            if (rhs.Buffer[0] == '.')
+                                PhAddItemList(config->StoreExtensionList, PhCreateStringEx(rhs.Buffer, rhs.Length));
+                            else
+                                PhAddItemList(config->StoreExtensionList, PhConcatStringRef2(&dotString, &rhs));
+                        }
+                    }
+                    else
+                    {
+                        BkpParseCompressionSetting(&config->Compression, &lhs, &rhs);
+                    }
+                }
+                break;
+            case BK_CONFIG_SECTION_TRIMCOMPRESSION:
+                BkpParseCompressionSetting(&config->TrimCompression, &lhs, &rhs);
+                break;
+            case BK_CONFIG_SECTION_COLDCOMPRESSION:
+                {
+                    if (PhEqualStringRef2(&lhs, L"Age", TRUE))
+                    {
+                        PhStringToInteger64(&rhs, 10, &integer);
+                        config->ColdAge = (ULONG)integer;
+                    }
+                    else
+                    {
+                        BkpParseCompressionSetting(&config->ColdCompression, &lhs, &rhs);
+                    }
                 }
                 break;
             }
         }
     }
 
+    // Trim settings that aren't specified are the same as the backup settings.
+
+    if (config->TrimCompression.Level == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.Level = config->Compression.Level;
+    if (config->TrimCompression.Method == PkDefaultMethod)
+        config->TrimCompression.Method = config->Compression.Method;
+    if (config->TrimCompression.DictionarySize == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.DictionarySize = config->Compression.DictionarySize;
+    if (config->TrimCompression.SolidBlockSize == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.SolidBlockSize = config->Compression.SolidBlockSize;
+    if (config->TrimCompression.NumberOfThreads == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.NumberOfThreads = config->Compression.NumberOfThreads;
+    if (config->TrimCompression.HeaderCompression == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.HeaderCompression = config->Compression.HeaderCompression;
+    if (config->TrimCompression.SortByType == PK_COMPRESSION_DEFAULT)
+        config->TrimCompression.SortByType = config->Compression.SortByType;
+
+    // Cold settings that aren't specified are the same as the trim settings.
+
+    if (config->ColdCompression.Level == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.Level = config->TrimCompression.Level;
+    if (config->ColdCompression.Method == PkDefaultMethod)
+        config->ColdCompression.Method = config->TrimCompression.Method;
+    if (config->ColdCompression.DictionarySize == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.DictionarySize = config->TrimCompression.DictionarySize;
+    if (config->ColdCompression.SolidBlockSize == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.SolidBlockSize = config->TrimCompression.SolidBlockSize;
+    if (config->ColdCompression.NumberOfThreads == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.NumberOfThreads = config->TrimCompression.NumberOfThreads;
+    if (config->ColdCompression.HeaderCompression == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.HeaderCompression = config->TrimCompression.HeaderCompression;
+    if (config->ColdCompression.SortByType == PK_COMPRESSION_DEFAULT)
+        config->ColdCompression.SortByType = config->TrimCompression.SortByType;
+
+    // Compile the filters so that matching a file doesn't need to parse them again.
+
+    config->IncludeFilters = PhAllocate(sizeof(BK_FILTER) * max(config->IncludeList->Count, 1));
+    config->ExcludeFilters = PhAllocate(sizeof(BK_FILTER) * max(config->ExcludeList->Count, 1));
+    config->IncludeSizeFilters = PhAllocate(sizeof(BK_SIZE_FILTER) * max(config->IncludeSizeList->Count, 1));
+    config->ExcludeSizeFilters = PhAllocate(sizeof(BK_SIZE_FILTER) * max(config->ExcludeSizeList->Count, 1));
+
+    for (i = 0; i < config->IncludeList->Count; i++)
+        BkpCompileFilter(&config->IncludeFilters[i], &((PPH_STRING)config->IncludeList->Items[i])->sr);
+    for (i = 0; i < config->ExcludeList->Count; i++)
+        BkpCompileFilter(&config->ExcludeFilters[i], &((PPH_STRING)config->ExcludeList->Items[i])->sr);
+    for (i = 0; i < config->IncludeSizeList->Count; i++)
+        BkpCompileSizeFilter(&config->IncludeSizeFilters[i], &((PPH_STRING)config->IncludeSizeList->Items[i])->sr);
+    for (i = 0; i < config->ExcludeSizeList->Count; i++)
+        BkpCompileSizeFilter(&config->ExcludeSizeFilters[i], &((PPH_STRING)config->ExcludeSizeList->Items[i])->sr);
+
+    BkpInitializeFilterSet(&config->IncludeFilterSet, config->IncludeFilters, config->IncludeList->Count);
+    BkpInitializeFilterSet(&config->ExcludeFilterSet, config->ExcludeFilters, config->ExcludeList->Count);
+
+    // An exclude pattern that ends in "\*" excludes everything in the directories it matches, so
+    // those directories don't need to be listed.
+
+    config->ExcludeSubtreeFilters = PhAllocate(sizeof(BK_FILTER) * max(config->ExcludeList->Count, 1));
+    config->NumberOfExcludeSubtreeFilters = 0;
+
+    for (i = 0; i < config->ExcludeList->Count; i++)
+    {
+        PH_STRINGREF pattern;
+
+        pattern = ((PPH_STRING)config->ExcludeList->Items[i])->sr;
+
+        if (PhEndsWithStringRef2(&pattern, L"\\*", FALSE))
+        {
+            pattern.Length -= sizeof(WCHAR);
+            BkpCompileFilter(&config->ExcludeSubtreeFilters[config->NumberOfExcludeSubtreeFilters++], &pattern);
+        }
+    }
+
     *Config = config;
 
     return TRUE;
@@ -327,10 +751,42 @@ VOID BkDereferenceStringList(
     PhDereferenceObject(List);
 }
 
+VOID BkpDeleteFilter(
+    _In_ PBK_FILTER Filter
+    )
+{
+    if (Filter->Pattern)
+        PhDereferenceObject(Filter->Pattern);
+}
+
 VOID BkFreeConfig(
     _In_ PBK_CONFIG Config
     )
 {
+    ULONG i;
+
+    for (i = 0; i < Config->IncludeList->Count; i++)
+        BkpDeleteFilter(&Config->IncludeFilters[i]);
+    for (i = 0; i < Config->ExcludeList->Count; i++)
+        BkpDeleteFilter(&Config->ExcludeFilters[i]);
+    for (i = 0; i < Config->IncludeSizeList->Count; i++)
+        BkpDeleteFilter(&Config->IncludeSizeFilters[i].Filter);
+    for (i = 0; i < Config->ExcludeSizeList->Count; i++)
+        BkpDeleteFilter(&Config->ExcludeSizeFilters[i].Filter);
+    for (i = 0; i < Config->NumberOfExcludeSubtreeFilters; i++)
+        BkpDeleteFilter(&Config->ExcludeSubtreeFilters[i]);
+
+    if (Config->IncludeFilterSet.Nodes)
+        BkpDeleteFilterSet(&Config->IncludeFilterSet);
+    if (Config->ExcludeFilterSet.Nodes)
+        BkpDeleteFilterSet(&Config->ExcludeFilterSet);
+
+    PhFree(Config->IncludeFilters);
+    PhFree(Config->ExcludeFilters);
+    PhFree(Config->IncludeSizeFilters);
+    PhFree(Config->ExcludeSizeFilters);
+    PhFree(Config->ExcludeSubtreeFilters);
+
     BkDereferenceStringList(Config->MapFromList);
     BkDereferenceStringList(Config->MapToList);
     BkDereferenceStringList(Config->SourceDirectoryList);
@@ -339,7 +795,105 @@ VOID BkFreeConfig(
     BkDereferenceStringList(Config->ExcludeList);
     BkDereferenceStringList(Config->IncludeSizeList);
     BkDereferenceStringList(Config->ExcludeSizeList);
+    BkDereferenceStringList(Config->ExcludeMarkerList);
+    BkDereferenceStringList(Config->StoreExtensionList);
     PhDereferenceObject(Config->DestinationDirectory);
 
+    if (Config->ChangeJournal)
+        PhDereferenceObject(Config->ChangeJournal);
+
     PhFree(Config);
 }
+
+BOOLEAN BkMatchFilter(
+    _In_ PBK_FILTER Filter,
+    _In_ PPH_STRING FileName
+    )
+{
+    switch (Filter->Type)
+    {
+    case BK_FILTER_EXACT:
+        return PhEqualStringRef(&FileName->sr, &Filter->Literal, TRUE);
+    case BK_FILTER_PREFIX:
+        return PhStartsWithStringRef(&FileName->sr, &Filter->Literal, TRUE);
+    case BK_FILTER_SUFFIX:
+        return PhEndsWithStringRef(&FileName->sr, &Filter->Literal, TRUE);
+    default:
+        if (!PhStartsWithStringRef(&FileName->sr, &Filter->Literal, TRUE))
+            return FALSE;
+
+        return PhMatchWildcards(Filter->Pattern->Buffer, FileName->Buffer, TRUE);
+    }
+}
+
+BOOLEAN BkMatchFilterSet(
+    _In_ PBK_FILTER_SET FilterSet,
+    _In_ PPH_STRING FileName
+    )
+{
+    PBK_FILTER_TRIE_NODE node;
+    ULONG child;
+    WCHAR c;
+    SIZE_T i;
+    ULONG j;
+
+    node = &FilterSet->Nodes[0];
+
+    for (i = 0; ; i++)
+    {
+        if (node->Prefix)
+            return TRUE;
+
+        if (i == FileName->Length / sizeof(WCHAR))
+        {
+            if (node->Exact)
+                return TRUE;
+
+            break;
+        }
+
+        c = RtlUpcaseUnicodeChar(FileName->Buffer[i]);
+
+        for (child = node->Child; child != 0; child = FilterSet->Nodes[child].Next)
+        {
+            if (FilterSet->Nodes[child].Character == c)
+                break;
+        }
+
+        if (child == 0)
+            break;
+
+        node = &FilterSet->Nodes[child];
+    }
+
+    for (j = 0; j < FilterSet->NumberOfOtherFilters; j++)
+    {
+        if (BkMatchFilter(FilterSet->OtherFilters[j], FileName))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN BkMatchSizeFilter(
+    _In_ PBK_SIZE_FILTER Filter,
+    _In_ PPH_STRING FileName,
+    _In_ PLARGE_INTEGER Size
+    )
+{
+    switch (Filter->Comparison)
+    {
+    case BK_SIZE_FILTER_GREATER:
+        if ((ULONG64)Size->QuadPart <= Filter->Size)
+            return FALSE;
+        break;
+    case BK_SIZE_FILTER_LESS:
+        if ((ULONG64)Size->QuadPart >= Filter->Size)
+            return FALSE;
+        break;
+    default:
+        return FALSE;
+    }
+
+    return BkMatchFilter(&Filter->Filter, FileName);
+}
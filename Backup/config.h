@@ -1,10 +1,61 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "package.h"
+
 #define BK_CONFIG_SECTION_MAP 1
 #define BK_CONFIG_SECTION_SOURCE 2
 #define BK_CONFIG_SECTION_SOURCEFILTERS 3
 #define BK_CONFIG_SECTION_DESTINATION 4
+#define BK_CONFIG_SECTION_COMPRESSION 5
+#define BK_CONFIG_SECTION_TRIMCOMPRESSION 6
+#define BK_CONFIG_SECTION_COLDCOMPRESSION 7
+
+#define BK_DEFAULT_READ_AHEAD_SIZE 64 // in MB
+
+#define BK_FILTER_WILDCARDS 0 // matched with PhMatchWildcards after checking the literal prefix
+#define BK_FILTER_EXACT 1 // no wildcards
+#define BK_FILTER_PREFIX 2 // literal followed by a single *
+#define BK_FILTER_SUFFIX 3 // single * followed by a literal
+
+typedef struct _BK_FILTER
+{
+    ULONG Type;
+    PPH_STRING Pattern; // NULL to match every file
+    PH_STRINGREF Literal; // part of the pattern without wildcards; the prefix for BK_FILTER_WILDCARDS
+} BK_FILTER, *PBK_FILTER;
+
+// Exact and prefix filters are stored in a trie of upper case characters, so a file name is
+// compared with all of them in a single pass. Other filters are checked one at a time.
+
+typedef struct _BK_FILTER_TRIE_NODE
+{
+    WCHAR Character;
+    BOOLEAN Exact; // an exact filter ends here
+    BOOLEAN Prefix; // a prefix filter ends here
+    ULONG Child; // index of the first child, 0 for none
+    ULONG Next; // index of the next sibling, 0 for none
+} BK_FILTER_TRIE_NODE, *PBK_FILTER_TRIE_NODE;
+
+typedef struct _BK_FILTER_SET
+{
+    PBK_FILTER_TRIE_NODE Nodes; // the first node is the root
+    ULONG NumberOfNodes;
+    ULONG AllocatedNodes;
+    PBK_FILTER *OtherFilters; // suffix and wildcard filters
+    ULONG NumberOfOtherFilters;
+} BK_FILTER_SET, *PBK_FILTER_SET;
+
+#define BK_SIZE_FILTER_NONE 0 // invalid expression, never matches
+#define BK_SIZE_FILTER_GREATER 1
+#define BK_SIZE_FILTER_LESS 2
+
+typedef struct _BK_SIZE_FILTER
+{
+    BK_FILTER Filter;
+    ULONG Comparison;
+    ULONG64 Size;
+} BK_SIZE_FILTER, *PBK_SIZE_FILTER;
 
 typedef struct _BK_CONFIG
 {
@@ -16,18 +67,53 @@ typedef struct _BK_CONFIG
     PPH_LIST SourceDirectoryList;
     PPH_LIST SourceFileList;
     ULONG UseShadowCopy;
+    ULONG ScanThreads; // 0 for the number of processors
+    PPH_STRING ChangeJournal; // NULL to compare all files
+    ULONG SkipUnchangedDirectories;
+    ULONG ReadAheadSize; // in MB, 0 to disable
+    ULONG UnbufferedReads; // not in the help until its effect on backup speed has been measured
 
     // SourceFilters
     PPH_LIST IncludeList;
     PPH_LIST ExcludeList;
     PPH_LIST IncludeSizeList;
     PPH_LIST ExcludeSizeList;
+    PPH_LIST ExcludeMarkerList;
+    // Compiled from the lists above, with the same number of entries
+    PBK_FILTER IncludeFilters;
+    PBK_FILTER ExcludeFilters;
+    PBK_SIZE_FILTER IncludeSizeFilters;
+    PBK_SIZE_FILTER ExcludeSizeFilters;
+    // Built from IncludeFilters and ExcludeFilters
+    BK_FILTER_SET IncludeFilterSet;
+    BK_FILTER_SET ExcludeFilterSet;
+    // Exclude patterns ending in "\*", without the "*", matched against directory names with a
+    // trailing backslash
+    PBK_FILTER ExcludeSubtreeFilters;
+    ULONG NumberOfExcludeSubtreeFilters;
 
     // Destination
     PPH_STRING DestinationDirectory;
-    ULONG CompressionLevel;
     ULONG UseTransactions;
     ULONG Strict;
+    ULONG MergeBufferSize; // in MB
+
+    // Compression
+    PK_COMPRESSION_SETTINGS Compression;
+    ULONG StoreIncompressible;
+    PPH_LIST StoreExtensionList;
+    ULONG NumberOfParts;
+    ULONG ChunkSize; // in MB, 0 to disable
+    ULONG SmallFileSize; // in KB, 0 to disable
+    ULONG SmallFileBlockSize; // in MB
+    ULONG PipelineSize; // in MB, 0 to disable
+
+    // TrimCompression
+    PK_COMPRESSION_SETTINGS TrimCompression;
+
+    // ColdCompression
+    PK_COMPRESSION_SETTINGS ColdCompression;
+    ULONG ColdAge; // in days, 0 to disable
 } BK_CONFIG, *PBK_CONFIG;
 
 NTSTATUS BkCreateConfigFromFile(
@@ -48,4 +134,20 @@ VOID BkFreeConfig(
     _In_ PBK_CONFIG Config
     );
 
+BOOLEAN BkMatchFilter(
+    _In_ PBK_FILTER Filter,
+    _In_ PPH_STRING FileName
+    );
+
+BOOLEAN BkMatchFilterSet(
+    _In_ PBK_FILTER_SET FilterSet,
+    _In_ PPH_STRING FileName
+    );
+
+BOOLEAN BkMatchSizeFilter(
+    _In_ PBK_SIZE_FILTER Filter,
+    _In_ PPH_STRING FileName,
+    _In_ PLARGE_INTEGER Size
+    );
+
 #endif
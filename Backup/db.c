@@ -455,6 +455,21 @@ NTSTATUS DbQueryInformationFile(
             memcpy(FileInformation, &dataInfo, sizeof(DB_FILE_DATA_INFORMATION));
         }
         break;
+    case DbFileSourceInformation:
+        {
+            DB_FILE_SOURCE_INFORMATION sourceInfo;
+
+            if (FileInformationLength != sizeof(DB_FILE_SOURCE_INFORMATION))
+                return STATUS_INFO_LENGTH_MISMATCH;
+            if (!(File->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+                return STATUS_INVALID_PARAMETER;
+
+            sourceInfo.NumberOfFiles = File->u.Directory.SourceNumberOfFiles;
+            sourceInfo.Stamp = File->u.Directory.SourceStamp;
+
+            memcpy(FileInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION));
+        }
+        break;
     default:
         return STATUS_INVALID_INFO_CLASS;
     }
@@ -520,6 +535,20 @@ NTSTATUS DbSetInformationFile(
             File->u.File.LastBackupTime = dataInfo->LastBackupTime.QuadPart;
         }
         break;
+    case DbFileSourceInformation:
+        {
+            PDB_FILE_SOURCE_INFORMATION sourceInfo;
+
+            if (FileInformationLength != sizeof(DB_FILE_SOURCE_INFORMATION))
+                return STATUS_INFO_LENGTH_MISMATCH;
+            if (!(File->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+                return STATUS_INVALID_PARAMETER;
+
+            sourceInfo = FileInformation;
+            File->u.Directory.SourceNumberOfFiles = sourceInfo->NumberOfFiles;
+            File->u.Directory.SourceStamp = sourceInfo->Stamp;
+        }
+        break;
     case DbFileRenameInformation:
         {
             PDB_FILE_RENAME_INFORMATION renameInfo;
@@ -988,6 +1017,11 @@ NTSTATUS DbpCopyAttributesFile(
         DestinationFile->u.File.EndOfFile = SourceFile->u.File.EndOfFile;
         DestinationFile->u.File.LastBackupTime = SourceFile->u.File.LastBackupTime;
     }
+    else
+    {
+        DestinationFile->u.Directory.SourceNumberOfFiles = SourceFile->u.Directory.SourceNumberOfFiles;
+        DestinationFile->u.Directory.SourceStamp = SourceFile->u.Directory.SourceStamp;
+    }
 
     return STATUS_SUCCESS;
 }
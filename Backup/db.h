@@ -7,6 +7,17 @@ typedef struct _DB_DATABASE *PDB_DATABASE;
 // Attributes
 #define DB_FILE_ATTRIBUTE_DIRECTORY 0x1
 #define DB_FILE_ATTRIBUTE_DELETE_TAG 0x2
+#define DB_FILE_ATTRIBUTE_CHUNKED 0x4 // file is stored as chunks
+#define DB_FILE_ATTRIBUTE_RECOMPRESSED 0x8 // diff directory only; packages use the cold compression settings
+#define DB_FILE_ATTRIBUTE_PART_MASK 0xff00 // package part that contains the file
+#define DB_FILE_ATTRIBUTE_PART_SHIFT 8
+#define DB_FILE_ATTRIBUTE_CHUNK_PART_MASK 0xffff0000 // package parts that contain chunks of the file
+#define DB_FILE_ATTRIBUTE_CHUNK_PART_SHIFT 16
+
+#define DB_FILE_ATTRIBUTE_GET_PART(Attributes) (((Attributes) & DB_FILE_ATTRIBUTE_PART_MASK) >> DB_FILE_ATTRIBUTE_PART_SHIFT)
+#define DB_FILE_ATTRIBUTE_GET_PART_MASK(Attributes) (((Attributes) & DB_FILE_ATTRIBUTE_CHUNKED) ? \
+    ((Attributes) & DB_FILE_ATTRIBUTE_CHUNK_PART_MASK) >> DB_FILE_ATTRIBUTE_CHUNK_PART_SHIFT : \
+    1 << DB_FILE_ATTRIBUTE_GET_PART(Attributes))
 
 NTSTATUS DbCreateDatabase(
     _In_ PWSTR FileName
@@ -80,7 +91,8 @@ typedef enum _DB_FILE_INFORMATION_CLASS
     DbFileStandardInformation, // q
     DbFileRevisionIdInformation, // s
     DbFileDataInformation, // qs
-    DbFileRenameInformation // s
+    DbFileRenameInformation, // s
+    DbFileSourceInformation // qs
 } DB_FILE_INFORMATION_CLASS, *PDB_FILE_INFORMATION_CLASS;
 
 typedef struct _DB_FILE_BASIC_INFORMATION
@@ -112,6 +124,12 @@ typedef struct _DB_FILE_RENAME_INFORMATION
     PH_STRINGREF FileName;
 } DB_FILE_RENAME_INFORMATION, *PDB_FILE_RENAME_INFORMATION;
 
+typedef struct _DB_FILE_SOURCE_INFORMATION
+{
+    ULONG NumberOfFiles;
+    ULONGLONG Stamp; // fingerprint of the source directory, 0 if unknown
+} DB_FILE_SOURCE_INFORMATION, *PDB_FILE_SOURCE_INFORMATION;
+
 NTSTATUS DbQueryInformationFile(
     _In_ PDB_DATABASE Database,
     _In_ PDBF_FILE File,
@@ -39,6 +39,8 @@ typedef struct _DBF_FILE_DATA
 typedef struct _DBF_DIRECTORY_DATA
 {
     ULONG NumberOfFiles;
+    ULONG SourceNumberOfFiles; // number of files in the source directory when it was last compared
+    ULONGLONG SourceStamp; // fingerprint of the source directory, 0 if unknown
 } DBF_DIRECTORY_DATA, *PDBF_DIRECTORY_DATA;
 
 typedef struct _DBF_FILE
@@ -118,6 +118,7 @@ NTSTATUS DbUtCopyFile(
     PDBF_FILE newFile;
     DB_FILE_BASIC_INFORMATION basicInfo;
     DB_FILE_DATA_INFORMATION dataInfo;
+    DB_FILE_SOURCE_INFORMATION sourceInfo;
 
     status = DbQueryInformationFile(Database, File, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
 
@@ -131,6 +132,13 @@ NTSTATUS DbUtCopyFile(
         if (!NT_SUCCESS(status))
             return status;
     }
+    else
+    {
+        status = DbQueryInformationFile(Database, File, DbFileSourceInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION));
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
 
     status = DbCreateFile(Database, FileName, RootDirectory, basicInfo.Attributes, FILE_CREATE, 0, NULL, &newFile);
 
@@ -141,6 +149,8 @@ NTSTATUS DbUtCopyFile(
 
     if (!(basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
         DbSetInformationFile(Database, newFile, DbFileDataInformation, &dataInfo, sizeof(DB_FILE_DATA_INFORMATION));
+    else
+        DbSetInformationFile(Database, newFile, DbFileSourceInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION));
 
     if (NewFile)
         *NewFile = newFile;
@@ -257,3 +267,48 @@ NTSTATUS DbUtDeleteDirectoryContents(
 
     return STATUS_SUCCESS;
 }
+
+NTSTATUS DbUtClearSourceInformation(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory
+    )
+{
+    NTSTATUS status;
+    DB_FILE_SOURCE_INFORMATION sourceInfo;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    ULONG i;
+    PDBF_FILE file;
+
+    memset(&sourceInfo, 0, sizeof(DB_FILE_SOURCE_INFORMATION));
+    status = DbSetInformationFile(Database, Directory, DbFileSourceInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION));
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        if (!(entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+            continue;
+
+        status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+        if (!NT_SUCCESS(status))
+            break;
+
+        status = DbUtClearSourceInformation(Database, file);
+        DbCloseFile(Database, file);
+
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+
+    return status;
+}
@@ -34,4 +34,9 @@ NTSTATUS DbUtDeleteDirectoryContents(
     _In_ PDBF_FILE Directory
     );
 
+NTSTATUS DbUtClearSourceInformation(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory
+    );
+
 #endif
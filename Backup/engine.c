@@ -41,14 +41,25 @@
  * Packages are stored in the forward direction due to the complexity of updating
  * existing archives. 0000000000000001.7z contains the files that were added in the
  * first revision, and each subsequent package contains the files that were added or
- * modified in that revision.
+ * modified in that revision. A revision's package can be split into parts: files that
+ * don't compress well can be placed in an uncompressed part (0000000000000001.store.7z),
+ * and the remaining files can be spread over several parts (0000000000000001.1.7z, ...)
+ * that are compressed in parallel. The part that contains a file is recorded in its
+ * attributes in the database. Files never move between parts, so each part is merged
+ * separately. Files larger than ChunkSize are stored as several items named
+ * <file>:<offset>, which can be in different parts. Small files can be placed in a part
+ * with small solid blocks (0000000000000001.small.7z).
  *
  * Backup. A distinction is made between the first backup and subsequent backups.
  * To create the first revision, the file system structure is copied to the database
  * and the first package is created. In subsequent revisions, the current file system
  * structure is compared with the HEAD directory. The HEAD directory is updated to
  * reflect the new file system structure and each change is recorded in the diff
- * directory. A new package is created for new/modified files.
+ * directory. A new package is created for new/modified files. If a change source (such as
+ * a journal written by a file system watcher) is configured, only directories that contain
+ * reported changes are compared, and the position in the change source is saved in the
+ * destination directory after each backup. All files are compared if that position is missing
+ * or no longer valid.
  *
  * Revert. To revert to an older revision, each diff directory up to the target
  * revision is merged with the HEAD directory. These diff directories and the
@@ -58,6 +69,10 @@
  * The old diff directories are then deleted. When merging packages, duplicate files
  * are avoided by scanning the database and creating an ignore list.
  *
+ * Squash. A range of revisions is turned into a single revision by merging the packages in
+ * the range (as in a trim) and replacing the diff directories with one diff directory that
+ * leads to the revision before the range. Later revisions are renumbered to close the gap.
+ *
  * Restore. Files and directories are restored by extracting files from the appropriate
  * packages.
  */
@@ -70,9 +85,12 @@
 #include "engine.h"
 #include "enginep.h"
 #include <shlobj.h>
+#include <math.h>
+#include <workqueue.h>
 
 PH_STRINGREF EnpBackslashString = PH_STRINGREF_INIT(L"\\");
 PH_STRINGREF EnpNewSuffixString = PH_STRINGREF_INIT(L".new.tmp");
+EN_CHANGE_SOURCE EnpJournalChangeSource = { L"journal", EnpQueryJournalChanges };
 
 NTSTATUS EnQueryRevision(
     _In_ PBK_CONFIG Config,
@@ -384,6 +402,98 @@ NTSTATUS EnTrimToRevision(
     return status;
 }
 
+NTSTATUS EnSquashRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_opt_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_opt_ PULONGLONG RevisionId
+    )
+{
+    NTSTATUS status;
+    HANDLE transactionHandle;
+    PDB_DATABASE database;
+
+    if (!MessageHandler)
+        MessageHandler = EnpDefaultMessageHandler;
+
+    transactionHandle = NULL;
+
+    if (Config->UseTransactions)
+    {
+        if (!NT_SUCCESS(status = EnpCreateTransaction(&transactionHandle, MessageHandler)))
+            return status;
+
+        RtlSetCurrentTransaction(transactionHandle);
+    }
+    else
+    {
+        RtlSetCurrentTransaction(NULL);
+    }
+
+    status = EnpOpenDatabase(Config, FALSE, &database);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open database %s\\%s", Config->DestinationDirectory->Buffer, EN_DATABASE_NAME));
+        status = EnpCommitAndCloseTransaction(status, transactionHandle, TRUE, MessageHandler);
+        return status;
+    }
+
+    status = EnpSquashRevisions(Config, transactionHandle, database, Ranges, NumberOfRanges, MessageHandler);
+
+    if (NT_SUCCESS(status))
+    {
+        if (RevisionId)
+            DbQueryRevisionIdsDatabase(database, RevisionId, NULL);
+    }
+
+    DbCloseDatabase(database);
+    status = EnpCommitAndCloseTransaction(status, transactionHandle, status == STATUS_ABANDONED, MessageHandler);
+
+    return status;
+}
+
+NTSTATUS EnRecompressRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ ULONGLONG LastRevisionId,
+    _In_opt_ PLARGE_INTEGER MaximumTimeStamp,
+    _In_opt_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_opt_ PULONG NumberOfPackages
+    )
+{
+    NTSTATUS status;
+    PDB_DATABASE database;
+    ULONG numberOfPackages;
+
+    if (!MessageHandler)
+        MessageHandler = EnpDefaultMessageHandler;
+
+    // Each package is replaced on its own, so no transaction is needed. If the operation is
+    // interrupted, it can simply be started again.
+    RtlSetCurrentTransaction(NULL);
+
+    status = EnpOpenDatabase(Config, FALSE, &database);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open database %s\\%s", Config->DestinationDirectory->Buffer, EN_DATABASE_NAME));
+        return status;
+    }
+
+    status = EnpRecompressRevisions(Config, database, LastRevisionId, MaximumTimeStamp, MessageHandler, &numberOfPackages);
+
+    if (NT_SUCCESS(status))
+    {
+        if (NumberOfPackages)
+            *NumberOfPackages = numberOfPackages;
+    }
+
+    DbCloseDatabase(database);
+
+    return status;
+}
+
 NTSTATUS EnRestoreFromRevision(
     _In_ PBK_CONFIG Config,
     _In_ ULONG Flags,
@@ -516,9 +626,9 @@ NTSTATUS EnCompactDatabase(
         goto CleanupExit;
     }
 
-    if (NT_SUCCESS(status = EnpRenameFileWin32(NULL, databaseFileName->Buffer, tempDatabaseFileName2->Buffer)))
+    if (NT_SUCCESS(status = EnpRenameFileWin32(NULL, databaseFileName->Buffer, tempDatabaseFileName2->Buffer, FALSE)))
     {
-        status = EnpRenameFileWin32(NULL, tempDatabaseFileName->Buffer, databaseFileName->Buffer);
+        status = EnpRenameFileWin32(NULL, tempDatabaseFileName->Buffer, databaseFileName->Buffer, FALSE);
 
         if (NT_SUCCESS(status))
             PhDeleteFileWin32(tempDatabaseFileName2->Buffer);
@@ -549,17 +659,17 @@ NTSTATUS EnpBackupFirstRevision(
     )
 {
     NTSTATUS status;
-    HRESULT result;
     PDBF_FILE headDirectory;
     PH_STRINGREF headDirectoryName;
     PEN_FILEINFO rootInfo;
     PPK_ACTION_LIST actionList;
+    PPK_ACTION_LIST packageActionList;
+    EN_PACKAGE_PIPELINE pipeline;
+    BOOLEAN pipelined;
+    NTSTATUS pipelineStatus;
     PBK_VSS_OBJECT vss;
-    PPH_STRING packageFileName;
-    BOOLEAN fileStreamCreated;
-    PPH_FILE_STREAM fileStream;
-    PPK_FILE_STREAM pkFileStream;
-    EN_PACKAGE_CALLBACK_CONTEXT updateContext;
+    PEN_CHANGE_SET changes;
+    PPH_STRING newCursor;
     ULONGLONG revisionId;
     DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
 
@@ -577,6 +687,12 @@ NTSTATUS EnpBackupFirstRevision(
 
     RtlSetCurrentTransaction(NULL);
 
+    // Every file is backed up, so only the current position of the change source is needed.
+    EnpQueryChanges(Config, &changes, &newCursor, MessageHandler);
+
+    if (changes)
+        EnpDestroyChangeSet(changes);
+
     rootInfo = EnpCreateRootFileInfo();
     EnpPopulateRootFileInfo(Config, rootInfo);
 
@@ -587,59 +703,54 @@ NTSTATUS EnpBackupFirstRevision(
         if (!EnpStartVssObject(Config, rootInfo, &vss, MessageHandler) && Config->Strict)
         {
             MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
-            EnpDestroyFileInfo(rootInfo);
+            EnpDestroyRootFileInfo(rootInfo);
+
+            if (newCursor)
+                PhDereferenceObject(newCursor);
+
             return STATUS_UNSUCCESSFUL;
         }
     }
 
     actionList = PkCreateActionList();
-    status = EnpSyncTreeFirstRevision(Config, Database, headDirectory, rootInfo, actionList, vss, MessageHandler);
-    result = S_OK;
-    packageFileName = NULL;
-    fileStreamCreated = FALSE;
+    pipelined = Config->PipelineSize != 0;
 
-    if (NT_SUCCESS(status))
+    if (pipelined)
+        EnpInitializePackagePipeline(&pipeline, Config, TransactionHandle, Database, headDirectory, 1, actionList, vss, MessageHandler);
+
+    status = EnpSyncTreeFirstRevision(Config, Database, headDirectory, rootInfo, actionList, pipelined ? &pipeline : NULL, vss, MessageHandler);
+    packageActionList = actionList;
+
+    if (pipelined)
     {
-        packageFileName = EnpFormatPackageName(Config, 1);
-        RtlSetCurrentTransaction(TransactionHandle);
-        status = PhCreateFileStream(&fileStream, packageFileName->Buffer, FILE_GENERIC_READ | FILE_GENERIC_WRITE, 0, FILE_CREATE, 0);
-        RtlSetCurrentTransaction(NULL);
+        // The batches are waited for even if the sync failed.
+        pipelineStatus = EnpCompletePackagePipeline(&pipeline);
+        packageActionList = pipeline.RemainingActionList;
 
         if (NT_SUCCESS(status))
-        {
-            fileStreamCreated = TRUE;
-            pkFileStream = PkCreateFileStream(fileStream);
-            PhDereferenceObject(fileStream);
+            status = pipelineStatus;
+    }
+
+    if (NT_SUCCESS(status))
+        status = EnpCreatePackageParts(Config, TransactionHandle, Database, headDirectory, 1, packageActionList, vss, MessageHandler);
 
-            updateContext.Config = Config;
-            updateContext.Database = Database;
-            updateContext.Vss = vss;
-            updateContext.MessageHandler = MessageHandler;
-            result = PkCreatePackage(pkFileStream, actionList, EnpBackupPackageCallback, &updateContext);
-            PkDereferenceFileStream(pkFileStream);
+    RtlSetCurrentTransaction(TransactionHandle);
 
-            if (!SUCCEEDED(result))
-            {
-                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to update package %s: 0x%x", packageFileName->Buffer, result));
-            }
-        }
-        else
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create package %s", packageFileName->Buffer));
-        }
+    if (pipelined)
+    {
+        if (!NT_SUCCESS(status) && pipeline.NumberOfBatches != 0)
+            EnpDeletePackageParts(Config, 1, MessageHandler);
 
-        RtlSetCurrentTransaction(TransactionHandle);
+        EnpDeletePackagePipeline(&pipeline);
     }
 
+    EnpDestroyPackageFiles(actionList);
     PkDestroyActionList(actionList);
 
     if (vss)
         BkDestroyVssObject(vss);
 
-    EnpDestroyFileInfo(rootInfo);
-
-    if (!SUCCEEDED(result))
-        status = STATUS_UNSUCCESSFUL;
+    EnpDestroyRootFileInfo(rootInfo);
 
     if (NT_SUCCESS(status))
     {
@@ -648,15 +759,15 @@ NTSTATUS EnpBackupFirstRevision(
 
         revisionId = 1;
         DbSetRevisionIdsDatabase(Database, &revisionId, &revisionId);
-    }
-    else
-    {
-        if (fileStreamCreated)
-            PhDeleteFileWin32(packageFileName->Buffer);
+
+        if (newCursor && !NT_SUCCESS(EnpWriteChangeCursor(Config, newCursor)))
+            MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"Unable to save the change journal position"));
+
+        EnpSaveFilterHash(Config, MessageHandler);
     }
 
-    if (packageFileName)
-        PhDereferenceObject(packageFileName);
+    if (newCursor)
+        PhDereferenceObject(newCursor);
 
     DbCloseFile(Database, headDirectory);
 
@@ -669,6 +780,7 @@ NTSTATUS EnpSyncTreeFirstRevision(
     _In_ PDBF_FILE Directory,
     _Inout_ PEN_FILEINFO Root,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PEN_PACKAGE_PIPELINE Pipeline,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
@@ -676,8 +788,11 @@ NTSTATUS EnpSyncTreeFirstRevision(
     NTSTATUS status;
     SINGLE_LIST_ENTRY listHead; // file info stack
     PEN_FILEINFO info;
-    PEN_FILEINFO *childInfoPtr;
     PEN_FILEINFO childInfo;
+    PPH_STRING fileName;
+    EN_SCAN_CONTEXT scanContext;
+
+    EnpInitializeScanContext(&scanContext, Config, NULL, Vss);
 
     listHead.Next = NULL;
     info = Root;
@@ -688,25 +803,34 @@ NTSTATUS EnpSyncTreeFirstRevision(
         switch (info->State)
         {
         case FileInfoPreEnum:
+            // Directories are usually listed in advance by EnpScanDirectory.
+            EnpWaitForScanDirectory(&scanContext, info);
+
             if (info->FsExpand)
             {
-                status = EnpPopulateFsFileInfo(Config, info, Vss);
+                info->FsStatus = EnpPopulateFsFileInfo(Config, info, Vss);
+                info->FsExpand = FALSE;
+            }
 
-                if (!NT_SUCCESS(status))
-                {
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to list contents of %s: 0x%x", info->FullSourceFileName->Buffer, status));
+            if (!NT_SUCCESS(info->FsStatus))
+            {
+                fileName = EnpGetFullSourceFileName(info);
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to list contents of %s: 0x%x", fileName->Buffer, info->FsStatus));
+                PhDereferenceObject(fileName);
 
-                    if (Config->Strict)
-                    {
-                        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
-                        return status;
-                    }
+                if (Config->Strict)
+                {
+                    MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
+                    EnpDeleteScanContext(&scanContext);
+                    return info->FsStatus;
                 }
             }
 
+            EnpScanDirectory(&scanContext, info);
+
             if (info->Files)
             {
-                PhBeginEnumHashtable(info->Files, &info->EnumContext);
+                info->EnumFile = info->Files;
                 info->State = FileInfoEnum;
             }
             else
@@ -716,17 +840,10 @@ NTSTATUS EnpSyncTreeFirstRevision(
 
             break;
         case FileInfoEnum:
-            if (info->Files)
+            if (info->EnumFile)
             {
-                childInfoPtr = PhNextEnumHashtable(&info->EnumContext);
-
-                if (!childInfoPtr)
-                {
-                    info->State = FileInfoPostEnum;
-                    break;
-                }
-
-                childInfo = *childInfoPtr;
+                childInfo = info->EnumFile;
+                info->EnumFile = childInfo->Next;
 
                 status = EnpSyncFileFirstRevision(Config, Database, childInfo, ActionList, Vss, MessageHandler);
 
@@ -742,7 +859,13 @@ NTSTATUS EnpSyncTreeFirstRevision(
                 }
                 else
                 {
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to sync %s", info->FullSourceFileName->Buffer));
+                    fileName = EnpGetFullSourceFileName(info);
+                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to sync %s", fileName->Buffer));
+                    PhDereferenceObject(fileName);
+
+                    // The directory is skipped, but it may be being listed in advance.
+                    if (childInfo->Directory)
+                        EnpWaitForScanDirectory(&scanContext, childInfo);
                 }
             }
             else
@@ -756,14 +879,23 @@ NTSTATUS EnpSyncTreeFirstRevision(
             {
                 if (info->DbFile)
                     DbCloseFile(Database, info->DbFile);
+
+                // The files in this directory are no longer needed.
+                EnpClearFileInfo(info);
             }
 
+            // Start compressing the new files if there are enough of them.
+            if (Pipeline)
+                EnpFlushPackagePipeline(Pipeline);
+
             // Go back to the parent directory.
             info = (PEN_FILEINFO)PopEntryList(&listHead);
             break;
         }
     }
 
+    EnpDeleteScanContext(&scanContext);
+
     return STATUS_SUCCESS;
 }
 
@@ -779,11 +911,10 @@ NTSTATUS EnpSyncFileFirstRevision(
     NTSTATUS status;
     PDBF_FILE file;
     ULONG actionFlags;
+    PPH_STRING fileName;
     DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
     DB_FILE_DATA_INFORMATION dataInfo;
 
-    dprintf("Syncing %S from %S\n", FileInfo->FullFileName->Buffer, FileInfo->FullSourceFileName->Buffer);
-
     if (FileInfo->NeedFsInfo)
     {
         EnpUpdateFsFileInfo(FileInfo, Vss);
@@ -792,7 +923,7 @@ NTSTATUS EnpSyncFileFirstRevision(
 
     status = DbCreateFile(
         Database,
-        &FileInfo->Name->sr,
+        &FileInfo->Name,
         FileInfo->Parent->DbFile,
         FileInfo->Directory ? DB_FILE_ATTRIBUTE_DIRECTORY : 0,
         DB_FILE_CREATE,
@@ -809,7 +940,9 @@ NTSTATUS EnpSyncFileFirstRevision(
     if (FileInfo->Directory)
         actionFlags |= PK_ACTION_DIRECTORY;
 
-    PkAppendAddToActionList(ActionList, actionFlags, FileInfo->FullFileName, FileInfo);
+    fileName = EnpGetFullFileName(FileInfo);
+    PkAppendAddToActionList(ActionList, actionFlags, fileName, EnpCreatePackageFile(FileInfo, fileName));
+    PhDereferenceObject(fileName);
 
     revisionIdInfo.RevisionId = 1;
     DbSetInformationFile(Database, file, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
@@ -837,7 +970,6 @@ NTSTATUS EnpBackupNewRevision(
     )
 {
     NTSTATUS status;
-    HRESULT result;
     ULONGLONG revisionId;
     PDBF_FILE headDirectory;
     PH_STRINGREF headDirectoryName;
@@ -849,13 +981,15 @@ NTSTATUS EnpBackupNewRevision(
     PH_STRINGREF diffDirectoryName;
     PEN_FILEINFO rootInfo;
     PPK_ACTION_LIST actionList;
+    PPK_ACTION_LIST packageActionList;
+    EN_PACKAGE_PIPELINE pipeline;
+    BOOLEAN pipelined;
+    NTSTATUS pipelineStatus;
     PBK_VSS_OBJECT vss;
+    PEN_CHANGE_SET changes;
+    PPH_STRING newCursor;
     ULONGLONG numberOfChanges;
-    PPH_STRING packageFileName;
-    BOOLEAN fileStreamCreated;
-    PPH_FILE_STREAM fileStream;
-    PPK_FILE_STREAM pkFileStream;
-    EN_PACKAGE_CALLBACK_CONTEXT updateContext;
+    BOOLEAN packageCreated;
     DB_FILE_RENAME_INFORMATION renameInfo;
     DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
     DB_FILE_BASIC_INFORMATION basicInfo;
@@ -936,6 +1070,8 @@ NTSTATUS EnpBackupNewRevision(
 
     RtlSetCurrentTransaction(NULL);
 
+    EnpQueryChanges(Config, &changes, &newCursor, MessageHandler);
+
     rootInfo = EnpCreateRootFileInfo();
     EnpPopulateRootFileInfo(Config, rootInfo);
 
@@ -946,7 +1082,13 @@ NTSTATUS EnpBackupNewRevision(
         if (!EnpStartVssObject(Config, rootInfo, &vss, MessageHandler) && Config->Strict)
         {
             MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
-            EnpDestroyFileInfo(rootInfo);
+            EnpDestroyRootFileInfo(rootInfo);
+
+            if (changes)
+                EnpDestroyChangeSet(changes);
+            if (newCursor)
+                PhDereferenceObject(newCursor);
+
             DbUtDeleteDirectoryContents(Database, newHeadDirectory);
             DbDeleteFile(Database, newHeadDirectory);
             DbCloseFile(Database, headDirectory);
@@ -956,58 +1098,60 @@ NTSTATUS EnpBackupNewRevision(
 
     actionList = PkCreateActionList();
     numberOfChanges = 0;
-    status = EnpDiffTreeNewRevision(Config, Database, revisionId, newHeadDirectory, diffDirectory, rootInfo, actionList, &numberOfChanges, vss, MessageHandler);
-    result = S_OK;
-    packageFileName = NULL;
-    fileStreamCreated = FALSE;
+    pipelined = Config->PipelineSize != 0;
 
-    if (NT_SUCCESS(status) && PkQueryCountActionList(actionList) != 0)
+    if (pipelined)
+        EnpInitializePackagePipeline(&pipeline, Config, TransactionHandle, Database, newHeadDirectory, revisionId, actionList, vss, MessageHandler);
+
+    status = EnpDiffTreeNewRevision(Config, Database, revisionId, newHeadDirectory, diffDirectory, rootInfo, changes, actionList, pipelined ? &pipeline : NULL, &numberOfChanges, vss, MessageHandler);
+    packageActionList = actionList;
+    packageCreated = FALSE;
+
+    if (pipelined)
     {
-        packageFileName = EnpFormatPackageName(Config, revisionId);
-        RtlSetCurrentTransaction(TransactionHandle);
-        status = PhCreateFileStream(&fileStream, packageFileName->Buffer, FILE_GENERIC_READ | FILE_GENERIC_WRITE, 0, FILE_CREATE, 0);
-        RtlSetCurrentTransaction(NULL);
+        // The batches are waited for even if the diff failed.
+        pipelineStatus = EnpCompletePackagePipeline(&pipeline);
+        packageActionList = pipeline.RemainingActionList;
+        packageCreated = pipeline.NumberOfBatches != 0;
 
         if (NT_SUCCESS(status))
-        {
-            fileStreamCreated = TRUE;
-            pkFileStream = PkCreateFileStream(fileStream);
-            PhDereferenceObject(fileStream);
-
-            updateContext.Config = Config;
-            updateContext.Database = Database;
-            updateContext.Vss = vss;
-            updateContext.MessageHandler = MessageHandler;
-            result = PkCreatePackage(pkFileStream, actionList, EnpBackupPackageCallback, &updateContext);
-            PkDereferenceFileStream(pkFileStream);
+            status = pipelineStatus;
+    }
 
-            if (!SUCCEEDED(result))
-            {
-                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to update package %s: 0x%x", packageFileName->Buffer, result));
-            }
-        }
-        else
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create package %s", packageFileName->Buffer));
-        }
+    if (NT_SUCCESS(status) && PkQueryCountActionList(packageActionList) != 0)
+    {
+        status = EnpCreatePackageParts(Config, TransactionHandle, Database, newHeadDirectory, revisionId, packageActionList, vss, MessageHandler);
 
-        RtlSetCurrentTransaction(TransactionHandle);
+        if (NT_SUCCESS(status))
+            packageCreated = TRUE;
     }
 
+    RtlSetCurrentTransaction(TransactionHandle);
+
+    if (pipelined)
+        EnpDeletePackagePipeline(&pipeline);
+
+    EnpDestroyPackageFiles(actionList);
     PkDestroyActionList(actionList);
 
     if (vss)
         BkDestroyVssObject(vss);
 
-    EnpDestroyFileInfo(rootInfo);
+    EnpDestroyRootFileInfo(rootInfo);
 
-    if (!NT_SUCCESS(status) || !SUCCEEDED(result) || numberOfChanges == 0)
+    if (changes)
+        EnpDestroyChangeSet(changes);
+
+    if (!NT_SUCCESS(status) || numberOfChanges == 0)
     {
         // Something went wrong or nothing changed.
         // Don't create a new revision and delete everything that we created so far.
 
-        if (fileStreamCreated)
-            PhDeleteFileWin32(packageFileName->Buffer);
+        if (newCursor)
+            PhDereferenceObject(newCursor);
+
+        if (packageCreated)
+            EnpDeletePackageParts(Config, revisionId, MessageHandler);
 
         DbUtDeleteDirectoryContents(Database, diffDirectory);
         DbUtDeleteDirectoryContents(Database, newHeadDirectory);
@@ -1015,21 +1159,17 @@ NTSTATUS EnpBackupNewRevision(
         DbDeleteFile(Database, newHeadDirectory);
         DbCloseFile(Database, headDirectory);
 
-        if (packageFileName)
-            PhDereferenceObject(packageFileName);
-
-        if (NT_SUCCESS(status) && !SUCCEEDED(result))
-            status = STATUS_UNSUCCESSFUL;
-
         if (NT_SUCCESS(status))
+        {
+            // Every directory was compared with the current settings, so the database is up to
+            // date even though there is no new revision.
+            EnpSaveFilterHash(Config, MessageHandler);
             status = STATUS_ABANDONED; // indicates that there are no changes
+        }
 
         return status;
     }
 
-    if (packageFileName)
-        PhDereferenceObject(packageFileName);
-
     revisionIdInfo.RevisionId = revisionId;
     DbSetInformationFile(Database, newHeadDirectory, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
     revisionIdInfo.RevisionId--;
@@ -1058,6 +1198,16 @@ NTSTATUS EnpBackupNewRevision(
 
     DbSetRevisionIdsDatabase(Database, &revisionId, NULL);
 
+    if (newCursor)
+    {
+        if (!NT_SUCCESS(EnpWriteChangeCursor(Config, newCursor)))
+            MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"Unable to save the change journal position"));
+
+        PhDereferenceObject(newCursor);
+    }
+
+    EnpSaveFilterHash(Config, MessageHandler);
+
     return status;
 }
 
@@ -1105,7 +1255,7 @@ NTSTATUS EnpTestBackupNewRevision(
     }
 
     numberOfChanges = 0;
-    status = EnpDiffTreeNewRevision(Config, Database, revisionId, headDirectory, NULL, rootInfo, NULL, &numberOfChanges, vss, MessageHandler);
+    status = EnpDiffTreeNewRevision(Config, Database, revisionId, headDirectory, NULL, rootInfo, NULL, NULL, NULL, &numberOfChanges, vss, MessageHandler);
 
     if (numberOfChanges != 0)
         MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%I64u change(s)", numberOfChanges));
@@ -1113,7 +1263,7 @@ NTSTATUS EnpTestBackupNewRevision(
     if (vss)
         BkDestroyVssObject(vss);
 
-    EnpDestroyFileInfo(rootInfo);
+    EnpDestroyRootFileInfo(rootInfo);
     DbDeleteFile(Database, headDirectory);
 
     return status;
@@ -1126,7 +1276,9 @@ NTSTATUS EnpDiffTreeNewRevision(
     _In_ PDBF_FILE HeadDirectory,
     _In_opt_ PDBF_FILE DiffDirectory,
     _Inout_ PEN_FILEINFO Root,
+    _In_opt_ PEN_CHANGE_SET Changes,
     _In_opt_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PEN_PACKAGE_PIPELINE Pipeline,
     _Inout_ PULONGLONG NumberOfChanges,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
@@ -1135,8 +1287,23 @@ NTSTATUS EnpDiffTreeNewRevision(
     NTSTATUS status;
     SINGLE_LIST_ENTRY listHead; // file info stack
     PEN_FILEINFO info;
-    PEN_FILEINFO *childInfoPtr;
     PEN_FILEINFO childInfo;
+    PPH_STRING fileName;
+    BOOLEAN skipUnchanged;
+    EN_SCAN_CONTEXT scanContext;
+
+    EnpInitializeScanContext(&scanContext, Config, Changes, Vss);
+
+    // Directories reported by a change source must always be compared in full, because a file
+    // can be modified without changing the last write time of its directory.
+    skipUnchanged = Config->SkipUnchangedDirectories && !Changes;
+
+    // Files that are now included by the filters could be in a directory that hasn't changed.
+    if (skipUnchanged && !EnpIsSameFilterHash(Config))
+    {
+        MessageHandler(EN_MESSAGE_INFORMATION, PhCreateString(L"Source or filter settings have changed; comparing all directories"));
+        skipUnchanged = FALSE;
+    }
 
     listHead.Next = NULL;
     info = Root;
@@ -1146,32 +1313,44 @@ NTSTATUS EnpDiffTreeNewRevision(
         switch (info->State)
         {
         case FileInfoPreEnum:
+            // Directories are usually listed in advance by EnpScanDirectory.
+            EnpWaitForScanDirectory(&scanContext, info);
+
             if (info->FsExpand)
             {
-                status = EnpPopulateFsFileInfo(Config, info, Vss);
+                info->FsStatus = EnpPopulateFsFileInfo(Config, info, Vss);
+                info->FsExpand = FALSE;
+            }
 
-                if (!NT_SUCCESS(status))
-                {
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to list contents of %s: 0x%x", info->FullSourceFileName->Buffer, status));
+            if (!NT_SUCCESS(info->FsStatus))
+            {
+                fileName = EnpGetFullSourceFileName(info);
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to list contents of %s: 0x%x", fileName->Buffer, info->FsStatus));
+                PhDereferenceObject(fileName);
 
-                    if (Config->Strict)
-                    {
-                        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
-                        return status;
-                    }
+                if (Config->Strict)
+                {
+                    MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
+                    EnpDeleteScanContext(&scanContext);
+                    return info->FsStatus;
                 }
             }
 
-            status = EnpDiffDirectoryNewRevision(Config, Database, NewRevisionId, HeadDirectory, DiffDirectory, info, ActionList, NumberOfChanges, Vss, MessageHandler);
+            status = EnpDiffDirectoryNewRevision(Config, Database, NewRevisionId, HeadDirectory, DiffDirectory, info, skipUnchanged, ActionList, NumberOfChanges, Vss, MessageHandler);
 
             if (!NT_SUCCESS(status))
             {
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to diff %s", info->FullSourceFileName->Buffer));
+                fileName = EnpGetFullSourceFileName(info);
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to diff %s", fileName->Buffer));
+                PhDereferenceObject(fileName);
             }
 
+            // This happens after the diff, which marks new directories as changed.
+            EnpScanDirectory(&scanContext, info);
+
             if (info->Files)
             {
-                PhBeginEnumHashtable(info->Files, &info->EnumContext);
+                info->EnumFile = info->Files;
                 info->State = FileInfoEnum;
             }
             else
@@ -1181,19 +1360,13 @@ NTSTATUS EnpDiffTreeNewRevision(
 
             break;
         case FileInfoEnum:
-            if (info->Files)
+            if (info->EnumFile)
             {
-                childInfoPtr = PhNextEnumHashtable(&info->EnumContext);
-
-                if (!childInfoPtr)
-                {
-                    info->State = FileInfoPostEnum;
-                    break;
-                }
-
-                childInfo = *childInfoPtr;
+                childInfo = info->EnumFile;
+                info->EnumFile = childInfo->Next;
 
-                if (childInfo->Directory)
+                // Directories without changes are left as they are in the database.
+                if (childInfo->Directory && EnpIsChangedFileInfo(Changes, childInfo))
                 {
                     // Process the child directory.
                     PushEntryList(&listHead, &info->ListEntry);
@@ -1211,73 +1384,205 @@ NTSTATUS EnpDiffTreeNewRevision(
             if (info->DbFile)
                 DbCloseFile(Database, info->DbFile);
 
+            // The diff for this directory is complete, and the files that were added to the
+            // package have been copied into the action list.
+            if (info != Root)
+                EnpClearFileInfo(info);
+
+            // Start compressing the new files if there are enough of them.
+            if (Pipeline)
+                EnpFlushPackagePipeline(Pipeline);
+
             // Go back to the parent directory.
             info = (PEN_FILEINFO)PopEntryList(&listHead);
             break;
         }
     }
 
+    EnpDeleteScanContext(&scanContext);
+
     return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpDiffDirectoryNewRevision(
-    _In_ PBK_CONFIG Config,
-    _In_ PDB_DATABASE Database,
-    _In_ ULONGLONG NewRevisionId,
-    _In_ PDBF_FILE HeadDirectory,
-    _In_opt_ PDBF_FILE DiffDirectory,
-    _In_ PEN_FILEINFO FileInfo,
-    _In_opt_ PPK_ACTION_LIST ActionList,
-    _Inout_ PULONGLONG NumberOfChanges,
-    _In_opt_ PBK_VSS_OBJECT Vss,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+ULONG EnpHashFilters(
+    _In_ PBK_CONFIG Config
     )
 {
-    NTSTATUS status;
-    PDBF_FILE referenceDirectory;
-    PDB_FILE_DIRECTORY_INFORMATION entries;
-    ULONG numberOfEntries;
-    PDB_FILE_DIRECTORY_INFORMATION entry;
-    PPH_HASHTABLE directoryHashtable;
+    PPH_LIST lists[] =
+    {
+        Config->MapFromList,
+        Config->MapToList,
+        Config->SourceDirectoryList,
+        Config->SourceFileList,
+        Config->IncludeList,
+        Config->ExcludeList,
+        Config->IncludeSizeList,
+        Config->ExcludeSizeList,
+        Config->ExcludeMarkerList
+    };
+    ULONG hash;
     ULONG i;
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_FILEINFO *childInfoPtr;
-    PEN_FILEINFO childInfo;
-    BOOLEAN fileInfoIsDirectory;
-    BOOLEAN entryIsDirectory;
-    BOOLEAN modified;
+    ULONG j;
 
-    dprintf("Performing diff for directory %S\n", FileInfo->FullFileName->Buffer);
+    // File names are compared without case, so changing the case of a filter doesn't change the
+    // hash.
 
-    if (!FileInfo->Parent || FileInfo->Parent->DbFile)
-    {
-        status = DbCreateFile(
-            Database,
-            &FileInfo->Name->sr,
-            FileInfo->Parent ? FileInfo->Parent->DbFile : HeadDirectory,
-            0,
-            DB_FILE_OPEN,
-            DB_FILE_DIRECTORY_FILE,
-            NULL,
-            &referenceDirectory
-            );
-    }
-    else
-    {
-        // For test mode.
-        status = STATUS_OBJECT_NAME_NOT_FOUND;
-    }
+    hash = 0;
 
-    if (DiffDirectory || (status != STATUS_OBJECT_NAME_NOT_FOUND && status != STATUS_NOT_A_DIRECTORY))
+    for (i = 0; i < sizeof(lists) / sizeof(PPH_LIST); i++)
     {
-        if (!NT_SUCCESS(status))
-            return status;
+        hash = hash * 31 + lists[i]->Count;
 
-        FileInfo->DbFile = referenceDirectory;
+        for (j = 0; j < lists[i]->Count; j++)
+            hash = hash * 31 + PhHashStringRef(&((PPH_STRING)lists[i]->Items[j])->sr, TRUE);
+    }
 
-        status = DbQueryDirectoryFile(Database, referenceDirectory, &entries, &numberOfEntries);
+    return hash;
+}
 
-        if (!NT_SUCCESS(status))
+BOOLEAN EnpIsSameFilterHash(
+    _In_ PBK_CONFIG Config
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF name;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
+    ULONG hash;
+
+    PhInitializeStringRef(&name, EN_FILTER_HASH_NAME);
+    fileName = EnpAppendComponentToPath(&Config->DestinationDirectory->sr, &name);
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_READ,
+        0,
+        FILE_SHARE_READ,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+    PhDereferenceObject(fileName);
+
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, &hash, sizeof(ULONG), NULL, NULL);
+    NtClose(fileHandle);
+
+    return NT_SUCCESS(status) && iosb.Information == sizeof(ULONG) && hash == EnpHashFilters(Config);
+}
+
+VOID EnpSaveFilterHash(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF name;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
+    ULONG hash;
+
+    PhInitializeStringRef(&name, EN_FILTER_HASH_NAME);
+    fileName = EnpAppendComponentToPath(&Config->DestinationDirectory->sr, &name);
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_WRITE,
+        0,
+        0,
+        FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+    PhDereferenceObject(fileName);
+
+    if (NT_SUCCESS(status))
+    {
+        hash = EnpHashFilters(Config);
+        status = NtWriteFile(fileHandle, NULL, NULL, NULL, &iosb, &hash, sizeof(ULONG), NULL, NULL);
+        NtClose(fileHandle);
+    }
+
+    if (!NT_SUCCESS(status))
+        MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"Unable to save the filter settings; all directories will be compared next time"));
+}
+
+NTSTATUS EnpDiffDirectoryNewRevision(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG NewRevisionId,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_opt_ PDBF_FILE DiffDirectory,
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ BOOLEAN SkipUnchanged,
+    _In_opt_ PPK_ACTION_LIST ActionList,
+    _Inout_ PULONGLONG NumberOfChanges,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PDBF_FILE referenceDirectory;
+    DB_FILE_SOURCE_INFORMATION sourceInfo;
+    BOOLEAN recordSourceInfo;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    PDB_FILE_DIRECTORY_INFORMATION entry;
+    PPH_HASHTABLE directoryHashtable;
+    PBOOLEAN entryFound;
+    ULONG i;
+    PEN_FILEINFO childInfo;
+    PPH_STRING fileName;
+    BOOLEAN fileInfoIsDirectory;
+    BOOLEAN entryIsDirectory;
+    BOOLEAN modified;
+    BOOLEAN failed;
+
+    // The stamp is only known for directories that were listed from the file system.
+    recordSourceInfo = FileInfo->FsStamp != 0;
+
+    if (!FileInfo->Parent || FileInfo->Parent->DbFile)
+    {
+        status = DbCreateFile(
+            Database,
+            &FileInfo->Name,
+            FileInfo->Parent ? FileInfo->Parent->DbFile : HeadDirectory,
+            0,
+            DB_FILE_OPEN,
+            DB_FILE_DIRECTORY_FILE,
+            NULL,
+            &referenceDirectory
+            );
+    }
+    else
+    {
+        // For test mode.
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    if (DiffDirectory || (status != STATUS_OBJECT_NAME_NOT_FOUND && status != STATUS_NOT_A_DIRECTORY))
+    {
+        if (!NT_SUCCESS(status))
+            return status;
+
+        FileInfo->DbFile = referenceDirectory;
+
+        // If the directory has the same stamp and number of files as when it was last compared,
+        // its files have not changed. Subdirectories are still compared.
+        if (SkipUnchanged && recordSourceInfo &&
+            NT_SUCCESS(DbQueryInformationFile(Database, referenceDirectory, DbFileSourceInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION))) &&
+            sourceInfo.Stamp != 0 &&
+            sourceInfo.Stamp == FileInfo->FsStamp &&
+            sourceInfo.NumberOfFiles == FileInfo->NumberOfFiles)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        status = DbQueryDirectoryFile(Database, referenceDirectory, &entries, &numberOfEntries);
+
+        if (!NT_SUCCESS(status))
             return status;
     }
     else
@@ -1306,13 +1611,27 @@ NTSTATUS EnpDiffDirectoryNewRevision(
         entry++;
     }
 
-    // Detect files/directories that have been deleted.
+    // Detect files/directories that have been deleted. The files in the file system aren't
+    // indexed, so mark the entries that still exist first.
+
+    entryFound = PhAllocate(numberOfEntries + 1);
+    memset(entryFound, 0, numberOfEntries);
+
+    for (childInfo = FileInfo->Files; childInfo; childInfo = childInfo->Next)
+    {
+        entry = EnpFindDirectoryEntry(directoryHashtable, &childInfo->Name);
+
+        if (entry)
+            entryFound[entry - entries] = TRUE;
+    }
 
     entry = entries;
+    fileName = NULL;
+    failed = FALSE;
 
     for (i = 0; i < numberOfEntries; i++)
     {
-        if (!EnpFindFileInfo(FileInfo, &entry->FileName->sr))
+        if (!entryFound[i])
         {
             // Deleted file
             (*NumberOfChanges)++;
@@ -1320,33 +1639,39 @@ NTSTATUS EnpDiffDirectoryNewRevision(
             if (DiffDirectory)
                 status = EnpDiffDeleteFileNewRevision(Database, NewRevisionId, HeadDirectory, DiffDirectory, referenceDirectory, FileInfo, entry, MessageHandler);
 
+            if (!fileName)
+                fileName = EnpGetFullFileName(FileInfo);
+
             if (NT_SUCCESS(status))
-                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"- %s\\%s", FileInfo->FullFileName->Buffer, entry->FileName->Buffer));
+            {
+                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"- %s\\%s", fileName->Buffer, entry->FileName->Buffer));
+            }
             else
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file delete for %s\\%s: 0x%x", FileInfo->FullFileName->Buffer, entry->FileName->Buffer, status));
+            {
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file delete for %s\\%s: 0x%x", fileName->Buffer, entry->FileName->Buffer, status));
+                failed = TRUE;
+            }
         }
 
         entry++;
     }
 
-    // Detect files/directories that have been added or modified.
+    if (fileName)
+        PhDereferenceObject(fileName);
 
-    if (FileInfo->Files)
-        PhBeginEnumHashtable(FileInfo->Files, &enumContext);
-    else
-        memset(&enumContext, 0, sizeof(PH_HASHTABLE_ENUM_CONTEXT)); // no files
+    PhFree(entryFound);
 
-    while (childInfoPtr = PhNextEnumHashtable(&enumContext))
-    {
-        childInfo = *childInfoPtr;
+    // Detect files/directories that have been added or modified.
 
+    for (childInfo = FileInfo->Files; childInfo; childInfo = childInfo->Next)
+    {
         if (childInfo->NeedFsInfo)
         {
             EnpUpdateFsFileInfo(childInfo, Vss);
             childInfo->NeedFsInfo = FALSE;
         }
 
-        entry = EnpFindDirectoryEntry(directoryHashtable, childInfo->Name);
+        entry = EnpFindDirectoryEntry(directoryHashtable, &childInfo->Name);
 
         if (entry)
         {
@@ -1356,8 +1681,14 @@ NTSTATUS EnpDiffDirectoryNewRevision(
             entryIsDirectory = !!(entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY);
 
             if (fileInfoIsDirectory != entryIsDirectory)
+            {
                 modified = TRUE;
 
+                // The database has nothing below this directory.
+                if (fileInfoIsDirectory)
+                    childInfo->FsChanged = TRUE;
+            }
+
             if (!modified && !childInfo->Directory)
             {
                 if (childInfo->FileInformation.EndOfFile.QuadPart != entry->EndOfFile.QuadPart)
@@ -1375,10 +1706,19 @@ NTSTATUS EnpDiffDirectoryNewRevision(
                 if (DiffDirectory)
                     status = EnpDiffModifyFileNewRevision(Database, NewRevisionId, HeadDirectory, DiffDirectory, referenceDirectory, childInfo, entry, ActionList, MessageHandler);
 
+                fileName = EnpGetFullFileName(childInfo);
+
                 if (NT_SUCCESS(status))
-                    MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%c %s", fileInfoIsDirectory != entryIsDirectory ? 's' : 'm', childInfo->FullFileName->Buffer));
+                {
+                    MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%c %s", fileInfoIsDirectory != entryIsDirectory ? 's' : 'm', fileName->Buffer));
+                }
                 else
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file modify for %s: 0x%x", childInfo->FullFileName->Buffer, status));
+                {
+                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file modify for %s: 0x%x", fileName->Buffer, status));
+                    failed = TRUE;
+                }
+
+                PhDereferenceObject(fileName);
             }
         }
         else
@@ -1386,13 +1726,27 @@ NTSTATUS EnpDiffDirectoryNewRevision(
             // Added file
             (*NumberOfChanges)++;
 
+            // The change source may not report the contents of a new directory, for example
+            // when a directory is added to the configuration.
+            if (childInfo->Directory)
+                childInfo->FsChanged = TRUE;
+
             if (DiffDirectory)
                 status = EnpDiffAddFileNewRevision(Database, NewRevisionId, HeadDirectory, DiffDirectory, referenceDirectory, childInfo, TRUE, ActionList, MessageHandler);
 
+            fileName = EnpGetFullFileName(childInfo);
+
             if (NT_SUCCESS(status))
-                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"+ %s", childInfo->FullFileName->Buffer));
+            {
+                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"+ %s", fileName->Buffer));
+            }
             else
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file add for %s: 0x%x", childInfo->FullFileName->Buffer, status));
+            {
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to process file add for %s: 0x%x", fileName->Buffer, status));
+                failed = TRUE;
+            }
+
+            PhDereferenceObject(fileName);
         }
     }
 
@@ -1401,6 +1755,23 @@ NTSTATUS EnpDiffDirectoryNewRevision(
     if (entries)
         DbFreeQueryDirectoryFile(entries, numberOfEntries);
 
+    if (DiffDirectory && recordSourceInfo)
+    {
+        // If a file could not be processed, the directory must be compared again next time even
+        // if it doesn't change, otherwise the file would be left out of every later revision.
+        if (!failed)
+        {
+            sourceInfo.NumberOfFiles = FileInfo->NumberOfFiles;
+            sourceInfo.Stamp = FileInfo->FsStamp;
+        }
+        else
+        {
+            memset(&sourceInfo, 0, sizeof(DB_FILE_SOURCE_INFORMATION));
+        }
+
+        DbSetInformationFile(Database, referenceDirectory, DbFileSourceInformation, &sourceInfo, sizeof(DB_FILE_SOURCE_INFORMATION));
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -1420,6 +1791,7 @@ NTSTATUS EnpDiffAddFileNewRevision(
     ULONG attributes;
     PDBF_FILE file;
     ULONG actionFlags;
+    PPH_STRING fileName;
     DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
     DB_FILE_DATA_INFORMATION dataInfo;
 
@@ -1432,7 +1804,7 @@ NTSTATUS EnpDiffAddFileNewRevision(
 
     status = DbCreateFile(
         Database,
-        &FileInfo->Name->sr,
+        &FileInfo->Name,
         ThisDirectoryInHead,
         attributes,
         DB_FILE_CREATE,
@@ -1463,7 +1835,8 @@ NTSTATUS EnpDiffAddFileNewRevision(
     if (FileInfo->Directory)
         actionFlags |= PK_ACTION_DIRECTORY;
 
-    PkAppendAddToActionList(ActionList, actionFlags, FileInfo->FullFileName, FileInfo);
+    fileName = EnpGetFullFileName(FileInfo);
+    PkAppendAddToActionList(ActionList, actionFlags, fileName, EnpCreatePackageFile(FileInfo, fileName));
 
     // Record a delete action in the diff directory.
     // We don't do this if the caller is handling a file modify.
@@ -1471,10 +1844,10 @@ NTSTATUS EnpDiffAddFileNewRevision(
 
     if (CreateDiffFile && !(FileInfo->DiffFlags & EN_DIFF_SWITCHED))
     {
-        DbUtCreateParentDirectories(Database, DiffDirectory, &FileInfo->FullFileName->sr);
+        DbUtCreateParentDirectories(Database, DiffDirectory, &fileName->sr);
         status = DbCreateFile(
             Database,
-            &FileInfo->FullFileName->sr,
+            &fileName->sr,
             DiffDirectory,
             attributes | DB_FILE_ATTRIBUTE_DELETE_TAG,
             DB_FILE_CREATE,
@@ -1484,11 +1857,16 @@ NTSTATUS EnpDiffAddFileNewRevision(
             );
 
         if (!NT_SUCCESS(status))
+        {
+            PhDereferenceObject(fileName);
             return status;
+        }
 
         DbCloseFile(Database, file);
     }
 
+    PhDereferenceObject(fileName);
+
     return STATUS_SUCCESS;
 }
 
@@ -1524,9 +1902,10 @@ NTSTATUS EnpDiffDeleteFileNewRevision(
     if (!NT_SUCCESS(status))
         return status;
 
-    if (DirectoryFileInfo->FullFileName->Length != 0)
+    if (DirectoryFileInfo->Parent)
     {
-        fileName = EnpAppendComponentToPath(&DirectoryFileInfo->FullFileName->sr, &Entry->FileName->sr);
+        fileName = EnpGetFullFileName(DirectoryFileInfo);
+        PhMoveReference(&fileName, EnpAppendComponentToPath(&fileName->sr, &Entry->FileName->sr));
     }
     else
     {
@@ -1614,14 +1993,17 @@ ULONG EnpDirectoryEntryHashFunction(
 
 PDB_FILE_DIRECTORY_INFORMATION EnpFindDirectoryEntry(
     _In_ PPH_HASHTABLE Hashtable,
-    _In_ PPH_STRING Name
+    _In_ PPH_STRINGREF Name
     )
 {
     DB_FILE_DIRECTORY_INFORMATION lookupEntry;
     PDB_FILE_DIRECTORY_INFORMATION lookupEntryPtr = &lookupEntry;
     PDB_FILE_DIRECTORY_INFORMATION *entry;
+    PH_STRING lookupName;
 
-    lookupEntry.FileName = Name;
+    // Only the name is used by the compare and hash functions.
+    lookupName.sr = *Name;
+    lookupEntry.FileName = &lookupName;
     entry = PhFindEntryHashtable(Hashtable, &lookupEntryPtr);
 
     if (entry)
@@ -1639,12 +2021,13 @@ HRESULT EnpBackupPackageCallback(
 {
     NTSTATUS status;
     PEN_PACKAGE_CALLBACK_CONTEXT context = Context;
-    PEN_FILEINFO fileInfo;
+    PEN_PACKAGE_FILE packageFile;
+    ULONGLONG chunkOffset;
 
     if (Action)
-        fileInfo = Action->Context;
+        packageFile = Action->Context;
     else
-        fileInfo = NULL;
+        packageFile = NULL;
 
     switch (Message)
     {
@@ -1653,22 +2036,89 @@ HRESULT EnpBackupPackageCallback(
     case PkGetCreationTimeMessage:
     case PkGetAccessTimeMessage:
     case PkGetModifiedTimeMessage:
-        *(PFILE_NETWORK_OPEN_INFORMATION)Parameter = fileInfo->FileInformation;
+        *(PFILE_NETWORK_OPEN_INFORMATION)Parameter = packageFile->FileInformation;
 
-        if (fileInfo->Directory)
+        if (packageFile->Directory)
         {
             ((PFILE_NETWORK_OPEN_INFORMATION)Parameter)->FileAttributes |= FILE_ATTRIBUTE_DIRECTORY;
         }
+        else if (EnpSplitChunkName(&Action->u.Add.Destination->sr, NULL, &chunkOffset))
+        {
+            ((PFILE_NETWORK_OPEN_INFORMATION)Parameter)->EndOfFile.QuadPart = EnpQueryChunkLength(context->Config, packageFile, chunkOffset);
+            ((PFILE_NETWORK_OPEN_INFORMATION)Parameter)->AllocationSize = ((PFILE_NETWORK_OPEN_INFORMATION)Parameter)->EndOfFile;
+        }
 
         break;
     case PkGetStreamMessage:
         {
             PPK_PARAMETER_GET_STREAM getStream = Parameter;
+            PPH_FILE_STREAM fileStream;
+            LARGE_INTEGER offset;
+            BOOLEAN unbuffered;
+
+            unbuffered = !!context->Config->UnbufferedReads;
+
+            if (EnpSplitChunkName(&Action->u.Add.Destination->sr, NULL, &chunkOffset))
+            {
+                // Chunks can be read by several parts at the same time, so each one gets its own
+                // handle.
+
+                status = EnpOpenStreamForFile(packageFile, unbuffered, context->Vss, context->MessageHandler, &fileStream);
+
+                // Unbuffered streams are read at an offset instead of from the current position.
+                if (NT_SUCCESS(status) && !unbuffered)
+                {
+                    offset.QuadPart = chunkOffset;
+                    status = PhSeekFileStream(fileStream, &offset, SeekStart);
+
+                    if (!NT_SUCCESS(status))
+                    {
+                        PPH_STRING fileName;
+
+                        fileName = EnpGetPackageFileSourceName(packageFile);
+                        context->MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to read %s: 0x%x", fileName->Buffer, status));
+                        PhDereferenceObject(fileName);
+                        PhDereferenceObject(fileStream);
+                    }
+                }
+
+                if (!NT_SUCCESS(status))
+                {
+                    if (context->Config->Strict)
+                    {
+                        context->MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Aborting because Strict is enabled."));
+                        return E_FAIL;
+                    }
+
+                    getStream->FileStream = PkCreateFileStream(NULL);
+                    break;
+                }
+
+                if (unbuffered)
+                {
+                    getStream->FileStream = PkCreateFileStreamUnbuffered(
+                        fileStream,
+                        chunkOffset,
+                        EnpQueryChunkLength(context->Config, packageFile, chunkOffset),
+                        EN_UNBUFFERED_READ_SIZE
+                        );
+                }
+                else
+                {
+                    getStream->FileStream = PkCreateFileStreamRange(fileStream, EnpQueryChunkLength(context->Config, packageFile, chunkOffset));
+                }
+
+                PhDereferenceObject(fileStream);
+                break;
+            }
 
-            if (!fileInfo->FileStreamAttempted)
+            if (context->Backup.ReadAhead && EnpTakeReadAheadStream(context->Backup.ReadAhead, Action, &getStream->FileStream))
+                break;
+
+            if (!packageFile->FileStreamAttempted)
             {
-                status = EnpOpenStreamForFile(fileInfo, context->Vss, context->MessageHandler);
-                fileInfo->FileStreamAttempted = TRUE;
+                status = EnpOpenStreamForFile(packageFile, unbuffered, context->Vss, context->MessageHandler, &packageFile->FileStream);
+                packageFile->FileStreamAttempted = TRUE;
 
                 if (!NT_SUCCESS(status))
                 {
@@ -1677,25 +2127,56 @@ HRESULT EnpBackupPackageCallback(
                 }
             }
 
-            getStream->FileStream = PkCreateFileStream(fileInfo->FileStream); // creates zero-length stream if NULL
-            PhSwapReference(&fileInfo->FileStream, NULL);
+            if (packageFile->FileStream && unbuffered)
+                getStream->FileStream = PkCreateFileStreamUnbuffered(packageFile->FileStream, 0, -1, EN_UNBUFFERED_READ_SIZE);
+            else
+                getStream->FileStream = PkCreateFileStream(packageFile->FileStream); // creates zero-length stream if NULL
+
+            PhSwapReference(&packageFile->FileStream, NULL);
         }
         break;
     case PkProgressMessage:
         {
             PPK_PARAMETER_PROGRESS progress = Parameter;
+            PEN_PACKAGE_PROGRESS partProgress = context->Backup.Progress;
             PH_FORMAT format[3];
+            ULONGLONG value;
+            ULONGLONG total;
+            ULONG i;
 
-            if (progress->ProgressTotal != 0)
+            value = progress->ProgressValue;
+            total = progress->ProgressTotal;
+
+            // Parts are compressed at the same time, so report the progress of all parts together.
+            if (partProgress)
+            {
+                PhAcquireQueuedLockExclusive(&partProgress->Lock);
+                partProgress->Value[context->Backup.PartId] = value;
+                partProgress->Total[context->Backup.PartId] = total;
+                value = 0;
+                total = 0;
+
+                for (i = 0; i < EN_MAXIMUM_PACKAGE_PARTS; i++)
+                {
+                    value += partProgress->Value[i];
+                    total += partProgress->Total[i];
+                }
+            }
+
+            // Batches are compressed while the diff is still reporting its own progress.
+            if (total != 0 && !context->Backup.Pipeline)
             {
                 PhInitFormatS(&format[0], L"Compressing: ");
-                PhInitFormatF(&format[1], (DOUBLE)progress->ProgressValue * 100 / progress->ProgressTotal, 2);
+                PhInitFormatF(&format[1], (DOUBLE)value * 100 / total, 2);
                 format[1].Type |= FormatRightAlign;
                 format[1].Width = 5;
                 PhInitFormatC(&format[2], '%');
 
                 context->MessageHandler(EN_MESSAGE_PROGRESS, PhFormat(format, 3, 0));
             }
+
+            if (partProgress)
+                PhReleaseQueuedLockExclusive(&partProgress->Lock);
         }
         break;
     }
@@ -1703,2664 +2184,6280 @@ HRESULT EnpBackupPackageCallback(
     return S_OK;
 }
 
-NTSTATUS EnpOpenStreamForFile(
-    _In_ PEN_FILEINFO FileInfo,
+NTSTATUS EnpCreatePackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ ULONGLONG RevisionId,
+    _In_ PPK_ACTION_LIST ActionList,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
     NTSTATUS status;
-    PPH_STRING sourceFileName;
-    HANDLE fileHandle;
+    ULONG numberOfCompressedParts;
+    PUCHAR partIds;
+    EN_PACKAGE_PART_ENTRY partEntries[EN_MAXIMUM_PACKAGE_PARTS];
+    PEN_PACKAGE_PART_ENTRY partEntry;
+    ULONG numberOfPartEntries;
+    EN_PACKAGE_PROGRESS progress;
+    PH_WORK_QUEUE workQueue;
+    PPK_ACTION action;
+    PPK_ACTION_LIST chunkedActionList;
     PPH_FILE_STREAM fileStream;
+    BOOLEAN chunk;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
+    ULONG partId;
+    ULONG i;
 
-    if (Vss)
+    numberOfCompressedParts = min(max(Config->NumberOfParts, 1), EN_MAXIMUM_COMPRESSED_PARTS);
+    memset(partEntries, 0, sizeof(partEntries));
+
+    // Split large files into chunks first so that the chunks can be spread over the parts.
+    chunkedActionList = EnpCreateChunkedActionList(Config, ActionList);
+
+    if (chunkedActionList)
+        ActionList = chunkedActionList;
+
+    if (!Config->StoreIncompressible && !Config->SmallFileSize && numberOfCompressedParts == 1 && !chunkedActionList)
     {
-        sourceFileName = BkMapFileNameVssObject(Vss, FileInfo->FullSourceFileName);
+        partEntries[EN_PACKAGE_PART_MAIN].ActionList = ActionList;
     }
     else
     {
-        sourceFileName = FileInfo->FullSourceFileName;
-        PhReferenceObject(sourceFileName);
-    }
+        // 7-Zip applies the same method to every item in an archive and compresses each archive
+        // with a single UpdateItems call, so the files are split into separate parts instead.
 
-    status = PhCreateFileWin32(
-        &fileHandle,
-        sourceFileName->Buffer,
-        FILE_GENERIC_READ,
-        0,
-        FILE_SHARE_READ,
-        FILE_OPEN,
-        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT
-        );
+        partIds = PhAllocate(ActionList->NumberOfActions);
+        EnpAssignPackageParts(Config, ActionList, numberOfCompressedParts, Vss, MessageHandler, partIds);
 
-    if (!NT_SUCCESS(status))
-    {
-        status = PhCreateFileWin32(
-            &fileHandle,
-            sourceFileName->Buffer,
-            FILE_GENERIC_READ,
-            0,
-            FILE_SHARE_READ,
-            FILE_OPEN,
-            FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
-            );
-    }
+        // Keep the original order within each part so that similar files stay together.
 
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %s: 0x%x", sourceFileName->Buffer, status));
-        PhDereferenceObject(sourceFileName);
-        return status;
-    }
+        for (i = 0; i < ActionList->NumberOfActions; i++)
+        {
+            action = &ActionList->Actions[i];
+            partId = partIds[i];
 
-    status = PhCreateFileStream2(&fileStream, fileHandle, 0, PAGE_SIZE);
+            if (!partEntries[partId].ActionList)
+                partEntries[partId].ActionList = PkCreateActionList();
 
-    if (NT_SUCCESS(status))
-    {
-        FileInfo->FileStream = fileStream;
-    }
-    else
-    {
-        NtClose(fileHandle);
-    }
+            PkAppendAddToActionList(partEntries[partId].ActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
 
-    PhDereferenceObject(sourceFileName);
+            // Record the part in the database so that a restore only opens the parts it needs.
 
-    return status;
-}
-
-NTSTATUS EnpRevertToRevision(
-    _In_ PBK_CONFIG Config,
-    _In_opt_ HANDLE TransactionHandle,
-    _In_ PDB_DATABASE Database,
-    _In_ ULONGLONG TargetRevisionId,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
-    )
-{
-    NTSTATUS status;
-    ULONGLONG lastRevisionId;
-    ULONGLONG firstRevisionId;
-    PDBF_FILE headDirectory;
-    PH_STRINGREF headDirectoryName;
-    PDBF_FILE newHeadDirectory;
-    PH_STRINGREF newHeadDirectoryName;
-    ULONG createStatus;
-    ULONGLONG revisionId;
-    PDBF_FILE diffDirectory;
-    WCHAR diffDirectoryNameBuffer[17];
-    PH_STRINGREF diffDirectoryName;
-    DB_FILE_BASIC_INFORMATION basicInfo;
-    PPH_STRING packageFileName;
-    DB_FILE_RENAME_INFORMATION renameInfo;
-    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+            chunk = chunkedActionList && EnpSplitChunkName(&action->u.Add.Destination->sr, NULL, NULL);
 
-    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+            if (partId != EN_PACKAGE_PART_MAIN || chunk)
+                EnpSetPackagePartFile(Database, HeadDirectory, action->Context, partId, chunk);
+        }
 
-    if (TargetRevisionId < firstRevisionId || TargetRevisionId > lastRevisionId)
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", TargetRevisionId));
-        return STATUS_INVALID_PARAMETER;
+        PhFree(partIds);
     }
 
-    if (TargetRevisionId == lastRevisionId)
-    {
-        // Nothing to do
-        return STATUS_ABANDONED;
-    }
+    // Create the package files on this thread, since the current transaction is per-thread.
 
-    // Open the HEAD directory.
+    status = STATUS_SUCCESS;
+    numberOfPartEntries = 0;
+    PhInitializeQueuedLock(&progress.Lock);
+    memset(progress.Value, 0, sizeof(progress.Value));
+    memset(progress.Total, 0, sizeof(progress.Total));
 
-    PhInitializeStringRef(&headDirectoryName, L"head");
-    status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+    {
+        partEntry = &partEntries[partId];
 
-    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-        MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"HEAD directory does not exist"));
+        if (!partEntry->ActionList || PkQueryCountActionList(partEntry->ActionList) == 0)
+            continue;
 
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD directory"));
-        return status;
-    }
+        partEntry->FileName = EnpFormatPackagePartName(Config, RevisionId, partId);
+        RtlSetCurrentTransaction(TransactionHandle);
+        status = PhCreateFileStream(&fileStream, partEntry->FileName->Buffer, FILE_GENERIC_READ | FILE_GENERIC_WRITE, 0, FILE_CREATE, 0);
+        RtlSetCurrentTransaction(NULL);
 
-    // Create the NEWHEAD directory and copy the contents of HEAD to NEWHEAD.
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create package %s", partEntry->FileName->Buffer));
+            break;
+        }
 
-    PhInitializeStringRef(&newHeadDirectoryName, L"newHead");
-    status = DbCreateFile(Database, &newHeadDirectoryName, NULL, DB_FILE_ATTRIBUTE_DIRECTORY, DB_FILE_OPEN_IF, DB_FILE_DIRECTORY_FILE, &createStatus, &newHeadDirectory);
+        partEntry->FileStream = PkCreateFileStream(fileStream);
+        PhDereferenceObject(fileStream);
 
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to create or open NEWHEAD directory"));
-        DbCloseFile(Database, headDirectory);
-        return status;
+        EnpInitializePartCompression(Config, &Config->Compression, partId, &partEntry->Settings);
+        partEntry->Context.Config = Config;
+        partEntry->Context.Database = Database;
+        partEntry->Context.Vss = Vss;
+        partEntry->Context.MessageHandler = MessageHandler;
+        partEntry->Context.Backup.PartId = partId;
+        partEntry->Context.Backup.Progress = &progress;
+        numberOfPartEntries++;
     }
 
-    if (createStatus == DB_FILE_OPENED)
+    if (NT_SUCCESS(status) && numberOfPartEntries != 0)
     {
-        MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"NEWHEAD directory already exists; deleting contents"));
-        DbUtDeleteDirectoryContents(Database, newHeadDirectory);
-    }
+        // Share the processors between the parts unless the number of threads was specified. The
+        // read-ahead memory is always shared.
 
-    status = DbUtCopyDirectoryContents(Database, headDirectory, newHeadDirectory);
+        for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+        {
+            partEntry = &partEntries[partId];
 
-    if (!NT_SUCCESS(status) || status == STATUS_SOME_NOT_MAPPED)
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to copy HEAD to NEWHEAD"));
-        DbUtDeleteDirectoryContents(Database, newHeadDirectory);
-        DbDeleteFile(Database, newHeadDirectory);
-        DbCloseFile(Database, headDirectory);
+            if (partEntry->FileStream && partEntry->Settings.NumberOfThreads == PK_COMPRESSION_DEFAULT && numberOfPartEntries > 1)
+                partEntry->Settings.NumberOfThreads = max(PhSystemBasicInformation.NumberOfProcessors / numberOfPartEntries, 1);
 
-        if (status == STATUS_SOME_NOT_MAPPED)
-            status = STATUS_UNSUCCESSFUL;
+            partEntry->ReadAheadSize = (SIZE_T)Config->ReadAheadSize * 1024 * 1024 / numberOfPartEntries;
+        }
 
-        return status;
-    }
+        PhQuerySystemTime(&startTime);
+        PhInitializeWorkQueue(&workQueue, 0, min(numberOfPartEntries, PhSystemBasicInformation.NumberOfProcessors), 1000);
 
-    // Open the previous diff directories and merge them.
+        for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+        {
+            if (partEntries[partId].FileStream)
+                PhQueueItemWorkQueue(&workQueue, EnpCreatePackagePartWorker, &partEntries[partId]);
+        }
 
-    for (revisionId = lastRevisionId - 1; revisionId >= TargetRevisionId; revisionId--)
-    {
-        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
-        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
-        diffDirectoryName.Length = 16 * sizeof(WCHAR);
-        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+        PhWaitForWorkQueue(&workQueue);
+        PhDeleteWorkQueue(&workQueue);
+        PhQuerySystemTime(&endTime);
 
-        if (NT_SUCCESS(status))
+        for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
         {
-            // Get the time stamp for this directory. We'll need it later.
-            status = DbQueryInformationFile(Database, diffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+            partEntry = &partEntries[partId];
 
-            if (NT_SUCCESS(status))
+            if (partEntry->FileStream && !SUCCEEDED(partEntry->Result))
             {
-                MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Merging %s to HEAD", diffDirectoryNameBuffer));
-                status = EnpMergeDirectoryToHead(Database, newHeadDirectory, diffDirectory, MessageHandler);
-                DbCloseFile(Database, diffDirectory);
+                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to update package %s: 0x%x", partEntry->FileName->Buffer, partEntry->Result));
+                status = STATUS_UNSUCCESSFUL;
             }
         }
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge %s", diffDirectoryNameBuffer));
-            DbUtDeleteDirectoryContents(Database, newHeadDirectory);
-            DbDeleteFile(Database, newHeadDirectory);
-            DbCloseFile(Database, headDirectory);
-            return status;
-        }
+        if (NT_SUCCESS(status))
+            EnpReportPackagePartsCompression(TransactionHandle, partEntries, &progress, endTime.QuadPart - startTime.QuadPart, MessageHandler);
     }
 
-    // Delete the diff directories and package files.
-
-    for (revisionId = lastRevisionId - 1; revisionId >= TargetRevisionId; revisionId--)
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
     {
-        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
-        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
-        diffDirectoryName.Length = 16 * sizeof(WCHAR);
-        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+        partEntry = &partEntries[partId];
 
-        if (NT_SUCCESS(status))
-        {
-            DbUtDeleteDirectoryContents(Database, diffDirectory);
-            DbDeleteFile(Database, diffDirectory);
-        }
-        else
+        if (partEntry->FileStream)
         {
-            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", diffDirectoryNameBuffer));
+            PkDereferenceFileStream(partEntry->FileStream);
+
+            if (!NT_SUCCESS(status))
+            {
+                RtlSetCurrentTransaction(TransactionHandle);
+                PhDeleteFileWin32(partEntry->FileName->Buffer);
+                RtlSetCurrentTransaction(NULL);
+            }
         }
 
-        packageFileName = EnpFormatPackageName(Config, revisionId + 1);
-        status = PhDeleteFileWin32(packageFileName->Buffer);
+        if (partEntry->FileName)
+            PhDereferenceObject(partEntry->FileName);
+        if (partEntry->ActionList && partEntry->ActionList != ActionList)
+            PkDestroyActionList(partEntry->ActionList);
+    }
 
-        // It's OK if the file didn't exist.
-        if (!NT_SUCCESS(status) && status != STATUS_OBJECT_PATH_NOT_FOUND && status != STATUS_OBJECT_NAME_NOT_FOUND)
-            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", packageFileName->Buffer));
+    if (chunkedActionList)
+        PkDestroyActionList(chunkedActionList);
 
-        PhDereferenceObject(packageFileName);
-    }
+    return status;
+}
 
-    revisionIdInfo.RevisionId = TargetRevisionId;
-    DbSetInformationFile(Database, newHeadDirectory, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
-    DbUtTouchFile(Database, newHeadDirectory, &basicInfo.TimeStamp);
+VOID EnpReportPackagePartsCompression(
+    _In_opt_ HANDLE TransactionHandle,
+    _In_reads_(EN_MAXIMUM_PACKAGE_PARTS) PEN_PACKAGE_PART_ENTRY PartEntries,
+    _In_ PEN_PACKAGE_PROGRESS Progress,
+    _In_ LONG64 ElapsedTime,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    FILE_NETWORK_OPEN_INFORMATION networkOpenInfo;
+    ULONGLONG inputSize;
+    ULONGLONG outputSize;
+    PH_FORMAT format[9];
+    ULONG partId;
 
-    // Delete the current HEAD directory and rename NEWHEAD to HEAD.
-    DbUtDeleteDirectoryContents(Database, headDirectory);
-    DbDeleteFile(Database, headDirectory);
+    inputSize = 0;
+    outputSize = 0;
 
-    renameInfo.RootDirectory = NULL;
-    PhInitializeStringRef(&renameInfo.FileName, L"head");
-    status = DbSetInformationFile(Database, newHeadDirectory, DbFileRenameInformation, &renameInfo, sizeof(DB_FILE_RENAME_INFORMATION));
+    // The total reported by 7-Zip for each part is the amount of data that was read.
 
-    if (!NT_SUCCESS(status))
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename NEWHEAD to HEAD; the database is in an unknown state"));
+        if (!PartEntries[partId].FileStream)
+            continue;
+
+        inputSize += Progress->Total[partId];
+
+        RtlSetCurrentTransaction(TransactionHandle);
+
+        if (NT_SUCCESS(EnpQueryFullAttributesFileWin32(PartEntries[partId].FileName->Buffer, &networkOpenInfo)))
+            outputSize += networkOpenInfo.EndOfFile.QuadPart;
+
+        RtlSetCurrentTransaction(NULL);
     }
 
-    DbSetRevisionIdsDatabase(Database, &TargetRevisionId, NULL);
+    if (inputSize == 0 || outputSize == 0)
+        return;
 
-    return status;
+    if (ElapsedTime <= 0)
+        ElapsedTime = 1;
+
+    PhInitFormatS(&format[0], L"Compressed ");
+    PhInitFormatSize(&format[1], inputSize);
+    PhInitFormatS(&format[2], L" to ");
+    PhInitFormatSize(&format[3], outputSize);
+    PhInitFormatS(&format[4], L" (");
+    PhInitFormatF(&format[5], (DOUBLE)outputSize * 100 / inputSize, 2);
+    PhInitFormatS(&format[6], L"%) at ");
+    // ElapsedTime is in 100ns units.
+    PhInitFormatSize(&format[7], (ULONG64)((DOUBLE)inputSize * 10000000 / ElapsedTime));
+
+    PhInitFormatS(&format[8], L"/s");
+
+    MessageHandler(EN_MESSAGE_INFORMATION, PhFormat(format, 9, 0));
 }
 
-NTSTATUS EnpMergeDirectoryToHead(
-    _In_ PDB_DATABASE Database,
-    _In_ PDBF_FILE DirectoryInHead,
-    _In_ PDBF_FILE DirectoryInDiff,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+VOID EnpAssignPackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_ ULONG NumberOfCompressedParts,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_writes_(ActionList->NumberOfActions) PUCHAR PartIds
     )
 {
-    NTSTATUS status;
-    PDB_FILE_DIRECTORY_INFORMATION entries;
-    ULONG numberOfEntries;
+    PVOID sampleBuffer;
+    PEN_PART_SIZE_ENTRY sizeEntries;
+    ULONG numberOfSizeEntries;
+    ULONGLONG partSizes[EN_MAXIMUM_COMPRESSED_PARTS];
+    PPK_ACTION action;
+    PEN_PACKAGE_FILE packageFile;
+    PEN_PACKAGE_FILE lastPackageFile;
+    BOOLEAN incompressible;
+    ULONGLONG chunkOffset;
+    ULONG index;
+    ULONG partIndex;
     ULONG i;
-    PDBF_FILE fileInHead;
-    PDBF_FILE fileInDiff;
-    DB_FILE_BASIC_INFORMATION basicInfo;
-    BOOLEAN copyFromDiffToHead;
-
-    status = DbQueryDirectoryFile(Database, DirectoryInDiff, &entries, &numberOfEntries);
+    ULONG j;
 
-    if (!NT_SUCCESS(status))
-        return status;
+    sampleBuffer = NULL;
+    lastPackageFile = NULL;
+    incompressible = FALSE;
 
-    for (i = 0; i < numberOfEntries; i++)
+    if (Config->StoreIncompressible)
     {
-        copyFromDiffToHead = FALSE;
-        status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInHead, 0, DB_FILE_OPEN, 0, NULL, &fileInHead);
-
-        if (NT_SUCCESS(status))
-        {
-            status = DbQueryInformationFile(Database, fileInHead, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+        MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Classifying files"));
+        sampleBuffer = PhAllocatePage(EN_STORE_SAMPLE_SIZE, NULL);
+    }
 
-            if (NT_SUCCESS(status))
-            {
-                if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
-                {
-                    // File was added in the current revision; delete it.
+    sizeEntries = PhAllocate(sizeof(EN_PART_SIZE_ENTRY) * ActionList->NumberOfActions);
+    numberOfSizeEntries = 0;
 
-                    if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-                        DbUtDeleteDirectoryContents(Database, fileInHead);
+    for (index = 0; index < ActionList->NumberOfActions; index++)
+    {
+        action = &ActionList->Actions[index];
+        packageFile = action->Context;
 
-                    status = DbDeleteFile(Database, fileInHead);
+        // The chunks of a file are next to each other, so the file only needs to be sampled
+        // once.
+        if (sampleBuffer && !packageFile->Directory && packageFile != lastPackageFile)
+        {
+            incompressible = EnpIsIncompressibleFile(Config, packageFile, Vss, sampleBuffer);
+            lastPackageFile = packageFile;
+        }
 
-                    if (!NT_SUCCESS(status))
-                        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete '%s' during reversal of file add", entries[i].FileName->Buffer));
-                }
-                else
-                {
-                    if ((entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) && (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
-                    {
-                        // Both are directories, which doesn't indicate much.
-                        // Scan the directory.
+        if (packageFile->Directory)
+        {
+            PartIds[index] = EN_PACKAGE_PART_MAIN;
+        }
+        else if (sampleBuffer && incompressible)
+        {
+            PartIds[index] = EN_PACKAGE_PART_STORE;
+        }
+        else if (Config->SmallFileSize != 0 &&
+            (ULONGLONG)packageFile->FileInformation.EndOfFile.QuadPart <= (ULONGLONG)Config->SmallFileSize * 1024)
+        {
+            PartIds[index] = EN_PACKAGE_PART_SMALL;
+        }
+        else
+        {
+            PartIds[index] = EN_PACKAGE_PART_MAIN;
 
-                        status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInDiff, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &fileInDiff);
+            if (EnpSplitChunkName(&action->u.Add.Destination->sr, NULL, &chunkOffset))
+                sizeEntries[numberOfSizeEntries].Size = EnpQueryChunkLength(Config, packageFile, chunkOffset);
+            else
+                sizeEntries[numberOfSizeEntries].Size = packageFile->FileInformation.EndOfFile.QuadPart;
 
-                        if (NT_SUCCESS(status))
-                        {
-                            status = EnpMergeDirectoryToHead(Database, fileInHead, fileInDiff, MessageHandler);
-                            DbCloseFile(Database, fileInDiff);
-                        }
+            sizeEntries[numberOfSizeEntries].Index = index;
+            numberOfSizeEntries++;
+        }
+    }
 
-                        DbCloseFile(Database, fileInHead);
-                    }
-                    else
-                    {
-                        // Both are files, indicating a modification, or there was a switch (file -> directory or directory -> file).
-                        // Just delete the file in HEAD.
+    if (sampleBuffer)
+        PhFreePage(sampleBuffer);
 
-                        if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-                            DbUtDeleteDirectoryContents(Database, fileInHead);
+    if (NumberOfCompressedParts > 1)
+    {
+        // Balance the compressed parts by size: take the largest files first and put each one
+        // in the part with the least data so far.
 
-                        status = DbDeleteFile(Database, fileInHead);
+        qsort(sizeEntries, numberOfSizeEntries, sizeof(EN_PART_SIZE_ENTRY), EnpPartSizeCompareFunction);
+        memset(partSizes, 0, sizeof(partSizes));
 
-                        if (NT_SUCCESS(status))
-                            copyFromDiffToHead = TRUE;
-                        else
-                            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete '%s' during reversal of file modify", entries[i].FileName->Buffer));
-                    }
-                }
-            }
-        }
-        else if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        for (i = 0; i < numberOfSizeEntries; i++)
         {
-            if (!(entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG))
+            partIndex = 0;
+
+            for (j = 1; j < NumberOfCompressedParts; j++)
             {
-                // File was deleted in current revision; bring it back.
-                copyFromDiffToHead = TRUE;
+                if (partSizes[j] < partSizes[partIndex])
+                    partIndex = j;
             }
 
-            status = STATUS_SUCCESS;
+            partSizes[partIndex] += sizeEntries[i].Size;
+            PartIds[sizeEntries[i].Index] = (UCHAR)EN_COMPRESSED_PART_ID(partIndex);
         }
+    }
 
-        if (copyFromDiffToHead)
-        {
-            status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInDiff, 0, DB_FILE_OPEN, 0, NULL, &fileInDiff);
+    PhFree(sizeEntries);
+}
 
-            if (NT_SUCCESS(status))
-            {
-                status = DbUtCopyFile(Database, fileInDiff, DirectoryInHead, &entries[i].FileName->sr, &fileInHead);
+int __cdecl EnpPartSizeCompareFunction(
+    _In_ const void *Entry1,
+    _In_ const void *Entry2
+    )
+{
+    PEN_PART_SIZE_ENTRY entry1 = (PEN_PART_SIZE_ENTRY)Entry1;
+    PEN_PART_SIZE_ENTRY entry2 = (PEN_PART_SIZE_ENTRY)Entry2;
 
-                if (NT_SUCCESS(status))
-                {
-                    if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-                        status = DbUtCopyDirectoryContents(Database, fileInDiff, fileInHead);
+    // Largest first
+    return uint64cmp(entry2->Size, entry1->Size);
+}
 
-                    DbCloseFile(Database, fileInHead);
-                }
+VOID EnpSetPackagePartFile(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ ULONG PartId,
+    _In_ BOOLEAN Chunk
+    )
+{
+    PDBF_FILE file;
+    DB_FILE_BASIC_INFORMATION basicInfo;
 
-                DbCloseFile(Database, fileInDiff);
-            }
+    if (!NT_SUCCESS(DbCreateFile(Database, &File->FileName->sr, HeadDirectory, 0, DB_FILE_OPEN, DB_FILE_NON_DIRECTORY_FILE, NULL, &file)))
+        return;
 
-            if (!NT_SUCCESS(status))
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to copy '%s'", entries[i].FileName->Buffer));
+    if (NT_SUCCESS(DbQueryInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION))))
+    {
+        if (Chunk)
+        {
+            // The chunks of a file can be in several parts.
+            basicInfo.Attributes |= DB_FILE_ATTRIBUTE_CHUNKED;
+            basicInfo.Attributes |= (1 << PartId) << DB_FILE_ATTRIBUTE_CHUNK_PART_SHIFT;
         }
-
-        if (!NT_SUCCESS(status))
+        else
         {
-            DbFreeQueryDirectoryFile(entries, numberOfEntries);
-            return status;
+            basicInfo.Attributes &= ~DB_FILE_ATTRIBUTE_PART_MASK;
+            basicInfo.Attributes |= PartId << DB_FILE_ATTRIBUTE_PART_SHIFT;
         }
+
+        DbSetInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
     }
 
-    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+    DbCloseFile(Database, file);
+}
+
+NTSTATUS NTAPI EnpCreatePackagePartWorker(
+    _In_ PVOID Parameter
+    )
+{
+    PEN_PACKAGE_PART_ENTRY partEntry = Parameter;
+    EN_READ_AHEAD readAhead;
+
+    if (partEntry->ReadAheadSize != 0)
+    {
+        EnpInitializeReadAhead(&readAhead, partEntry->ActionList, &partEntry->Settings, partEntry->ReadAheadSize, partEntry->Context.Vss);
+        partEntry->Context.Backup.ReadAhead = &readAhead;
+    }
+
+    partEntry->Result = PkCreatePackage(
+        partEntry->FileStream,
+        partEntry->ActionList,
+        &partEntry->Settings,
+        EnpBackupPackageCallback,
+        &partEntry->Context
+        );
+
+    if (partEntry->Context.Backup.ReadAhead)
+    {
+        EnpDeleteReadAhead(&readAhead);
+        partEntry->Context.Backup.ReadAhead = NULL;
+    }
 
     return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpTrimToRevision(
+VOID EnpInitializePackagePipeline(
+    _Out_ PEN_PACKAGE_PIPELINE Pipeline,
     _In_ PBK_CONFIG Config,
     _In_opt_ HANDLE TransactionHandle,
     _In_ PDB_DATABASE Database,
-    _In_ ULONGLONG TargetFirstRevisionId,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ ULONGLONG RevisionId,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
-    NTSTATUS status;
-    ULONGLONG lastRevisionId;
-    ULONGLONG firstRevisionId;
-    ULONGLONG revisionId;
-    PPH_HASHTABLE revisionEntries;
-    PDBF_FILE diffDirectory;
-    WCHAR diffDirectoryNameBuffer[17];
-    PH_STRINGREF diffDirectoryName;
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_REVISION_ENTRY revisionEntry;
+    ULONG numberOfCompressedParts;
+
+    memset(Pipeline, 0, sizeof(EN_PACKAGE_PIPELINE));
+    Pipeline->Config = Config;
+    Pipeline->TransactionHandle = TransactionHandle;
+    Pipeline->Database = Database;
+    Pipeline->HeadDirectory = HeadDirectory;
+    Pipeline->RevisionId = RevisionId;
+    Pipeline->ActionList = ActionList;
+    Pipeline->Vss = Vss;
+    Pipeline->MessageHandler = MessageHandler;
+    Pipeline->Status = STATUS_SUCCESS;
+
+    // EnpCreatePackageParts uses the first compressed parts after the diff, and the batches use
+    // the rest.
+    numberOfCompressedParts = min(max(Config->NumberOfParts, 1), EN_MAXIMUM_COMPRESSED_PARTS);
+    Pipeline->MaximumBatches = EN_MAXIMUM_COMPRESSED_PARTS - numberOfCompressedParts;
+
+    PhInitializeQueuedLock(&Pipeline->Lock);
+    PhInitializeQueuedLock(&Pipeline->Condition);
+    // One batch is compressed at a time, and 7-Zip uses all processors for it.
+    PhInitializeWorkQueue(&Pipeline->WorkQueue, 0, 1, 1000);
+    Pipeline->DeferredActionList = PkCreateActionList();
+    Pipeline->RemainingActionList = PkCreateActionList();
+    PhInitializeQueuedLock(&Pipeline->Progress.Lock);
+}
 
-    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+VOID EnpDeletePackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
+    )
+{
+    PEN_PACKAGE_PART_ENTRY partEntry;
+    ULONG partId;
 
-    if (TargetFirstRevisionId < firstRevisionId || TargetFirstRevisionId > lastRevisionId)
+    // EnpCompletePackagePipeline must have been called.
+
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", TargetFirstRevisionId));
-        return STATUS_INVALID_PARAMETER;
+        partEntry = &Pipeline->PartEntries[partId];
+
+        if (partEntry->FileStream)
+            PkDereferenceFileStream(partEntry->FileStream);
+        if (partEntry->FileName)
+            PhDereferenceObject(partEntry->FileName);
+        if (partEntry->ActionList)
+            PkDestroyActionList(partEntry->ActionList);
     }
 
-    if (TargetFirstRevisionId == firstRevisionId)
+    PkDestroyActionList(Pipeline->DeferredActionList);
+    PkDestroyActionList(Pipeline->RemainingActionList);
+}
+
+BOOLEAN EnpIsPipelineFile(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File
+    )
+{
+    // Directories go in the main part, and small files go in the small part.
+
+    if (File->Directory)
+        return FALSE;
+
+    if (Config->SmallFileSize != 0 &&
+        (ULONGLONG)File->FileInformation.EndOfFile.QuadPart <= (ULONGLONG)Config->SmallFileSize * 1024)
     {
-        // Nothing to do
-        return STATUS_ABANDONED;
+        return FALSE;
     }
 
-    // Create a list of files to ignore from each revision.
-    // In each revision, these files will be replaced by files in a later revision (or are eventually deleted).
+    // Files that have to be sampled are checked by EnpPackagePipelineWorker.
+    if (Config->StoreIncompressible && EnpMatchStoreExtension(Config, &File->FileName->sr))
+        return FALSE;
 
-    revisionEntries = PhCreateHashtable(
-        sizeof(EN_REVISION_ENTRY),
-        EnpRevisionEntryCompareFunction,
-        EnpRevisionEntryHashFunction,
-        10
-        );
+    return TRUE;
+}
+
+VOID EnpFlushPackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
+    )
+{
+    NTSTATUS status;
+    PBK_CONFIG config = Pipeline->Config;
+    PPK_ACTION_LIST actionList = Pipeline->ActionList;
+    PPK_ACTION action;
+    PEN_PACKAGE_FILE packageFile;
+    PEN_PACKAGE_PART_ENTRY partEntry;
+    PPH_FILE_STREAM fileStream;
+    ULONG partId;
+    ULONG i;
+
+    if (Pipeline->Stopped)
+        return;
 
-    for (revisionId = firstRevisionId; revisionId < TargetFirstRevisionId; revisionId++)
+    for (; Pipeline->ScanIndex < actionList->NumberOfActions; Pipeline->ScanIndex++)
     {
-        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
-        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
-        diffDirectoryName.Length = 16 * sizeof(WCHAR);
-        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+        packageFile = actionList->Actions[Pipeline->ScanIndex].Context;
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
-            goto CleanupExit;
-        }
+        if (EnpIsPipelineFile(config, packageFile))
+            Pipeline->PendingSize += packageFile->FileInformation.EndOfFile.QuadPart;
+    }
 
-        status = EnpAddMergeFileNamesFromDirectory(Database, revisionEntries, diffDirectory, NULL);
-        DbCloseFile(Database, diffDirectory);
+    if (Pipeline->PendingSize < EN_PIPELINE_SIZE(config))
+        return;
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to process %s directory", diffDirectoryNameBuffer));
-            goto CleanupExit;
-        }
+    if (Pipeline->NumberOfBatches >= Pipeline->MaximumBatches)
+    {
+        // There are no more parts. The rest of the files are packaged after the diff.
+        Pipeline->Stopped = TRUE;
+        return;
     }
 
-    // Merge packages up to the target revision.
+    // Don't let the diff get too far ahead of the compressor.
 
-    status = EnpMergePackages(Config, TransactionHandle, firstRevisionId, TargetFirstRevisionId, revisionEntries, MessageHandler);
+    PhAcquireQueuedLockExclusive(&Pipeline->Lock);
 
-    if (NT_SUCCESS(status))
+    while (Pipeline->NumberOfPendingBatches >= EN_PIPELINE_MAXIMUM_PENDING)
+        PhWaitForCondition(&Pipeline->Condition, &Pipeline->Lock, NULL);
+
+    PhReleaseQueuedLockExclusive(&Pipeline->Lock);
+
+    partId = EN_COMPRESSED_PART_ID(EN_MAXIMUM_COMPRESSED_PARTS - 1 - Pipeline->NumberOfBatches);
+    partEntry = &Pipeline->PartEntries[partId];
+    partEntry->ActionList = PkCreateActionList();
+
+    // The diff keeps appending to its action list, so the batch gets a copy of its actions.
+
+    for (i = Pipeline->FlushedIndex; i < Pipeline->ScanIndex; i++)
     {
-        status = EnpUpdateDatabaseAfterTrim(Database, firstRevisionId, TargetFirstRevisionId, MessageHandler);
+        action = &actionList->Actions[i];
+
+        if (EnpIsPipelineFile(config, action->Context))
+            PkAppendAddToActionList(partEntry->ActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
+        else
+            PkAppendAddToActionList(Pipeline->RemainingActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
     }
 
-CleanupExit:
-    PhBeginEnumHashtable(revisionEntries, &enumContext);
+    Pipeline->FlushedIndex = Pipeline->ScanIndex;
+    Pipeline->PendingSize = 0;
 
-    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    // Create the package file on this thread, since the current transaction is per-thread.
+
+    partEntry->FileName = EnpFormatPackagePartName(config, Pipeline->RevisionId, partId);
+    RtlSetCurrentTransaction(Pipeline->TransactionHandle);
+    status = PhCreateFileStream(&fileStream, partEntry->FileName->Buffer, FILE_GENERIC_READ | FILE_GENERIC_WRITE, 0, FILE_CREATE, 0);
+    RtlSetCurrentTransaction(NULL);
+
+    if (!NT_SUCCESS(status))
     {
-        EnpDestroyFileNameHashtable(revisionEntry->FileNames);
+        Pipeline->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create package %s", partEntry->FileName->Buffer));
+        Pipeline->Status = status;
+        Pipeline->Stopped = TRUE;
+        return;
     }
 
-    PhDereferenceObject(revisionEntries);
+    partEntry->FileStream = PkCreateFileStream(fileStream);
+    PhDereferenceObject(fileStream);
 
-    return status;
+    EnpInitializePartCompression(config, &config->Compression, partId, &partEntry->Settings);
+    partEntry->Context.Config = config;
+    partEntry->Context.Database = Pipeline->Database;
+    partEntry->Context.Vss = Pipeline->Vss;
+    partEntry->Context.MessageHandler = Pipeline->MessageHandler;
+    partEntry->Context.Backup.PartId = partId;
+    partEntry->Context.Backup.Progress = &Pipeline->Progress;
+    partEntry->Context.Backup.Pipeline = Pipeline;
+    partEntry->ReadAheadSize = (SIZE_T)config->ReadAheadSize * 1024 * 1024;
+    Pipeline->NumberOfBatches++;
+
+    PhAcquireQueuedLockExclusive(&Pipeline->Lock);
+    Pipeline->NumberOfPendingBatches++;
+    PhReleaseQueuedLockExclusive(&Pipeline->Lock);
+
+    PhQueueItemWorkQueue(&Pipeline->WorkQueue, EnpPackagePipelineWorker, partEntry);
 }
 
-NTSTATUS EnpAddMergeFileNamesFromDirectory(
-    _In_ PDB_DATABASE Database,
-    _In_ PPH_HASHTABLE RevisionEntries,
-    _In_ PDBF_FILE Directory,
-    _In_opt_ PPH_STRING DirectoryName
+NTSTATUS NTAPI EnpPackagePipelineWorker(
+    _In_ PVOID Parameter
     )
 {
-    NTSTATUS status;
-    PDB_FILE_DIRECTORY_INFORMATION entries;
-    ULONG numberOfEntries;
+    PEN_PACKAGE_PART_ENTRY partEntry = Parameter;
+    PEN_PACKAGE_PIPELINE pipeline = partEntry->Context.Backup.Pipeline;
+    PBK_CONFIG config = pipeline->Config;
+    PPK_ACTION_LIST actionList;
+    PPK_ACTION_LIST chunkedActionList;
+    PPK_ACTION action;
+    PUCHAR partIds;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
     ULONG i;
-    PPH_STRING fileName;
-    PDBF_FILE file;
-    PEN_REVISION_ENTRY revisionEntry;
-    EN_REVISION_ENTRY localRevisionEntry;
-    BOOLEAN added;
-
-    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
 
-    if (!NT_SUCCESS(status))
-        return status;
+    PhQuerySystemTime(&startTime);
 
-    for (i = 0; i < numberOfEntries; i++)
+    if (config->StoreIncompressible)
     {
-        if (DirectoryName)
-        {
-            fileName = EnpAppendComponentToPath(&DirectoryName->sr, &entries[i].FileName->sr);
-        }
-        else
-        {
-            fileName = entries[i].FileName;
-            PhReferenceObject(fileName);
-        }
-
-        if (entries[i].RevisionId != 0 && !(entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG))
-        {
-            localRevisionEntry.RevisionId = entries[i].RevisionId;
-            localRevisionEntry.FileNames = NULL;
-            localRevisionEntry.DirectoryNames = NULL;
-            revisionEntry = PhAddEntryHashtableEx(RevisionEntries, &localRevisionEntry, &added);
+        // Incompressible files are moved to the store part, which is created after the diff.
 
-            if (added)
-            {
-                revisionEntry->FileNames = EnpCreateFileNameHashtable();
-            }
+        partIds = PhAllocate(max(partEntry->ActionList->NumberOfActions, 1));
+        EnpAssignPackageParts(config, partEntry->ActionList, 1, pipeline->Vss, pipeline->MessageHandler, partIds);
+        actionList = PkCreateActionList();
 
-            EnpAddToFileNameHashtable(revisionEntry->FileNames, fileName);
-        }
+        PhAcquireQueuedLockExclusive(&pipeline->Lock);
 
-        if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+        for (i = 0; i < partEntry->ActionList->NumberOfActions; i++)
         {
-            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &file);
+            action = &partEntry->ActionList->Actions[i];
 
-            if (NT_SUCCESS(status))
-            {
-                status = EnpAddMergeFileNamesFromDirectory(Database, RevisionEntries, file, fileName);
-            }
+            if (partIds[i] == EN_PACKAGE_PART_STORE)
+                PkAppendAddToActionList(pipeline->DeferredActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
+            else
+                PkAppendAddToActionList(actionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
+        }
 
-            if (!NT_SUCCESS(status))
-            {
-                DbCloseFile(Database, file);
-                PhDereferenceObject(fileName);
-                break;
-            }
+        PhReleaseQueuedLockExclusive(&pipeline->Lock);
 
-            DbCloseFile(Database, file);
-        }
+        PhFree(partIds);
+        PkDestroyActionList(partEntry->ActionList);
+        partEntry->ActionList = actionList;
+    }
 
-        PhDereferenceObject(fileName);
+    // The chunks of a large file all go in this batch.
+    chunkedActionList = EnpCreateChunkedActionList(config, partEntry->ActionList);
+
+    if (chunkedActionList)
+    {
+        PkDestroyActionList(partEntry->ActionList);
+        partEntry->ActionList = chunkedActionList;
     }
 
-    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+    // An empty batch is deleted by EnpCompletePackagePipeline.
+    if (PkQueryCountActionList(partEntry->ActionList) != 0)
+        EnpCreatePackagePartWorker(partEntry);
 
-    return status;
+    PhQuerySystemTime(&endTime);
+
+    PhAcquireQueuedLockExclusive(&pipeline->Lock);
+    pipeline->ElapsedTime += endTime.QuadPart - startTime.QuadPart;
+    pipeline->NumberOfPendingBatches--;
+    PhPulseAllCondition(&pipeline->Condition);
+    PhReleaseQueuedLockExclusive(&pipeline->Lock);
+
+    return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpMergePackages(
-    _In_ PBK_CONFIG Config,
-    _In_opt_ HANDLE TransactionHandle,
-    _In_ ULONGLONG OldFirstRevisionId,
-    _In_ ULONGLONG NewFirstRevisionId,
-    _In_ PPH_HASHTABLE RevisionEntries,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+NTSTATUS EnpCompletePackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
     )
 {
     NTSTATUS status;
-    HRESULT result;
-    PPH_STRING targetPackageFileName;
-    ULONGLONG revisionId;
-    PPK_ACTION_LIST actionList;
-    PPH_FILE_STREAM fileStream;
-    PPH_STRING mergePackageFileName;
-    PPK_FILE_STREAM pkMergePackageFileStream;
-    PPK_PACKAGE mergePackage;
-    PPH_STRING basePackageFileName;
-    PPK_PACKAGE basePackage;
-    EN_REVISION_ENTRY lookupRevisionEntry;
-    PEN_REVISION_ENTRY revisionEntry;
-    PPK_ACTION_LIST actionListToMerge;
-    EN_PACKAGE_CALLBACK_CONTEXT updateContext;
-    PPK_ACTION_SEGMENT segment;
+    PPK_ACTION_LIST actionList = Pipeline->ActionList;
+    PPK_ACTION action;
+    PEN_PACKAGE_PART_ENTRY partEntry;
+    ULONG partId;
     ULONG i;
-    PPH_STRING newPackageFileName;
-    PPK_FILE_STREAM pkNewPackageFileStream;
 
-    targetPackageFileName = EnpFormatPackageName(Config, NewFirstRevisionId);
-    basePackageFileName = NULL;
-    basePackage = NULL;
-    newPackageFileName = NULL;
-    pkNewPackageFileStream = NULL;
-    actionList = PkCreateActionList();
-    RtlSetCurrentTransaction(NULL);
+    PhWaitForWorkQueue(&Pipeline->WorkQueue);
+    PhDeleteWorkQueue(&Pipeline->WorkQueue);
 
-    updateContext.MessageHandler = MessageHandler;
+    status = Pipeline->Status;
 
-    for (revisionId = OldFirstRevisionId; revisionId <= NewFirstRevisionId; revisionId++)
-    {
-        mergePackageFileName = EnpFormatPackageName(Config, revisionId);
-        result = S_OK;
+    // Files that were not given to a batch are packaged by EnpCreatePackageParts.
 
-        if (RtlDoesFileExists_U(mergePackageFileName->Buffer))
-        {
-            status = PhCreateFileStream(
-                &fileStream,
-                mergePackageFileName->Buffer,
-                FILE_GENERIC_READ,
-                0,
-                FILE_OPEN,
-                FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
-                );
+    for (i = Pipeline->FlushedIndex; i < actionList->NumberOfActions; i++)
+    {
+        action = &actionList->Actions[i];
+        PkAppendAddToActionList(Pipeline->RemainingActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
+    }
 
-            if (!NT_SUCCESS(status))
-            {
-                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s", mergePackageFileName->Buffer));
-                PhDereferenceObject(mergePackageFileName);
-                goto CleanupExit;
-            }
+    for (i = 0; i < Pipeline->DeferredActionList->NumberOfActions; i++)
+    {
+        action = &Pipeline->DeferredActionList->Actions[i];
+        PkAppendAddToActionList(Pipeline->RemainingActionList, action->u.Add.Flags, action->u.Add.Destination, action->Context);
+    }
 
-            pkMergePackageFileStream = PkCreateFileStream(fileStream);
-            PhDereferenceObject(fileStream);
-            MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Processing %s", mergePackageFileName->Buffer));
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+    {
+        partEntry = &Pipeline->PartEntries[partId];
 
-            // Open the package.
-            // If this isn't the target revision, filter out the files that will be replaced by the files in a later revision's package.
+        if (!partEntry->FileStream)
+            continue;
 
-            updateContext.Merge.IgnoreFileNames = NULL;
+        if (!SUCCEEDED(partEntry->Result))
+        {
+            Pipeline->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to update package %s: 0x%x", partEntry->FileName->Buffer, partEntry->Result));
+            status = STATUS_UNSUCCESSFUL;
+            continue;
+        }
 
-            if (revisionId != NewFirstRevisionId)
-            {
-                lookupRevisionEntry.RevisionId = revisionId;
-                revisionEntry = PhFindEntryHashtable(RevisionEntries, &lookupRevisionEntry);
+        if (PkQueryCountActionList(partEntry->ActionList) == 0)
+        {
+            // Every file in the batch was moved to the store part.
+            PkDereferenceFileStream(partEntry->FileStream);
+            partEntry->FileStream = NULL;
+            RtlSetCurrentTransaction(Pipeline->TransactionHandle);
+            PhDeleteFileWin32(partEntry->FileName->Buffer);
+            RtlSetCurrentTransaction(NULL);
+            continue;
+        }
 
-                if (revisionEntry)
-                    updateContext.Merge.IgnoreFileNames = revisionEntry->FileNames;
-            }
+        // Record the part in the database so that a restore only opens the parts it needs.
 
-            if (basePackage)
-            {
-                actionListToMerge = PkCreateActionList();
-                result = PkOpenPackageWithFilter(
-                    pkMergePackageFileStream,
-                    actionListToMerge,
-                    revisionId != NewFirstRevisionId ? EnpMergePackageCallback : NULL,
-                    revisionId != NewFirstRevisionId ? &updateContext : NULL,
-                    &mergePackage
-                    );
-
-                if (SUCCEEDED(result))
-                {
-                    segment = actionListToMerge->FirstSegment;
+        for (i = 0; i < partEntry->ActionList->NumberOfActions; i++)
+        {
+            action = &partEntry->ActionList->Actions[i];
+            EnpSetPackagePartFile(
+                Pipeline->Database,
+                Pipeline->HeadDirectory,
+                action->Context,
+                partId,
+                EnpSplitChunkName(&action->u.Add.Destination->sr, NULL, NULL)
+                );
+        }
+    }
 
-                    while (segment)
-                    {
-                        for (i = 0; i < segment->Count; i++)
-                        {
-                            PkAppendAddFromPackageToActionList(
-                                actionList,
-                                mergePackage,
-                                segment->Actions[i].u.Update.Index,
-                                NULL
-                                );
-                        }
+    if (NT_SUCCESS(status))
+        EnpReportPackagePartsCompression(Pipeline->TransactionHandle, Pipeline->PartEntries, &Pipeline->Progress, Pipeline->ElapsedTime, Pipeline->MessageHandler);
 
-                        segment = segment->Next;
-                    }
+    return status;
+}
 
-                    PkDereferencePackage(mergePackage);
-                }
+PPK_ACTION_LIST EnpCreateChunkedActionList(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_ACTION_LIST ActionList
+    )
+{
+    ULONGLONG chunkSize;
+    PPK_ACTION_LIST chunkedActionList;
+    PPK_ACTION action;
+    PEN_PACKAGE_FILE packageFile;
+    PPH_STRING chunkName;
+    ULONGLONG offset;
+    BOOLEAN found;
+    ULONG i;
 
-                PkDestroyActionList(actionListToMerge);
-            }
-            else if (revisionId != NewFirstRevisionId)
-            {
-                // Use this as our base package.
+    chunkSize = EN_CHUNK_SIZE(Config);
 
-                result = PkOpenPackageWithFilter(
-                    pkMergePackageFileStream,
-                    actionList,
-                    EnpMergePackageCallback,
-                    &updateContext,
-                    &basePackage
-                    );
+    if (chunkSize == 0)
+        return NULL;
 
-                if (SUCCEEDED(result))
-                {
-                    basePackageFileName = mergePackageFileName;
-                    mergePackageFileName = NULL;
-                }
-            }
-            else
-            {
-                // We don't have a base package and we're already at the target revision.
-                // Nothing needs to be done.
-            }
+    found = FALSE;
 
-            if (pkMergePackageFileStream)
-                PkDereferenceFileStream(pkMergePackageFileStream);
-        }
+    for (i = 0; i < ActionList->NumberOfActions; i++)
+    {
+        packageFile = ActionList->Actions[i].Context;
 
-        if (!SUCCEEDED(result))
+        if (!packageFile->Directory && (ULONGLONG)packageFile->FileInformation.EndOfFile.QuadPart > chunkSize)
         {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(
-                L"Unable to process package %s: 0x%x",
-                mergePackageFileName ? mergePackageFileName->Buffer : basePackageFileName->Buffer, result
-                ));
-
-            if (mergePackageFileName)
-                PhDereferenceObject(mergePackageFileName);
-
-            status = STATUS_UNSUCCESSFUL;
-            goto CleanupExit;
+            found = TRUE;
+            break;
         }
-
-        if (mergePackageFileName)
-            PhDereferenceObject(mergePackageFileName);
     }
 
-    if (basePackage)
-    {
-        RtlSetCurrentTransaction(TransactionHandle);
+    if (!found)
+        return NULL;
 
-        newPackageFileName = PhConcatStringRef2(&basePackageFileName->sr, &EnpNewSuffixString);
-        status = PhCreateFileStream(
-            &fileStream,
-            newPackageFileName->Buffer,
-            FILE_GENERIC_READ | FILE_GENERIC_WRITE,
-            0,
-            FILE_CREATE,
-            FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
-            );
+    chunkedActionList = PkCreateActionList();
 
-        if (!NT_SUCCESS(status))
+    for (i = 0; i < ActionList->NumberOfActions; i++)
+    {
+        action = &ActionList->Actions[i];
+        packageFile = action->Context;
+
+        if (!packageFile->Directory && (ULONGLONG)packageFile->FileInformation.EndOfFile.QuadPart > chunkSize)
         {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create %s", newPackageFileName->Buffer));
-            goto CleanupExit;
+            for (offset = 0; offset < (ULONGLONG)packageFile->FileInformation.EndOfFile.QuadPart; offset += chunkSize)
+            {
+                chunkName = EnpFormatChunkName(&action->u.Add.Destination->sr, offset);
+                PkAppendAddToActionList(chunkedActionList, action->u.Add.Flags, chunkName, packageFile);
+                PhDereferenceObject(chunkName);
+            }
+        }
+        else
+        {
+            PkAppendAddToActionList(chunkedActionList, action->u.Add.Flags, action->u.Add.Destination, packageFile);
         }
+    }
 
-        pkNewPackageFileStream = PkCreateFileStream(fileStream);
-        PhDereferenceObject(fileStream);
+    return chunkedActionList;
+}
 
-        MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Merging packages"));
-        result = PkUpdatePackage(
-            pkNewPackageFileStream,
-            basePackage,
-            actionList,
-            EnpMergePackageCallback,
-            &updateContext
-            );
+PPH_STRING EnpFormatChunkName(
+    _In_ PPH_STRINGREF FileName,
+    _In_ ULONGLONG Offset
+    )
+{
+    PH_FORMAT format[3];
 
-        PkDereferenceFileStream(pkNewPackageFileStream);
-        pkNewPackageFileStream = NULL;
-        PkDereferencePackage(basePackage);
-        basePackage = NULL;
-        PkDestroyActionList(actionList);
-        actionList = NULL;
+    PhInitFormatSR(&format[0], *FileName);
+    PhInitFormatC(&format[1], EN_CHUNK_SEPARATOR);
+    PhInitFormatI64U(&format[2], Offset);
+    format[2].Type |= FormatUseRadix | FormatPadZeros;
+    format[2].Width = 16;
+    format[2].Radix = 16;
 
-        if (!SUCCEEDED(result))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge packages: 0x%x", result));
-            PhDeleteFileWin32(newPackageFileName->Buffer);
-            status = STATUS_UNSUCCESSFUL;
-            goto CleanupExit;
-        }
+    return PhFormat(format, 3, FileName->Length + 18 * sizeof(WCHAR));
+}
 
-        for (revisionId = OldFirstRevisionId; revisionId <= NewFirstRevisionId; revisionId++)
-        {
-            mergePackageFileName = EnpFormatPackageName(Config, revisionId);
-            status = PhDeleteFileWin32(mergePackageFileName->Buffer);
+BOOLEAN EnpSplitChunkName(
+    _In_ PPH_STRINGREF Name,
+    _Out_opt_ PPH_STRINGREF FileName,
+    _Out_opt_ PULONGLONG Offset
+    )
+{
+    PH_STRINGREF offsetString;
+    LONG64 offset;
 
-            if (!NT_SUCCESS(status) && status != STATUS_OBJECT_PATH_NOT_FOUND && status != STATUS_OBJECT_NAME_NOT_FOUND)
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", mergePackageFileName->Buffer));
+    // Database names can't contain colons, so anything that ends with :<16 hex digits> is a
+    // chunk.
 
-            PhDereferenceObject(mergePackageFileName);
-        }
+    if (Name->Length <= 17 * sizeof(WCHAR))
+        return FALSE;
+    if (Name->Buffer[Name->Length / sizeof(WCHAR) - 17] != EN_CHUNK_SEPARATOR)
+        return FALSE;
 
-        status = EnpRenameFileWin32(NULL, newPackageFileName->Buffer, targetPackageFileName->Buffer);
+    offsetString.Buffer = Name->Buffer + Name->Length / sizeof(WCHAR) - 16;
+    offsetString.Length = 16 * sizeof(WCHAR);
 
-        if (!NT_SUCCESS(status))
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename %s", newPackageFileName->Buffer));
+    if (!PhStringToInteger64(&offsetString, 16, &offset))
+        return FALSE;
+
+    if (FileName)
+    {
+        FileName->Buffer = Name->Buffer;
+        FileName->Length = Name->Length - 17 * sizeof(WCHAR);
     }
 
-CleanupExit:
-    if (targetPackageFileName)
-        PhDereferenceObject(targetPackageFileName);
-    if (basePackageFileName)
-        PhDereferenceObject(basePackageFileName);
-    if (basePackage)
-        PkDereferencePackage(basePackage);
-    if (newPackageFileName)
-        PhDereferenceObject(newPackageFileName);
-    if (pkNewPackageFileStream)
-        PkDereferenceFileStream(pkNewPackageFileStream);
-    if (actionList)
-        PkDestroyActionList(actionList);
+    if (Offset)
+        *Offset = offset;
 
-    return status;
+    return TRUE;
 }
 
-HRESULT EnpMergePackageCallback(
-    _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
-    _In_opt_ PPK_ACTION Action,
-    _In_ PVOID Parameter,
-    _In_opt_ PVOID Context
+ULONGLONG EnpQueryChunkLength(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ ULONGLONG Offset
     )
 {
-    PEN_PACKAGE_CALLBACK_CONTEXT context = Context;
-
-    switch (Message)
-    {
-    case PkFilterItemMessage:
-        {
-            PPK_PARAMETER_FILTER_ITEM filterItem = Parameter;
-
-            if (context->Merge.IgnoreFileNames)
-            {
-                if (EnpFindInFileNameHashtable(context->Merge.IgnoreFileNames, &filterItem->Path))
-                    filterItem->Reject = TRUE;
-            }
-        }
-        break;
-    case PkProgressMessage:
-        {
-            PPK_PARAMETER_PROGRESS progress = Parameter;
-            PH_FORMAT format[3];
+    ULONGLONG endOfFile;
 
-            if (progress->ProgressTotal != 0)
-            {
-                PhInitFormatS(&format[0], L"Compressing: ");
-                PhInitFormatF(&format[1], (DOUBLE)progress->ProgressValue * 100 / progress->ProgressTotal, 2);
-                format[1].Type |= FormatRightAlign;
-                format[1].Width = 5;
-                PhInitFormatC(&format[2], '%');
+    endOfFile = File->FileInformation.EndOfFile.QuadPart;
 
-                context->MessageHandler(EN_MESSAGE_PROGRESS, PhFormat(format, 3, 0));
-            }
-        }
-        break;
-    }
+    if (Offset >= endOfFile)
+        return 0;
 
-    return S_OK;
+    return min(EN_CHUNK_SIZE(Config), endOfFile - Offset);
 }
 
-NTSTATUS EnpUpdateDatabaseAfterTrim(
-    _In_ PDB_DATABASE Database,
-    _In_ ULONGLONG OldFirstRevisionId,
-    _In_ ULONGLONG NewFirstRevisionId,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+BOOLEAN EnpIsIncompressibleFile(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _Out_writes_bytes_(EN_STORE_SAMPLE_SIZE) PVOID Buffer
     )
 {
     NTSTATUS status;
-    ULONGLONG revisionId;
-    PDBF_FILE directory;
-    PH_STRINGREF directoryName;
-    WCHAR directoryNameBuffer[17];
+    PPH_STRING sourceFileName;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
+    ULONG counts[256];
+    PUCHAR data;
+    ULONG length;
+    DOUBLE entropy;
+    DOUBLE probability;
+    ULONG i;
 
-    for (revisionId = OldFirstRevisionId; revisionId < NewFirstRevisionId; revisionId++)
-    {
-        EnpFormatRevisionId(revisionId, directoryNameBuffer);
-        directoryName.Buffer = directoryNameBuffer;
-        directoryName.Length = 16 * sizeof(WCHAR);
-        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+    if (File->Directory)
+        return FALSE;
 
-        if (NT_SUCCESS(status))
-        {
-            // Delete the diff directory.
-            DbUtDeleteDirectoryContents(Database, directory);
-            status = DbDeleteFile(Database, directory);
-            DbCloseFile(Database, directory);
-        }
+    if (EnpMatchStoreExtension(Config, &File->FileName->sr))
+        return TRUE;
 
-        if (!NT_SUCCESS(status))
-            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s directory", directoryNameBuffer));
-    }
+    // Small files don't take long to compress anyway.
+    if (File->FileInformation.EndOfFile.QuadPart < EN_STORE_SAMPLE_SIZE)
+        return FALSE;
 
-    PhInitializeEmptyStringRef(&directoryName);
-    status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+    sourceFileName = EnpGetPackageFileSourceName(File);
 
-    if (NT_SUCCESS(status))
-    {
-        status = EnpUpdateDirectoryMinimumRevisionIds(Database, directory, NewFirstRevisionId);
-        DbCloseFile(Database, directory);
-    }
+    if (Vss)
+        PhMoveReference(&sourceFileName, BkMapFileNameVssObject(Vss, sourceFileName));
+
+    // The sample is small, so it is always read through the file cache.
+    status = EnpOpenSourceFile(sourceFileName, FALSE, &fileHandle);
+    PhDereferenceObject(sourceFileName);
 
+    // If the file can't be opened now, the error will be reported when the package is created.
     if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to update revision IDs"));
-        status = STATUS_NOT_ALL_ASSIGNED;
-    }
+        return FALSE;
 
-    DbSetRevisionIdsDatabase(Database, NULL, &NewFirstRevisionId);
+    status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, Buffer, EN_STORE_SAMPLE_SIZE, NULL, NULL);
+    NtClose(fileHandle);
 
-    return status;
-}
+    if (!NT_SUCCESS(status) || iosb.Information == 0)
+        return FALSE;
 
-NTSTATUS EnpUpdateDirectoryMinimumRevisionIds(
-    _In_ PDB_DATABASE Database,
-    _In_ PDBF_FILE Directory,
-    _In_ ULONGLONG FirstRevisionId
-    )
-{
-    NTSTATUS status;
-    PDB_FILE_DIRECTORY_INFORMATION entries;
-    ULONG numberOfEntries;
-    ULONG i;
-    PDBF_FILE file;
-    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+    // Compressed and encrypted data looks random, so the byte entropy of the sample is close to 8 bits.
 
-    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+    memset(counts, 0, sizeof(counts));
+    data = Buffer;
+    length = (ULONG)iosb.Information;
 
-    if (!NT_SUCCESS(status))
-        return status;
+    for (i = 0; i < length; i++)
+        counts[data[i]]++;
 
-    for (i = 0; i < numberOfEntries; i++)
+    entropy = 0;
+
+    for (i = 0; i < 256; i++)
     {
-        if (entries[i].RevisionId < FirstRevisionId || (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+        if (counts[i] != 0)
         {
-            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, 0, NULL, &file);
-
-            if (NT_SUCCESS(status))
-            {
-                if (entries[i].RevisionId != 0 && entries[i].RevisionId < FirstRevisionId)
-                {
-                    revisionIdInfo.RevisionId = FirstRevisionId;
-                    DbSetInformationFile(Database, file, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
-                }
-
-                if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-                {
-                    EnpUpdateDirectoryMinimumRevisionIds(Database, file, FirstRevisionId);
-                }
-
-                DbCloseFile(Database, file);
-            }
+            probability = (DOUBLE)counts[i] / length;
+            entropy -= probability * log(probability);
         }
     }
 
-    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+    entropy /= log(2.0);
 
-    return STATUS_SUCCESS;
+    return entropy >= EN_STORE_ENTROPY_THRESHOLD;
 }
 
-BOOLEAN EnpRevisionEntryCompareFunction(
-    _In_ PVOID Entry1,
-    _In_ PVOID Entry2
+BOOLEAN EnpMatchStoreExtension(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRINGREF FileName
     )
 {
-    PEN_REVISION_ENTRY revisionEntry1 = Entry1;
-    PEN_REVISION_ENTRY revisionEntry2 = Entry2;
+    static PWSTR defaultExtensions[] =
+    {
+        L".7z", L".zip", L".rar", L".gz", L".tgz", L".bz2", L".xz", L".zst", L".lz4", L".cab",
+        L".jpg", L".jpeg", L".png", L".gif", L".webp", L".heic",
+        L".mp3", L".m4a", L".aac", L".ogg", L".opus", L".flac",
+        L".mp4", L".m4v", L".mkv", L".avi", L".mov", L".wmv", L".webm",
+        L".docx", L".xlsx", L".pptx", L".jar", L".apk"
+    };
 
-    return revisionEntry1->RevisionId == revisionEntry2->RevisionId;
+    ULONG i;
+
+    for (i = 0; i < sizeof(defaultExtensions) / sizeof(PWSTR); i++)
+    {
+        if (PhEndsWithStringRef2(FileName, defaultExtensions[i], TRUE))
+            return TRUE;
+    }
+
+    for (i = 0; i < Config->StoreExtensionList->Count; i++)
+    {
+        if (PhEndsWithStringRef(FileName, &((PPH_STRING)Config->StoreExtensionList->Items[i])->sr, TRUE))
+            return TRUE;
+    }
+
+    return FALSE;
 }
 
-ULONG EnpRevisionEntryHashFunction(
-    _In_ PVOID Entry
+NTSTATUS EnpOpenSourceFile(
+    _In_ PPH_STRING SourceFileName,
+    _In_ BOOLEAN Unbuffered,
+    _Out_ PHANDLE FileHandle
     )
 {
-    PEN_REVISION_ENTRY revisionEntry = Entry;
+    NTSTATUS status;
+    ULONG createOptions;
 
-    return PhHashInt64(revisionEntry->RevisionId);
+    // Unbuffered files bypass the file cache and are read asynchronously by PkFileStream, so that
+    // backing up doesn't push other programs' data out of memory.
+    if (Unbuffered)
+        createOptions = FILE_NON_DIRECTORY_FILE | FILE_NO_INTERMEDIATE_BUFFERING | FILE_SEQUENTIAL_ONLY;
+    else
+        createOptions = FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT;
+
+    status = PhCreateFileWin32(
+        FileHandle,
+        SourceFileName->Buffer,
+        FILE_GENERIC_READ,
+        0,
+        FILE_SHARE_READ,
+        FILE_OPEN,
+        createOptions | FILE_OPEN_FOR_BACKUP_INTENT
+        );
+
+    if (!NT_SUCCESS(status))
+    {
+        status = PhCreateFileWin32(
+            FileHandle,
+            SourceFileName->Buffer,
+            FILE_GENERIC_READ,
+            0,
+            FILE_SHARE_READ,
+            FILE_OPEN,
+            createOptions
+            );
+    }
+
+    return status;
 }
 
-NTSTATUS EnpRestoreFromRevision(
-    _In_ PBK_CONFIG Config,
-    _In_ PDB_DATABASE Database,
-    _In_ ULONG Flags,
-    _In_ PPH_STRINGREF FileName,
-    _In_opt_ ULONGLONG RevisionId,
-    _In_ PPH_STRINGREF RestoreToDirectory,
-    _In_opt_ PPH_STRINGREF RestoreToName,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+NTSTATUS EnpOpenStreamForFile(
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ BOOLEAN Unbuffered,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PPH_FILE_STREAM *FileStream
     )
 {
     NTSTATUS status;
-    PH_STRINGREF fileName;
-    ULONGLONG lastRevisionId;
-    ULONGLONG firstRevisionId;
-    ULONGLONG revisionId;
-    ULONGLONG revisionIdOnFile;
-    BOOLEAN restoreDirectoryFile;
-    PH_STRINGREF directoryName;
-    WCHAR directoryNameBuffer[17];
-    PDBF_FILE directory;
-    PDBF_FILE file;
-    DB_FILE_BASIC_INFORMATION basicInfo;
-    PPH_STRING newRestoreToDirectory;
-    HANDLE directoryHandle;
-    ULONG createStatus;
+    PPH_STRING sourceFileName;
+    HANDLE fileHandle;
+    PPH_FILE_STREAM fileStream;
 
-    fileName = *FileName;
+    sourceFileName = EnpGetPackageFileSourceName(File);
 
-    while (fileName.Length != 0 && fileName.Buffer[0] == '\\')
+    if (Vss)
+        PhMoveReference(&sourceFileName, BkMapFileNameVssObject(Vss, sourceFileName));
+
+    status = EnpOpenSourceFile(sourceFileName, Unbuffered, &fileHandle);
+
+    if (!NT_SUCCESS(status))
     {
-        fileName.Buffer++;
-        fileName.Length -= sizeof(WCHAR);
+        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %s: 0x%x", sourceFileName->Buffer, status));
+        PhDereferenceObject(sourceFileName);
+        return status;
     }
 
-    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+    if (Unbuffered)
+        status = PhCreateFileStream2(&fileStream, fileHandle, PH_FILE_STREAM_UNBUFFERED | PH_FILE_STREAM_ASYNCHRONOUS, 0);
+    else
+        status = PhCreateFileStream2(&fileStream, fileHandle, 0, PAGE_SIZE);
 
-    if (RevisionId == 0)
+    if (NT_SUCCESS(status))
     {
-        RevisionId = lastRevisionId;
+        *FileStream = fileStream;
     }
     else
     {
-        if (RevisionId < firstRevisionId || RevisionId > lastRevisionId)
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", RevisionId));
-            return STATUS_INVALID_PARAMETER;
-        }
+        NtClose(fileHandle);
     }
 
-    revisionIdOnFile = 0;
-    restoreDirectoryFile = FALSE;
-
-    // Perform virtual merges for just the specified file.
-    for (revisionId = lastRevisionId; revisionId >= RevisionId; revisionId--)
-    {
-        if (revisionId == lastRevisionId)
-        {
-            PhInitializeStringRef(&directoryName, L"head");
-        }
-        else
-        {
-            EnpFormatRevisionId(revisionId, directoryNameBuffer);
-            directoryName.Buffer = directoryNameBuffer;
-            directoryName.Length = 16 * sizeof(WCHAR);
-        }
-
-        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+    PhDereferenceObject(sourceFileName);
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
-            return status;
-        }
+    return status;
+}
 
-        status = DbCreateFile(Database, &fileName, directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+VOID EnpInitializeReadAhead(
+    _Out_ PEN_READ_AHEAD ReadAhead,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_ PPK_COMPRESSION_SETTINGS Settings,
+    _In_ SIZE_T Budget,
+    _In_opt_ PBK_VSS_OBJECT Vss
+    )
+{
+    PEN_READ_AHEAD_ORDER_ENTRY orderEntries;
+    ULONG numberOfOrderEntries;
+    PPK_ACTION action;
+    PEN_PACKAGE_FILE packageFile;
+    PEN_READ_AHEAD_ENTRY entry;
+    PEN_READ_AHEAD_ORDER_ENTRY orderEntry;
+    ULONG_PTR indexOfBackslash;
+    ULONG_PTR indexOfDot;
+    ULONG i;
 
-        if (status == STATUS_OBJECT_PATH_NOT_FOUND || status == STATUS_OBJECT_NAME_NOT_FOUND)
+    memset(ReadAhead, 0, sizeof(EN_READ_AHEAD));
+    PhInitializeQueuedLock(&ReadAhead->Lock);
+    PhInitializeQueuedLock(&ReadAhead->Condition);
+    PhInitializeWorkQueue(&ReadAhead->WorkQueue, 0, EN_READ_AHEAD_THREADS, 1000);
+    ReadAhead->Vss = Vss;
+    ReadAhead->Budget = Budget;
+    ReadAhead->ActionList = ActionList;
+    ReadAhead->Entries = PhAllocate(sizeof(EN_READ_AHEAD_ENTRY) * max(ActionList->NumberOfActions, 1));
+
+    orderEntries = PhAllocate(sizeof(EN_READ_AHEAD_ORDER_ENTRY) * max(ActionList->NumberOfActions, 1));
+    numberOfOrderEntries = 0;
+
+    for (i = 0; i < ActionList->NumberOfActions; i++)
+    {
+        action = &ActionList->Actions[i];
+        packageFile = action->Context;
+        entry = &ReadAhead->Entries[i];
+        memset(entry, 0, sizeof(EN_READ_AHEAD_ENTRY));
+        entry->ReadAhead = ReadAhead;
+        entry->File = packageFile;
+        entry->State = ReadAheadNone;
+        entry->Position = -1;
+
+        if (packageFile->Directory ||
+            packageFile->FileInformation.EndOfFile.QuadPart == 0 ||
+            (ULONGLONG)packageFile->FileInformation.EndOfFile.QuadPart > min(EN_READ_AHEAD_MAXIMUM_FILE_SIZE, Budget) ||
+            EnpSplitChunkName(&action->u.Add.Destination->sr, NULL, NULL))
         {
-            // The file doesn't exist in this revision. Go to the next one.
-            DbCloseFile(Database, directory);
             continue;
         }
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", fileName.Length / sizeof(WCHAR), fileName.Buffer));
-            DbCloseFile(Database, directory);
-            return status;
-        }
+        entry->Size = (SIZE_T)packageFile->FileInformation.EndOfFile.QuadPart;
 
-        status = DbQueryInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+        orderEntry = &orderEntries[numberOfOrderEntries++];
+        orderEntry->Name = action->u.Add.Destination->sr;
+        orderEntry->Extension.Buffer = NULL;
+        orderEntry->Extension.Length = 0;
+        orderEntry->Index = i;
 
-        if (NT_SUCCESS(status))
+        if (Settings->SortByType == 1)
         {
-            if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
-            {
-                revisionIdOnFile = 0;
-                restoreDirectoryFile = FALSE;
-            }
-            else
+            indexOfBackslash = PhFindLastCharInStringRef(&orderEntry->Name, '\\', FALSE);
+            indexOfDot = PhFindLastCharInStringRef(&orderEntry->Name, '.', FALSE);
+
+            if (indexOfDot != -1 && (indexOfBackslash == -1 || indexOfDot > indexOfBackslash))
             {
-                if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-                {
-                    revisionIdOnFile = 0;
-                    restoreDirectoryFile = TRUE;
-                }
-                else
-                {
-                    revisionIdOnFile = basicInfo.RevisionId;
-                    restoreDirectoryFile = FALSE;
-                }
+                orderEntry->Extension.Buffer = orderEntry->Name.Buffer + indexOfDot + 1;
+                orderEntry->Extension.Length = orderEntry->Name.Length - (indexOfDot + 1) * sizeof(WCHAR);
             }
         }
-        else
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to query %.*s", fileName.Length / sizeof(WCHAR), fileName.Buffer));
-        }
-
-        DbCloseFile(Database, file);
-        DbCloseFile(Database, directory);
     }
 
-    if (restoreDirectoryFile)
-    {
-        if (RestoreToName)
-        {
-            newRestoreToDirectory = EnpAppendComponentToPath(RestoreToDirectory, RestoreToName);
-            status = PhCreateFileWin32Ex(
-                &directoryHandle,
-                newRestoreToDirectory->Buffer,
-                FILE_GENERIC_READ,
-                FILE_ATTRIBUTE_DIRECTORY,
-                FILE_SHARE_READ | FILE_SHARE_WRITE,
-                FILE_OPEN_IF,
-                FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
-                &createStatus
-                );
-
-            if (NT_SUCCESS(status))
-            {
-                NtClose(directoryHandle);
-            }
+    // 7-Zip sorts new items before compressing them, so the files are read in the same order.
+    // If the order turns out to be different, the files are still read correctly, but the
+    // compressor has to wait for them.
 
-            RestoreToDirectory = &newRestoreToDirectory->sr;
-        }
-        else
-        {
-            newRestoreToDirectory = NULL;
-        }
+    qsort(orderEntries, numberOfOrderEntries, sizeof(EN_READ_AHEAD_ORDER_ENTRY), EnpReadAheadOrderCompareFunction);
 
-        if (NT_SUCCESS(status))
-        {
-            if (RevisionId == lastRevisionId)
-                status = EnpRestoreDirectoryFromHead(Config, Database, Flags, &fileName, RestoreToDirectory, MessageHandler);
-            else
-                status = EnpRestoreDirectoryFromRevision(Config, Flags, &fileName, RevisionId, RestoreToDirectory, MessageHandler);
-        }
+    ReadAhead->Order = PhAllocate(sizeof(ULONG) * max(numberOfOrderEntries, 1));
+    ReadAhead->NumberOfOrderEntries = numberOfOrderEntries;
 
-        if (newRestoreToDirectory)
-            PhDereferenceObject(newRestoreToDirectory);
-    }
-    else if (revisionIdOnFile != 0)
-    {
-        status = EnpRestoreSingleFileFromRevision(Config, Database, Flags, &fileName, revisionIdOnFile, RestoreToDirectory, RestoreToName, MessageHandler);
-    }
-    else
+    for (i = 0; i < numberOfOrderEntries; i++)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"The file does not exist in revision %I64u", RevisionId));
-        status = STATUS_OBJECT_NAME_NOT_FOUND;
+        ReadAhead->Order[i] = orderEntries[i].Index;
+        ReadAhead->Entries[orderEntries[i].Index].Position = i;
     }
 
-    return status;
+    PhFree(orderEntries);
+
+    PhAcquireQueuedLockExclusive(&ReadAhead->Lock);
+    EnpFillReadAhead(ReadAhead);
+    PhReleaseQueuedLockExclusive(&ReadAhead->Lock);
 }
 
-NTSTATUS EnpRestoreSingleFileFromRevision(
-    _In_ PBK_CONFIG Config,
-    _In_ PDB_DATABASE Database,
-    _In_ ULONG Flags,
-    _In_ PPH_STRINGREF FileName,
-    _In_ ULONGLONG RevisionId,
-    _In_ PPH_STRINGREF RestoreToDirectory,
-    _In_opt_ PPH_STRINGREF RestoreToName,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+VOID EnpDeleteReadAhead(
+    _Inout_ PEN_READ_AHEAD ReadAhead
     )
 {
-    NTSTATUS status;
-    PH_STRINGREF path;
-    PH_STRINGREF name;
-    PPH_STRING fileName;
-    PPH_HASHTABLE fileNames;
+    ULONG i;
 
-    if (!RestoreToName)
-    {
-        if (!PhSplitStringRefAtLastChar(FileName, '\\', &path, &name))
-            name = *FileName;
+    PhWaitForWorkQueue(&ReadAhead->WorkQueue);
+    PhDeleteWorkQueue(&ReadAhead->WorkQueue);
 
-        RestoreToName = &name;
+    // Files that were read but not compressed, for example because the package was aborted.
+
+    for (i = 0; i < ReadAhead->ActionList->NumberOfActions; i++)
+    {
+        if (ReadAhead->Entries[i].Buffer)
+            PhFree(ReadAhead->Entries[i].Buffer);
     }
 
-    fileNames = EnpCreateFileNameHashtable();
+    PhFree(ReadAhead->Entries);
+    PhFree(ReadAhead->Order);
+}
 
-    fileName = PhCreateStringEx(FileName->Buffer, FileName->Length);
-    EnpAddToFileNameHashtable(fileNames, fileName);
-    PhDereferenceObject(fileName);
+int __cdecl EnpReadAheadOrderCompareFunction(
+    _In_ const void *Entry1,
+    _In_ const void *Entry2
+    )
+{
+    PEN_READ_AHEAD_ORDER_ENTRY entry1 = (PEN_READ_AHEAD_ORDER_ENTRY)Entry1;
+    PEN_READ_AHEAD_ORDER_ENTRY entry2 = (PEN_READ_AHEAD_ORDER_ENTRY)Entry2;
+    int result;
 
-    status = EnpExtractFromPackage(Config, Flags, RevisionId, NULL, fileNames, RestoreToDirectory, RestoreToName, MessageHandler);
+    // Like 7-Zip: by extension if sorting by type, then by name, then in the original order.
 
-    EnpDestroyFileNameHashtable(fileNames);
+    result = PhCompareStringRef(&entry1->Extension, &entry2->Extension, TRUE);
 
-    return status;
+    if (result == 0)
+        result = PhCompareStringRef(&entry1->Name, &entry2->Name, TRUE);
+    if (result == 0)
+        result = uintcmp(entry1->Index, entry2->Index);
+
+    return result;
 }
 
-NTSTATUS EnpRestoreDirectoryFromHead(
-    _In_ PBK_CONFIG Config,
-    _In_ PDB_DATABASE Database,
-    _In_ ULONG Flags,
-    _In_ PPH_STRINGREF FileName,
-    _In_ PPH_STRINGREF RestoreToDirectory,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+VOID EnpFillReadAhead(
+    _Inout_ PEN_READ_AHEAD ReadAhead
     )
 {
-    NTSTATUS status;
-    PDBF_FILE headDirectory;
-    PH_STRINGREF headDirectoryName;
-    PDBF_FILE file;
-    PPH_STRING fileName;
-    PPH_HASHTABLE revisionEntries;
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_REVISION_ENTRY revisionEntry;
-    PH_HASHTABLE_ENUM_CONTEXT directoryEnumContext;
-    PPH_STRING *directoryNamePtr;
-    PPH_STRING directoryName;
-    PH_STRINGREF relativeName;
-    PPH_STRING newDirectoryName;
-
-    PhInitializeStringRef(&headDirectoryName, L"head");
-    status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
-
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD"));
-        return status;
-    }
-
-    status = DbCreateFile(Database, FileName, headDirectory, 0, DB_FILE_OPEN, 0, NULL, &file);
-    DbCloseFile(Database, headDirectory);
-
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", FileName->Length / sizeof(WCHAR), FileName->Buffer));
-        return status;
-    }
-
-    fileName = PhCreateStringEx(FileName->Buffer, FileName->Length);
-
-    revisionEntries = PhCreateHashtable(
-        sizeof(EN_REVISION_ENTRY),
-        EnpRevisionEntryCompareFunction,
-        EnpRevisionEntryHashFunction,
-        10
-        );
-
-    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Creating file list"));
-    status = EnpAddRestoreFileNamesFromDirectory(Database, revisionEntries, file, fileName);
-    DbCloseFile(Database, file);
-    PhDereferenceObject(fileName);
-
-    // Create all directories.
+    PEN_READ_AHEAD_ENTRY entry;
 
-    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Creating directories"));
-    PhBeginEnumHashtable(revisionEntries, &enumContext);
+    // The lock must be held.
 
-    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    while (ReadAhead->NextPosition < ReadAhead->NumberOfOrderEntries &&
+        ReadAhead->NumberOfBufferedFiles < EN_READ_AHEAD_MAXIMUM_FILES)
     {
-        PhBeginEnumHashtable(revisionEntry->DirectoryNames, &directoryEnumContext);
+        entry = &ReadAhead->Entries[ReadAhead->Order[ReadAhead->NextPosition]];
 
-        while (directoryNamePtr = PhNextEnumHashtable(&directoryEnumContext))
+        // The compressor may have already asked for this file.
+        if (entry->State != ReadAheadNone)
         {
-            directoryName = *directoryNamePtr;
-
-            if (!PhStartsWithStringRef(&directoryName->sr, FileName, TRUE))
-            {
-                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Wrong prefix: %s", directoryName->Buffer));
-                status = STATUS_INVALID_PARAMETER;
-                break;
-            }
-
-            relativeName.Buffer = (PWSTR)((PCHAR)directoryName->Buffer + FileName->Length);
-            relativeName.Length = directoryName->Length - FileName->Length;
-            newDirectoryName = EnpAppendComponentToPath(RestoreToDirectory, &relativeName);
-
-            SHCreateDirectory(NULL, newDirectoryName->Buffer);
-            PhDereferenceObject(newDirectoryName);
+            ReadAhead->NextPosition++;
+            continue;
         }
 
-        if (!NT_SUCCESS(status))
+        if (ReadAhead->BufferedSize + entry->Size > ReadAhead->Budget)
             break;
-    }
-
-    // Extract the files.
-
-    PhBeginEnumHashtable(revisionEntries, &enumContext);
-
-    while (revisionEntry = PhNextEnumHashtable(&enumContext))
-    {
-        if (NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Processing revision %I64u", revisionEntry->RevisionId));
-            status = EnpExtractFromPackage(Config, Flags, revisionEntry->RevisionId, FileName, revisionEntry->FileNames, RestoreToDirectory, NULL, MessageHandler);
-        }
 
-        EnpDestroyFileNameHashtable(revisionEntry->FileNames);
-        EnpDestroyFileNameHashtable(revisionEntry->DirectoryNames);
+        entry->State = ReadAheadQueued;
+        ReadAhead->BufferedSize += entry->Size;
+        ReadAhead->NumberOfBufferedFiles++;
+        ReadAhead->NextPosition++;
+        PhQueueItemWorkQueue(&ReadAhead->WorkQueue, EnpReadAheadWorker, entry);
     }
-
-    PhDereferenceObject(revisionEntries);
-
-    return status;
 }
 
-NTSTATUS EnpAddRestoreFileNamesFromDirectory(
-    _In_ PDB_DATABASE Database,
-    _In_ PPH_HASHTABLE RevisionEntries,
-    _In_ PDBF_FILE Directory,
-    _In_ PPH_STRING DirectoryName
+NTSTATUS NTAPI EnpReadAheadWorker(
+    _In_ PVOID Parameter
     )
 {
+    PEN_READ_AHEAD_ENTRY entry = Parameter;
+    PEN_READ_AHEAD readAhead = entry->ReadAhead;
     NTSTATUS status;
-    PDB_FILE_DIRECTORY_INFORMATION entries;
-    ULONG numberOfEntries;
-    ULONG i;
-    PPH_STRING fileName;
-    PDBF_FILE file;
-    PEN_REVISION_ENTRY revisionEntry;
-    EN_REVISION_ENTRY localRevisionEntry;
-    BOOLEAN added;
+    PPH_STRING sourceFileName;
+    HANDLE fileHandle;
+    LARGE_INTEGER fileSize;
+    IO_STATUS_BLOCK iosb;
+    PVOID buffer;
+    SIZE_T length;
 
-    // This function is similar to EnpAddMergeFileNamesFromDirectory, except that directories are added to a separate hashtable.
+    buffer = NULL;
+    length = 0;
+    sourceFileName = EnpGetPackageFileSourceName(entry->File);
 
-    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+    if (readAhead->Vss)
+        PhMoveReference(&sourceFileName, BkMapFileNameVssObject(readAhead->Vss, sourceFileName));
 
-    if (!NT_SUCCESS(status))
-        return status;
+    // Errors are not reported here. The compressor opens the file again and reports the error.
 
-    for (i = 0; i < numberOfEntries; i++)
+    status = EnpOpenSourceFile(sourceFileName, FALSE, &fileHandle);
+    PhDereferenceObject(sourceFileName);
+
+    if (NT_SUCCESS(status))
     {
-        fileName = EnpAppendComponentToPath(&DirectoryName->sr, &entries[i].FileName->sr);
+        status = PhGetFileSize(fileHandle, &fileSize);
 
-        localRevisionEntry.RevisionId = entries[i].RevisionId;
-        localRevisionEntry.FileNames = NULL;
-        localRevisionEntry.DirectoryNames = NULL;
-        revisionEntry = PhAddEntryHashtableEx(RevisionEntries, &localRevisionEntry, &added);
+        // If the file has changed since it was scanned, let the compressor read it as usual.
+        if (NT_SUCCESS(status) && fileSize.QuadPart != entry->File->FileInformation.EndOfFile.QuadPart)
+            status = STATUS_UNSUCCESSFUL;
 
-        if (added)
+        if (NT_SUCCESS(status))
         {
-            revisionEntry->FileNames = EnpCreateFileNameHashtable();
-            revisionEntry->DirectoryNames = EnpCreateFileNameHashtable();
-        }
+            buffer = PhAllocate(entry->Size);
 
-        if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
-        {
-            EnpAddToFileNameHashtable(revisionEntry->DirectoryNames, fileName);
+            while (length < entry->Size)
+            {
+                status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, (PCHAR)buffer + length, (ULONG)(entry->Size - length), NULL, NULL);
 
-            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &file);
+                if (!NT_SUCCESS(status))
+                    break;
 
-            if (NT_SUCCESS(status))
-            {
-                status = EnpAddRestoreFileNamesFromDirectory(Database, RevisionEntries, file, fileName);
+                length += iosb.Information;
             }
 
             if (!NT_SUCCESS(status))
             {
-                DbCloseFile(Database, file);
-                PhDereferenceObject(fileName);
-                break;
+                PhFree(buffer);
+                buffer = NULL;
             }
-
-            DbCloseFile(Database, file);
-        }
-        else
-        {
-            EnpAddToFileNameHashtable(revisionEntry->FileNames, fileName);
         }
 
-        PhDereferenceObject(fileName);
+        NtClose(fileHandle);
     }
 
-    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+    PhAcquireQueuedLockExclusive(&readAhead->Lock);
+    entry->Status = status;
+    entry->Buffer = buffer;
+    entry->Length = length;
+    entry->State = ReadAheadCompleted;
+    PhPulseAllCondition(&readAhead->Condition);
+    PhReleaseQueuedLockExclusive(&readAhead->Lock);
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpRestoreDirectoryFromRevision(
-    _In_ PBK_CONFIG Config,
-    _In_ ULONG Flags,
-    _In_ PPH_STRINGREF FileName,
-    _In_ ULONGLONG RevisionId,
-    _In_ PPH_STRINGREF RestoreToDirectory,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+BOOLEAN EnpTakeReadAheadStream(
+    _Inout_ PEN_READ_AHEAD ReadAhead,
+    _In_ PPK_ACTION Action,
+    _Out_ PPK_FILE_STREAM *FileStream
     )
 {
-    NTSTATUS status;
-    PH_STRINGREF databaseName;
-    PPH_STRING databaseFileName;
-    PPH_STRING tempDatabaseFileName;
-    PDB_DATABASE tempDatabase;
-    PDBF_FILE headDirectory;
-    PDBF_FILE file;
+    ULONG_PTR index;
+    PEN_READ_AHEAD_ENTRY entry;
+    PVOID buffer;
 
-    PhInitializeStringRef(&databaseName, L"\\" EN_DATABASE_NAME);
-    databaseFileName = PhConcatStringRef2(&Config->DestinationDirectory->sr, &databaseName);
-    tempDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
+    index = Action - ReadAhead->ActionList->Actions;
 
-    status = EnpCopyFileWin32(databaseFileName->Buffer, tempDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+    if (index >= ReadAhead->ActionList->NumberOfActions)
+        return FALSE;
 
-    if (!NT_SUCCESS(status))
-    {
-        PhDereferenceObject(tempDatabaseFileName);
-        PhDereferenceObject(databaseFileName);
-        return status;
-    }
+    entry = &ReadAhead->Entries[index];
 
-    status = DbOpenDatabase(&tempDatabase, tempDatabaseFileName->Buffer, FALSE, 0);
+    PhAcquireQueuedLockExclusive(&ReadAhead->Lock);
 
-    if (NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Merging until revision %I64u", RevisionId));
-        status = EnpMergeToHeadUntilRevision(tempDatabase, RevisionId, MessageHandler, &headDirectory);
+    while (entry->State == ReadAheadQueued)
+        PhWaitForCondition(&ReadAhead->Condition, &ReadAhead->Lock, NULL);
 
-        if (NT_SUCCESS(status))
-        {
-            status = DbCreateFile(tempDatabase, FileName, headDirectory, 0, DB_FILE_OPEN, 0, NULL, &file);
+    if (entry->State == ReadAheadCompleted)
+    {
+        ReadAhead->BufferedSize -= entry->Size;
+        ReadAhead->NumberOfBufferedFiles--;
+    }
+    else if (entry->Position != -1 && entry->Position >= ReadAhead->NextPosition)
+    {
+        // The compressor wants a file that hasn't been read yet. Continue after this file instead
+        // of reading files that the compressor may have already skipped.
+        ReadAhead->NextPosition = entry->Position + 1;
+    }
 
-            if (NT_SUCCESS(status))
-            {
-                status = EnpRestoreDirectoryFromHead(Config, tempDatabase, Flags, FileName, RestoreToDirectory, MessageHandler);
-                DbCloseFile(tempDatabase, file);
-            }
-            else
-            {
-                MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"The file does not exist in the specified revision."));
-            }
+    entry->State = ReadAheadTaken;
+    buffer = entry->Buffer;
+    entry->Buffer = NULL;
+    EnpFillReadAhead(ReadAhead);
 
-            DbCloseFile(tempDatabase, headDirectory);
-        }
+    PhReleaseQueuedLockExclusive(&ReadAhead->Lock);
 
-        DbCloseDatabase(tempDatabase);
-    }
+    if (!buffer)
+        return FALSE;
 
-    PhDeleteFileWin32(tempDatabaseFileName->Buffer);
-    PhDereferenceObject(tempDatabaseFileName);
-    PhDereferenceObject(databaseFileName);
+    *FileStream = PkCreateFileStreamBuffer(buffer, entry->Length);
 
-    return status;
+    return TRUE;
 }
 
-NTSTATUS EnpMergeToHeadUntilRevision(
+NTSTATUS EnpRevertToRevision(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
     _In_ PDB_DATABASE Database,
     _In_ ULONGLONG TargetRevisionId,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler,
-    _Out_opt_ PDBF_FILE *HeadDirectory
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
     NTSTATUS status;
-    ULONGLONG revisionId;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
     PDBF_FILE headDirectory;
     PH_STRINGREF headDirectoryName;
+    PDBF_FILE newHeadDirectory;
+    PH_STRINGREF newHeadDirectoryName;
+    ULONG createStatus;
+    ULONGLONG revisionId;
     PDBF_FILE diffDirectory;
-    PH_STRINGREF diffDirectoryName;
     WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    DB_FILE_RENAME_INFORMATION renameInfo;
+    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    if (TargetRevisionId < firstRevisionId || TargetRevisionId > lastRevisionId)
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", TargetRevisionId));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (TargetRevisionId == lastRevisionId)
+    {
+        // Nothing to do
+        return STATUS_ABANDONED;
+    }
+
+    // Open the HEAD directory.
 
     PhInitializeStringRef(&headDirectoryName, L"head");
     status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
 
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"HEAD directory does not exist"));
+
     if (!NT_SUCCESS(status))
     {
         MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD directory"));
         return status;
     }
 
-    DbQueryRevisionIdsDatabase(Database, &revisionId, NULL);
-    revisionId--;
+    // Create the NEWHEAD directory and copy the contents of HEAD to NEWHEAD.
 
-    while (revisionId >= TargetRevisionId)
+    PhInitializeStringRef(&newHeadDirectoryName, L"newHead");
+    status = DbCreateFile(Database, &newHeadDirectoryName, NULL, DB_FILE_ATTRIBUTE_DIRECTORY, DB_FILE_OPEN_IF, DB_FILE_DIRECTORY_FILE, &createStatus, &newHeadDirectory);
+
+    if (!NT_SUCCESS(status))
     {
-        // Open the diff directory.
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to create or open NEWHEAD directory"));
+        DbCloseFile(Database, headDirectory);
+        return status;
+    }
 
-        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
-        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
-        diffDirectoryName.Length = 16 * sizeof(WCHAR);
-        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+    if (createStatus == DB_FILE_OPENED)
+    {
+        MessageHandler(EN_MESSAGE_WARNING, PhCreateString(L"NEWHEAD directory already exists; deleting contents"));
+        DbUtDeleteDirectoryContents(Database, newHeadDirectory);
+    }
 
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
-            break;
-        }
+    status = DbUtCopyDirectoryContents(Database, headDirectory, newHeadDirectory);
 
-        // Perform the merge.
-        status = EnpMergeDirectoryToHead(Database, headDirectory, diffDirectory, MessageHandler);
+    if (!NT_SUCCESS(status) || status == STATUS_SOME_NOT_MAPPED)
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to copy HEAD to NEWHEAD"));
+        DbUtDeleteDirectoryContents(Database, newHeadDirectory);
+        DbDeleteFile(Database, newHeadDirectory);
+        DbCloseFile(Database, headDirectory);
 
-        DbCloseFile(Database, diffDirectory);
+        if (status == STATUS_SOME_NOT_MAPPED)
+            status = STATUS_UNSUCCESSFUL;
 
-        if (!NT_SUCCESS(status))
+        return status;
+    }
+
+    // Open the previous diff directories and merge them.
+
+    for (revisionId = lastRevisionId - 1; revisionId >= TargetRevisionId; revisionId--)
+    {
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+
+        if (NT_SUCCESS(status))
         {
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge revision %I64u with HEAD", revisionId));
-            break;
+            // Get the time stamp for this directory. We'll need it later.
+            status = DbQueryInformationFile(Database, diffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+
+            if (NT_SUCCESS(status))
+            {
+                MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Merging %s to HEAD", diffDirectoryNameBuffer));
+                status = EnpMergeDirectoryToHead(Database, newHeadDirectory, diffDirectory, MessageHandler);
+                DbCloseFile(Database, diffDirectory);
+            }
         }
 
-        revisionId--;
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge %s", diffDirectoryNameBuffer));
+            DbUtDeleteDirectoryContents(Database, newHeadDirectory);
+            DbDeleteFile(Database, newHeadDirectory);
+            DbCloseFile(Database, headDirectory);
+            return status;
+        }
     }
 
-    if (HeadDirectory)
-        *HeadDirectory = headDirectory;
-    else
-        DbCloseFile(Database, headDirectory);
-
-    return status;
-}
-
-NTSTATUS EnpExtractFromPackage(
-    _In_ PBK_CONFIG Config,
-    _In_ ULONG Flags,
-    _In_ ULONGLONG RevisionId,
-    _In_opt_ PPH_STRINGREF BaseFileName,
-    _In_ PPH_HASHTABLE FileNames,
-    _In_ PPH_STRINGREF RestoreToDirectory,
-    _In_opt_ PPH_STRINGREF RestoreToName,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
-    )
-{
-    NTSTATUS status;
-    HRESULT result;
-    PPH_STRING packageFileName;
-    PPH_FILE_STREAM fileStream;
-    PPK_FILE_STREAM pkFileStream;
-    EN_PACKAGE_CALLBACK_CONTEXT context;
-    PPK_PACKAGE package;
-    PPK_ACTION_LIST actionList;
+    // The file system has not been reverted, so the next backup must compare every directory in
+    // full. Forget the stored directory information and the position in the change source.
+    DbUtClearSourceInformation(Database, newHeadDirectory);
+    EnpDeleteChangeCursor(Config);
 
-    packageFileName = EnpFormatPackageName(Config, RevisionId);
-    status = PhCreateFileStream(&fileStream, packageFileName->Buffer, FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN, 0);
+    // Delete the diff directories and package files.
 
-    if (!NT_SUCCESS(status))
+    for (revisionId = lastRevisionId - 1; revisionId >= TargetRevisionId; revisionId--)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s", packageFileName->Buffer));
-        PhDereferenceObject(packageFileName);
-        return status;
-    }
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
 
-    pkFileStream = PkCreateFileStream(fileStream);
-    PhDereferenceObject(fileStream);
+        if (NT_SUCCESS(status))
+        {
+            DbUtDeleteDirectoryContents(Database, diffDirectory);
+            DbDeleteFile(Database, diffDirectory);
+        }
+        else
+        {
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", diffDirectoryNameBuffer));
+        }
 
-    context.Config = Config;
-    context.MessageHandler = MessageHandler;
-    context.Restore.Flags = Flags;
-    context.Restore.RestoreToDirectory = RestoreToDirectory;
-    context.Restore.RestoreToName = RestoreToName;
-    context.Restore.BaseFileName = BaseFileName;
-    context.Restore.FileNames = FileNames;
+        EnpDeletePackageParts(Config, revisionId + 1, MessageHandler);
+    }
 
-    actionList = PkCreateActionList();
+    revisionIdInfo.RevisionId = TargetRevisionId;
+    DbSetInformationFile(Database, newHeadDirectory, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
+    DbUtTouchFile(Database, newHeadDirectory, &basicInfo.TimeStamp);
 
-    result = PkOpenPackageWithFilter(
-        pkFileStream,
-        actionList,
-        EnpRestorePackageCallback,
-        &context,
-        &package
-        );
+    // Delete the current HEAD directory and rename NEWHEAD to HEAD.
+    DbUtDeleteDirectoryContents(Database, headDirectory);
+    DbDeleteFile(Database, headDirectory);
 
-    if (SUCCEEDED(result))
-    {
-        result = PkExtractPackage(
-            package,
-            actionList,
-            EnpRestorePackageCallback,
-            &context
-            );
-        PkDereferencePackage(package);
+    renameInfo.RootDirectory = NULL;
+    PhInitializeStringRef(&renameInfo.FileName, L"head");
+    status = DbSetInformationFile(Database, newHeadDirectory, DbFileRenameInformation, &renameInfo, sizeof(DB_FILE_RENAME_INFORMATION));
 
-        if (!SUCCEEDED(result))
-            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to extract from package %s", packageFileName->Buffer));
-    }
-    else
+    if (!NT_SUCCESS(status))
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open package %s", packageFileName->Buffer));
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename NEWHEAD to HEAD; the database is in an unknown state"));
     }
 
-    PkDestroyActionList(actionList);
-
-    PkDereferenceFileStream(pkFileStream);
-    PhDereferenceObject(packageFileName);
-
-    if (!SUCCEEDED(result))
-        status = STATUS_UNSUCCESSFUL;
+    DbSetRevisionIdsDatabase(Database, &TargetRevisionId, NULL);
 
     return status;
 }
 
-HRESULT EnpRestorePackageCallback(
-    _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
-    _In_opt_ PPK_ACTION Action,
-    _In_ PVOID Parameter,
-    _In_opt_ PVOID Context
+NTSTATUS EnpMergeDirectoryToHead(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE DirectoryInHead,
+    _In_ PDBF_FILE DirectoryInDiff,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
     NTSTATUS status;
-    PEN_PACKAGE_CALLBACK_CONTEXT context = Context;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    ULONG i;
+    PDBF_FILE fileInHead;
+    PDBF_FILE fileInDiff;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    BOOLEAN copyFromDiffToHead;
 
-    switch (Message)
-    {
-    case PkFilterItemMessage:
-        {
-            PPK_PARAMETER_FILTER_ITEM filterItem = Parameter;
-            PPH_STRING fileName;
+    status = DbQueryDirectoryFile(Database, DirectoryInDiff, &entries, &numberOfEntries);
 
-            fileName = EnpFindInFileNameHashtable(context->Restore.FileNames, &filterItem->Path);
+    if (!NT_SUCCESS(status))
+        return status;
 
-            if (!fileName)
-            {
-                filterItem->Reject = TRUE;
-                return S_OK;
-            }
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        copyFromDiffToHead = FALSE;
+        status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInHead, 0, DB_FILE_OPEN, 0, NULL, &fileInHead);
 
-            filterItem->NewContext = fileName;
-        }
-        break;
-    case PkGetStreamMessage:
+        if (NT_SUCCESS(status))
         {
-            PPK_PARAMETER_GET_STREAM getStream = Parameter;
-            PPH_STRING fileName;
-            PPH_STRING outFileName;
-            PH_STRINGREF relativeName;
-            PPH_FILE_STREAM outFileStream;
-            PPK_FILE_STREAM pkOutFileStream;
-            FILE_BASIC_INFORMATION basicInfo;
-            IO_STATUS_BLOCK iosb;
-
-            fileName = Action->Context;
+            status = DbQueryInformationFile(Database, fileInHead, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
 
-            if (context->Restore.BaseFileName)
+            if (NT_SUCCESS(status))
             {
-                if (!PhStartsWithStringRef(&fileName->sr, context->Restore.BaseFileName, TRUE))
+                if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
                 {
-                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Wrong prefix: %s", fileName->Buffer));
-                    return E_FAIL;
-                }
+                    // File was added in the current revision; delete it.
 
-                relativeName.Buffer = (PWSTR)((PCHAR)fileName->Buffer + context->Restore.BaseFileName->Length);
-                relativeName.Length = fileName->Length - context->Restore.BaseFileName->Length;
-                outFileName = EnpAppendComponentToPath(context->Restore.RestoreToDirectory, &relativeName);
-            }
-            else
-            {
-                outFileName = EnpAppendComponentToPath(context->Restore.RestoreToDirectory, context->Restore.RestoreToName);
-            }
+                    if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                        DbUtDeleteDirectoryContents(Database, fileInHead);
 
-            status = PhCreateFileStream(
-                &outFileStream,
-                outFileName->Buffer,
-                FILE_GENERIC_READ | FILE_GENERIC_WRITE,
-                0,
-                (context->Restore.Flags & EN_RESTORE_OVERWRITE_FILES) ? FILE_OVERWRITE_IF : FILE_CREATE,
-                0
-                );
+                    status = DbDeleteFile(Database, fileInHead);
 
-            if (!NT_SUCCESS(status))
-            {
-                if (status == STATUS_OBJECT_NAME_COLLISION)
-                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"File already exists (try --force): %s", outFileName->Buffer));
+                    if (!NT_SUCCESS(status))
+                        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete '%s' during reversal of file add", entries[i].FileName->Buffer));
+                }
                 else
-                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create %s", outFileName->Buffer));
-
-                PhDereferenceObject(outFileName);
-                return E_FAIL;
-            }
-
-            if (NT_SUCCESS(status = NtQueryInformationFile(outFileStream->FileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation)))
-            {
-                if (getStream->FileInformation.CreationTime.QuadPart != 0)
-                    basicInfo.CreationTime = getStream->FileInformation.CreationTime;
+                {
+                    if ((entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) && (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+                    {
+                        // Both are directories, which doesn't indicate much.
+                        // Scan the directory.
 
-                if (getStream->FileInformation.LastAccessTime.QuadPart != 0)
-                    basicInfo.LastAccessTime = getStream->FileInformation.LastAccessTime;
+                        status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInDiff, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &fileInDiff);
 
-                if (getStream->FileInformation.LastWriteTime.QuadPart != 0)
-                    basicInfo.LastWriteTime = getStream->FileInformation.LastWriteTime;
+                        if (NT_SUCCESS(status))
+                        {
+                            status = EnpMergeDirectoryToHead(Database, fileInHead, fileInDiff, MessageHandler);
+                            DbCloseFile(Database, fileInDiff);
+                        }
 
-                if (getStream->FileInformation.ChangeTime.QuadPart != 0)
-                    basicInfo.ChangeTime = getStream->FileInformation.ChangeTime;
+                        DbCloseFile(Database, fileInHead);
+                    }
+                    else
+                    {
+                        // Both are files, indicating a modification, or there was a switch (file -> directory or directory -> file).
+                        // Just delete the file in HEAD.
 
-                basicInfo.FileAttributes = getStream->FileInformation.FileAttributes & ~FILE_ATTRIBUTE_NORMAL;
+                        if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                            DbUtDeleteDirectoryContents(Database, fileInHead);
 
-                status = NtSetInformationFile(outFileStream->FileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation);
-            }
+                        status = DbDeleteFile(Database, fileInHead);
 
-            if (!NT_SUCCESS(status))
-                context->MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to set attributes on %s", outFileName->Buffer));
-
-            pkOutFileStream = PkCreateFileStream(outFileStream);
-            PhDereferenceObject(outFileStream);
-
-            getStream->FileStream = pkOutFileStream;
-
-            PhDereferenceObject(outFileName);
+                        if (NT_SUCCESS(status))
+                            copyFromDiffToHead = TRUE;
+                        else
+                            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete '%s' during reversal of file modify", entries[i].FileName->Buffer));
+                    }
+                }
+            }
         }
-        break;
-    case PkProgressMessage:
+        else if (status == STATUS_OBJECT_NAME_NOT_FOUND)
         {
-            PPK_PARAMETER_PROGRESS progress = Parameter;
-            PH_FORMAT format[3];
-
-            if (progress->ProgressTotal != 0)
+            if (!(entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG))
             {
-                PhInitFormatS(&format[0], L"Extracting: ");
-                PhInitFormatF(&format[1], (DOUBLE)progress->ProgressValue * 100 / progress->ProgressTotal, 2);
-                format[1].Type |= FormatRightAlign;
-                format[1].Width = 5;
-                PhInitFormatC(&format[2], '%');
-
-                context->MessageHandler(EN_MESSAGE_PROGRESS, PhFormat(format, 3, 0));
+                // File was deleted in current revision; bring it back.
+                copyFromDiffToHead = TRUE;
             }
-        }
-        break;
-    }
-
-    return S_OK;
-}
-
-NTSTATUS EnpQueryFileRevisions(
-    _In_ PDB_DATABASE Database,
-    _In_ PPH_STRINGREF FileName,
-    _In_ ULONGLONG FirstRevisionId,
-    _In_ ULONGLONG LastRevisionId,
-    _Out_ PEN_FILE_REVISION_INFORMATION *Entries,
-    _Out_ PULONG NumberOfEntries,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
-    )
-{
-    NTSTATUS status;
-    PEN_FILE_REVISION_INFORMATION entries;
-    ULONG allocatedEntries;
-    ULONG numberOfEntries;
-    ULONGLONG revisionId;
-    PDBF_FILE directory;
-    PH_STRINGREF directoryName;
-    WCHAR directoryNameBuffer[17];
-    PDBF_FILE file;
-    DB_FILE_BASIC_INFORMATION basicInfo;
-    DB_FILE_DATA_INFORMATION dataInfo;
-    PEN_FILE_REVISION_INFORMATION entry;
-
-    allocatedEntries = 16;
-    entries = PhAllocate(allocatedEntries * sizeof(EN_FILE_REVISION_INFORMATION));
-    numberOfEntries = 0;
 
-    for (revisionId = LastRevisionId; revisionId >= FirstRevisionId; revisionId--)
-    {
-        if (revisionId == LastRevisionId)
-        {
-            PhInitializeStringRef(&directoryName, L"head");
-        }
-        else
-        {
-            EnpFormatRevisionId(revisionId, directoryNameBuffer);
-            directoryName.Buffer = directoryNameBuffer;
-            directoryName.Length = 16 * sizeof(WCHAR);
-        }
-
-        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_ATTRIBUTE_DIRECTORY, NULL, &directory);
-
-        if (!NT_SUCCESS(status))
-        {
-            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
-            continue;
+            status = STATUS_SUCCESS;
         }
 
-        status = DbCreateFile(Database, FileName, directory, 0, DB_FILE_OPEN, 0, NULL, &file);
-
-        if (NT_SUCCESS(status))
+        if (copyFromDiffToHead)
         {
-            status = DbQueryInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+            status = DbCreateFile(Database, &entries[i].FileName->sr, DirectoryInDiff, 0, DB_FILE_OPEN, 0, NULL, &fileInDiff);
 
             if (NT_SUCCESS(status))
             {
-                if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
-                {
-                    DbCloseFile(Database, file);
-                    DbCloseFile(Database, directory);
-                    continue;
-                }
-
-                if (!(basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
-                    status = DbQueryInformationFile(Database, file, DbFileDataInformation, &dataInfo, sizeof(DB_FILE_DATA_INFORMATION));
-                else
-                    memset(&dataInfo, 0, sizeof(DB_FILE_DATA_INFORMATION));
-            }
+                status = DbUtCopyFile(Database, fileInDiff, DirectoryInHead, &entries[i].FileName->sr, &fileInHead);
 
-            if (NT_SUCCESS(status))
-            {
-                if (numberOfEntries == allocatedEntries)
+                if (NT_SUCCESS(status))
                 {
-                    allocatedEntries *= 2;
-                    entries = PhReAllocate(entries, allocatedEntries * sizeof(EN_FILE_REVISION_INFORMATION));
-                }
+                    if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                        status = DbUtCopyDirectoryContents(Database, fileInDiff, fileInHead);
 
-                entry = &entries[numberOfEntries++];
-                entry->Attributes = basicInfo.Attributes;
-                entry->RevisionId = revisionId;
-                entry->TimeStamp = basicInfo.TimeStamp;
-                entry->EndOfFile = dataInfo.EndOfFile;
-                entry->LastBackupTime = dataInfo.LastBackupTime;
+                    DbCloseFile(Database, fileInHead);
+                }
 
-                if (!(basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
-                    entry->RevisionId = basicInfo.RevisionId;
-            }
-            else
-            {
-                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to query information in %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
+                DbCloseFile(Database, fileInDiff);
             }
 
-            DbCloseFile(Database, file);
+            if (!NT_SUCCESS(status))
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to copy '%s'", entries[i].FileName->Buffer));
         }
 
-        DbCloseFile(Database, directory);
+        if (!NT_SUCCESS(status))
+        {
+            DbFreeQueryDirectoryFile(entries, numberOfEntries);
+            return status;
+        }
     }
 
-    *Entries = entries;
-    *NumberOfEntries = numberOfEntries;
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
 
     return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpCompareRevisions(
+NTSTATUS EnpTrimToRevision(
     _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
     _In_ PDB_DATABASE Database,
-    _In_ ULONGLONG BaseRevisionId,
-    _In_opt_ ULONGLONG TargetRevisionId,
+    _In_ ULONGLONG TargetFirstRevisionId,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
     NTSTATUS status;
     ULONGLONG lastRevisionId;
     ULONGLONG firstRevisionId;
-    PH_STRINGREF databaseName;
-    PPH_STRING databaseFileName;
-    PPH_STRING tempBaseDatabaseFileName;
-    PPH_STRING tempTargetDatabaseFileName;
-    BOOLEAN tempBaseDatabaseCreated;
-    BOOLEAN tempTargetDatabaseCreated;
-    PDB_DATABASE tempBaseDatabase;
-    PDB_DATABASE tempTargetDatabase;
-    PDBF_FILE baseHeadDirectory;
-    PDBF_FILE targetHeadDirectory;
-    PH_STRINGREF headDirectoryName;
-    PPH_STRING emptyFileName;
-    ULONGLONG numberOfChanges;
+    PPH_HASHTABLE revisionEntries;
+    PPH_HASHTABLE pathTable;
 
     DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
 
-    if (TargetRevisionId == 0)
-    {
-        TargetRevisionId = lastRevisionId;
-    }
-    else if (TargetRevisionId < firstRevisionId || TargetRevisionId > lastRevisionId)
+    if (TargetFirstRevisionId < firstRevisionId || TargetFirstRevisionId > lastRevisionId)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid base revision ID '%I64u'", BaseRevisionId));
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", TargetFirstRevisionId));
         return STATUS_INVALID_PARAMETER;
     }
 
-    if (BaseRevisionId < firstRevisionId || BaseRevisionId > lastRevisionId)
+    if (TargetFirstRevisionId == firstRevisionId)
     {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid base revision ID '%I64u'", BaseRevisionId));
-        return STATUS_INVALID_PARAMETER;
+        // Nothing to do
+        return STATUS_ABANDONED;
     }
 
-    if (BaseRevisionId >= TargetRevisionId)
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Base revision ID '%I64u' must be less than target revision ID '%I64u'", BaseRevisionId, TargetRevisionId));
-        return STATUS_INVALID_PARAMETER;
-    }
+    // Create a list of files to ignore from each revision.
+    // In each revision, these files will be replaced by files in a later revision (or are eventually deleted).
 
-    PhInitializeStringRef(&databaseName, L"\\" EN_DATABASE_NAME);
-    databaseFileName = PhConcatStringRef2(&Config->DestinationDirectory->sr, &databaseName);
-    tempBaseDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
-    tempTargetDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
-    tempBaseDatabaseCreated = FALSE;
-    tempTargetDatabaseCreated = FALSE;
-    tempBaseDatabase = NULL;
-    tempTargetDatabase = NULL;
-    baseHeadDirectory = NULL;
-    targetHeadDirectory = NULL;
+    status = EnpCreateMergeRevisionEntries(Database, firstRevisionId, TargetFirstRevisionId, MessageHandler, &revisionEntries, &pathTable);
 
-    // Create a temporary "base" database and merge to the base revision ID.
+    if (!NT_SUCCESS(status))
+        return status;
 
-    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Processing base"));
+    // Merge packages up to the target revision.
 
-    status = EnpCopyFileWin32(databaseFileName->Buffer, tempBaseDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+    status = EnpMergePackages(Config, TransactionHandle, firstRevisionId, TargetFirstRevisionId, revisionEntries, pathTable, MessageHandler);
 
-    if (!NT_SUCCESS(status))
-        goto CleanupExit;
+    if (NT_SUCCESS(status))
+    {
+        status = EnpUpdateDatabaseAfterTrim(Database, firstRevisionId, TargetFirstRevisionId, MessageHandler);
 
-    tempBaseDatabaseCreated = TRUE;
-    status = DbOpenDatabase(&tempBaseDatabase, tempBaseDatabaseFileName->Buffer, FALSE, 0);
+        // The packages of the new first revision were merged using the trim settings.
+        EnpSetRevisionRecompressed(Database, TargetFirstRevisionId, FALSE);
+    }
 
-    if (!NT_SUCCESS(status))
-        goto CleanupExit;
+    EnpDestroyMergeRevisionEntries(revisionEntries, pathTable);
 
-    status = EnpMergeToHeadUntilRevision(tempBaseDatabase, BaseRevisionId, MessageHandler, &baseHeadDirectory);
+    return status;
+}
 
-    if (!NT_SUCCESS(status))
-    {
-        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to merge base revisions"));
-        goto CleanupExit;
-    }
+NTSTATUS EnpCreateMergeRevisionEntries(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG FirstRevisionId,
+    _In_ ULONGLONG LastRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PPH_HASHTABLE *RevisionEntries,
+    _Out_ PPH_HASHTABLE *PathTable
+    )
+{
+    NTSTATUS status;
+    ULONGLONG revisionId;
+    PPH_HASHTABLE revisionEntries;
+    PPH_HASHTABLE pathTable;
+    PDBF_FILE diffDirectory;
+    WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PEN_REVISION_ENTRY revisionEntry;
 
-    // If necessary, create a temporary "target" database and merge to the target revision ID.
+    // The diff directories FirstRevisionId .. LastRevisionId - 1 record every file version that is
+    // replaced (or deleted) somewhere between FirstRevisionId + 1 and LastRevisionId.
+    // Each path is stored once in the path table; the revision entries only contain path IDs.
 
-    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Processing target"));
+    revisionEntries = PhCreateHashtable(
+        sizeof(EN_REVISION_ENTRY),
+        EnpRevisionEntryCompareFunction,
+        EnpRevisionEntryHashFunction,
+        10
+        );
+    pathTable = EnpCreatePathTable();
+    status = STATUS_SUCCESS;
 
-    if (TargetRevisionId == lastRevisionId)
+    for (revisionId = FirstRevisionId; revisionId < LastRevisionId; revisionId++)
     {
-        PhInitializeStringRef(&headDirectoryName, L"head");
-        status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &targetHeadDirectory);
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
 
         if (!NT_SUCCESS(status))
-            goto CleanupExit;
-    }
-    else
-    {
-        status = EnpCopyFileWin32(databaseFileName->Buffer, tempTargetDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
+            break;
+        }
 
-        if (!NT_SUCCESS(status))
-            goto CleanupExit;
-
-        tempTargetDatabaseCreated = TRUE;
-        status = DbOpenDatabase(&tempTargetDatabase, tempTargetDatabaseFileName->Buffer, FALSE, 0);
-
-        if (!NT_SUCCESS(status))
-            goto CleanupExit;
-
-        status = EnpMergeToHeadUntilRevision(tempTargetDatabase, TargetRevisionId, MessageHandler, &targetHeadDirectory);
+        status = EnpAddMergeFileNamesFromDirectory(Database, revisionEntries, pathTable, diffDirectory, 0);
+        DbCloseFile(Database, diffDirectory);
 
         if (!NT_SUCCESS(status))
         {
-            MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to merge target revisions"));
-            goto CleanupExit;
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to process %s directory", diffDirectoryNameBuffer));
+            break;
         }
     }
 
-    emptyFileName = PhReferenceEmptyString();
-    numberOfChanges = 0;
-    status = EnpDiffDirectoryCompareRevisions(
-        tempBaseDatabase,
-        tempTargetDatabase ? tempTargetDatabase : Database,
-        baseHeadDirectory,
-        targetHeadDirectory,
-        emptyFileName,
-        &numberOfChanges,
-        MessageHandler
-        );
-    PhDereferenceObject(emptyFileName);
+    if (!NT_SUCCESS(status))
+    {
+        EnpDestroyMergeRevisionEntries(revisionEntries, pathTable);
+        return status;
+    }
 
-    if (numberOfChanges != 0)
-        MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%I64u change(s)", numberOfChanges));
+    PhBeginEnumHashtable(revisionEntries, &enumContext);
 
-CleanupExit:
-    if (baseHeadDirectory)
-        DbCloseFile(tempBaseDatabase, baseHeadDirectory);
-    if (targetHeadDirectory)
-        DbCloseFile(tempTargetDatabase ? tempTargetDatabase : Database, targetHeadDirectory);
-    if (tempBaseDatabase)
-        DbCloseDatabase(tempBaseDatabase);
-    if (tempTargetDatabase)
-        DbCloseDatabase(tempTargetDatabase);
-    if (tempBaseDatabaseCreated)
-        PhDeleteFileWin32(tempBaseDatabaseFileName->Buffer);
-    if (tempTargetDatabaseCreated)
-        PhDeleteFileWin32(tempTargetDatabaseFileName->Buffer);
+    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    {
+        EnpSortPathIds(&revisionEntry->PathIds);
+    }
 
-    PhDereferenceObject(tempBaseDatabaseFileName);
-    PhDereferenceObject(tempTargetDatabaseFileName);
-    PhDereferenceObject(databaseFileName);
+    *RevisionEntries = revisionEntries;
+    *PathTable = pathTable;
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
-NTSTATUS EnpDiffDirectoryCompareRevisions(
-    _In_opt_ PDB_DATABASE BaseDatabase,
-    _In_ PDB_DATABASE TargetDatabase,
-    _In_opt_ PDBF_FILE BaseDirectory,
-    _In_ PDBF_FILE TargetDirectory,
-    _In_ PPH_STRING FileName,
-    _Inout_ PULONGLONG NumberOfChanges,
-    _In_ PEN_MESSAGE_HANDLER MessageHandler
+VOID EnpDestroyMergeRevisionEntries(
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable
+    )
+{
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PEN_REVISION_ENTRY revisionEntry;
+
+    PhBeginEnumHashtable(RevisionEntries, &enumContext);
+
+    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    {
+        PhDeleteArray(&revisionEntry->PathIds);
+    }
+
+    PhDereferenceObject(RevisionEntries);
+    EnpDestroyPathTable(PathTable);
+}
+
+NTSTATUS EnpAddMergeFileNamesFromDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PDBF_FILE Directory,
+    _In_ ULONG DirectoryPathId
     )
 {
     NTSTATUS status;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
     ULONG i;
-    PPH_STRING fileNamePrefix;
-    PDB_FILE_DIRECTORY_INFORMATION baseEntries;
-    ULONG numberOfBaseEntries;
-    PDB_FILE_DIRECTORY_INFORMATION targetEntries;
-    ULONG numberOfTargetEntries;
-    PPH_HASHTABLE baseHashtable;
-    PPH_HASHTABLE targetHashtable;
-    PDB_FILE_DIRECTORY_INFORMATION entry;
-    PDB_FILE_DIRECTORY_INFORMATION otherEntry;
-    BOOLEAN modified;
-    BOOLEAN switched;
-    PDBF_FILE baseDirectory;
-    PDBF_FILE targetDirectory;
-    PPH_STRING fullFileName;
+    ULONG pathId;
+    PDBF_FILE file;
+    PEN_REVISION_ENTRY revisionEntry;
+    EN_REVISION_ENTRY localRevisionEntry;
+    BOOLEAN added;
 
-    if (FileName->Length != 0)
-        fileNamePrefix = PhConcatStringRef2(&FileName->sr, &EnpBackslashString);
-    else
-        fileNamePrefix = PhReferenceEmptyString();
+    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
 
-    baseEntries = NULL;
-    targetEntries = NULL;
-    baseHashtable = NULL;
-    targetHashtable = NULL;
+    if (!NT_SUCCESS(status))
+        return status;
 
-    if (BaseDirectory)
+    for (i = 0; i < numberOfEntries; i++)
     {
-        status = DbQueryDirectoryFile(BaseDatabase, BaseDirectory, &baseEntries, &numberOfBaseEntries);
+        pathId = EnpAddToPathTable(PathTable, DirectoryPathId, entries[i].FileName);
 
-        if (!NT_SUCCESS(status))
-            goto CleanupExit;
-    }
-    else
-    {
-        baseEntries = NULL;
-        numberOfBaseEntries = 0;
-    }
+        if (entries[i].RevisionId != 0 && !(entries[i].Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG))
+        {
+            localRevisionEntry.RevisionId = entries[i].RevisionId;
+            localRevisionEntry.FileNames = NULL;
+            localRevisionEntry.DirectoryNames = NULL;
+            localRevisionEntry.PartMask = 0;
+            revisionEntry = PhAddEntryHashtableEx(RevisionEntries, &localRevisionEntry, &added);
 
-    status = DbQueryDirectoryFile(TargetDatabase, TargetDirectory, &targetEntries, &numberOfTargetEntries);
+            if (added)
+            {
+                PhInitializeArray(&revisionEntry->PathIds, sizeof(ULONG), 64);
+            }
 
-    if (!NT_SUCCESS(status))
-        goto CleanupExit;
+            PhAddItemArray(&revisionEntry->PathIds, &pathId);
+        }
 
-    baseHashtable = PhCreateHashtable(
-        sizeof(PDB_FILE_DIRECTORY_INFORMATION),
-        EnpDirectoryEntryCompareFunction,
-        EnpDirectoryEntryHashFunction,
-        numberOfBaseEntries
-        );
-    entry = baseEntries;
+        if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+        {
+            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &file);
 
-    for (i = 0; i < numberOfBaseEntries; i++)
-    {
-        PhAddEntryHashtable(baseHashtable, &entry);
-        entry++;
-    }
+            if (!NT_SUCCESS(status))
+                break;
 
-    targetHashtable = PhCreateHashtable(
-        sizeof(PDB_FILE_DIRECTORY_INFORMATION),
-        EnpDirectoryEntryCompareFunction,
-        EnpDirectoryEntryHashFunction,
-        numberOfTargetEntries
-        );
-    entry = targetEntries;
+            status = EnpAddMergeFileNamesFromDirectory(Database, RevisionEntries, PathTable, file, pathId);
+            DbCloseFile(Database, file);
 
-    for (i = 0; i < numberOfTargetEntries; i++)
-    {
-        PhAddEntryHashtable(targetHashtable, &entry);
-        entry++;
+            if (!NT_SUCCESS(status))
+                break;
+        }
     }
 
-    // Detect files/directories that have been deleted.
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
 
-    entry = baseEntries;
+    return status;
+}
 
-    for (i = 0; i < numberOfBaseEntries; i++)
+NTSTATUS EnpMergePackages(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ ULONGLONG OldFirstRevisionId,
+    _In_ ULONGLONG NewFirstRevisionId,
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONG partId;
+
+    // Files never move between parts, so each part can be merged on its own.
+
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
     {
-        if (!EnpFindDirectoryEntry(targetHashtable, entry->FileName))
-        {
-            // Deleted file
-            (*NumberOfChanges)++;
-            MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"- %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
-        }
+        status = EnpMergePackagePart(Config, TransactionHandle, OldFirstRevisionId, NewFirstRevisionId, partId, RevisionEntries, PathTable, MessageHandler);
 
-        entry++;
+        if (!NT_SUCCESS(status))
+            return status;
     }
 
-    // Detect files/directories that have been added or modified.
+    return STATUS_SUCCESS;
+}
 
-    entry = targetEntries;
+NTSTATUS EnpMergePackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ ULONGLONG OldFirstRevisionId,
+    _In_ ULONGLONG NewFirstRevisionId,
+    _In_ ULONG PartId,
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    HRESULT result;
+    PPH_STRING targetPackageFileName;
+    ULONGLONG revisionId;
+    PPK_ACTION_LIST actionList;
+    PPH_FILE_STREAM fileStream;
+    PPH_STRING mergePackageFileName;
+    PPH_STRING basePackageFileName;
+    PPK_PACKAGE basePackage;
+    EN_REVISION_ENTRY lookupRevisionEntry;
+    PEN_REVISION_ENTRY revisionEntry;
+    PEN_MERGE_PACKAGE_ENTRY mergeEntries;
+    ULONG numberOfMergeEntries;
+    PEN_MERGE_PACKAGE_ENTRY mergeEntry;
+    PH_WORK_QUEUE workQueue;
+    EN_PACKAGE_CALLBACK_CONTEXT updateContext;
+    ULONG i;
+    ULONG j;
+    PPH_STRING newPackageFileName;
+    PPK_FILE_STREAM pkNewPackageFileStream;
+    PK_COMPRESSION_SETTINGS settings;
 
-    for (i = 0; i < numberOfTargetEntries; i++)
+    status = STATUS_SUCCESS;
+    targetPackageFileName = EnpFormatPackagePartName(Config, NewFirstRevisionId, PartId);
+    basePackageFileName = NULL;
+    basePackage = NULL;
+    newPackageFileName = NULL;
+    pkNewPackageFileStream = NULL;
+    actionList = NULL;
+    RtlSetCurrentTransaction(NULL);
+
+    updateContext.MessageHandler = MessageHandler;
+    updateContext.Merge.PathTable = NULL;
+    updateContext.Merge.IgnorePathIds = NULL;
+    updateContext.Merge.NumberOfIgnorePathIds = 0;
+
+    // Find the packages that need to be merged.
+
+    mergeEntries = PhAllocate(sizeof(EN_MERGE_PACKAGE_ENTRY) * (ULONG)(NewFirstRevisionId - OldFirstRevisionId + 1));
+    numberOfMergeEntries = 0;
+
+    for (revisionId = OldFirstRevisionId; revisionId <= NewFirstRevisionId; revisionId++)
     {
-        otherEntry = EnpFindDirectoryEntry(baseHashtable, entry->FileName);
+        mergePackageFileName = EnpFormatPackagePartName(Config, revisionId, PartId);
 
-        if (otherEntry)
+        if (!RtlDoesFileExists_U(mergePackageFileName->Buffer))
         {
-            modified = FALSE;
-            switched = FALSE;
+            PhDereferenceObject(mergePackageFileName);
+            continue;
+        }
 
-            if ((entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) != (otherEntry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
-            {
-                modified = TRUE;
-                switched = TRUE;
-            }
+        mergeEntry = &mergeEntries[numberOfMergeEntries++];
+        memset(mergeEntry, 0, sizeof(EN_MERGE_PACKAGE_ENTRY));
+        mergeEntry->RevisionId = revisionId;
+        mergeEntry->FileName = mergePackageFileName;
+        // The packages are opened on worker threads, which don't report messages. Failures are
+        // returned in Status and Result, and reported on this thread below.
+        mergeEntry->Context.MessageHandler = NULL;
 
-            if (!modified && !(entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
-            {
-                if (entry->EndOfFile.QuadPart != otherEntry->EndOfFile.QuadPart)
-                    modified = TRUE;
-                if (entry->LastBackupTime.QuadPart != otherEntry->LastBackupTime.QuadPart)
-                    modified = TRUE;
-            }
+        // If this isn't the target revision, filter out the files that will be replaced by the files in a later revision's package.
 
-            if (modified)
+        if (revisionId != NewFirstRevisionId)
+        {
+            mergeEntry->Filter = TRUE;
+            lookupRevisionEntry.RevisionId = revisionId;
+            revisionEntry = PhFindEntryHashtable(RevisionEntries, &lookupRevisionEntry);
+
+            if (revisionEntry)
             {
-                // Modified file
-                // or switched file (file has become directory or directory has become file)
-                (*NumberOfChanges)++;
-                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%c %s%s", switched ? 's' : 'm', fileNamePrefix->Buffer, entry->FileName->Buffer));
+                mergeEntry->Context.Merge.PathTable = PathTable;
+                mergeEntry->Context.Merge.IgnorePathIds = revisionEntry->PathIds.Items;
+                mergeEntry->Context.Merge.NumberOfIgnorePathIds = (ULONG)revisionEntry->PathIds.Count;
             }
         }
-        else
-        {
-            // Added file
-            (*NumberOfChanges)++;
-            MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"+ %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
+    }
+
+    if (numberOfMergeEntries == 0 || mergeEntries[0].RevisionId == NewFirstRevisionId)
+    {
+        // We don't have a base package and we're already at the target revision.
+        // Nothing needs to be done.
+        goto CleanupExit;
+    }
+
+    // Open and filter the packages in parallel. The results are collected in revision order below,
+    // so the order of items in the merged package does not depend on scheduling.
+
+    PhInitializeWorkQueue(&workQueue, 0, min(numberOfMergeEntries, PhSystemBasicInformation.NumberOfProcessors), 1000);
+
+    for (i = 0; i < numberOfMergeEntries; i++)
+        PhQueueItemWorkQueue(&workQueue, EnpOpenMergePackageWorker, &mergeEntries[i]);
+
+    PhWaitForWorkQueue(&workQueue);
+    PhDeleteWorkQueue(&workQueue);
+
+    for (i = 0; i < numberOfMergeEntries; i++)
+    {
+        mergeEntry = &mergeEntries[i];
+        MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Processing %s", mergeEntry->FileName->Buffer));
+
+        if (!NT_SUCCESS(mergeEntry->Status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s", mergeEntry->FileName->Buffer));
+            status = mergeEntry->Status;
+            goto CleanupExit;
         }
 
-        if (entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+        if (!SUCCEEDED(mergeEntry->Result))
         {
-            baseDirectory = NULL;
-            targetDirectory = NULL;
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to process package %s: 0x%x", mergeEntry->FileName->Buffer, mergeEntry->Result));
+            status = STATUS_UNSUCCESSFUL;
+            goto CleanupExit;
+        }
 
-            if (otherEntry && (otherEntry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+        if (i == 0)
+        {
+            // Use this as our base package.
+
+            basePackage = mergeEntry->Package;
+            mergeEntry->Package = NULL;
+            actionList = mergeEntry->ActionList;
+            mergeEntry->ActionList = NULL;
+            basePackageFileName = mergeEntry->FileName;
+            PhReferenceObject(basePackageFileName);
+        }
+        else
+        {
+            for (j = 0; j < mergeEntry->ActionList->NumberOfActions; j++)
             {
-                status = DbCreateFile(BaseDatabase, &otherEntry->FileName->sr, BaseDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &baseDirectory);
-
-                if (!NT_SUCCESS(status))
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open base directory %s%s", fileNamePrefix->Buffer, otherEntry->FileName->Buffer));
+                PkAppendAddFromPackageToActionList(
+                    actionList,
+                    mergeEntry->Package,
+                    mergeEntry->ActionList->Actions[j].u.Update.Index,
+                    NULL
+                    );
             }
 
-            if (NT_SUCCESS(status))
+            // The action list has its own reference to the package. Close our reference now so
+            // that the package file can be deleted after merging.
+            PkDereferencePackage(mergeEntry->Package);
+            mergeEntry->Package = NULL;
+            PkDestroyActionList(mergeEntry->ActionList);
+            mergeEntry->ActionList = NULL;
+        }
+    }
+
+    if (basePackage)
+    {
+        RtlSetCurrentTransaction(TransactionHandle);
+
+        newPackageFileName = PhConcatStringRef2(&basePackageFileName->sr, &EnpNewSuffixString);
+        status = PhCreateFileStream(
+            &fileStream,
+            newPackageFileName->Buffer,
+            FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+            0,
+            FILE_CREATE,
+            FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+            );
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create %s", newPackageFileName->Buffer));
+            goto CleanupExit;
+        }
+
+        pkNewPackageFileStream = PkCreateFileStream(fileStream);
+        PhDereferenceObject(fileStream);
+
+        EnpInitializePartCompression(Config, &Config->TrimCompression, PartId, &settings);
+
+        if (Config->MergeBufferSize != 0)
+            settings.PipeBufferSize = Config->MergeBufferSize;
+
+        MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Merging packages"));
+        result = PkUpdatePackage(
+            pkNewPackageFileStream,
+            basePackage,
+            actionList,
+            &settings,
+            EnpMergePackageCallback,
+            &updateContext
+            );
+
+        PkDereferenceFileStream(pkNewPackageFileStream);
+        pkNewPackageFileStream = NULL;
+        PkDereferencePackage(basePackage);
+        basePackage = NULL;
+        PkDestroyActionList(actionList);
+        actionList = NULL;
+
+        if (!SUCCEEDED(result))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge packages: 0x%x", result));
+            PhDeleteFileWin32(newPackageFileName->Buffer);
+            status = STATUS_UNSUCCESSFUL;
+            goto CleanupExit;
+        }
+
+        for (revisionId = OldFirstRevisionId; revisionId <= NewFirstRevisionId; revisionId++)
+        {
+            mergePackageFileName = EnpFormatPackagePartName(Config, revisionId, PartId);
+            status = PhDeleteFileWin32(mergePackageFileName->Buffer);
+
+            if (!NT_SUCCESS(status) && status != STATUS_OBJECT_PATH_NOT_FOUND && status != STATUS_OBJECT_NAME_NOT_FOUND)
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", mergePackageFileName->Buffer));
+
+            PhDereferenceObject(mergePackageFileName);
+        }
+
+        status = EnpRenameFileWin32(NULL, newPackageFileName->Buffer, targetPackageFileName->Buffer, FALSE);
+
+        if (!NT_SUCCESS(status))
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename %s", newPackageFileName->Buffer));
+    }
+
+CleanupExit:
+    if (targetPackageFileName)
+        PhDereferenceObject(targetPackageFileName);
+    if (basePackageFileName)
+        PhDereferenceObject(basePackageFileName);
+    if (basePackage)
+        PkDereferencePackage(basePackage);
+    if (newPackageFileName)
+        PhDereferenceObject(newPackageFileName);
+    if (pkNewPackageFileStream)
+        PkDereferenceFileStream(pkNewPackageFileStream);
+    if (actionList)
+        PkDestroyActionList(actionList);
+
+    for (i = 0; i < numberOfMergeEntries; i++)
+    {
+        PhDereferenceObject(mergeEntries[i].FileName);
+
+        if (mergeEntries[i].Package)
+            PkDereferencePackage(mergeEntries[i].Package);
+        if (mergeEntries[i].ActionList)
+            PkDestroyActionList(mergeEntries[i].ActionList);
+    }
+
+    PhFree(mergeEntries);
+
+    return status;
+}
+
+NTSTATUS NTAPI EnpOpenMergePackageWorker(
+    _In_ PVOID Parameter
+    )
+{
+    PEN_MERGE_PACKAGE_ENTRY mergeEntry = Parameter;
+    PPH_FILE_STREAM fileStream;
+    PPK_FILE_STREAM pkFileStream;
+
+    mergeEntry->Status = PhCreateFileStream(
+        &fileStream,
+        mergeEntry->FileName->Buffer,
+        FILE_GENERIC_READ,
+        0,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+
+    if (!NT_SUCCESS(mergeEntry->Status))
+        return mergeEntry->Status;
+
+    pkFileStream = PkCreateFileStream(fileStream);
+    PhDereferenceObject(fileStream);
+
+    mergeEntry->ActionList = PkCreateActionList();
+    mergeEntry->Result = PkOpenPackageWithFilter(
+        pkFileStream,
+        mergeEntry->ActionList,
+        mergeEntry->Filter ? EnpMergePackageCallback : NULL,
+        mergeEntry->Filter ? &mergeEntry->Context : NULL,
+        &mergeEntry->Package
+        );
+
+    PkDereferenceFileStream(pkFileStream);
+
+    return STATUS_SUCCESS;
+}
+
+HRESULT EnpMergePackageCallback(
+    _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
+    _In_opt_ PPK_ACTION Action,
+    _In_ PVOID Parameter,
+    _In_opt_ PVOID Context
+    )
+{
+    PEN_PACKAGE_CALLBACK_CONTEXT context = Context;
+
+    switch (Message)
+    {
+    case PkFilterItemMessage:
+        {
+            PPK_PARAMETER_FILTER_ITEM filterItem = Parameter;
+            PH_STRINGREF path;
+            ULONG pathId;
+
+            if (context->Merge.NumberOfIgnorePathIds != 0)
             {
-                status = DbCreateFile(TargetDatabase, &entry->FileName->sr, TargetDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &targetDirectory);
+                // Chunks belong to the file they were split from.
+                if (!EnpSplitChunkName(&filterItem->Path, &path, NULL))
+                    path = filterItem->Path;
 
-                if (!NT_SUCCESS(status))
-                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open target directory %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
+                pathId = EnpFindInPathTable(context->Merge.PathTable, &path);
+
+                if (pathId != 0 && EnpFindPathId(context->Merge.IgnorePathIds, context->Merge.NumberOfIgnorePathIds, pathId))
+                    filterItem->Reject = TRUE;
             }
+        }
+        break;
+    case PkProgressMessage:
+        {
+            PPK_PARAMETER_PROGRESS progress = Parameter;
+            PH_FORMAT format[3];
 
-            if (NT_SUCCESS(status))
+            if (progress->ProgressTotal != 0 && context->MessageHandler)
             {
-                fullFileName = PhConcatStringRef2(&fileNamePrefix->sr, &entry->FileName->sr);
-                EnpDiffDirectoryCompareRevisions(BaseDatabase, TargetDatabase, baseDirectory, targetDirectory, fullFileName, NumberOfChanges, MessageHandler);
-                PhDereferenceObject(fullFileName);
+                PhInitFormatS(&format[0], L"Compressing: ");
+                PhInitFormatF(&format[1], (DOUBLE)progress->ProgressValue * 100 / progress->ProgressTotal, 2);
+                format[1].Type |= FormatRightAlign;
+                format[1].Width = 5;
+                PhInitFormatC(&format[2], '%');
+
+                context->MessageHandler(EN_MESSAGE_PROGRESS, PhFormat(format, 3, 0));
             }
+        }
+        break;
+    }
+
+    return S_OK;
+}
+
+NTSTATUS EnpUpdateDatabaseAfterTrim(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG OldFirstRevisionId,
+    _In_ ULONGLONG NewFirstRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG revisionId;
+    PDBF_FILE directory;
+    PH_STRINGREF directoryName;
+    WCHAR directoryNameBuffer[17];
+
+    for (revisionId = OldFirstRevisionId; revisionId < NewFirstRevisionId; revisionId++)
+    {
+        EnpFormatRevisionId(revisionId, directoryNameBuffer);
+        directoryName.Buffer = directoryNameBuffer;
+        directoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+
+        if (NT_SUCCESS(status))
+        {
+            // Delete the diff directory.
+            DbUtDeleteDirectoryContents(Database, directory);
+            status = DbDeleteFile(Database, directory);
+            DbCloseFile(Database, directory);
+        }
+
+        if (!NT_SUCCESS(status))
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s directory", directoryNameBuffer));
+    }
+
+    PhInitializeEmptyStringRef(&directoryName);
+    status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+
+    if (NT_SUCCESS(status))
+    {
+        status = EnpUpdateDirectoryMinimumRevisionIds(Database, directory, NewFirstRevisionId);
+        DbCloseFile(Database, directory);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to update revision IDs"));
+        status = STATUS_NOT_ALL_ASSIGNED;
+    }
+
+    DbSetRevisionIdsDatabase(Database, NULL, &NewFirstRevisionId);
+
+    return status;
+}
+
+NTSTATUS EnpUpdateDirectoryMinimumRevisionIds(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory,
+    _In_ ULONGLONG FirstRevisionId
+    )
+{
+    NTSTATUS status;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    ULONG i;
+    PDBF_FILE file;
+    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+
+    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        if (entries[i].RevisionId < FirstRevisionId || (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+        {
+            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+            if (NT_SUCCESS(status))
+            {
+                if (entries[i].RevisionId != 0 && entries[i].RevisionId < FirstRevisionId)
+                {
+                    revisionIdInfo.RevisionId = FirstRevisionId;
+                    DbSetInformationFile(Database, file, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
+                }
+
+                if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                {
+                    EnpUpdateDirectoryMinimumRevisionIds(Database, file, FirstRevisionId);
+                }
+
+                DbCloseFile(Database, file);
+            }
+        }
+    }
+
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN EnpRevisionEntryCompareFunction(
+    _In_ PVOID Entry1,
+    _In_ PVOID Entry2
+    )
+{
+    PEN_REVISION_ENTRY revisionEntry1 = Entry1;
+    PEN_REVISION_ENTRY revisionEntry2 = Entry2;
+
+    return revisionEntry1->RevisionId == revisionEntry2->RevisionId;
+}
+
+ULONG EnpRevisionEntryHashFunction(
+    _In_ PVOID Entry
+    )
+{
+    PEN_REVISION_ENTRY revisionEntry = Entry;
+
+    return PhHashInt64(revisionEntry->RevisionId);
+}
+
+NTSTATUS EnpSquashRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    ULONG i;
+    PEN_REVISION_RANGE range;
+    BOOLEAN squash;
+    PPH_HASHTABLE revisionEntries;
+    PPH_HASHTABLE pathTable;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    // The ranges must be sorted and must not overlap.
+
+    squash = FALSE;
+
+    for (i = 0; i < NumberOfRanges; i++)
+    {
+        range = &Ranges[i];
+
+        if (range->FirstRevisionId < firstRevisionId || range->LastRevisionId > lastRevisionId ||
+            range->FirstRevisionId > range->LastRevisionId ||
+            (i != 0 && range->FirstRevisionId <= Ranges[i - 1].LastRevisionId))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision range '%I64u:%I64u'", range->FirstRevisionId, range->LastRevisionId));
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (range->FirstRevisionId != range->LastRevisionId)
+            squash = TRUE;
+    }
+
+    if (!squash)
+    {
+        // Nothing to do
+        return STATUS_ABANDONED;
+    }
+
+    // Merge the packages in each range into the package for the last revision in the range.
+    // Only the diff directories inside a range are used to create the ignore list; a file that is
+    // replaced in a later range is still visible at the end of this range and must be kept.
+
+    for (i = 0; i < NumberOfRanges; i++)
+    {
+        range = &Ranges[i];
+
+        if (range->FirstRevisionId == range->LastRevisionId)
+            continue;
+
+        MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Squashing revisions %I64u to %I64u", range->FirstRevisionId, range->LastRevisionId));
+
+        status = EnpCreateMergeRevisionEntries(Database, range->FirstRevisionId, range->LastRevisionId, MessageHandler, &revisionEntries, &pathTable);
+
+        if (!NT_SUCCESS(status))
+            return status;
+
+        status = EnpMergePackages(Config, TransactionHandle, range->FirstRevisionId, range->LastRevisionId, revisionEntries, pathTable, MessageHandler);
+        EnpDestroyMergeRevisionEntries(revisionEntries, pathTable);
+
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    RtlSetCurrentTransaction(TransactionHandle);
+
+    // Replace the diff directories in each range with a single diff directory.
+
+    status = EnpUpdateDatabaseAfterSquash(Database, Ranges, NumberOfRanges, MessageHandler);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    // The merged packages were created using the trim settings.
+
+    for (i = 0; i < NumberOfRanges; i++)
+    {
+        if (Ranges[i].FirstRevisionId != Ranges[i].LastRevisionId)
+            EnpSetRevisionRecompressed(Database, Ranges[i].LastRevisionId, FALSE);
+    }
+
+    // Close the gaps left by the squashed revisions.
+
+    status = EnpRenumberRevisions(Config, Database, Ranges, NumberOfRanges, MessageHandler);
+
+    return status;
+}
+
+NTSTATUS EnpUpdateDatabaseAfterSquash(
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    ULONGLONG workRevisionId;
+    PDBF_FILE headDirectory;
+    PH_STRINGREF headDirectoryName;
+    PDBF_FILE workDirectory;
+    PDBF_FILE snapshotDirectory;
+    PDBF_FILE diffDirectory;
+    PDBF_FILE oldDiffDirectory;
+    WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    DB_FILE_RENAME_INFORMATION renameInfo;
+    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+    ULONG i;
+    PEN_REVISION_RANGE range;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+    workDirectory = NULL;
+    snapshotDirectory = NULL;
+    diffDirectory = NULL;
+
+    // Copy HEAD to a work directory. As in a revert, the work directory is moved back through the
+    // revisions by merging the existing diff directories.
+
+    PhInitializeStringRef(&headDirectoryName, L"head");
+    status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD directory"));
+        return status;
+    }
+
+    status = EnpCreateTemporaryDirectory(Database, L"squashWork", &workDirectory);
+
+    if (NT_SUCCESS(status))
+    {
+        status = DbUtCopyDirectoryContents(Database, headDirectory, workDirectory);
+
+        if (status == STATUS_SOME_NOT_MAPPED)
+            status = STATUS_UNSUCCESSFUL;
+    }
+
+    DbCloseFile(Database, headDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to copy HEAD"));
+        goto CleanupExit;
+    }
+
+    workRevisionId = lastRevisionId;
+
+    // Process the ranges from newest to oldest so that the diff directories below the current range
+    // have not been modified yet.
+
+    for (i = NumberOfRanges; i != 0; i--)
+    {
+        range = &Ranges[i - 1];
+
+        if (range->FirstRevisionId == range->LastRevisionId)
+            continue;
+
+        if (range->FirstRevisionId == firstRevisionId)
+        {
+            // There are no revisions before this range, so the diff directories can simply be deleted.
+            EnpDeleteDiffDirectories(Database, range->FirstRevisionId, range->LastRevisionId, MessageHandler);
+            continue;
+        }
+
+        // Take a snapshot of the last revision in the range.
+
+        status = EnpMergeDiffsToDirectory(Database, workDirectory, workRevisionId, range->LastRevisionId, MessageHandler);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+
+        status = EnpCreateTemporaryDirectory(Database, L"squashSnapshot", &snapshotDirectory);
+
+        if (NT_SUCCESS(status))
+        {
+            status = DbUtCopyDirectoryContents(Database, workDirectory, snapshotDirectory);
+
+            if (status == STATUS_SOME_NOT_MAPPED)
+                status = STATUS_UNSUCCESSFUL;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create snapshot of revision %I64u", range->LastRevisionId));
+            goto CleanupExit;
+        }
+
+        // Move the work directory to the revision before the range and compare.
+
+        status = EnpMergeDiffsToDirectory(Database, workDirectory, range->LastRevisionId, range->FirstRevisionId - 1, MessageHandler);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+
+        workRevisionId = range->FirstRevisionId - 1;
+
+        status = EnpCreateTemporaryDirectory(Database, L"squashDiff", &diffDirectory);
+
+        if (NT_SUCCESS(status))
+            status = EnpDiffSquashedDirectory(Database, snapshotDirectory, workDirectory, diffDirectory, NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create diff for revisions %I64u to %I64u", range->FirstRevisionId, range->LastRevisionId));
+            goto CleanupExit;
+        }
+
+        EnpDeleteTemporaryDirectory(Database, snapshotDirectory);
+        snapshotDirectory = NULL;
+
+        // Replace the old diff directories with the new one, keeping the time stamp of the revision before the range.
+
+        EnpFormatRevisionId(workRevisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &oldDiffDirectory);
+
+        if (NT_SUCCESS(status))
+        {
+            status = DbQueryInformationFile(Database, oldDiffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+            DbCloseFile(Database, oldDiffDirectory);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
+            goto CleanupExit;
+        }
+
+        EnpDeleteDiffDirectories(Database, workRevisionId, range->LastRevisionId, MessageHandler);
+
+        renameInfo.RootDirectory = NULL;
+        renameInfo.FileName = diffDirectoryName;
+        status = DbSetInformationFile(Database, diffDirectory, DbFileRenameInformation, &renameInfo, sizeof(DB_FILE_RENAME_INFORMATION));
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename diff to %s; the database is in an unknown state", diffDirectoryNameBuffer));
+            goto CleanupExit;
+        }
+
+        revisionIdInfo.RevisionId = workRevisionId;
+        DbSetInformationFile(Database, diffDirectory, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
+        DbUtTouchFile(Database, diffDirectory, &basicInfo.TimeStamp);
+        DbCloseFile(Database, diffDirectory);
+        diffDirectory = NULL;
+    }
+
+CleanupExit:
+    if (diffDirectory)
+        EnpDeleteTemporaryDirectory(Database, diffDirectory);
+    if (snapshotDirectory)
+        EnpDeleteTemporaryDirectory(Database, snapshotDirectory);
+    if (workDirectory)
+        EnpDeleteTemporaryDirectory(Database, workDirectory);
+
+    return status;
+}
+
+NTSTATUS EnpMergeDiffsToDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONGLONG TargetRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG revisionId;
+    PDBF_FILE diffDirectory;
+    WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+
+    for (revisionId = RevisionId - 1; revisionId >= TargetRevisionId && revisionId < RevisionId; revisionId--)
+    {
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+
+        if (NT_SUCCESS(status))
+        {
+            status = EnpMergeDirectoryToHead(Database, Directory, diffDirectory, MessageHandler);
+            DbCloseFile(Database, diffDirectory);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge %s", diffDirectoryNameBuffer));
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS EnpDiffSquashedDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE NewerDirectory,
+    _In_ PDBF_FILE OlderDirectory,
+    _In_ PDBF_FILE DiffDirectory,
+    _In_opt_ PPH_STRING DirectoryName
+    )
+{
+    NTSTATUS status;
+    PDB_FILE_DIRECTORY_INFORMATION newerEntries;
+    ULONG numberOfNewerEntries;
+    PDB_FILE_DIRECTORY_INFORMATION olderEntries;
+    ULONG numberOfOlderEntries;
+    PPH_HASHTABLE newerHashtable;
+    PDB_FILE_DIRECTORY_INFORMATION entry;
+    PDB_FILE_DIRECTORY_INFORMATION newerEntry;
+    PDB_FILE_DIRECTORY_INFORMATION *entryPtr;
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    ULONG i;
+    PPH_STRING fileName;
+    PDBF_FILE newerFile;
+    PDBF_FILE olderFile;
+    PDBF_FILE file;
+    BOOLEAN copyFromOlder;
+
+    status = DbQueryDirectoryFile(Database, NewerDirectory, &newerEntries, &numberOfNewerEntries);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = DbQueryDirectoryFile(Database, OlderDirectory, &olderEntries, &numberOfOlderEntries);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbFreeQueryDirectoryFile(newerEntries, numberOfNewerEntries);
+        return status;
+    }
+
+    newerHashtable = PhCreateHashtable(
+        sizeof(PDB_FILE_DIRECTORY_INFORMATION),
+        EnpDirectoryEntryCompareFunction,
+        EnpDirectoryEntryHashFunction,
+        numberOfNewerEntries
+        );
+
+    for (i = 0; i < numberOfNewerEntries; i++)
+    {
+        entry = &newerEntries[i];
+        PhAddEntryHashtable(newerHashtable, &entry);
+    }
+
+    // The diff records the state of the older directory wherever it differs from the newer directory.
+    // The resulting diff directory has the same format as one created by a backup.
+
+    for (i = 0; i < numberOfOlderEntries; i++)
+    {
+        entry = &olderEntries[i];
+        copyFromOlder = FALSE;
+
+        if (DirectoryName)
+        {
+            fileName = EnpAppendComponentToPath(&DirectoryName->sr, &entry->FileName->sr);
+        }
+        else
+        {
+            fileName = entry->FileName;
+            PhReferenceObject(fileName);
+        }
+
+        newerEntry = EnpFindDirectoryEntry(newerHashtable, &entry->FileName->sr);
+
+        if (newerEntry)
+        {
+            // Remove the entry so that only files added in the range remain.
+            PhRemoveEntryHashtable(newerHashtable, &newerEntry);
+
+            if ((entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) && (newerEntry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+            {
+                // Both are directories. Scan the directory.
+
+                status = DbCreateFile(Database, &entry->FileName->sr, NewerDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &newerFile);
+
+                if (NT_SUCCESS(status))
+                {
+                    status = DbCreateFile(Database, &entry->FileName->sr, OlderDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &olderFile);
+
+                    if (NT_SUCCESS(status))
+                    {
+                        status = EnpDiffSquashedDirectory(Database, newerFile, olderFile, DiffDirectory, fileName);
+                        DbCloseFile(Database, olderFile);
+                    }
+
+                    DbCloseFile(Database, newerFile);
+                }
+            }
+            else if (entry->Attributes != newerEntry->Attributes ||
+                entry->RevisionId != newerEntry->RevisionId ||
+                entry->EndOfFile.QuadPart != newerEntry->EndOfFile.QuadPart ||
+                entry->LastBackupTime.QuadPart != newerEntry->LastBackupTime.QuadPart)
+            {
+                // The file was modified or switched in the range.
+                copyFromOlder = TRUE;
+            }
+        }
+        else
+        {
+            // The file was deleted in the range.
+            copyFromOlder = TRUE;
+        }
+
+        if (copyFromOlder)
+        {
+            status = DbCreateFile(Database, &entry->FileName->sr, OlderDirectory, 0, DB_FILE_OPEN, 0, NULL, &olderFile);
+
+            if (NT_SUCCESS(status))
+            {
+                DbUtCreateParentDirectories(Database, DiffDirectory, &fileName->sr);
+                status = DbUtCopyFile(Database, olderFile, DiffDirectory, &fileName->sr, &file);
+
+                if (NT_SUCCESS(status))
+                {
+                    if (entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                    {
+                        status = DbUtCopyDirectoryContents(Database, olderFile, file);
+
+                        if (status == STATUS_SOME_NOT_MAPPED)
+                            status = STATUS_UNSUCCESSFUL;
+                    }
+
+                    DbCloseFile(Database, file);
+                }
+
+                DbCloseFile(Database, olderFile);
+            }
+        }
+
+        PhDereferenceObject(fileName);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+    }
+
+    // Record a delete action for each file that was added in the range.
+
+    PhBeginEnumHashtable(newerHashtable, &enumContext);
+
+    while (entryPtr = PhNextEnumHashtable(&enumContext))
+    {
+        entry = *entryPtr;
+
+        if (DirectoryName)
+        {
+            fileName = EnpAppendComponentToPath(&DirectoryName->sr, &entry->FileName->sr);
+        }
+        else
+        {
+            fileName = entry->FileName;
+            PhReferenceObject(fileName);
+        }
+
+        DbUtCreateParentDirectories(Database, DiffDirectory, &fileName->sr);
+        status = DbCreateFile(
+            Database,
+            &fileName->sr,
+            DiffDirectory,
+            (entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) | DB_FILE_ATTRIBUTE_DELETE_TAG,
+            DB_FILE_CREATE,
+            0,
+            NULL,
+            &file
+            );
+        PhDereferenceObject(fileName);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+
+        DbCloseFile(Database, file);
+    }
+
+CleanupExit:
+    PhDereferenceObject(newerHashtable);
+    DbFreeQueryDirectoryFile(olderEntries, numberOfOlderEntries);
+    DbFreeQueryDirectoryFile(newerEntries, numberOfNewerEntries);
+
+    return status;
+}
+
+VOID EnpDeleteDiffDirectories(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG FirstRevisionId,
+    _In_ ULONGLONG LastRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG revisionId;
+    PDBF_FILE directory;
+    PH_STRINGREF directoryName;
+    WCHAR directoryNameBuffer[17];
+
+    for (revisionId = FirstRevisionId; revisionId < LastRevisionId; revisionId++)
+    {
+        EnpFormatRevisionId(revisionId, directoryNameBuffer);
+        directoryName.Buffer = directoryNameBuffer;
+        directoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+
+        if (NT_SUCCESS(status))
+        {
+            DbUtDeleteDirectoryContents(Database, directory);
+            status = DbDeleteFile(Database, directory);
+            DbCloseFile(Database, directory);
+        }
+
+        if (!NT_SUCCESS(status))
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s directory", directoryNameBuffer));
+    }
+}
+
+NTSTATUS EnpCreateTemporaryDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PWSTR Name,
+    _Out_ PDBF_FILE *Directory
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF directoryName;
+    ULONG createStatus;
+    PDBF_FILE directory;
+
+    PhInitializeStringRef(&directoryName, Name);
+    status = DbCreateFile(Database, &directoryName, NULL, DB_FILE_ATTRIBUTE_DIRECTORY, DB_FILE_OPEN_IF, DB_FILE_DIRECTORY_FILE, &createStatus, &directory);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    // Clean up after a previous failed operation.
+    if (createStatus == DB_FILE_OPENED)
+        DbUtDeleteDirectoryContents(Database, directory);
+
+    *Directory = directory;
+
+    return STATUS_SUCCESS;
+}
+
+VOID EnpDeleteTemporaryDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory
+    )
+{
+    DbUtDeleteDirectoryContents(Database, Directory);
+    DbDeleteFile(Database, Directory);
+    DbCloseFile(Database, Directory);
+}
+
+NTSTATUS EnpRenumberRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    ULONGLONG revisionId;
+    ULONGLONG newRevisionId;
+    PDBF_FILE directory;
+    PH_STRINGREF directoryName;
+    WCHAR directoryNameBuffer[17];
+    WCHAR newDirectoryNameBuffer[17];
+    DB_FILE_RENAME_INFORMATION renameInfo;
+    PPH_STRING packageFileName;
+    PPH_STRING newPackageFileName;
+    ULONG partId;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    // Update the revision IDs of all files, including HEAD and the diff directories themselves.
+
+    PhInitializeEmptyStringRef(&directoryName);
+    status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+
+    if (NT_SUCCESS(status))
+    {
+        status = EnpRemapDirectoryRevisionIds(Database, directory, Ranges, NumberOfRanges);
+        DbCloseFile(Database, directory);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to update revision IDs; the database is in an unknown state"));
+        return status;
+    }
+
+    // Rename the diff directories and packages. Revision IDs only ever decrease, so processing them
+    // in ascending order never overwrites a directory or package that hasn't been renamed yet.
+
+    for (revisionId = firstRevisionId; revisionId <= lastRevisionId; revisionId++)
+    {
+        newRevisionId = EnpMapSquashedRevisionId(revisionId, Ranges, NumberOfRanges);
+
+        if (newRevisionId == revisionId)
+            continue;
+
+        if (revisionId != lastRevisionId)
+        {
+            EnpFormatRevisionId(revisionId, directoryNameBuffer);
+            directoryName.Buffer = directoryNameBuffer;
+            directoryName.Length = 16 * sizeof(WCHAR);
+
+            // Diff directories inside a squashed range have already been deleted.
+            if (NT_SUCCESS(DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory)))
+            {
+                EnpFormatRevisionId(newRevisionId, newDirectoryNameBuffer);
+                renameInfo.RootDirectory = NULL;
+                renameInfo.FileName.Buffer = newDirectoryNameBuffer;
+                renameInfo.FileName.Length = 16 * sizeof(WCHAR);
+                status = DbSetInformationFile(Database, directory, DbFileRenameInformation, &renameInfo, sizeof(DB_FILE_RENAME_INFORMATION));
+                DbCloseFile(Database, directory);
+
+                if (!NT_SUCCESS(status))
+                {
+                    MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename %s directory; the database is in an unknown state", directoryNameBuffer));
+                    return status;
+                }
+            }
+        }
+
+        for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+        {
+            packageFileName = EnpFormatPackagePartName(Config, revisionId, partId);
+
+            if (RtlDoesFileExists_U(packageFileName->Buffer))
+            {
+                newPackageFileName = EnpFormatPackagePartName(Config, newRevisionId, partId);
+                status = EnpRenameFileWin32(NULL, packageFileName->Buffer, newPackageFileName->Buffer, FALSE);
+
+                if (!NT_SUCCESS(status))
+                    MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to rename %s", packageFileName->Buffer));
+
+                PhDereferenceObject(newPackageFileName);
+            }
+
+            PhDereferenceObject(packageFileName);
+
+            if (!NT_SUCCESS(status))
+                return status;
+        }
+    }
+
+    newRevisionId = EnpMapSquashedRevisionId(lastRevisionId, Ranges, NumberOfRanges);
+    DbSetRevisionIdsDatabase(Database, &newRevisionId, NULL);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS EnpRemapDirectoryRevisionIds(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges
+    )
+{
+    NTSTATUS status;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    ULONG i;
+    PDBF_FILE file;
+    DB_FILE_REVISION_ID_INFORMATION revisionIdInfo;
+
+    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        revisionIdInfo.RevisionId = EnpMapSquashedRevisionId(entries[i].RevisionId, Ranges, NumberOfRanges);
+
+        if (revisionIdInfo.RevisionId != entries[i].RevisionId || (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+        {
+            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+            if (!NT_SUCCESS(status))
+                break;
+
+            if (entries[i].RevisionId != 0 && revisionIdInfo.RevisionId != entries[i].RevisionId)
+                DbSetInformationFile(Database, file, DbFileRevisionIdInformation, &revisionIdInfo, sizeof(DB_FILE_REVISION_ID_INFORMATION));
+
+            if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                status = EnpRemapDirectoryRevisionIds(Database, file, Ranges, NumberOfRanges);
+
+            DbCloseFile(Database, file);
+
+            if (!NT_SUCCESS(status))
+                break;
+        }
+    }
+
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+
+    return status;
+}
+
+ULONGLONG EnpMapSquashedRevisionId(
+    _In_ ULONGLONG RevisionId,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges
+    )
+{
+    ULONGLONG shift;
+    ULONG i;
+
+    if (RevisionId == 0)
+        return 0;
+
+    // Every revision in a range becomes a single revision, and later revisions move down to fill the gap.
+
+    shift = 0;
+
+    for (i = 0; i < NumberOfRanges; i++)
+    {
+        if (RevisionId < Ranges[i].FirstRevisionId)
+            break;
+        if (RevisionId <= Ranges[i].LastRevisionId)
+            return Ranges[i].FirstRevisionId - shift;
+
+        shift += Ranges[i].LastRevisionId - Ranges[i].FirstRevisionId;
+    }
+
+    return RevisionId - shift;
+}
+
+NTSTATUS EnpRecompressRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_opt_ ULONGLONG LastRevisionId,
+    _In_opt_ PLARGE_INTEGER MaximumTimeStamp,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PULONG NumberOfPackages
+    )
+{
+    NTSTATUS status;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    ULONGLONG revisionId;
+    PDBF_FILE diffDirectory;
+    WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    ULONG numberOfPackages;
+    ULONG partId;
+    BOOLEAN recompressed;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    if (LastRevisionId != 0 && (LastRevisionId < firstRevisionId || LastRevisionId > lastRevisionId))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", LastRevisionId));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = STATUS_SUCCESS;
+    numberOfPackages = 0;
+
+    // Recompressing with strong settings takes a long time, so run with background CPU and I/O
+    // priority.
+    SetPriorityClass(NtCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+
+    // The last revision has no diff directory to record that it was recompressed, and it is also
+    // the revision most likely to be restored.
+
+    for (revisionId = firstRevisionId; revisionId < lastRevisionId; revisionId++)
+    {
+        if (LastRevisionId != 0 && revisionId > LastRevisionId)
+            break;
+
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+
+        if (!NT_SUCCESS(DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory)))
+        {
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
+            continue;
+        }
+
+        status = DbQueryInformationFile(Database, diffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+        DbCloseFile(Database, diffDirectory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to query information in %s", diffDirectoryNameBuffer));
+            status = STATUS_SUCCESS;
+            continue;
+        }
+
+        if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_RECOMPRESSED)
+            continue;
+        if (MaximumTimeStamp && basicInfo.TimeStamp.QuadPart > MaximumTimeStamp->QuadPart)
+            continue;
+
+        for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+        {
+            // Files in the store part are already compressed.
+            if (partId == EN_PACKAGE_PART_STORE)
+                continue;
+
+            status = EnpRecompressPackagePart(Config, revisionId, partId, MessageHandler, &recompressed);
+
+            if (!NT_SUCCESS(status))
+                break;
+
+            if (recompressed)
+                numberOfPackages++;
+        }
+
+        if (!NT_SUCCESS(status))
+            break;
+
+        EnpSetRevisionRecompressed(Database, revisionId, TRUE);
+    }
+
+    SetPriorityClass(NtCurrentProcess(), PROCESS_MODE_BACKGROUND_END);
+
+    *NumberOfPackages = numberOfPackages;
+
+    return status;
+}
+
+NTSTATUS EnpRecompressPackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PBOOLEAN Recompressed
+    )
+{
+    NTSTATUS status;
+    HRESULT result;
+    EN_MERGE_PACKAGE_ENTRY sourceEntry;
+    PPK_ACTION_LIST actionList;
+    PPH_STRING newPackageFileName;
+    PPH_FILE_STREAM fileStream;
+    PPK_FILE_STREAM pkNewPackageFileStream;
+    PK_COMPRESSION_SETTINGS settings;
+    EN_PACKAGE_CALLBACK_CONTEXT context;
+    FILE_NETWORK_OPEN_INFORMATION oldInformation;
+    FILE_NETWORK_OPEN_INFORMATION newInformation;
+    ULONG i;
+
+    *Recompressed = FALSE;
+    status = STATUS_SUCCESS;
+    actionList = NULL;
+    newPackageFileName = NULL;
+
+    memset(&sourceEntry, 0, sizeof(EN_MERGE_PACKAGE_ENTRY));
+    sourceEntry.RevisionId = RevisionId;
+    sourceEntry.FileName = EnpFormatPackagePartName(Config, RevisionId, PartId);
+    sourceEntry.Context.MessageHandler = MessageHandler;
+
+    if (!RtlDoesFileExists_U(sourceEntry.FileName->Buffer))
+        goto CleanupExit;
+
+    MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Recompressing %s", sourceEntry.FileName->Buffer));
+    EnpOpenMergePackageWorker(&sourceEntry);
+
+    if (!NT_SUCCESS(sourceEntry.Status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s", sourceEntry.FileName->Buffer));
+        status = sourceEntry.Status;
+        goto CleanupExit;
+    }
+
+    if (!SUCCEEDED(sourceEntry.Result))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to process package %s: 0x%x", sourceEntry.FileName->Buffer, sourceEntry.Result));
+        status = STATUS_UNSUCCESSFUL;
+        goto CleanupExit;
+    }
+
+    if (PkQueryCountActionList(sourceEntry.ActionList) == 0)
+        goto CleanupExit;
+
+    // Add every item as new data. Updating the package in place would copy the compressed data
+    // without recompressing it.
+
+    actionList = PkCreateActionList();
+
+    for (i = 0; i < sourceEntry.ActionList->NumberOfActions; i++)
+        PkAppendAddFromPackageToActionList(actionList, sourceEntry.Package, sourceEntry.ActionList->Actions[i].u.Update.Index, NULL);
+
+    // A temporary file left behind by an interrupted run is overwritten.
+
+    newPackageFileName = PhConcatStringRef2(&sourceEntry.FileName->sr, &EnpNewSuffixString);
+    status = PhCreateFileStream(
+        &fileStream,
+        newPackageFileName->Buffer,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+        0,
+        FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create %s", newPackageFileName->Buffer));
+        goto CleanupExit;
+    }
+
+    pkNewPackageFileStream = PkCreateFileStream(fileStream);
+    PhDereferenceObject(fileStream);
+
+    EnpInitializePartCompression(Config, &Config->ColdCompression, PartId, &settings);
+
+    if (Config->MergeBufferSize != 0)
+        settings.PipeBufferSize = Config->MergeBufferSize;
+    memset(&context, 0, sizeof(EN_PACKAGE_CALLBACK_CONTEXT));
+    context.Config = Config;
+    context.MessageHandler = MessageHandler;
+
+    result = PkCreatePackage(
+        pkNewPackageFileStream,
+        actionList,
+        &settings,
+        EnpMergePackageCallback,
+        &context
+        );
+
+    PkDereferenceFileStream(pkNewPackageFileStream);
+
+    // The old package must be closed before it can be replaced.
+
+    PkDestroyActionList(actionList);
+    actionList = NULL;
+    PkDereferencePackage(sourceEntry.Package);
+    sourceEntry.Package = NULL;
+
+    if (!SUCCEEDED(result))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to recompress %s: 0x%x", sourceEntry.FileName->Buffer, result));
+        PhDeleteFileWin32(newPackageFileName->Buffer);
+        status = STATUS_UNSUCCESSFUL;
+        goto CleanupExit;
+    }
+
+    // Keep the old package if the new one isn't any smaller.
+
+    if (NT_SUCCESS(EnpQueryFullAttributesFileWin32(sourceEntry.FileName->Buffer, &oldInformation)) &&
+        NT_SUCCESS(EnpQueryFullAttributesFileWin32(newPackageFileName->Buffer, &newInformation)) &&
+        newInformation.EndOfFile.QuadPart >= oldInformation.EndOfFile.QuadPart)
+    {
+        PhDeleteFileWin32(newPackageFileName->Buffer);
+        goto CleanupExit;
+    }
+
+    // The rename replaces the old package in one step, so the package is always either the old
+    // one or the new one.
+
+    status = EnpRenameFileWin32(NULL, newPackageFileName->Buffer, sourceEntry.FileName->Buffer, TRUE);
+
+    if (NT_SUCCESS(status))
+    {
+        *Recompressed = TRUE;
+    }
+    else
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to replace %s", sourceEntry.FileName->Buffer));
+        PhDeleteFileWin32(newPackageFileName->Buffer);
+    }
+
+CleanupExit:
+    if (actionList)
+        PkDestroyActionList(actionList);
+    if (newPackageFileName)
+        PhDereferenceObject(newPackageFileName);
+    if (sourceEntry.Package)
+        PkDereferencePackage(sourceEntry.Package);
+    if (sourceEntry.ActionList)
+        PkDestroyActionList(sourceEntry.ActionList);
+
+    PhDereferenceObject(sourceEntry.FileName);
+
+    return status;
+}
+
+VOID EnpSetRevisionRecompressed(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG RevisionId,
+    _In_ BOOLEAN Recompressed
+    )
+{
+    PDBF_FILE diffDirectory;
+    WCHAR diffDirectoryNameBuffer[17];
+    PH_STRINGREF diffDirectoryName;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+
+    EnpFormatRevisionId(RevisionId, diffDirectoryNameBuffer);
+    diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+    diffDirectoryName.Length = 16 * sizeof(WCHAR);
+
+    // The last revision has no diff directory.
+    if (!NT_SUCCESS(DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory)))
+        return;
+
+    if (NT_SUCCESS(DbQueryInformationFile(Database, diffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION))))
+    {
+        if (Recompressed)
+            basicInfo.Attributes |= DB_FILE_ATTRIBUTE_RECOMPRESSED;
+        else
+            basicInfo.Attributes &= ~DB_FILE_ATTRIBUTE_RECOMPRESSED;
+
+        DbSetInformationFile(Database, diffDirectory, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+    }
+
+    DbCloseFile(Database, diffDirectory);
+}
+
+NTSTATUS EnpRestoreFromRevision(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_ ULONG Flags,
+    _In_ PPH_STRINGREF FileName,
+    _In_opt_ ULONGLONG RevisionId,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_opt_ PPH_STRINGREF RestoreToName,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF fileName;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    ULONGLONG revisionId;
+    ULONGLONG revisionIdOnFile;
+    ULONG partMaskOnFile;
+    BOOLEAN restoreDirectoryFile;
+    PH_STRINGREF directoryName;
+    WCHAR directoryNameBuffer[17];
+    PDBF_FILE directory;
+    PDBF_FILE file;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    PPH_STRING newRestoreToDirectory;
+    HANDLE directoryHandle;
+    ULONG createStatus;
+
+    fileName = *FileName;
+
+    while (fileName.Length != 0 && fileName.Buffer[0] == '\\')
+    {
+        fileName.Buffer++;
+        fileName.Length -= sizeof(WCHAR);
+    }
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    if (RevisionId == 0)
+    {
+        RevisionId = lastRevisionId;
+    }
+    else
+    {
+        if (RevisionId < firstRevisionId || RevisionId > lastRevisionId)
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid revision ID '%I64u'", RevisionId));
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    revisionIdOnFile = 0;
+    partMaskOnFile = 1 << EN_PACKAGE_PART_MAIN;
+    restoreDirectoryFile = FALSE;
+
+    // Perform virtual merges for just the specified file.
+    for (revisionId = lastRevisionId; revisionId >= RevisionId; revisionId--)
+    {
+        if (revisionId == lastRevisionId)
+        {
+            PhInitializeStringRef(&directoryName, L"head");
+        }
+        else
+        {
+            EnpFormatRevisionId(revisionId, directoryNameBuffer);
+            directoryName.Buffer = directoryNameBuffer;
+            directoryName.Length = 16 * sizeof(WCHAR);
+        }
+
+        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &directory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
+            return status;
+        }
+
+        status = DbCreateFile(Database, &fileName, directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+        if (status == STATUS_OBJECT_PATH_NOT_FOUND || status == STATUS_OBJECT_NAME_NOT_FOUND)
+        {
+            // The file doesn't exist in this revision. Go to the next one.
+            DbCloseFile(Database, directory);
+            continue;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", fileName.Length / sizeof(WCHAR), fileName.Buffer));
+            DbCloseFile(Database, directory);
+            return status;
+        }
+
+        status = DbQueryInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+
+        if (NT_SUCCESS(status))
+        {
+            if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
+            {
+                revisionIdOnFile = 0;
+                restoreDirectoryFile = FALSE;
+            }
+            else
+            {
+                if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+                {
+                    revisionIdOnFile = 0;
+                    restoreDirectoryFile = TRUE;
+                }
+                else
+                {
+                    revisionIdOnFile = basicInfo.RevisionId;
+                    partMaskOnFile = DB_FILE_ATTRIBUTE_GET_PART_MASK(basicInfo.Attributes);
+                    restoreDirectoryFile = FALSE;
+                }
+            }
+        }
+        else
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to query %.*s", fileName.Length / sizeof(WCHAR), fileName.Buffer));
+        }
+
+        DbCloseFile(Database, file);
+        DbCloseFile(Database, directory);
+    }
+
+    if (restoreDirectoryFile)
+    {
+        if (RestoreToName)
+        {
+            newRestoreToDirectory = EnpAppendComponentToPath(RestoreToDirectory, RestoreToName);
+            status = PhCreateFileWin32Ex(
+                &directoryHandle,
+                newRestoreToDirectory->Buffer,
+                FILE_GENERIC_READ,
+                FILE_ATTRIBUTE_DIRECTORY,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                FILE_OPEN_IF,
+                FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                &createStatus
+                );
+
+            if (NT_SUCCESS(status))
+            {
+                NtClose(directoryHandle);
+            }
+
+            RestoreToDirectory = &newRestoreToDirectory->sr;
+        }
+        else
+        {
+            newRestoreToDirectory = NULL;
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            if (RevisionId == lastRevisionId)
+                status = EnpRestoreDirectoryFromHead(Config, Database, Flags, &fileName, RestoreToDirectory, MessageHandler);
+            else
+                status = EnpRestoreDirectoryFromRevision(Config, Flags, &fileName, RevisionId, RestoreToDirectory, MessageHandler);
+        }
+
+        if (newRestoreToDirectory)
+            PhDereferenceObject(newRestoreToDirectory);
+    }
+    else if (revisionIdOnFile != 0)
+    {
+        status = EnpRestoreSingleFileFromRevision(Config, Database, Flags, &fileName, revisionIdOnFile, partMaskOnFile, RestoreToDirectory, RestoreToName, MessageHandler);
+    }
+    else
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"The file does not exist in revision %I64u", RevisionId));
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    return status;
+}
+
+NTSTATUS EnpRestoreSingleFileFromRevision(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_ ULONG Flags,
+    _In_ PPH_STRINGREF FileName,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartMask,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_opt_ PPH_STRINGREF RestoreToName,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF path;
+    PH_STRINGREF name;
+    PPH_STRING fileName;
+    PPH_HASHTABLE fileNames;
+
+    if (!RestoreToName)
+    {
+        if (!PhSplitStringRefAtLastChar(FileName, '\\', &path, &name))
+            name = *FileName;
+
+        RestoreToName = &name;
+    }
+
+    fileNames = EnpCreateFileNameHashtable();
+
+    fileName = PhCreateStringEx(FileName->Buffer, FileName->Length);
+    EnpAddToFileNameHashtable(fileNames, fileName);
+    PhDereferenceObject(fileName);
+
+    status = EnpExtractFromPackage(Config, Flags, RevisionId, PartMask, NULL, fileNames, RestoreToDirectory, RestoreToName, MessageHandler);
+
+    EnpDestroyFileNameHashtable(fileNames);
+
+    return status;
+}
+
+NTSTATUS EnpRestoreDirectoryFromHead(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_ ULONG Flags,
+    _In_ PPH_STRINGREF FileName,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PDBF_FILE headDirectory;
+    PH_STRINGREF headDirectoryName;
+    PDBF_FILE file;
+    PPH_STRING fileName;
+    PPH_HASHTABLE revisionEntries;
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PEN_REVISION_ENTRY revisionEntry;
+    PH_HASHTABLE_ENUM_CONTEXT directoryEnumContext;
+    PPH_STRING *directoryNamePtr;
+    PPH_STRING directoryName;
+    PH_STRINGREF relativeName;
+    PPH_STRING newDirectoryName;
+
+    PhInitializeStringRef(&headDirectoryName, L"head");
+    status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD"));
+        return status;
+    }
+
+    status = DbCreateFile(Database, FileName, headDirectory, 0, DB_FILE_OPEN, 0, NULL, &file);
+    DbCloseFile(Database, headDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %.*s", FileName->Length / sizeof(WCHAR), FileName->Buffer));
+        return status;
+    }
+
+    fileName = PhCreateStringEx(FileName->Buffer, FileName->Length);
+
+    revisionEntries = PhCreateHashtable(
+        sizeof(EN_REVISION_ENTRY),
+        EnpRevisionEntryCompareFunction,
+        EnpRevisionEntryHashFunction,
+        10
+        );
+
+    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Creating file list"));
+    status = EnpAddRestoreFileNamesFromDirectory(Database, revisionEntries, file, fileName);
+    DbCloseFile(Database, file);
+    PhDereferenceObject(fileName);
+
+    // Create all directories.
+
+    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Creating directories"));
+    PhBeginEnumHashtable(revisionEntries, &enumContext);
+
+    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    {
+        PhBeginEnumHashtable(revisionEntry->DirectoryNames, &directoryEnumContext);
+
+        while (directoryNamePtr = PhNextEnumHashtable(&directoryEnumContext))
+        {
+            directoryName = *directoryNamePtr;
+
+            if (!PhStartsWithStringRef(&directoryName->sr, FileName, TRUE))
+            {
+                MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Wrong prefix: %s", directoryName->Buffer));
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            relativeName.Buffer = (PWSTR)((PCHAR)directoryName->Buffer + FileName->Length);
+            relativeName.Length = directoryName->Length - FileName->Length;
+            newDirectoryName = EnpAppendComponentToPath(RestoreToDirectory, &relativeName);
+
+            SHCreateDirectory(NULL, newDirectoryName->Buffer);
+            PhDereferenceObject(newDirectoryName);
+        }
+
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    // Extract the files.
+
+    PhBeginEnumHashtable(revisionEntries, &enumContext);
+
+    while (revisionEntry = PhNextEnumHashtable(&enumContext))
+    {
+        if (NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Processing revision %I64u", revisionEntry->RevisionId));
+            status = EnpExtractFromPackage(Config, Flags, revisionEntry->RevisionId, revisionEntry->PartMask, FileName, revisionEntry->FileNames, RestoreToDirectory, NULL, MessageHandler);
+        }
+
+        EnpDestroyFileNameHashtable(revisionEntry->FileNames);
+        EnpDestroyFileNameHashtable(revisionEntry->DirectoryNames);
+    }
+
+    PhDereferenceObject(revisionEntries);
+
+    return status;
+}
+
+NTSTATUS EnpAddRestoreFileNamesFromDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PDBF_FILE Directory,
+    _In_ PPH_STRING DirectoryName
+    )
+{
+    NTSTATUS status;
+    PDB_FILE_DIRECTORY_INFORMATION entries;
+    ULONG numberOfEntries;
+    ULONG i;
+    PPH_STRING fileName;
+    PDBF_FILE file;
+    PEN_REVISION_ENTRY revisionEntry;
+    EN_REVISION_ENTRY localRevisionEntry;
+    BOOLEAN added;
+
+    // This function is similar to EnpAddMergeFileNamesFromDirectory, except that directories are added to a separate hashtable.
+
+    status = DbQueryDirectoryFile(Database, Directory, &entries, &numberOfEntries);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    for (i = 0; i < numberOfEntries; i++)
+    {
+        fileName = EnpAppendComponentToPath(&DirectoryName->sr, &entries[i].FileName->sr);
+
+        localRevisionEntry.RevisionId = entries[i].RevisionId;
+        localRevisionEntry.FileNames = NULL;
+        localRevisionEntry.DirectoryNames = NULL;
+        localRevisionEntry.PartMask = 0;
+        revisionEntry = PhAddEntryHashtableEx(RevisionEntries, &localRevisionEntry, &added);
+
+        if (added)
+        {
+            revisionEntry->FileNames = EnpCreateFileNameHashtable();
+            revisionEntry->DirectoryNames = EnpCreateFileNameHashtable();
+        }
+
+        if (entries[i].Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+        {
+            EnpAddToFileNameHashtable(revisionEntry->DirectoryNames, fileName);
+
+            status = DbCreateFile(Database, &entries[i].FileName->sr, Directory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &file);
+
+            if (NT_SUCCESS(status))
+            {
+                status = EnpAddRestoreFileNamesFromDirectory(Database, RevisionEntries, file, fileName);
+            }
+
+            if (!NT_SUCCESS(status))
+            {
+                DbCloseFile(Database, file);
+                PhDereferenceObject(fileName);
+                break;
+            }
+
+            DbCloseFile(Database, file);
+        }
+        else
+        {
+            EnpAddToFileNameHashtable(revisionEntry->FileNames, fileName);
+            revisionEntry->PartMask |= DB_FILE_ATTRIBUTE_GET_PART_MASK(entries[i].Attributes);
+        }
+
+        PhDereferenceObject(fileName);
+    }
+
+    DbFreeQueryDirectoryFile(entries, numberOfEntries);
+
+    return status;
+}
+
+NTSTATUS EnpRestoreDirectoryFromRevision(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONG Flags,
+    _In_ PPH_STRINGREF FileName,
+    _In_ ULONGLONG RevisionId,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF databaseName;
+    PPH_STRING databaseFileName;
+    PPH_STRING tempDatabaseFileName;
+    PDB_DATABASE tempDatabase;
+    PDBF_FILE headDirectory;
+    PDBF_FILE file;
+
+    PhInitializeStringRef(&databaseName, L"\\" EN_DATABASE_NAME);
+    databaseFileName = PhConcatStringRef2(&Config->DestinationDirectory->sr, &databaseName);
+    tempDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
+
+    status = EnpCopyFileWin32(databaseFileName->Buffer, tempDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        PhDereferenceObject(tempDatabaseFileName);
+        PhDereferenceObject(databaseFileName);
+        return status;
+    }
+
+    status = DbOpenDatabase(&tempDatabase, tempDatabaseFileName->Buffer, FALSE, 0);
+
+    if (NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_PROGRESS, PhFormatString(L"Merging until revision %I64u", RevisionId));
+        status = EnpMergeToHeadUntilRevision(tempDatabase, RevisionId, MessageHandler, &headDirectory);
+
+        if (NT_SUCCESS(status))
+        {
+            status = DbCreateFile(tempDatabase, FileName, headDirectory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+            if (NT_SUCCESS(status))
+            {
+                status = EnpRestoreDirectoryFromHead(Config, tempDatabase, Flags, FileName, RestoreToDirectory, MessageHandler);
+                DbCloseFile(tempDatabase, file);
+            }
+            else
+            {
+                MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"The file does not exist in the specified revision."));
+            }
+
+            DbCloseFile(tempDatabase, headDirectory);
+        }
+
+        DbCloseDatabase(tempDatabase);
+    }
+
+    PhDeleteFileWin32(tempDatabaseFileName->Buffer);
+    PhDereferenceObject(tempDatabaseFileName);
+    PhDereferenceObject(databaseFileName);
+
+    return status;
+}
+
+NTSTATUS EnpMergeToHeadUntilRevision(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG TargetRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_opt_ PDBF_FILE *HeadDirectory
+    )
+{
+    NTSTATUS status;
+    ULONGLONG revisionId;
+    PDBF_FILE headDirectory;
+    PH_STRINGREF headDirectoryName;
+    PDBF_FILE diffDirectory;
+    PH_STRINGREF diffDirectoryName;
+    WCHAR diffDirectoryNameBuffer[17];
+
+    PhInitializeStringRef(&headDirectoryName, L"head");
+    status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &headDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to open HEAD directory"));
+        return status;
+    }
+
+    DbQueryRevisionIdsDatabase(Database, &revisionId, NULL);
+    revisionId--;
+
+    while (revisionId >= TargetRevisionId)
+    {
+        // Open the diff directory.
+
+        EnpFormatRevisionId(revisionId, diffDirectoryNameBuffer);
+        diffDirectoryName.Buffer = diffDirectoryNameBuffer;
+        diffDirectoryName.Length = 16 * sizeof(WCHAR);
+        status = DbCreateFile(Database, &diffDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &diffDirectory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s directory", diffDirectoryNameBuffer));
+            break;
+        }
+
+        // Perform the merge.
+        status = EnpMergeDirectoryToHead(Database, headDirectory, diffDirectory, MessageHandler);
+
+        DbCloseFile(Database, diffDirectory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to merge revision %I64u with HEAD", revisionId));
+            break;
+        }
+
+        revisionId--;
+    }
+
+    if (HeadDirectory)
+        *HeadDirectory = headDirectory;
+    else
+        DbCloseFile(Database, headDirectory);
+
+    return status;
+}
+
+NTSTATUS EnpExtractFromPackage(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONG Flags,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartMask,
+    _In_opt_ PPH_STRINGREF BaseFileName,
+    _In_ PPH_HASHTABLE FileNames,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_opt_ PPH_STRINGREF RestoreToName,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PPH_STRING packageFileName;
+    PPH_HASHTABLE chunkedFiles;
+    ULONG partId;
+
+    status = STATUS_SUCCESS;
+    chunkedFiles = PhCreateHashtable(
+        sizeof(EN_CHUNKED_FILE_ENTRY),
+        EnpFileNameCompareFunction,
+        EnpFileNameHashFunction,
+        16
+        );
+
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+    {
+        if (!(PartMask & (1 << partId)))
+            continue;
+
+        packageFileName = EnpFormatPackagePartName(Config, RevisionId, partId);
+        status = EnpExtractFromPackagePart(Config, Flags, packageFileName, BaseFileName, FileNames, chunkedFiles, RestoreToDirectory, RestoreToName, MessageHandler);
+        PhDereferenceObject(packageFileName);
+
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    EnpCompleteChunkedFiles(chunkedFiles, MessageHandler);
+    PhDereferenceObject(chunkedFiles);
+
+    return status;
+}
+
+NTSTATUS EnpExtractFromPackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONG Flags,
+    _In_ PPH_STRING PackageFileName,
+    _In_opt_ PPH_STRINGREF BaseFileName,
+    _In_ PPH_HASHTABLE FileNames,
+    _In_ PPH_HASHTABLE ChunkedFiles,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_opt_ PPH_STRINGREF RestoreToName,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    HRESULT result;
+    PPH_FILE_STREAM fileStream;
+    PPK_FILE_STREAM pkFileStream;
+    EN_PACKAGE_CALLBACK_CONTEXT context;
+    PPK_PACKAGE package;
+    PPK_ACTION_LIST actionList;
+
+    status = PhCreateFileStream(&fileStream, PackageFileName->Buffer, FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN, 0);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open %s", PackageFileName->Buffer));
+        return status;
+    }
+
+    pkFileStream = PkCreateFileStream(fileStream);
+    PhDereferenceObject(fileStream);
+
+    context.Config = Config;
+    context.MessageHandler = MessageHandler;
+    context.Restore.Flags = Flags;
+    context.Restore.RestoreToDirectory = RestoreToDirectory;
+    context.Restore.RestoreToName = RestoreToName;
+    context.Restore.BaseFileName = BaseFileName;
+    context.Restore.FileNames = FileNames;
+    context.Restore.ChunkedFiles = ChunkedFiles;
+
+    actionList = PkCreateActionList();
+
+    result = PkOpenPackageWithFilter(
+        pkFileStream,
+        actionList,
+        EnpRestorePackageCallback,
+        &context,
+        &package
+        );
+
+    if (SUCCEEDED(result))
+    {
+        result = PkExtractPackage(
+            package,
+            actionList,
+            EnpRestorePackageCallback,
+            &context
+            );
+        PkDereferencePackage(package);
+
+        if (!SUCCEEDED(result))
+            MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to extract from package %s", PackageFileName->Buffer));
+    }
+    else
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to open package %s", PackageFileName->Buffer));
+    }
+
+    PkDestroyActionList(actionList);
+
+    PkDereferenceFileStream(pkFileStream);
+
+    if (!SUCCEEDED(result))
+        status = STATUS_UNSUCCESSFUL;
+
+    return status;
+}
+
+HRESULT EnpRestorePackageCallback(
+    _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
+    _In_opt_ PPK_ACTION Action,
+    _In_ PVOID Parameter,
+    _In_opt_ PVOID Context
+    )
+{
+    NTSTATUS status;
+    PEN_PACKAGE_CALLBACK_CONTEXT context = Context;
+
+    switch (Message)
+    {
+    case PkFilterItemMessage:
+        {
+            PPK_PARAMETER_FILTER_ITEM filterItem = Parameter;
+            PH_STRINGREF path;
+            PPH_STRING fileName;
+
+            if (!EnpSplitChunkName(&filterItem->Path, &path, NULL))
+                path = filterItem->Path;
+
+            fileName = EnpFindInFileNameHashtable(context->Restore.FileNames, &path);
+
+            if (!fileName)
+            {
+                filterItem->Reject = TRUE;
+                return S_OK;
+            }
+
+            filterItem->NewContext = fileName;
+        }
+        break;
+    case PkGetStreamMessage:
+        {
+            PPK_PARAMETER_GET_STREAM getStream = Parameter;
+            PPH_STRING fileName;
+            PPH_STRING outFileName;
+            PH_STRINGREF relativeName;
+            PPH_FILE_STREAM outFileStream;
+            PPK_FILE_STREAM pkOutFileStream;
+            ULONG createDisposition;
+            BOOLEAN chunk;
+            ULONGLONG chunkOffset;
+            EN_CHUNKED_FILE_ENTRY localChunkedFile;
+            PEN_CHUNKED_FILE_ENTRY chunkedFile;
+            LARGE_INTEGER offset;
+
+            fileName = Action->Context;
+
+            if (context->Restore.BaseFileName)
+            {
+                if (!PhStartsWithStringRef(&fileName->sr, context->Restore.BaseFileName, TRUE))
+                {
+                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Wrong prefix: %s", fileName->Buffer));
+                    return E_FAIL;
+                }
+
+                relativeName.Buffer = (PWSTR)((PCHAR)fileName->Buffer + context->Restore.BaseFileName->Length);
+                relativeName.Length = fileName->Length - context->Restore.BaseFileName->Length;
+                outFileName = EnpAppendComponentToPath(context->Restore.RestoreToDirectory, &relativeName);
+            }
+            else
+            {
+                outFileName = EnpAppendComponentToPath(context->Restore.RestoreToDirectory, context->Restore.RestoreToName);
+            }
+
+            createDisposition = (context->Restore.Flags & EN_RESTORE_OVERWRITE_FILES) ? FILE_OVERWRITE_IF : FILE_CREATE;
+            chunk = EnpSplitChunkName(&getStream->Path, NULL, &chunkOffset);
+            chunkedFile = NULL;
+
+            if (chunk)
+            {
+                // Only the first chunk that is extracted creates the file.
+
+                localChunkedFile.FileName = outFileName;
+                chunkedFile = PhFindEntryHashtable(context->Restore.ChunkedFiles, &localChunkedFile);
+
+                if (chunkedFile)
+                    createDisposition = FILE_OPEN;
+            }
+
+            status = PhCreateFileStream(
+                &outFileStream,
+                outFileName->Buffer,
+                FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+                0,
+                createDisposition,
+                0
+                );
+
+            if (!NT_SUCCESS(status))
+            {
+                if (status == STATUS_OBJECT_NAME_COLLISION)
+                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"File already exists (try --force): %s", outFileName->Buffer));
+                else
+                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to create %s", outFileName->Buffer));
+
+                PhDereferenceObject(outFileName);
+                return E_FAIL;
+            }
+
+            if (chunk)
+            {
+                // Later chunks would change the times, so they are set after all chunks have been
+                // written. See EnpCompleteChunkedFiles.
+
+                if (!chunkedFile)
+                {
+                    localChunkedFile.FileName = outFileName;
+                    localChunkedFile.FileInformation = getStream->FileInformation;
+                    PhReferenceObject(outFileName);
+                    PhAddEntryHashtable(context->Restore.ChunkedFiles, &localChunkedFile);
+                }
+
+                offset.QuadPart = chunkOffset;
+
+                if (!NT_SUCCESS(status = PhSeekFileStream(outFileStream, &offset, SeekStart)))
+                {
+                    context->MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Unable to write to %s: 0x%x", outFileName->Buffer, status));
+                    PhDereferenceObject(outFileStream);
+                    PhDereferenceObject(outFileName);
+                    return E_FAIL;
+                }
+            }
+            else
+            {
+                if (!NT_SUCCESS(EnpSetRestoredFileInformation(outFileStream->FileHandle, &getStream->FileInformation)))
+                    context->MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to set attributes on %s", outFileName->Buffer));
+            }
+
+            pkOutFileStream = PkCreateFileStream(outFileStream);
+            PhDereferenceObject(outFileStream);
+
+            getStream->FileStream = pkOutFileStream;
+
+            PhDereferenceObject(outFileName);
+        }
+        break;
+    case PkProgressMessage:
+        {
+            PPK_PARAMETER_PROGRESS progress = Parameter;
+            PH_FORMAT format[3];
+
+            if (progress->ProgressTotal != 0)
+            {
+                PhInitFormatS(&format[0], L"Extracting: ");
+                PhInitFormatF(&format[1], (DOUBLE)progress->ProgressValue * 100 / progress->ProgressTotal, 2);
+                format[1].Type |= FormatRightAlign;
+                format[1].Width = 5;
+                PhInitFormatC(&format[2], '%');
+
+                context->MessageHandler(EN_MESSAGE_PROGRESS, PhFormat(format, 3, 0));
+            }
+        }
+        break;
+    }
+
+    return S_OK;
+}
+
+VOID EnpCompleteChunkedFiles(
+    _In_ PPH_HASHTABLE ChunkedFiles,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PEN_CHUNKED_FILE_ENTRY chunkedFile;
+    HANDLE fileHandle;
+
+    PhBeginEnumHashtable(ChunkedFiles, &enumContext);
+
+    while (chunkedFile = PhNextEnumHashtable(&enumContext))
+    {
+        status = PhCreateFileWin32(
+            &fileHandle,
+            chunkedFile->FileName->Buffer,
+            FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES | SYNCHRONIZE,
+            0,
+            FILE_SHARE_READ,
+            FILE_OPEN,
+            FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+            );
+
+        if (NT_SUCCESS(status))
+        {
+            status = EnpSetRestoredFileInformation(fileHandle, &chunkedFile->FileInformation);
+            NtClose(fileHandle);
+        }
+
+        if (!NT_SUCCESS(status))
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to set attributes on %s", chunkedFile->FileName->Buffer));
+
+        PhDereferenceObject(chunkedFile->FileName);
+    }
+
+    PhClearHashtable(ChunkedFiles);
+}
+
+NTSTATUS EnpSetRestoredFileInformation(
+    _In_ HANDLE FileHandle,
+    _In_ PFILE_NETWORK_OPEN_INFORMATION FileInformation
+    )
+{
+    NTSTATUS status;
+    FILE_BASIC_INFORMATION basicInfo;
+    IO_STATUS_BLOCK iosb;
+
+    if (NT_SUCCESS(status = NtQueryInformationFile(FileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation)))
+    {
+        if (FileInformation->CreationTime.QuadPart != 0)
+            basicInfo.CreationTime = FileInformation->CreationTime;
+
+        if (FileInformation->LastAccessTime.QuadPart != 0)
+            basicInfo.LastAccessTime = FileInformation->LastAccessTime;
+
+        if (FileInformation->LastWriteTime.QuadPart != 0)
+            basicInfo.LastWriteTime = FileInformation->LastWriteTime;
+
+        if (FileInformation->ChangeTime.QuadPart != 0)
+            basicInfo.ChangeTime = FileInformation->ChangeTime;
+
+        basicInfo.FileAttributes = FileInformation->FileAttributes & ~FILE_ATTRIBUTE_NORMAL;
+
+        status = NtSetInformationFile(FileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation);
+    }
+
+    return status;
+}
+
+NTSTATUS EnpQueryFileRevisions(
+    _In_ PDB_DATABASE Database,
+    _In_ PPH_STRINGREF FileName,
+    _In_ ULONGLONG FirstRevisionId,
+    _In_ ULONGLONG LastRevisionId,
+    _Out_ PEN_FILE_REVISION_INFORMATION *Entries,
+    _Out_ PULONG NumberOfEntries,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PEN_FILE_REVISION_INFORMATION entries;
+    ULONG allocatedEntries;
+    ULONG numberOfEntries;
+    ULONGLONG revisionId;
+    PDBF_FILE directory;
+    PH_STRINGREF directoryName;
+    WCHAR directoryNameBuffer[17];
+    PDBF_FILE file;
+    DB_FILE_BASIC_INFORMATION basicInfo;
+    DB_FILE_DATA_INFORMATION dataInfo;
+    PEN_FILE_REVISION_INFORMATION entry;
+
+    allocatedEntries = 16;
+    entries = PhAllocate(allocatedEntries * sizeof(EN_FILE_REVISION_INFORMATION));
+    numberOfEntries = 0;
+
+    for (revisionId = LastRevisionId; revisionId >= FirstRevisionId; revisionId--)
+    {
+        if (revisionId == LastRevisionId)
+        {
+            PhInitializeStringRef(&directoryName, L"head");
+        }
+        else
+        {
+            EnpFormatRevisionId(revisionId, directoryNameBuffer);
+            directoryName.Buffer = directoryNameBuffer;
+            directoryName.Length = 16 * sizeof(WCHAR);
+        }
+
+        status = DbCreateFile(Database, &directoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_ATTRIBUTE_DIRECTORY, NULL, &directory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
+            continue;
+        }
+
+        status = DbCreateFile(Database, FileName, directory, 0, DB_FILE_OPEN, 0, NULL, &file);
+
+        if (NT_SUCCESS(status))
+        {
+            status = DbQueryInformationFile(Database, file, DbFileBasicInformation, &basicInfo, sizeof(DB_FILE_BASIC_INFORMATION));
+
+            if (NT_SUCCESS(status))
+            {
+                if (basicInfo.Attributes & DB_FILE_ATTRIBUTE_DELETE_TAG)
+                {
+                    DbCloseFile(Database, file);
+                    DbCloseFile(Database, directory);
+                    continue;
+                }
+
+                if (!(basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+                    status = DbQueryInformationFile(Database, file, DbFileDataInformation, &dataInfo, sizeof(DB_FILE_DATA_INFORMATION));
+                else
+                    memset(&dataInfo, 0, sizeof(DB_FILE_DATA_INFORMATION));
+            }
+
+            if (NT_SUCCESS(status))
+            {
+                if (numberOfEntries == allocatedEntries)
+                {
+                    allocatedEntries *= 2;
+                    entries = PhReAllocate(entries, allocatedEntries * sizeof(EN_FILE_REVISION_INFORMATION));
+                }
+
+                entry = &entries[numberOfEntries++];
+                entry->Attributes = basicInfo.Attributes;
+                entry->RevisionId = revisionId;
+                entry->TimeStamp = basicInfo.TimeStamp;
+                entry->EndOfFile = dataInfo.EndOfFile;
+                entry->LastBackupTime = dataInfo.LastBackupTime;
+
+                if (!(basicInfo.Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+                    entry->RevisionId = basicInfo.RevisionId;
+            }
+            else
+            {
+                MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to query information in %.*s", directoryName.Length / sizeof(WCHAR), directoryName.Buffer));
+            }
+
+            DbCloseFile(Database, file);
+        }
+
+        DbCloseFile(Database, directory);
+    }
+
+    *Entries = entries;
+    *NumberOfEntries = numberOfEntries;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS EnpCompareRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG BaseRevisionId,
+    _In_opt_ ULONGLONG TargetRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONGLONG lastRevisionId;
+    ULONGLONG firstRevisionId;
+    PH_STRINGREF databaseName;
+    PPH_STRING databaseFileName;
+    PPH_STRING tempBaseDatabaseFileName;
+    PPH_STRING tempTargetDatabaseFileName;
+    BOOLEAN tempBaseDatabaseCreated;
+    BOOLEAN tempTargetDatabaseCreated;
+    PDB_DATABASE tempBaseDatabase;
+    PDB_DATABASE tempTargetDatabase;
+    PDBF_FILE baseHeadDirectory;
+    PDBF_FILE targetHeadDirectory;
+    PH_STRINGREF headDirectoryName;
+    PPH_STRING emptyFileName;
+    ULONGLONG numberOfChanges;
+
+    DbQueryRevisionIdsDatabase(Database, &lastRevisionId, &firstRevisionId);
+
+    if (TargetRevisionId == 0)
+    {
+        TargetRevisionId = lastRevisionId;
+    }
+    else if (TargetRevisionId < firstRevisionId || TargetRevisionId > lastRevisionId)
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid base revision ID '%I64u'", BaseRevisionId));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (BaseRevisionId < firstRevisionId || BaseRevisionId > lastRevisionId)
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Invalid base revision ID '%I64u'", BaseRevisionId));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (BaseRevisionId >= TargetRevisionId)
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhFormatString(L"Base revision ID '%I64u' must be less than target revision ID '%I64u'", BaseRevisionId, TargetRevisionId));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PhInitializeStringRef(&databaseName, L"\\" EN_DATABASE_NAME);
+    databaseFileName = PhConcatStringRef2(&Config->DestinationDirectory->sr, &databaseName);
+    tempBaseDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
+    tempTargetDatabaseFileName = EnpFormatTempDatabaseFileName(Config, FALSE);
+    tempBaseDatabaseCreated = FALSE;
+    tempTargetDatabaseCreated = FALSE;
+    tempBaseDatabase = NULL;
+    tempTargetDatabase = NULL;
+    baseHeadDirectory = NULL;
+    targetHeadDirectory = NULL;
+
+    // Create a temporary "base" database and merge to the base revision ID.
+
+    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Processing base"));
+
+    status = EnpCopyFileWin32(databaseFileName->Buffer, tempBaseDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+
+    if (!NT_SUCCESS(status))
+        goto CleanupExit;
+
+    tempBaseDatabaseCreated = TRUE;
+    status = DbOpenDatabase(&tempBaseDatabase, tempBaseDatabaseFileName->Buffer, FALSE, 0);
+
+    if (!NT_SUCCESS(status))
+        goto CleanupExit;
+
+    status = EnpMergeToHeadUntilRevision(tempBaseDatabase, BaseRevisionId, MessageHandler, &baseHeadDirectory);
+
+    if (!NT_SUCCESS(status))
+    {
+        MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to merge base revisions"));
+        goto CleanupExit;
+    }
+
+    // If necessary, create a temporary "target" database and merge to the target revision ID.
+
+    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Processing target"));
+
+    if (TargetRevisionId == lastRevisionId)
+    {
+        PhInitializeStringRef(&headDirectoryName, L"head");
+        status = DbCreateFile(Database, &headDirectoryName, NULL, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &targetHeadDirectory);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+    }
+    else
+    {
+        status = EnpCopyFileWin32(databaseFileName->Buffer, tempTargetDatabaseFileName->Buffer, FILE_ATTRIBUTE_TEMPORARY, FALSE);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+
+        tempTargetDatabaseCreated = TRUE;
+        status = DbOpenDatabase(&tempTargetDatabase, tempTargetDatabaseFileName->Buffer, FALSE, 0);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+
+        status = EnpMergeToHeadUntilRevision(tempTargetDatabase, TargetRevisionId, MessageHandler, &targetHeadDirectory);
+
+        if (!NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_ERROR, PhCreateString(L"Unable to merge target revisions"));
+            goto CleanupExit;
+        }
+    }
+
+    emptyFileName = PhReferenceEmptyString();
+    numberOfChanges = 0;
+    status = EnpDiffDirectoryCompareRevisions(
+        tempBaseDatabase,
+        tempTargetDatabase ? tempTargetDatabase : Database,
+        baseHeadDirectory,
+        targetHeadDirectory,
+        emptyFileName,
+        &numberOfChanges,
+        MessageHandler
+        );
+    PhDereferenceObject(emptyFileName);
+
+    if (numberOfChanges != 0)
+        MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%I64u change(s)", numberOfChanges));
+
+CleanupExit:
+    if (baseHeadDirectory)
+        DbCloseFile(tempBaseDatabase, baseHeadDirectory);
+    if (targetHeadDirectory)
+        DbCloseFile(tempTargetDatabase ? tempTargetDatabase : Database, targetHeadDirectory);
+    if (tempBaseDatabase)
+        DbCloseDatabase(tempBaseDatabase);
+    if (tempTargetDatabase)
+        DbCloseDatabase(tempTargetDatabase);
+    if (tempBaseDatabaseCreated)
+        PhDeleteFileWin32(tempBaseDatabaseFileName->Buffer);
+    if (tempTargetDatabaseCreated)
+        PhDeleteFileWin32(tempTargetDatabaseFileName->Buffer);
+
+    PhDereferenceObject(tempBaseDatabaseFileName);
+    PhDereferenceObject(tempTargetDatabaseFileName);
+    PhDereferenceObject(databaseFileName);
+
+    return status;
+}
+
+NTSTATUS EnpDiffDirectoryCompareRevisions(
+    _In_opt_ PDB_DATABASE BaseDatabase,
+    _In_ PDB_DATABASE TargetDatabase,
+    _In_opt_ PDBF_FILE BaseDirectory,
+    _In_ PDBF_FILE TargetDirectory,
+    _In_ PPH_STRING FileName,
+    _Inout_ PULONGLONG NumberOfChanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    ULONG i;
+    PPH_STRING fileNamePrefix;
+    PDB_FILE_DIRECTORY_INFORMATION baseEntries;
+    ULONG numberOfBaseEntries;
+    PDB_FILE_DIRECTORY_INFORMATION targetEntries;
+    ULONG numberOfTargetEntries;
+    PPH_HASHTABLE baseHashtable;
+    PPH_HASHTABLE targetHashtable;
+    PDB_FILE_DIRECTORY_INFORMATION entry;
+    PDB_FILE_DIRECTORY_INFORMATION otherEntry;
+    BOOLEAN modified;
+    BOOLEAN switched;
+    PDBF_FILE baseDirectory;
+    PDBF_FILE targetDirectory;
+    PPH_STRING fullFileName;
+
+    if (FileName->Length != 0)
+        fileNamePrefix = PhConcatStringRef2(&FileName->sr, &EnpBackslashString);
+    else
+        fileNamePrefix = PhReferenceEmptyString();
+
+    baseEntries = NULL;
+    targetEntries = NULL;
+    baseHashtable = NULL;
+    targetHashtable = NULL;
+
+    if (BaseDirectory)
+    {
+        status = DbQueryDirectoryFile(BaseDatabase, BaseDirectory, &baseEntries, &numberOfBaseEntries);
+
+        if (!NT_SUCCESS(status))
+            goto CleanupExit;
+    }
+    else
+    {
+        baseEntries = NULL;
+        numberOfBaseEntries = 0;
+    }
+
+    status = DbQueryDirectoryFile(TargetDatabase, TargetDirectory, &targetEntries, &numberOfTargetEntries);
+
+    if (!NT_SUCCESS(status))
+        goto CleanupExit;
+
+    baseHashtable = PhCreateHashtable(
+        sizeof(PDB_FILE_DIRECTORY_INFORMATION),
+        EnpDirectoryEntryCompareFunction,
+        EnpDirectoryEntryHashFunction,
+        numberOfBaseEntries
+        );
+    entry = baseEntries;
+
+    for (i = 0; i < numberOfBaseEntries; i++)
+    {
+        PhAddEntryHashtable(baseHashtable, &entry);
+        entry++;
+    }
+
+    targetHashtable = PhCreateHashtable(
+        sizeof(PDB_FILE_DIRECTORY_INFORMATION),
+        EnpDirectoryEntryCompareFunction,
+        EnpDirectoryEntryHashFunction,
+        numberOfTargetEntries
+        );
+    entry = targetEntries;
+
+    for (i = 0; i < numberOfTargetEntries; i++)
+    {
+        PhAddEntryHashtable(targetHashtable, &entry);
+        entry++;
+    }
+
+    // Detect files/directories that have been deleted.
+
+    entry = baseEntries;
+
+    for (i = 0; i < numberOfBaseEntries; i++)
+    {
+        if (!EnpFindDirectoryEntry(targetHashtable, &entry->FileName->sr))
+        {
+            // Deleted file
+            (*NumberOfChanges)++;
+            MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"- %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
+        }
+
+        entry++;
+    }
+
+    // Detect files/directories that have been added or modified.
+
+    entry = targetEntries;
+
+    for (i = 0; i < numberOfTargetEntries; i++)
+    {
+        otherEntry = EnpFindDirectoryEntry(baseHashtable, &entry->FileName->sr);
+
+        if (otherEntry)
+        {
+            modified = FALSE;
+            switched = FALSE;
+
+            if ((entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY) != (otherEntry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+            {
+                modified = TRUE;
+                switched = TRUE;
+            }
+
+            if (!modified && !(entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+            {
+                if (entry->EndOfFile.QuadPart != otherEntry->EndOfFile.QuadPart)
+                    modified = TRUE;
+                if (entry->LastBackupTime.QuadPart != otherEntry->LastBackupTime.QuadPart)
+                    modified = TRUE;
+            }
+
+            if (modified)
+            {
+                // Modified file
+                // or switched file (file has become directory or directory has become file)
+                (*NumberOfChanges)++;
+                MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%c %s%s", switched ? 's' : 'm', fileNamePrefix->Buffer, entry->FileName->Buffer));
+            }
+        }
+        else
+        {
+            // Added file
+            (*NumberOfChanges)++;
+            MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"+ %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
+        }
+
+        if (entry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY)
+        {
+            baseDirectory = NULL;
+            targetDirectory = NULL;
+
+            if (otherEntry && (otherEntry->Attributes & DB_FILE_ATTRIBUTE_DIRECTORY))
+            {
+                status = DbCreateFile(BaseDatabase, &otherEntry->FileName->sr, BaseDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &baseDirectory);
+
+                if (!NT_SUCCESS(status))
+                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open base directory %s%s", fileNamePrefix->Buffer, otherEntry->FileName->Buffer));
+            }
+
+            if (NT_SUCCESS(status))
+            {
+                status = DbCreateFile(TargetDatabase, &entry->FileName->sr, TargetDirectory, 0, DB_FILE_OPEN, DB_FILE_DIRECTORY_FILE, NULL, &targetDirectory);
+
+                if (!NT_SUCCESS(status))
+                    MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open target directory %s%s", fileNamePrefix->Buffer, entry->FileName->Buffer));
+            }
+
+            if (NT_SUCCESS(status))
+            {
+                fullFileName = PhConcatStringRef2(&fileNamePrefix->sr, &entry->FileName->sr);
+                EnpDiffDirectoryCompareRevisions(BaseDatabase, TargetDatabase, baseDirectory, targetDirectory, fullFileName, NumberOfChanges, MessageHandler);
+                PhDereferenceObject(fullFileName);
+            }
+
+            if (baseDirectory)
+                DbCloseFile(BaseDatabase, baseDirectory);
+            if (targetDirectory)
+                DbCloseFile(TargetDatabase, targetDirectory);
+
+            status = STATUS_SUCCESS;
+        }
+
+        entry++;
+    }
+
+CleanupExit:
+    if (baseHashtable)
+        PhDereferenceObject(baseHashtable);
+    if (targetHashtable)
+        PhDereferenceObject(targetHashtable);
+    if (baseEntries)
+        DbFreeQueryDirectoryFile(baseEntries, numberOfBaseEntries);
+    if (targetEntries)
+        DbFreeQueryDirectoryFile(targetEntries, numberOfTargetEntries);
+
+    PhDereferenceObject(fileNamePrefix);
+
+    return status;
+}
+
+PPH_HASHTABLE EnpCreateFileNameHashtable(
+    VOID
+    )
+{
+    return PhCreateHashtable(
+        sizeof(PPH_STRING),
+        EnpFileNameCompareFunction,
+        EnpFileNameHashFunction,
+        64
+        );
+}
+
+VOID EnpDestroyFileNameHashtable(
+    _In_ PPH_HASHTABLE Hashtable
+    )
+{
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PPH_STRING *stringPtr;
+
+    PhBeginEnumHashtable(Hashtable, &enumContext);
+
+    while (stringPtr = PhNextEnumHashtable(&enumContext))
+        PhDereferenceObject(*stringPtr);
+
+    PhDereferenceObject(Hashtable);
+}
+
+VOID EnpAddToFileNameHashtable(
+    _In_ PPH_HASHTABLE Hashtable,
+    _In_ PPH_STRING FileName
+    )
+{
+    BOOLEAN added;
+
+    PhAddEntryHashtableEx(Hashtable, &FileName, &added);
+
+    if (added)
+        PhReferenceObject(FileName);
+}
+
+PPH_STRING EnpFindInFileNameHashtable(
+    _In_ PPH_HASHTABLE Hashtable,
+    _In_ PPH_STRINGREF FileName
+    )
+{
+    PH_STRING lookupString;
+    PPH_STRING lookupStringPtr = &lookupString;
+    PPH_STRING *string;
+
+    lookupString.sr = *FileName;
+    string = PhFindEntryHashtable(Hashtable, &lookupStringPtr);
+
+    if (string)
+        return *string;
+    else
+        return NULL;
+}
+
+BOOLEAN EnpRemoveFromFileNameHashtable(
+    _In_ PPH_HASHTABLE Hashtable,
+    _In_ PPH_STRINGREF FileName
+    )
+{
+    PH_STRING lookupString;
+    PPH_STRING lookupStringPtr = &lookupString;
+
+    lookupString.sr = *FileName;
+    return PhRemoveEntryHashtable(Hashtable, &lookupStringPtr);
+}
+
+BOOLEAN EnpFileNameCompareFunction(
+    _In_ PVOID Entry1,
+    _In_ PVOID Entry2
+    )
+{
+    PPH_STRING string1 = *(PPH_STRING *)Entry1;
+    PPH_STRING string2 = *(PPH_STRING *)Entry2;
+
+    return PhEqualStringRef(&string1->sr, &string2->sr, TRUE);
+}
+
+ULONG EnpFileNameHashFunction(
+    _In_ PVOID Entry
+    )
+{
+    PPH_STRING string = *(PPH_STRING *)Entry;
+
+    return DbHashName(string->Buffer, string->Length / sizeof(WCHAR));
+}
+
+PPH_HASHTABLE EnpCreatePathTable(
+    VOID
+    )
+{
+    return PhCreateHashtable(
+        sizeof(EN_PATH_ENTRY),
+        EnpPathEntryCompareFunction,
+        EnpPathEntryHashFunction,
+        256
+        );
+}
+
+VOID EnpDestroyPathTable(
+    _In_ PPH_HASHTABLE PathTable
+    )
+{
+    PH_HASHTABLE_ENUM_CONTEXT enumContext;
+    PEN_PATH_ENTRY entry;
+
+    PhBeginEnumHashtable(PathTable, &enumContext);
+
+    while (entry = PhNextEnumHashtable(&enumContext))
+        PhDereferenceObject(entry->Name);
+
+    PhDereferenceObject(PathTable);
+}
+
+ULONG EnpAddToPathTable(
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ ULONG ParentId,
+    _In_ PPH_STRING Name
+    )
+{
+    EN_PATH_ENTRY localEntry;
+    PEN_PATH_ENTRY entry;
+    BOOLEAN added;
+
+    // Paths are stored as (parent ID, name) pairs, so each name is stored once no matter how many
+    // revisions refer to it and full paths never need to be built. ID 0 is the root.
+
+    localEntry.ParentId = ParentId;
+    localEntry.Id = PathTable->Count + 1;
+    localEntry.Name = Name;
+    entry = PhAddEntryHashtableEx(PathTable, &localEntry, &added);
+
+    if (added)
+        PhReferenceObject(Name);
+
+    return entry->Id;
+}
+
+ULONG EnpFindInPathTable(
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PPH_STRINGREF FileName
+    )
+{
+    PH_STRINGREF remainingPart;
+    PH_STRING lookupString;
+    EN_PATH_ENTRY lookupEntry;
+    PEN_PATH_ENTRY entry;
+
+    remainingPart = *FileName;
+    lookupEntry.ParentId = 0;
+    lookupEntry.Name = &lookupString;
+
+    while (remainingPart.Length != 0)
+    {
+        PhSplitStringRefAtChar(&remainingPart, '\\', &lookupString.sr, &remainingPart);
+
+        if (lookupString.Length == 0)
+            continue;
+
+        entry = PhFindEntryHashtable(PathTable, &lookupEntry);
+
+        if (!entry)
+            return 0;
+
+        lookupEntry.ParentId = entry->Id;
+    }
+
+    return lookupEntry.ParentId;
+}
+
+BOOLEAN EnpPathEntryCompareFunction(
+    _In_ PVOID Entry1,
+    _In_ PVOID Entry2
+    )
+{
+    PEN_PATH_ENTRY entry1 = Entry1;
+    PEN_PATH_ENTRY entry2 = Entry2;
+
+    return entry1->ParentId == entry2->ParentId && PhEqualStringRef(&entry1->Name->sr, &entry2->Name->sr, TRUE);
+}
+
+ULONG EnpPathEntryHashFunction(
+    _In_ PVOID Entry
+    )
+{
+    PEN_PATH_ENTRY entry = Entry;
+
+    return DbHashName(entry->Name->Buffer, entry->Name->Length / sizeof(WCHAR)) ^ PhHashInt32(entry->ParentId);
+}
+
+VOID EnpSortPathIds(
+    _Inout_ PPH_ARRAY PathIds
+    )
+{
+    PULONG pathIds;
+    SIZE_T i;
+    SIZE_T count;
+
+    if (PathIds->Count == 0)
+        return;
+
+    pathIds = PathIds->Items;
+    qsort(pathIds, PathIds->Count, sizeof(ULONG), EnpPathIdCompareFunction);
+
+    // Remove duplicates.
+
+    count = 1;
+
+    for (i = 1; i < PathIds->Count; i++)
+    {
+        if (pathIds[i] != pathIds[count - 1])
+            pathIds[count++] = pathIds[i];
+    }
+
+    PathIds->Count = count;
+}
+
+int __cdecl EnpPathIdCompareFunction(
+    _In_ const void *Elem1,
+    _In_ const void *Elem2
+    )
+{
+    ULONG pathId1 = *(PULONG)Elem1;
+    ULONG pathId2 = *(PULONG)Elem2;
+
+    return uintcmp(pathId1, pathId2);
+}
+
+BOOLEAN EnpFindPathId(
+    _In_reads_(NumberOfPathIds) PULONG PathIds,
+    _In_ ULONG NumberOfPathIds,
+    _In_ ULONG PathId
+    )
+{
+    ULONG low;
+    ULONG high;
+    ULONG i;
+
+    low = 0;
+    high = NumberOfPathIds;
+
+    while (low < high)
+    {
+        i = low + (high - low) / 2;
+
+        if (PathIds[i] == PathId)
+            return TRUE;
+        else if (PathIds[i] < PathId)
+            low = i + 1;
+        else
+            high = i;
+    }
+
+    return FALSE;
+}
+
+PEN_FILEINFO EnpCreateFileInfo(
+    _Inout_ PEN_FILEINFO Parent,
+    _In_ PPH_STRINGREF Name,
+    _In_opt_ PPH_STRINGREF SourceName
+    )
+{
+    PEN_FILEINFO fileInfo;
+
+    fileInfo = EnpAllocateFileInfo(Parent, sizeof(EN_FILEINFO));
+    memset(fileInfo, 0, sizeof(EN_FILEINFO));
+    fileInfo->Parent = Parent;
+    fileInfo->Directory = TRUE;
+    fileInfo->DiffFlags = Parent->DiffFlags;
+    EnpCopyStringRefFileInfo(Parent, Name, &fileInfo->Name);
+
+    if (SourceName && !PhEqualStringRef(SourceName, Name, FALSE))
+        EnpCopyStringRefFileInfo(Parent, SourceName, &fileInfo->SourceName);
+    else
+        fileInfo->SourceName = fileInfo->Name;
+
+    return fileInfo;
+}
+
+VOID EnpAddFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo,
+    _In_ PEN_FILEINFO ChildFileInfo
+    )
+{
+    ChildFileInfo->Next = FileInfo->Files;
+    FileInfo->Files = ChildFileInfo;
+    FileInfo->NumberOfFiles++;
+}
+
+VOID EnpClearFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo
+    )
+{
+    PEN_FILEINFO fileInfo;
+    PEN_FILEINFO_BLOCK block;
+    PEN_FILEINFO_BLOCK nextBlock;
+
+    for (fileInfo = FileInfo->Files; fileInfo; fileInfo = fileInfo->Next)
+    {
+        if (fileInfo->Blocks)
+            EnpClearFileInfo(fileInfo);
+    }
+
+    for (block = FileInfo->Blocks; block; block = nextBlock)
+    {
+        nextBlock = block->Next;
+        PhFree(block);
+    }
+
+    FileInfo->Files = NULL;
+    FileInfo->NumberOfFiles = 0;
+    FileInfo->Blocks = NULL;
+}
+
+PEN_FILEINFO EnpFindFileInfo(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ PPH_STRINGREF Name
+    )
+{
+    PEN_FILEINFO fileInfo;
+
+    // This is only used while adding the sources from the configuration, so the files in a
+    // directory are not indexed.
+
+    for (fileInfo = FileInfo->Files; fileInfo; fileInfo = fileInfo->Next)
+    {
+        if (PhEqualStringRef(&fileInfo->Name, Name, TRUE))
+            return fileInfo;
+    }
+
+    return NULL;
+}
+
+PEN_FILEINFO EnpCreateRootFileInfo(
+    VOID
+    )
+{
+    PEN_FILEINFO fileInfo;
+
+    fileInfo = PhAllocate(sizeof(EN_FILEINFO));
+    memset(fileInfo, 0, sizeof(EN_FILEINFO));
+    fileInfo->Directory = TRUE;
+    fileInfo->FsExpand = FALSE;
+
+    return fileInfo;
+}
+
+VOID EnpDestroyRootFileInfo(
+    _In_ PEN_FILEINFO Root
+    )
+{
+    assert(!Root->Parent);
+    EnpClearFileInfo(Root);
+    PhFree(Root);
+}
+
+PVOID EnpAllocateFileInfo(
+    _Inout_ PEN_FILEINFO Directory,
+    _In_ SIZE_T Size
+    )
+{
+    PEN_FILEINFO_BLOCK block;
+    SIZE_T blockSize;
+    PVOID memory;
+
+    // A directory is only modified by one thread at a time, so no locking is needed.
+
+    Size = ALIGN_UP(Size, ULONGLONG);
+    block = Directory->Blocks;
+
+    if (!block || block->Size - block->Used < Size)
+    {
+        // Most directories are small, so start with a small block and double the size each time.
+        blockSize = block ? block->Size * 2 : EN_FILEINFO_MINIMUM_BLOCK_SIZE;
+
+        if (blockSize > EN_FILEINFO_MAXIMUM_BLOCK_SIZE)
+            blockSize = EN_FILEINFO_MAXIMUM_BLOCK_SIZE;
+        if (blockSize < sizeof(EN_FILEINFO_BLOCK) + Size)
+            blockSize = sizeof(EN_FILEINFO_BLOCK) + Size;
+
+        block = PhAllocate(blockSize);
+        block->Next = Directory->Blocks;
+        block->Size = blockSize;
+        block->Used = sizeof(EN_FILEINFO_BLOCK);
+        Directory->Blocks = block;
+    }
+
+    memory = (PUCHAR)block + block->Used;
+    block->Used += Size;
+
+    return memory;
+}
+
+VOID EnpCopyStringRefFileInfo(
+    _Inout_ PEN_FILEINFO Directory,
+    _In_ PPH_STRINGREF String,
+    _Out_ PPH_STRINGREF NewString
+    )
+{
+    NewString->Buffer = EnpAllocateFileInfo(Directory, String->Length);
+    NewString->Length = String->Length;
+    memcpy(NewString->Buffer, String->Buffer, String->Length);
+}
+
+PPH_STRING EnpFormatFullFileName(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ BOOLEAN Source
+    )
+{
+    PEN_FILEINFO fileInfo;
+    PH_STRINGREF name;
+    SIZE_T length;
+    PPH_STRING string;
+    PWCHAR buffer;
+
+    // Full file names are not stored in the tree. Add up the lengths of the components, then copy
+    // them starting from the end.
+
+    length = 0;
+
+    for (fileInfo = FileInfo; fileInfo->Parent; fileInfo = fileInfo->Parent)
+    {
+        name = Source ? fileInfo->SourceName : fileInfo->Name;
+
+        if (fileInfo != FileInfo)
+            EnpTrimTrailingBackslashes(&name);
+
+        length += name.Length;
+
+        if (fileInfo->Parent->Parent)
+            length += sizeof(WCHAR);
+    }
+
+    string = PhCreateStringEx(NULL, length);
+    buffer = (PWCHAR)((PCHAR)string->Buffer + length);
+
+    for (fileInfo = FileInfo; fileInfo->Parent; fileInfo = fileInfo->Parent)
+    {
+        name = Source ? fileInfo->SourceName : fileInfo->Name;
+
+        if (fileInfo != FileInfo)
+            EnpTrimTrailingBackslashes(&name);
+
+        buffer = (PWCHAR)((PCHAR)buffer - name.Length);
+        memcpy(buffer, name.Buffer, name.Length);
+
+        if (fileInfo->Parent->Parent)
+            *--buffer = '\\';
+    }
+
+    return string;
+}
+
+PPH_STRING EnpGetFullFileName(
+    _In_ PEN_FILEINFO FileInfo
+    )
+{
+    return EnpFormatFullFileName(FileInfo, FALSE);
+}
+
+PPH_STRING EnpGetFullSourceFileName(
+    _In_ PEN_FILEINFO FileInfo
+    )
+{
+    return EnpFormatFullFileName(FileInfo, TRUE);
+}
+
+PPH_STRING EnpGetVssSourceFileName(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_opt_ PBK_VSS_OBJECT Vss
+    )
+{
+    PPH_STRING fileName;
+
+    fileName = EnpGetFullSourceFileName(FileInfo);
+
+    if (Vss)
+        PhMoveReference(&fileName, BkMapFileNameVssObject(Vss, fileName));
+
+    return fileName;
+}
+
+PEN_PACKAGE_FILE EnpCreatePackageFile(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ PPH_STRING FileName
+    )
+{
+    PEN_PACKAGE_FILE packageFile;
+    PEN_FILEINFO baseFileInfo;
+
+    packageFile = PhAllocate(sizeof(EN_PACKAGE_FILE));
+    memset(packageFile, 0, sizeof(EN_PACKAGE_FILE));
+    packageFile->FileName = FileName;
+    PhReferenceObject(FileName);
+
+    baseFileInfo = FileInfo;
+
+    while (baseFileInfo->Parent->Parent)
+        baseFileInfo = baseFileInfo->Parent;
+
+    packageFile->BaseFileInfo = baseFileInfo;
+    packageFile->FileInformation = FileInfo->FileInformation;
+    packageFile->Directory = FileInfo->Directory;
+
+    return packageFile;
+}
+
+VOID EnpDestroyPackageFiles(
+    _In_ PPK_ACTION_LIST ActionList
+    )
+{
+    PEN_PACKAGE_FILE packageFile;
+    ULONG i;
+
+    // Each file appears once in the action list created by the diff. The action lists created
+    // for parts and chunks share the same files.
+
+    for (i = 0; i < ActionList->NumberOfActions; i++)
+    {
+        packageFile = ActionList->Actions[i].Context;
+        PhDereferenceObject(packageFile->FileName);
+
+        if (packageFile->FileStream)
+            PhDereferenceObject(packageFile->FileStream);
+
+        PhFree(packageFile);
+    }
+}
+
+PPH_STRING EnpGetPackageFileSourceName(
+    _In_ PEN_PACKAGE_FILE File
+    )
+{
+    PH_STRINGREF remainingPart;
+
+    // Below the base name, file names in the database are the same as in the file system.
+
+    remainingPart.Buffer = (PWCHAR)((PCHAR)File->FileName->Buffer + File->BaseFileInfo->Name.Length);
+    remainingPart.Length = File->FileName->Length - File->BaseFileInfo->Name.Length;
+
+    if (remainingPart.Length == 0)
+        return PhCreateString2(&File->BaseFileInfo->SourceName);
+
+    return EnpAppendComponentToPath(&File->BaseFileInfo->SourceName, &remainingPart);
+}
+
+VOID EnpMapBaseNamesFileInfo(
+    _In_ PBK_CONFIG Config,
+    _Inout_ PEN_FILEINFO FileInfo
+    )
+{
+    PPH_STRING sourceName;
+
+    // Perform required mappings.
+    sourceName = EnpMapFileName(Config, &FileInfo->SourceName, NULL);
+    EnpCopyStringRefFileInfo(FileInfo->Parent, &sourceName->sr, &FileInfo->SourceName);
+    PhDereferenceObject(sourceName);
+}
+
+VOID EnpTrimTrailingBackslashes(
+    _Inout_ PPH_STRINGREF String
+    )
+{
+    // Remove trailing backslashes.
+    while (String->Length != 0 && String->Buffer[String->Length / sizeof(WCHAR) - 1] == '\\')
+        String->Length -= sizeof(WCHAR);
+}
+
+VOID EnpAddSourceToRoot(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_FILEINFO Root,
+    _In_ PPH_STRINGREF SourceFileName,
+    _In_ BOOLEAN Directory
+    )
+{
+    PH_STRINGREF part;
+    PH_STRINGREF remainingPart;
+    PH_STRINGREF name;
+    PEN_FILEINFO fileInfo;
+    PEN_FILEINFO newFileInfo;
+
+    fileInfo = Root;
+    remainingPart = *SourceFileName;
+    EnpTrimTrailingBackslashes(&remainingPart);
+
+    while (remainingPart.Length != 0)
+    {
+        PhSplitStringRefAtChar(&remainingPart, '\\', &part, &remainingPart);
+
+        if (part.Length != 0)
+        {
+            name = part;
+
+            // If this is the first part, strip the trailing colon from the name if present.
+            if (fileInfo == Root && name.Length != 0 && name.Buffer[name.Length / sizeof(WCHAR) - 1] == ':')
+            {
+                name.Length -= sizeof(WCHAR);
+            }
+
+            if (remainingPart.Length != 0)
+            {
+                newFileInfo = EnpFindFileInfo(fileInfo, &name);
+
+                if (!newFileInfo)
+                {
+                    newFileInfo = EnpCreateFileInfo(fileInfo, &name, &part);
+
+                    if (fileInfo == Root)
+                        EnpMapBaseNamesFileInfo(Config, newFileInfo);
+
+                    newFileInfo->Directory = TRUE;
+                    newFileInfo->FsExpand = FALSE;
+                    newFileInfo->NeedFsInfo = TRUE;
+
+                    EnpAddFileInfo(fileInfo, newFileInfo);
+                }
+
+                fileInfo = newFileInfo;
+            }
+            else
+            {
+                newFileInfo = EnpFindFileInfo(fileInfo, &name);
+
+                if (newFileInfo)
+                {
+                    newFileInfo->FsExpand = TRUE;
+                    newFileInfo->NeedFsInfo = TRUE;
+
+                    if (newFileInfo != Root)
+                    {
+                        EnpClearFileInfo(newFileInfo);
+                    }
+                }
+                else
+                {
+                    newFileInfo = EnpCreateFileInfo(fileInfo, &name, &part);
+
+                    if (Directory)
+                    {
+                        if (fileInfo == Root)
+                            EnpMapBaseNamesFileInfo(Config, newFileInfo);
+
+                        newFileInfo->Directory = TRUE;
+                        newFileInfo->FsExpand = TRUE;
+                        newFileInfo->NeedFsInfo = TRUE;
+                    }
+                    else
+                    {
+                        newFileInfo->Directory = FALSE;
+                        newFileInfo->NeedFsInfo = TRUE;
+                    }
+
+                    EnpAddFileInfo(fileInfo, newFileInfo);
+                }
+            }
+        }
+    }
+}
+
+VOID EnpPopulateRootFileInfo(
+    _In_ PBK_CONFIG Config,
+    _Inout_ PEN_FILEINFO Root
+    )
+{
+    ULONG i;
+    PPH_STRING name;
+
+    for (i = 0; i < Config->SourceDirectoryList->Count; i++)
+    {
+        name = Config->SourceDirectoryList->Items[i];
+
+        if (EnpMatchFileName(Config, name))
+            EnpAddSourceToRoot(Config, Root, &name->sr, TRUE);
+    }
+
+    for (i = 0; i < Config->SourceFileList->Count; i++)
+    {
+        name = Config->SourceFileList->Items[i];
+
+        if (EnpMatchFileName(Config, name))
+            EnpAddSourceToRoot(Config, Root, &name->sr, FALSE);
+    }
+}
+
+BOOLEAN NTAPI EnpEnumDirectoryFile(
+    _In_ PFILE_DIRECTORY_INFORMATION Information,
+    _In_opt_ PVOID Context
+    )
+{
+    PEN_POPULATE_FS_CONTEXT context = Context;
+    PH_STRINGREF fileName;
+    PEN_FILEINFO fileInfo;
+
+    fileName.Buffer = Information->FileName;
+    fileName.Length = Information->FileNameLength;
+
+    if (PhEqualStringRef2(&fileName, L".", FALSE))
+        return TRUE;
+    if (PhEqualStringRef2(&fileName, L"..", FALSE))
+        return TRUE;
+
+    // Everything the diff compares goes into the stamp of the directory. A file modified in place
+    // doesn't change the times of its directory, but it does change its own entry.
+    context->Stamp = EnpHashSourceStamp(context->Stamp, fileName.Buffer, fileName.Length);
+    context->Stamp = EnpHashSourceStamp(context->Stamp, &Information->LastWriteTime, sizeof(LARGE_INTEGER));
+    context->Stamp = EnpHashSourceStamp(context->Stamp, &Information->ChangeTime, sizeof(LARGE_INTEGER));
+    context->Stamp = EnpHashSourceStamp(context->Stamp, &Information->EndOfFile, sizeof(LARGE_INTEGER));
+    context->Stamp = EnpHashSourceStamp(context->Stamp, &Information->FileAttributes, sizeof(ULONG));
+
+    // Never follow symbolic links, mount points or other reparse points.
+    if (Information->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+        return TRUE;
+
+    if (!(Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        ULONG i;
+
+        for (i = 0; i < context->Config->ExcludeMarkerList->Count; i++)
+        {
+            if (PhEqualStringRef(&fileName, &((PPH_STRING)context->Config->ExcludeMarkerList->Items[i])->sr, TRUE))
+            {
+                if (!context->Markers)
+                    context->Markers = PhCreateList(2);
+
+                PhAddItemList(context->Markers, context->Config->ExcludeMarkerList->Items[i]);
+                break;
+            }
+        }
+    }
+
+    // Build the full file name in the buffer that already contains the directory name.
+    PhRemoveEndStringBuilder(
+        &context->FileName,
+        (context->FileName.String->Length - context->DirectoryNameLength) / sizeof(WCHAR)
+        );
+    PhAppendStringBuilderEx(&context->FileName, fileName.Buffer, fileName.Length);
+
+    if (!EnpMatchFileName(context->Config, context->FileName.String) ||
+        (!(Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !EnpMatchFileSize(context->Config, context->FileName.String, &Information->EndOfFile)))
+    {
+        return TRUE;
+    }
 
-            if (baseDirectory)
-                DbCloseFile(BaseDatabase, baseDirectory);
-            if (targetDirectory)
-                DbCloseFile(TargetDatabase, targetDirectory);
+    // Files that were added from the configuration take precedence.
+    for (fileInfo = context->ExistingFiles; fileInfo; fileInfo = fileInfo->Next)
+    {
+        if (PhEqualStringRef(&fileInfo->Name, &fileName, TRUE))
+            return TRUE;
+    }
 
-            status = STATUS_SUCCESS;
-        }
+    fileInfo = EnpCreateFileInfo(context->FileInfo, &fileName, NULL);
 
-        entry++;
+    if (Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        fileInfo->Directory = TRUE;
+        fileInfo->FsExpand = TRUE;
+    }
+    else
+    {
+        fileInfo->Directory = FALSE;
     }
 
-CleanupExit:
-    if (baseHashtable)
-        PhDereferenceObject(baseHashtable);
-    if (targetHashtable)
-        PhDereferenceObject(targetHashtable);
-    if (baseEntries)
-        DbFreeQueryDirectoryFile(baseEntries, numberOfBaseEntries);
-    if (targetEntries)
-        DbFreeQueryDirectoryFile(targetEntries, numberOfTargetEntries);
+    fileInfo->FileInformation.CreationTime = Information->CreationTime;
+    fileInfo->FileInformation.LastAccessTime = Information->LastAccessTime;
+    fileInfo->FileInformation.LastWriteTime = Information->LastWriteTime;
+    fileInfo->FileInformation.ChangeTime = Information->ChangeTime;
+    fileInfo->FileInformation.AllocationSize = Information->AllocationSize;
+    fileInfo->FileInformation.EndOfFile = Information->EndOfFile;
+    fileInfo->FileInformation.FileAttributes = Information->FileAttributes;
 
-    PhDereferenceObject(fileNamePrefix);
+    EnpAddFileInfo(context->FileInfo, fileInfo);
 
-    return status;
+    return TRUE;
 }
 
-PPH_HASHTABLE EnpCreateFileNameHashtable(
-    VOID
+ULONGLONG EnpHashSourceStamp(
+    _In_ ULONGLONG Stamp,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
     )
 {
-    return PhCreateHashtable(
-        sizeof(PPH_STRING),
-        EnpFileNameCompareFunction,
-        EnpFileNameHashFunction,
-        64
-        );
+    PUCHAR buffer = Buffer;
+    SIZE_T i;
+
+    // 64-bit FNV-1a. The database only has room for one 64-bit value per directory, so the times
+    // of the directory and the entries of its files are combined into a single hash.
+    for (i = 0; i < Length; i++)
+    {
+        Stamp ^= buffer[i];
+        Stamp *= 0x100000001b3;
+    }
+
+    return Stamp;
 }
 
-VOID EnpDestroyFileNameHashtable(
-    _In_ PPH_HASHTABLE Hashtable
+VOID EnpInitializeScanContext(
+    _Out_ PEN_SCAN_CONTEXT Context,
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PEN_CHANGE_SET Changes,
+    _In_opt_ PBK_VSS_OBJECT Vss
     )
 {
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PPH_STRING *stringPtr;
+    ULONG numberOfThreads;
 
-    PhBeginEnumHashtable(Hashtable, &enumContext);
+    numberOfThreads = Config->ScanThreads;
 
-    while (stringPtr = PhNextEnumHashtable(&enumContext))
-        PhDereferenceObject(*stringPtr);
+    if (numberOfThreads == 0)
+        numberOfThreads = PhSystemBasicInformation.NumberOfProcessors;
 
-    PhDereferenceObject(Hashtable);
+    Context->Config = Config;
+    Context->Vss = Vss;
+    Context->Changes = Changes;
+    Context->Parallel = numberOfThreads > 1;
+    Context->PendingDirectories = NULL;
+    Context->Lookahead = 0;
+    Context->MaximumLookahead = numberOfThreads * EN_SCAN_LOOKAHEAD_PER_THREAD;
+    PhInitializeQueuedLock(&Context->Lock);
+    PhInitializeQueuedLock(&Context->Condition);
+
+    if (Context->Parallel)
+        PhInitializeWorkQueue(&Context->WorkQueue, 0, numberOfThreads, 1000);
 }
 
-VOID EnpAddToFileNameHashtable(
-    _In_ PPH_HASHTABLE Hashtable,
-    _In_ PPH_STRING FileName
+VOID EnpDeleteScanContext(
+    _Inout_ PEN_SCAN_CONTEXT Context
     )
 {
-    BOOLEAN added;
-
-    PhAddEntryHashtableEx(Hashtable, &FileName, &added);
-
-    if (added)
-        PhReferenceObject(FileName);
+    if (Context->Parallel)
+    {
+        // The walk can stop early, so directories may still be being listed.
+        PhWaitForWorkQueue(&Context->WorkQueue);
+        PhDeleteWorkQueue(&Context->WorkQueue);
+    }
 }
 
-PPH_STRING EnpFindInFileNameHashtable(
-    _In_ PPH_HASHTABLE Hashtable,
-    _In_ PPH_STRINGREF FileName
+VOID EnpScanDirectory(
+    _Inout_ PEN_SCAN_CONTEXT Context,
+    _Inout_ PEN_FILEINFO FileInfo
     )
 {
-    PH_STRING lookupString;
-    PPH_STRING lookupStringPtr = &lookupString;
-    PPH_STRING *string;
+    PEN_FILEINFO childInfo;
+    PEN_FILEINFO firstInfo;
+    PEN_FILEINFO *link;
 
-    lookupString.sr = *FileName;
-    string = PhFindEntryHashtable(Hashtable, &lookupStringPtr);
+    // Listing a directory mostly waits for the file system, so directories are listed on other
+    // threads before the walk reaches them. The pending list holds the directories in the order
+    // the walk visits them: the subdirectories of the current directory come before the remaining
+    // subdirectories of its parents. Only the first MaximumLookahead of them are listed in
+    // advance, which bounds the memory used. Each directory is only modified by the thread that
+    // lists it, so the results do not depend on timing.
 
-    if (string)
-        return *string;
-    else
-        return NULL;
+    if (!Context->Parallel)
+        return;
+
+    firstInfo = NULL;
+    link = &firstInfo;
+
+    for (childInfo = FileInfo->Files; childInfo; childInfo = childInfo->Next)
+    {
+        if (childInfo->Directory && childInfo->FsExpand && EnpIsChangedFileInfo(Context->Changes, childInfo))
+        {
+            childInfo->ScanState = EN_SCAN_STATE_PENDING;
+            *link = childInfo;
+            link = &childInfo->ScanNext;
+        }
+    }
+
+    *link = Context->PendingDirectories;
+    Context->PendingDirectories = firstInfo;
+
+    EnpQueueScanDirectories(Context);
 }
 
-BOOLEAN EnpRemoveFromFileNameHashtable(
-    _In_ PPH_HASHTABLE Hashtable,
-    _In_ PPH_STRINGREF FileName
+VOID EnpQueueScanDirectories(
+    _Inout_ PEN_SCAN_CONTEXT Context
     )
 {
-    PH_STRING lookupString;
-    PPH_STRING lookupStringPtr = &lookupString;
+    PEN_FILEINFO fileInfo;
+    PEN_SCAN_DIRECTORY_ITEM item;
 
-    lookupString.sr = *FileName;
-    return PhRemoveEntryHashtable(Hashtable, &lookupStringPtr);
+    while (Context->Lookahead < Context->MaximumLookahead && Context->PendingDirectories)
+    {
+        fileInfo = Context->PendingDirectories;
+        Context->PendingDirectories = fileInfo->ScanNext;
+        fileInfo->ScanNext = NULL;
+        fileInfo->ScanState = EN_SCAN_STATE_QUEUED;
+        Context->Lookahead++;
+
+        item = PhAllocate(sizeof(EN_SCAN_DIRECTORY_ITEM));
+        item->Context = Context;
+        item->FileInfo = fileInfo;
+        PhQueueItemWorkQueue(&Context->WorkQueue, EnpScanDirectoryWorker, item);
+    }
 }
 
-BOOLEAN EnpFileNameCompareFunction(
-    _In_ PVOID Entry1,
-    _In_ PVOID Entry2
+VOID EnpWaitForScanDirectory(
+    _Inout_ PEN_SCAN_CONTEXT Context,
+    _Inout_ PEN_FILEINFO FileInfo
     )
 {
-    PPH_STRING string1 = *(PPH_STRING *)Entry1;
-    PPH_STRING string2 = *(PPH_STRING *)Entry2;
+    PEN_FILEINFO *link;
 
-    return PhEqualStringRef(&string1->sr, &string2->sr, TRUE);
+    // This must be called for every directory passed to EnpScanDirectory before its parent is
+    // freed, including directories that the walk skips.
+
+    if (!Context->Parallel)
+        return;
+
+    PhAcquireQueuedLockExclusive(&Context->Lock);
+
+    while (FileInfo->ScanState == EN_SCAN_STATE_QUEUED)
+        PhWaitForCondition(&Context->Condition, &Context->Lock, NULL);
+
+    PhReleaseQueuedLockExclusive(&Context->Lock);
+
+    if (FileInfo->ScanState == EN_SCAN_STATE_PENDING)
+    {
+        // The directory hasn't been queued yet. It is usually the first pending directory, and
+        // the caller lists it itself.
+        link = &Context->PendingDirectories;
+
+        while (*link != FileInfo)
+            link = &(*link)->ScanNext;
+
+        *link = FileInfo->ScanNext;
+        FileInfo->ScanNext = NULL;
+    }
+    else if (FileInfo->ScanState == EN_SCAN_STATE_LISTED)
+    {
+        Context->Lookahead--;
+    }
+
+    FileInfo->ScanState = EN_SCAN_STATE_NONE;
+
+    EnpQueueScanDirectories(Context);
 }
 
-ULONG EnpFileNameHashFunction(
-    _In_ PVOID Entry
+NTSTATUS NTAPI EnpScanDirectoryWorker(
+    _In_ PVOID Parameter
     )
 {
-    PPH_STRING string = *(PPH_STRING *)Entry;
+    PEN_SCAN_DIRECTORY_ITEM item = Parameter;
+    PEN_SCAN_CONTEXT context = item->Context;
 
-    return DbHashName(string->Buffer, string->Length / sizeof(WCHAR));
+    item->FileInfo->FsStatus = EnpPopulateFsFileInfo(context->Config, item->FileInfo, context->Vss);
+    item->FileInfo->FsExpand = FALSE;
+
+    PhAcquireQueuedLockExclusive(&context->Lock);
+    item->FileInfo->ScanState = EN_SCAN_STATE_LISTED;
+    PhPulseAllCondition(&context->Condition);
+    PhReleaseQueuedLockExclusive(&context->Lock);
+
+    PhFree(item);
+
+    return STATUS_SUCCESS;
 }
 
-PEN_FILEINFO EnpCreateFileInfo(
-    _In_opt_ PEN_FILEINFO Parent,
-    _In_opt_ PPH_STRINGREF Name,
-    _In_opt_ PPH_STRINGREF SourceName
+NTSTATUS EnpPopulateFsFileInfo(
+    _In_ PBK_CONFIG Config,
+    _Inout_ PEN_FILEINFO FileInfo,
+    _In_opt_ PBK_VSS_OBJECT Vss
     )
 {
-    PEN_FILEINFO fileInfo;
+    NTSTATUS status;
+    EN_POPULATE_FS_CONTEXT context;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
+    FILE_BASIC_INFORMATION basicInfo;
+    BOOLEAN stampValid;
+    PPH_STRING fullSourceFileName;
+    PPH_STRING sourceFileName;
+    PH_STRINGREF directoryName;
+    WCHAR buffer[4];
+    PWSTR fileName;
 
-    fileInfo = PhAllocate(sizeof(EN_FILEINFO));
-    memset(fileInfo, 0, sizeof(EN_FILEINFO));
-    fileInfo->Directory = TRUE;
+    fullSourceFileName = EnpGetFullSourceFileName(FileInfo);
 
-    if (Parent)
+    // Don't list a directory if everything in it would be excluded.
+    if (EnpMatchExcludedSubtree(Config, fullSourceFileName))
     {
-        fileInfo->Parent = Parent;
-        fileInfo->DiffFlags = Parent->DiffFlags;
+        PhDereferenceObject(fullSourceFileName);
+        return STATUS_SUCCESS;
     }
 
-    if (Parent && Name)
+    sourceFileName = fullSourceFileName;
+    PhReferenceObject(sourceFileName);
+
+    if (Vss)
     {
-        fileInfo->Name = PhCreateStringEx(Name->Buffer, Name->Length);
-        fileInfo->FullFileName = EnpAppendComponentToPath(&Parent->FullFileName->sr, Name);
-        fileInfo->FullSourceFileName = EnpAppendComponentToPath(&Parent->FullSourceFileName->sr, SourceName);
+        PhMoveReference(&sourceFileName, BkMapFileNameVssObject(Vss, sourceFileName));
+    }
+
+    fileName = sourceFileName->Buffer;
 
-        fileInfo->Key = fileInfo->Name->sr;
+    // Drive names need a backslash after them.
+    if (sourceFileName->Length == 2 * sizeof(WCHAR) && sourceFileName->Buffer[1] == ':')
+    {
+        buffer[0] = sourceFileName->Buffer[0];
+        buffer[1] = ':';
+        buffer[2] = '\\';
+        buffer[3] = 0;
+        fileName = buffer;
     }
-    else
+
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName,
+        FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        FILE_OPEN,
+        FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT
+        );
+
+    if (!NT_SUCCESS(status))
     {
-        fileInfo->Name = PhReferenceEmptyString();
-        fileInfo->FullFileName = PhReferenceEmptyString();
-        fileInfo->FullSourceFileName = PhReferenceEmptyString();
+        status = PhCreateFileWin32(
+            &fileHandle,
+            fileName,
+            FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+            0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            FILE_OPEN,
+            FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+            );
     }
 
-    return fileInfo;
+    if (!NT_SUCCESS(status))
+    {
+        PhDereferenceObject(sourceFileName);
+        PhDereferenceObject(fullSourceFileName);
+        return status;
+    }
+
+    context.Config = Config;
+    context.FileInfo = FileInfo;
+    context.ExistingFiles = FileInfo->Files;
+    context.NumberOfExistingFiles = FileInfo->NumberOfFiles;
+    context.Markers = NULL;
+    context.Stamp = EN_SOURCE_STAMP_BASIS;
+
+    // The times in the parent's directory index can be out of date, so they are read from the
+    // directory itself. This happens before the directory is listed, so that a file added while
+    // it is being listed changes the stamp for the next run.
+    stampValid = NT_SUCCESS(NtQueryInformationFile(fileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation));
+
+    if (stampValid)
+    {
+        context.Stamp = EnpHashSourceStamp(context.Stamp, &basicInfo.LastWriteTime, sizeof(LARGE_INTEGER));
+        context.Stamp = EnpHashSourceStamp(context.Stamp, &basicInfo.ChangeTime, sizeof(LARGE_INTEGER));
+    }
+
+    PhInitializeStringBuilder(&context.FileName, 260);
+    directoryName = fullSourceFileName->sr;
+    EnpTrimTrailingBackslashes(&directoryName);
+    PhAppendStringBuilderEx(&context.FileName, directoryName.Buffer, directoryName.Length);
+    PhAppendCharStringBuilder(&context.FileName, '\\');
+    context.DirectoryNameLength = context.FileName.String->Length;
+
+    if (!NT_SUCCESS(PhEnumDirectoryFile(fileHandle, NULL, EnpEnumDirectoryFile, &context)))
+        stampValid = FALSE;
+
+    NtClose(fileHandle);
+    PhDeleteStringBuilder(&context.FileName);
+
+    if (stampValid)
+        FileInfo->FsStamp = context.Stamp != 0 ? context.Stamp : 1;
+
+    // The contents of a directory with a marker file are excluded. This happens before the
+    // subdirectories are listed, so the excluded tree is never scanned. A CACHEDIR.TAG without
+    // the signature doesn't hide another marker in the same directory.
+    if (context.Markers)
+    {
+        ULONG i;
+
+        for (i = 0; i < context.Markers->Count; i++)
+        {
+            if (EnpIsValidExcludeMarker(&sourceFileName->sr, context.Markers->Items[i]))
+            {
+                // Only remove the files that were listed. They were added in front of the files
+                // from the configuration, which are still backed up. The memory is freed with
+                // the directory.
+                FileInfo->Files = context.ExistingFiles;
+                FileInfo->NumberOfFiles = context.NumberOfExistingFiles;
+                break;
+            }
+        }
+
+        PhDereferenceObject(context.Markers);
+    }
+
+    PhDereferenceObject(sourceFileName);
+    PhDereferenceObject(fullSourceFileName);
+
+    return STATUS_SUCCESS;
 }
 
-BOOLEAN EnpFileInfoCompareFunction(
-    _In_ PVOID Entry1,
-    _In_ PVOID Entry2
+BOOLEAN EnpMatchExcludedSubtree(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING DirectoryName
     )
 {
-    PEN_FILEINFO fileInfo1 = *(PEN_FILEINFO *)Entry1;
-    PEN_FILEINFO fileInfo2 = *(PEN_FILEINFO *)Entry2;
+    PPH_STRING directoryName;
+    BOOLEAN match;
+    ULONG i;
+
+    if (Config->NumberOfExcludeSubtreeFilters == 0)
+        return FALSE;
+
+    directoryName = PhConcatStringRef2(&DirectoryName->sr, &EnpBackslashString);
+    match = FALSE;
+
+    for (i = 0; i < Config->NumberOfExcludeSubtreeFilters; i++)
+    {
+        if (BkMatchFilter(&Config->ExcludeSubtreeFilters[i], directoryName))
+        {
+            match = TRUE;
+            break;
+        }
+    }
 
-    return PhEqualStringRef(&fileInfo1->Key, &fileInfo2->Key, TRUE);
+    PhDereferenceObject(directoryName);
+
+    return match;
 }
 
-ULONG EnpFileInfoHashFunction(
-    _In_ PVOID Entry
+BOOLEAN EnpIsValidExcludeMarker(
+    _In_ PPH_STRINGREF DirectoryName,
+    _In_ PPH_STRING Marker
     )
 {
-    PEN_FILEINFO fileInfo = *(PEN_FILEINFO *)Entry;
+    NTSTATUS status;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
+    CHAR buffer[sizeof(EN_CACHEDIR_TAG_SIGNATURE) - 1];
+
+    // Other programs create CACHEDIR.TAG files for their own purposes, so they are only honored
+    // if they start with the signature. Other markers only need to exist.
+
+    if (!PhEqualStringRef2(&Marker->sr, EN_CACHEDIR_TAG_NAME, TRUE))
+        return TRUE;
+
+    fileName = EnpAppendComponentToPath(DirectoryName, &Marker->sr);
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_READ,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+    PhDereferenceObject(fileName);
+
+    if (!NT_SUCCESS(status))
+        return FALSE;
 
-    return DbHashName(fileInfo->Key.Buffer, fileInfo->Key.Length / sizeof(WCHAR));
-}
+    status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, buffer, sizeof(buffer), NULL, NULL);
+    NtClose(fileHandle);
 
-VOID EnpCreateHashtableFileInfo(
-    _Inout_ PEN_FILEINFO FileInfo
-    )
-{
-    assert(!FileInfo->Files);
-    FileInfo->Files = PhCreateHashtable(
-        sizeof(PEN_FILEINFO),
-        EnpFileInfoCompareFunction,
-        EnpFileInfoHashFunction,
-        8
-        );
+    return NT_SUCCESS(status) && iosb.Information == sizeof(buffer) &&
+        memcmp(buffer, EN_CACHEDIR_TAG_SIGNATURE, sizeof(buffer)) == 0;
 }
 
-VOID EnpDestroyFileInfo(
-    _In_ PEN_FILEINFO FileInfo
+NTSTATUS EnpUpdateFsFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo,
+    _In_opt_ PBK_VSS_OBJECT Vss
     )
 {
-    if (FileInfo->Files)
-        EnpClearFileInfo(FileInfo);
+    NTSTATUS status;
+    PPH_STRING fileName;
+
+    fileName = EnpGetVssSourceFileName(FileInfo, Vss);
+    status = EnpQueryFullAttributesFileWin32(fileName->Buffer, &FileInfo->FileInformation);
+    PhDereferenceObject(fileName);
 
-    EnpFreeFileInfo(FileInfo);
+    return status;
 }
 
-VOID EnpClearFileInfo(
-    _In_ PEN_FILEINFO FileInfo
+VOID EnpSetDiffFlagsFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo,
+    _In_ UCHAR DiffFlags
     )
 {
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_FILEINFO *fileInfo;
-
-    PhBeginEnumHashtable(FileInfo->Files, &enumContext);
+    PEN_FILEINFO fileInfo;
 
-    while (fileInfo = PhNextEnumHashtable(&enumContext))
-    {
-        EnpDestroyFileInfo(*fileInfo);
-    }
+    FileInfo->DiffFlags = DiffFlags;
 
-    PhClearHashtable(FileInfo->Files);
+    for (fileInfo = FileInfo->Files; fileInfo; fileInfo = fileInfo->Next)
+        EnpSetDiffFlagsFileInfo(fileInfo, DiffFlags);
 }
 
-VOID EnpFreeFileInfo(
-    _In_ PEN_FILEINFO FileInfo
+PEN_CHANGE_SOURCE EnpGetChangeSource(
+    _In_ PBK_CONFIG Config
     )
 {
-    PhSwapReference(&FileInfo->Name, NULL);
-    PhSwapReference(&FileInfo->FullFileName, NULL);
-    PhSwapReference(&FileInfo->FullSourceFileName, NULL);
-    PhSwapReference(&FileInfo->Files, NULL);
-    PhFree(FileInfo);
+    if (Config->ChangeJournal)
+        return &EnpJournalChangeSource;
+
+    return NULL;
 }
 
-PEN_FILEINFO EnpFindFileInfo(
-    _In_ PEN_FILEINFO FileInfo,
-    _In_ PPH_STRINGREF Name
+VOID EnpQueryChanges(
+    _In_ PBK_CONFIG Config,
+    _Out_ PEN_CHANGE_SET *ChangeSet,
+    _Out_ PPH_STRING *NewCursor,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
     )
 {
-    EN_FILEINFO lookupFileInfo;
-    PEN_FILEINFO lookupFileInfoPtr = &lookupFileInfo;
-    PEN_FILEINFO *fileInfo;
+    NTSTATUS status;
+    PEN_CHANGE_SOURCE source;
+    PPH_STRING cursor;
+    PEN_CHANGE_SET changeSet;
 
-    if (!FileInfo->Files)
-        return NULL;
+    *ChangeSet = NULL;
+    *NewCursor = NULL;
 
-    lookupFileInfo.Key = *Name;
-    fileInfo = PhFindEntryHashtable(FileInfo->Files, &lookupFileInfoPtr);
+    source = EnpGetChangeSource(Config);
 
-    if (fileInfo)
-        return *fileInfo;
-    else
-        return NULL;
-}
+    if (!source)
+        return;
 
-PEN_FILEINFO EnpCreateRootFileInfo(
-    VOID
-    )
-{
-    PEN_FILEINFO fileInfo;
+    MessageHandler(EN_MESSAGE_PROGRESS, PhCreateString(L"Reading changes"));
 
-    fileInfo = EnpCreateFileInfo(NULL, NULL, NULL);
-    fileInfo->Directory = TRUE;
-    fileInfo->FsExpand = FALSE;
+    if (NT_SUCCESS(EnpReadChangeCursor(Config, &cursor)))
+    {
+        changeSet = EnpCreateChangeSet();
+        status = source->QueryChanges(Config, &cursor->sr, changeSet, NewCursor);
+        PhDereferenceObject(cursor);
 
-    return fileInfo;
-}
+        if (NT_SUCCESS(status))
+        {
+            MessageHandler(EN_MESSAGE_INFORMATION, PhFormatString(L"%u change(s) reported by %s", changeSet->Count, source->Name));
+            *ChangeSet = changeSet;
+            return;
+        }
 
-VOID EnpMapBaseNamesFileInfo(
-    _In_ PBK_CONFIG Config,
-    _Inout_ PEN_FILEINFO FileInfo
-    )
-{
-    // Perform required mappings.
-    PhMoveReference(&FileInfo->FullSourceFileName, EnpMapFileName(
-        Config,
-        &FileInfo->FullSourceFileName->sr,
-        FileInfo->FullSourceFileName
-        ));
-}
+        EnpDestroyChangeSet(changeSet);
+        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to read changes from %s: 0x%x; comparing all files", source->Name, status));
+    }
 
-VOID EnpTrimTrailingBackslashes(
-    _Inout_ PPH_STRINGREF String
-    )
-{
-    // Remove trailing backslashes.
-    while (String->Length != 0 && String->Buffer[String->Length / sizeof(WCHAR) - 1] == '\\')
-        String->Length -= sizeof(WCHAR);
+    // Compare all files, and start reading changes from the current position next time.
+    status = source->QueryChanges(Config, NULL, NULL, NewCursor);
+
+    if (!NT_SUCCESS(status))
+        MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to open %s: 0x%x", source->Name, status));
 }
 
-VOID EnpAddSourceToRoot(
+NTSTATUS EnpReadChangeCursor(
     _In_ PBK_CONFIG Config,
-    _In_ PEN_FILEINFO Root,
-    _In_ PPH_STRINGREF SourceFileName,
-    _In_ BOOLEAN Directory
+    _Out_ PPH_STRING *Cursor
     )
 {
-    PH_STRINGREF part;
-    PH_STRINGREF remainingPart;
+    NTSTATUS status;
     PH_STRINGREF name;
-    PEN_FILEINFO fileInfo;
-    PEN_FILEINFO newFileInfo;
-    PEN_FILEINFO needMapFileInfo;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    LARGE_INTEGER fileSize;
+    IO_STATUS_BLOCK iosb;
+    PPH_STRING cursor;
 
-    needMapFileInfo = NULL;
-    fileInfo = Root;
-    remainingPart = *SourceFileName;
-    EnpTrimTrailingBackslashes(&remainingPart);
+    PhInitializeStringRef(&name, EN_CHANGE_CURSOR_NAME);
+    fileName = EnpAppendComponentToPath(&Config->DestinationDirectory->sr, &name);
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_READ,
+        0,
+        FILE_SHARE_READ,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+    PhDereferenceObject(fileName);
 
-    while (remainingPart.Length != 0)
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = PhGetFileSize(fileHandle, &fileSize);
+
+    if (NT_SUCCESS(status) && (fileSize.QuadPart > EN_MAXIMUM_CHANGE_CURSOR_SIZE || fileSize.QuadPart % sizeof(WCHAR) != 0))
+        status = STATUS_FILE_CORRUPT_ERROR;
+
+    if (NT_SUCCESS(status))
     {
-        PhSplitStringRefAtChar(&remainingPart, '\\', &part, &remainingPart);
+        cursor = PhCreateStringEx(NULL, (SIZE_T)fileSize.QuadPart);
+        status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, cursor->Buffer, (ULONG)fileSize.QuadPart, NULL, NULL);
 
-        if (part.Length != 0)
-        {
-            name = part;
+        if (NT_SUCCESS(status) && iosb.Information == fileSize.QuadPart)
+            *Cursor = cursor;
+        else
+            PhDereferenceObject(cursor);
 
-            // If this is the first part, strip the trailing colon from the name if present.
-            if (fileInfo == Root && name.Length != 0 && name.Buffer[name.Length / sizeof(WCHAR) - 1] == ':')
-            {
-                name.Length -= sizeof(WCHAR);
-            }
+        if (NT_SUCCESS(status) && iosb.Information != fileSize.QuadPart)
+            status = STATUS_END_OF_FILE;
+    }
 
-            if (remainingPart.Length != 0)
-            {
-                newFileInfo = EnpFindFileInfo(fileInfo, &name);
+    NtClose(fileHandle);
 
-                if (!newFileInfo)
-                {
-                    newFileInfo = EnpCreateFileInfo(fileInfo, &name, &part);
+    return status;
+}
 
-                    if (fileInfo == Root)
-                        EnpMapBaseNamesFileInfo(Config, newFileInfo);
+NTSTATUS EnpWriteChangeCursor(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING Cursor
+    )
+{
+    NTSTATUS status;
+    PH_STRINGREF name;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK iosb;
 
-                    newFileInfo->Directory = TRUE;
-                    newFileInfo->FsExpand = FALSE;
-                    newFileInfo->NeedFsInfo = TRUE;
+    PhInitializeStringRef(&name, EN_CHANGE_CURSOR_NAME);
+    fileName = EnpAppendComponentToPath(&Config->DestinationDirectory->sr, &name);
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_WRITE,
+        0,
+        0,
+        FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+        );
+    PhDereferenceObject(fileName);
 
-                    if (!fileInfo->Files)
-                        EnpCreateHashtableFileInfo(fileInfo);
+    if (!NT_SUCCESS(status))
+        return status;
 
-                    PhAddEntryHashtable(fileInfo->Files, &newFileInfo);
-                }
+    status = NtWriteFile(fileHandle, NULL, NULL, NULL, &iosb, Cursor->Buffer, (ULONG)Cursor->Length, NULL, NULL);
+    NtClose(fileHandle);
 
-                fileInfo = newFileInfo;
-            }
-            else
-            {
-                newFileInfo = EnpFindFileInfo(fileInfo, &name);
+    return status;
+}
 
-                if (newFileInfo)
-                {
-                    newFileInfo->FsExpand = TRUE;
-                    newFileInfo->NeedFsInfo = TRUE;
+VOID EnpDeleteChangeCursor(
+    _In_ PBK_CONFIG Config
+    )
+{
+    PH_STRINGREF name;
+    PPH_STRING fileName;
 
-                    if (newFileInfo != Root && newFileInfo->Files)
-                    {
-                        EnpClearFileInfo(newFileInfo);
-                    }
-                }
-                else
-                {
-                    newFileInfo = EnpCreateFileInfo(fileInfo, &name, &part);
+    PhInitializeStringRef(&name, EN_CHANGE_CURSOR_NAME);
+    fileName = EnpAppendComponentToPath(&Config->DestinationDirectory->sr, &name);
+    PhDeleteFileWin32(fileName->Buffer);
+    PhDereferenceObject(fileName);
+}
 
-                    if (Directory)
-                    {
-                        if (fileInfo == Root)
-                            EnpMapBaseNamesFileInfo(Config, newFileInfo);
+PEN_CHANGE_SET EnpCreateChangeSet(
+    VOID
+    )
+{
+    PEN_CHANGE_SET changeSet;
 
-                        newFileInfo->Directory = TRUE;
-                        newFileInfo->FsExpand = TRUE;
-                        newFileInfo->NeedFsInfo = TRUE;
-                    }
-                    else
-                    {
-                        newFileInfo->Directory = FALSE;
-                        newFileInfo->NeedFsInfo = TRUE;
-                    }
+    changeSet = PhAllocate(sizeof(EN_CHANGE_SET));
+    changeSet->Subtrees = EnpCreateFileNameHashtable();
+    changeSet->Directories = EnpCreateFileNameHashtable();
+    changeSet->Count = 0;
 
-                    if (!fileInfo->Files)
-                        EnpCreateHashtableFileInfo(fileInfo);
+    return changeSet;
+}
 
-                    PhAddEntryHashtable(fileInfo->Files, &newFileInfo);
-                }
-            }
-        }
-    }
+VOID EnpDestroyChangeSet(
+    _In_ PEN_CHANGE_SET ChangeSet
+    )
+{
+    EnpDestroyFileNameHashtable(ChangeSet->Subtrees);
+    EnpDestroyFileNameHashtable(ChangeSet->Directories);
+    PhFree(ChangeSet);
 }
 
-VOID EnpPopulateRootFileInfo(
-    _In_ PBK_CONFIG Config,
-    _Inout_ PEN_FILEINFO Root
+VOID EnpAddToChangeSet(
+    _Inout_ PEN_CHANGE_SET ChangeSet,
+    _In_ PPH_STRINGREF FileName
     )
 {
-    ULONG i;
-    PPH_STRING name;
+    static PH_STRINGREF whitespace = PH_STRINGREF_INIT(L" \t\r");
 
-    for (i = 0; i < Config->SourceDirectoryList->Count; i++)
-    {
-        name = Config->SourceDirectoryList->Items[i];
+    PH_STRINGREF fileName;
+    PH_STRINGREF parentName;
+    PH_STRINGREF name;
+    PPH_STRING string;
 
-        if (EnpMatchFileName(Config, name))
-            EnpAddSourceToRoot(Config, Root, &name->sr, TRUE);
-    }
+    fileName = *FileName;
+    PhTrimStringRef(&fileName, &whitespace, 0);
+    EnpTrimTrailingBackslashes(&fileName);
 
-    for (i = 0; i < Config->SourceFileList->Count; i++)
+    if (fileName.Length == 0)
+        return;
+
+    // The changed file or directory is compared in full, and its parent directories are listed
+    // so that the diff can reach it. A deleted file is detected when its parent is compared.
+
+    string = PhCreateString2(&fileName);
+    EnpAddToFileNameHashtable(ChangeSet->Subtrees, string);
+    PhDereferenceObject(string);
+    ChangeSet->Count++;
+
+    while (PhSplitStringRefAtLastChar(&fileName, '\\', &parentName, &name) && parentName.Length != 0)
     {
-        name = Config->SourceFileList->Items[i];
+        if (EnpFindInFileNameHashtable(ChangeSet->Directories, &parentName))
+            break; // all remaining parents have been added already
 
-        if (EnpMatchFileName(Config, name))
-            EnpAddSourceToRoot(Config, Root, &name->sr, FALSE);
+        string = PhCreateString2(&parentName);
+        EnpAddToFileNameHashtable(ChangeSet->Directories, string);
+        PhDereferenceObject(string);
+
+        fileName = parentName;
     }
 }
 
-BOOLEAN NTAPI EnpEnumDirectoryFile(
-    _In_ PFILE_DIRECTORY_INFORMATION Information,
-    _In_opt_ PVOID Context
+BOOLEAN EnpIsChangedFileInfo(
+    _In_opt_ PEN_CHANGE_SET Changes,
+    _Inout_ PEN_FILEINFO FileInfo
     )
 {
-    PEN_POPULATE_FS_CONTEXT context = Context;
-    PH_STRINGREF fileName;
-    PEN_FILEINFO fileInfo;
-
-    fileName.Buffer = Information->FileName;
-    fileName.Length = Information->FileNameLength;
+    PPH_STRING fileName;
+    BOOLEAN changed;
 
-    if (PhEqualStringRef2(&fileName, L".", FALSE))
-        return TRUE;
-    if (PhEqualStringRef2(&fileName, L"..", FALSE))
+    if (!Changes)
         return TRUE;
 
-    // Never follow symbolic links, mount points or other reparse points.
-    if (Information->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+    if (FileInfo->Parent && FileInfo->Parent->FsChanged)
+        FileInfo->FsChanged = TRUE;
+    if (FileInfo->FsChanged)
         return TRUE;
 
-    fileInfo = EnpCreateFileInfo(context->FileInfo, &fileName, &fileName);
-
-    if (!EnpMatchFileName(context->Config, fileInfo->FullSourceFileName) ||
-        (!(Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !EnpMatchFileSize(context->Config, fileInfo->FullSourceFileName, &Information->EndOfFile)))
-    {
-        EnpDestroyFileInfo(fileInfo);
-        return TRUE;
-    }
+    fileName = EnpGetFullSourceFileName(FileInfo);
 
-    if (Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-    {
-        fileInfo->Directory = TRUE;
-        fileInfo->FsExpand = TRUE;
-    }
-    else
+    if (EnpFindInFileNameHashtable(Changes->Subtrees, &fileName->sr))
     {
-        fileInfo->Directory = FALSE;
-    }
-
-    fileInfo->FileInformation.CreationTime = Information->CreationTime;
-    fileInfo->FileInformation.LastAccessTime = Information->LastAccessTime;
-    fileInfo->FileInformation.LastWriteTime = Information->LastWriteTime;
-    fileInfo->FileInformation.ChangeTime = Information->ChangeTime;
-    fileInfo->FileInformation.AllocationSize = Information->AllocationSize;
-    fileInfo->FileInformation.EndOfFile = Information->EndOfFile;
-    fileInfo->FileInformation.FileAttributes = Information->FileAttributes;
+        FileInfo->FsChanged = TRUE;
+        changed = TRUE;
+    }
+    else
+    {
+        // Directories that were created from the configuration instead of being listed are cheap
+        // to compare, and the configuration may have changed since the last backup.
+        changed = EnpFindInFileNameHashtable(Changes->Directories, &fileName->sr) || !FileInfo->FsExpand;
+    }
 
-    PhAddEntryHashtable(context->FileInfo->Files, &fileInfo);
+    PhDereferenceObject(fileName);
 
-    return TRUE;
+    return changed;
 }
 
-NTSTATUS EnpPopulateFsFileInfo(
+NTSTATUS EnpQueryJournalChanges(
     _In_ PBK_CONFIG Config,
-    _Inout_ PEN_FILEINFO FileInfo,
-    _In_opt_ PBK_VSS_OBJECT Vss
+    _In_opt_ PPH_STRINGREF Cursor,
+    _Inout_opt_ PEN_CHANGE_SET ChangeSet,
+    _Out_ PPH_STRING *NewCursor
     )
 {
     NTSTATUS status;
-    EN_POPULATE_FS_CONTEXT context;
     HANDLE fileHandle;
-    PPH_STRING sourceFileName;
-    WCHAR buffer[4];
-    PWSTR fileName;
-
-    context.Config = Config;
-    context.FileInfo = FileInfo;
-
-    sourceFileName = FileInfo->FullSourceFileName;
-    PhReferenceObject(sourceFileName);
-
-    if (Vss)
-    {
-        PhMoveReference(&sourceFileName, BkMapFileNameVssObject(Vss, sourceFileName));
-    }
-
-    fileName = sourceFileName->Buffer;
+    IO_STATUS_BLOCK iosb;
+    FILE_BASIC_INFORMATION basicInfo;
+    LARGE_INTEGER fileSize;
+    PH_STRINGREF creationTimeString;
+    PH_STRINGREF offsetString;
+    LONG64 creationTime;
+    LONG64 offset;
+    LARGE_INTEGER byteOffset;
+    ULONG bufferSize;
+    PCHAR buffer;
+    ULONG length;
+    PPH_STRING text;
+    PH_STRINGREF remainingText;
+    PH_STRINGREF line;
 
-    // Drive names need a backslash after them.
-    if (sourceFileName->Length == 2 * sizeof(WCHAR) && sourceFileName->Buffer[1] == ':')
-    {
-        buffer[0] = sourceFileName->Buffer[0];
-        buffer[1] = ':';
-        buffer[2] = '\\';
-        buffer[3] = 0;
-        fileName = buffer;
-    }
+    // The journal is a UTF-8 text file with one file name per line, and it is only ever appended
+    // to. The cursor contains the creation time of the journal, so that a journal that has been
+    // deleted and created again is detected, and the number of bytes that have been read.
 
     status = PhCreateFileWin32(
         &fileHandle,
-        fileName,
-        FILE_LIST_DIRECTORY | SYNCHRONIZE,
+        Config->ChangeJournal->Buffer,
+        FILE_GENERIC_READ,
         0,
         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
         FILE_OPEN,
-        FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT
+        FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT
         );
 
-    if (!NT_SUCCESS(status))
-    {
-        status = PhCreateFileWin32(
-            &fileHandle,
-            fileName,
-            FILE_LIST_DIRECTORY | SYNCHRONIZE,
-            0,
-            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-            FILE_OPEN,
-            FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
-            );
-    }
-
-    PhDereferenceObject(sourceFileName);
-
     if (!NT_SUCCESS(status))
         return status;
 
-    if (!FileInfo->Files)
-        EnpCreateHashtableFileInfo(FileInfo);
+    status = NtQueryInformationFile(fileHandle, &iosb, &basicInfo, sizeof(FILE_BASIC_INFORMATION), FileBasicInformation);
 
-    PhEnumDirectoryFile(fileHandle, NULL, EnpEnumDirectoryFile, &context);
-    NtClose(fileHandle);
+    if (NT_SUCCESS(status))
+        status = PhGetFileSize(fileHandle, &fileSize);
 
-    return STATUS_SUCCESS;
-}
+    if (!NT_SUCCESS(status))
+    {
+        NtClose(fileHandle);
+        return status;
+    }
 
-NTSTATUS EnpUpdateFsFileInfo(
-    _Inout_ PEN_FILEINFO FileInfo,
-    _In_opt_ PBK_VSS_OBJECT Vss
-    )
-{
-    NTSTATUS status;
-    PPH_STRING fileName;
+    if (!Cursor)
+    {
+        NtClose(fileHandle);
+        *NewCursor = PhFormatString(L"%I64x %I64u", basicInfo.CreationTime.QuadPart, fileSize.QuadPart);
+        return STATUS_SUCCESS;
+    }
 
-    if (Vss)
+    if (!PhSplitStringRefAtChar(Cursor, ' ', &creationTimeString, &offsetString) ||
+        !PhStringToInteger64(&creationTimeString, 16, &creationTime) ||
+        !PhStringToInteger64(&offsetString, 10, &offset) ||
+        creationTime != basicInfo.CreationTime.QuadPart ||
+        offset < 0 || offset > fileSize.QuadPart)
     {
-        fileName = BkMapFileNameVssObject(Vss, FileInfo->FullSourceFileName);
+        // The journal has been replaced or truncated.
+        NtClose(fileHandle);
+        return STATUS_INVALID_PARAMETER;
     }
-    else
+
+    if (fileSize.QuadPart - offset > EN_MAXIMUM_CHANGE_JOURNAL_READ)
     {
-        fileName = FileInfo->FullSourceFileName;
-        PhReferenceObject(fileName);
+        // Comparing all files is faster than processing this many changes.
+        NtClose(fileHandle);
+        return STATUS_FILE_TOO_LARGE;
     }
 
-    status = EnpQueryFullAttributesFileWin32(fileName->Buffer, &FileInfo->FileInformation);
-    PhDereferenceObject(fileName);
+    bufferSize = (ULONG)(fileSize.QuadPart - offset);
+    length = 0;
 
-    return status;
-}
+    if (bufferSize != 0)
+    {
+        buffer = PhAllocatePage(bufferSize, NULL);
 
-VOID EnpSetDiffFlagsFileInfo(
-    _Inout_ PEN_FILEINFO FileInfo,
-    _In_ UCHAR DiffFlags
-    )
-{
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_FILEINFO *fileInfoPtr;
+        if (!buffer)
+        {
+            NtClose(fileHandle);
+            return STATUS_NO_MEMORY;
+        }
 
-    FileInfo->DiffFlags = DiffFlags;
+        byteOffset.QuadPart = offset;
+        status = NtReadFile(fileHandle, NULL, NULL, NULL, &iosb, buffer, bufferSize, &byteOffset, NULL);
 
-    if (FileInfo->Files)
-    {
-        PhBeginEnumHashtable(FileInfo->Files, &enumContext);
+        if (NT_SUCCESS(status))
+        {
+            // Ignore the last line if the watcher has not finished writing it.
+
+            length = (ULONG)iosb.Information;
+
+            while (length != 0 && buffer[length - 1] != '\n')
+                length--;
+
+            if (length != 0 && ChangeSet)
+            {
+                text = PhConvertUtf8ToUtf16Ex(buffer, length);
+                remainingText = text->sr;
 
-        while (fileInfoPtr = PhNextEnumHashtable(&enumContext))
-            EnpSetDiffFlagsFileInfo(*fileInfoPtr, DiffFlags);
+                while (remainingText.Length != 0)
+                {
+                    PhSplitStringRefAtChar(&remainingText, '\n', &line, &remainingText);
+                    EnpAddToChangeSet(ChangeSet, &line);
+                }
+
+                PhDereferenceObject(text);
+            }
+        }
+
+        PhFreePage(buffer);
     }
+
+    NtClose(fileHandle);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    *NewCursor = PhFormatString(L"%I64x %I64u", basicInfo.CreationTime.QuadPart, offset + length);
+
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS EnpCreateTransaction(
@@ -4486,28 +8583,21 @@ VOID EnpConfigureVssObject(
     )
 {
     HRESULT result;
-    PH_HASHTABLE_ENUM_CONTEXT enumContext;
-    PEN_FILEINFO *filePtr;
     PEN_FILEINFO file;
     BOOLEAN added[26];
     WCHAR buffer[4];
     PPH_STRING volume;
 
-    if (!Root->Files)
-        return;
-
     memset(added, 0, sizeof(added));
-    PhBeginEnumHashtable(Root->Files, &enumContext);
 
-    while (filePtr = PhNextEnumHashtable(&enumContext))
+    for (file = Root->Files; file; file = file->Next)
     {
-        file = *filePtr;
-
-        if (file->FullSourceFileName->Length >= 2 * sizeof(WCHAR) && file->FullSourceFileName->Buffer[1] == ':')
+        // The source name of a base name is a full file name.
+        if (file->SourceName.Length >= 2 * sizeof(WCHAR) && file->SourceName.Buffer[1] == ':')
         {
             WCHAR letter;
 
-            letter = file->FullSourceFileName->Buffer[0];
+            letter = file->SourceName.Buffer[0];
 
             if (letter >= 'a' && letter <= 'z')
             {
@@ -4542,36 +8632,10 @@ BOOLEAN EnpMatchFileName(
     _In_ PPH_STRING FileName
     )
 {
-    ULONG i;
-    PPH_STRING filter;
-    BOOLEAN include;
-
-    if (Config->IncludeList->Count != 0)
-    {
-        include = FALSE;
-
-        for (i = 0; i < Config->IncludeList->Count; i++)
-        {
-            filter = Config->IncludeList->Items[i];
-
-            if (PhMatchWildcards(filter->Buffer, FileName->Buffer, TRUE))
-            {
-                include = TRUE;
-                break;
-            }
-        }
-
-        if (!include)
-            return FALSE;
-    }
-
-    for (i = 0; i < Config->ExcludeList->Count; i++)
-    {
-        filter = Config->ExcludeList->Items[i];
-
-        if (PhMatchWildcards(filter->Buffer, FileName->Buffer, TRUE))
-            return FALSE;
-    }
+    if (Config->IncludeList->Count != 0 && !BkMatchFilterSet(&Config->IncludeFilterSet, FileName))
+        return FALSE;
+    if (BkMatchFilterSet(&Config->ExcludeFilterSet, FileName))
+        return FALSE;
 
     return TRUE;
 }
@@ -4583,7 +8647,6 @@ BOOLEAN EnpMatchFileSize(
     )
 {
     ULONG i;
-    PPH_STRING filter;
     BOOLEAN include;
 
     if (Config->IncludeSizeList->Count != 0)
@@ -4592,9 +8655,7 @@ BOOLEAN EnpMatchFileSize(
 
         for (i = 0; i < Config->IncludeSizeList->Count; i++)
         {
-            filter = Config->IncludeSizeList->Items[i];
-
-            if (EnpMatchFileSizeAgainstExpression(filter, FileName, Size))
+            if (BkMatchSizeFilter(&Config->IncludeSizeFilters[i], FileName, Size))
             {
                 include = TRUE;
                 break;
@@ -4607,114 +8668,13 @@ BOOLEAN EnpMatchFileSize(
 
     for (i = 0; i < Config->ExcludeSizeList->Count; i++)
     {
-        filter = Config->ExcludeSizeList->Items[i];
-
-        if (EnpMatchFileSizeAgainstExpression(filter, FileName, Size))
+        if (BkMatchSizeFilter(&Config->ExcludeSizeFilters[i], FileName, Size))
             return FALSE;
     }
 
     return TRUE;
 }
 
-BOOLEAN EnpMatchFileSizeAgainstExpression(
-    _In_ PPH_STRING String,
-    _In_ PPH_STRING FileName,
-    _In_ PLARGE_INTEGER Size
-    )
-{
-    PH_STRINGREF filePart;
-    PH_STRINGREF string;
-    ULONG64 integer;
-
-    if (String->Length == 0)
-        return FALSE;
-
-    if (!PhSplitStringRefAtLastChar(&String->sr, '|', &filePart, &string))
-    {
-        PhInitializeEmptyStringRef(&filePart);
-        string = String->sr;
-    }
-
-    if (filePart.Length != 0)
-    {
-        PPH_STRING filePartString;
-
-        filePartString = PhCreateStringEx(filePart.Buffer, filePart.Length);
-
-        if (!PhMatchWildcards(filePartString->Buffer, FileName->Buffer, TRUE))
-        {
-            PhDereferenceObject(filePartString);
-            return FALSE;
-        }
-
-        PhDereferenceObject(filePartString);
-    }
-
-    if (string.Buffer[0] == '>')
-    {
-        string.Buffer++;
-        string.Length -= sizeof(WCHAR);
-        integer = EnpStringToSize(&string);
-
-        if ((ULONG64)Size->QuadPart > integer)
-            return TRUE;
-    }
-    else if (string.Buffer[0] == '<')
-    {
-        string.Buffer++;
-        string.Length -= sizeof(WCHAR);
-        integer = EnpStringToSize(&string);
-
-        if ((ULONG64)Size->QuadPart < integer)
-            return TRUE;
-    }
-
-    return FALSE;
-}
-
-ULONG64 EnpStringToSize(
-    _In_ PPH_STRINGREF String
-    )
-{
-    PH_STRINGREF string;
-    ULONG64 integer;
-    ULONG64 multiplier;
-
-    string = *String;
-    multiplier = 1;
-
-    if (PhEndsWithStringRef2(&string, L"KB", TRUE))
-    {
-        string.Length -= 2 * sizeof(WCHAR);
-        multiplier = 1024;
-    }
-    else if (PhEndsWithStringRef2(&string, L"MB", TRUE))
-    {
-        string.Length -= 2 * sizeof(WCHAR);
-        multiplier = 1024 * 1024;
-    }
-    else if (PhEndsWithStringRef2(&string, L"GB", TRUE))
-    {
-        string.Length -= 2 * sizeof(WCHAR);
-        multiplier = 1024 * 1024 * 1024;
-    }
-    else if (string.Length >= 2 * sizeof(WCHAR) &&
-        PhEndsWithStringRef2(&string, L"B", TRUE) &&
-        PhIsDigitCharacter(string.Buffer[string.Length / sizeof(WCHAR) - 2]))
-    {
-        string.Length -= sizeof(WCHAR);
-    }
-    else
-    {
-        return 0;
-    }
-
-    PhStringToInteger64(&string, 10, &integer);
-    integer *= multiplier;
-
-    return integer;
-}
-
 PPH_STRING EnpMapFileName(
     _In_ PBK_CONFIG Config,
     _In_opt_ PPH_STRINGREF FileName,
@@ -4817,7 +8777,8 @@ NTSTATUS EnpQueryFullAttributesFileWin32(
 NTSTATUS EnpRenameFileWin32(
     _In_opt_ HANDLE FileHandle,
     _In_opt_ PWSTR FileName,
-    _In_ PWSTR NewFileName
+    _In_ PWSTR NewFileName,
+    _In_ BOOLEAN ReplaceIfExists
     )
 {
     NTSTATUS status;
@@ -4858,7 +8819,7 @@ NTSTATUS EnpRenameFileWin32(
         {
             renameInfoSize = FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) + newFileNameNt.Length;
             renameInfo = PhAllocate(renameInfoSize);
-            renameInfo->ReplaceIfExists = FALSE;
+            renameInfo->ReplaceIfExists = ReplaceIfExists;
             renameInfo->RootDirectory = NULL;
             renameInfo->FileNameLength = newFileNameNt.Length;
             memcpy(renameInfo->FileName, newFileNameNt.Buffer, newFileNameNt.Length);
@@ -5058,6 +9019,102 @@ PPH_STRING EnpFormatPackageName(
     return PhFormat(format, 4, Config->DestinationDirectory->Length + 20 * sizeof(WCHAR));
 }
 
+PPH_STRING EnpFormatPackagePartName(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartId
+    )
+{
+    PH_FORMAT format[6];
+    ULONG count;
+
+    if (PartId == EN_PACKAGE_PART_MAIN)
+        return EnpFormatPackageName(Config, RevisionId);
+
+    PhInitFormatSR(&format[0], Config->DestinationDirectory->sr);
+    PhInitFormatC(&format[1], '\\');
+    PhInitFormatI64U(&format[2], RevisionId);
+    format[2].Type |= FormatUseRadix | FormatPadZeros;
+    format[2].Width = 16;
+    format[2].Radix = 16;
+
+    if (PartId == EN_PACKAGE_PART_STORE)
+    {
+        PhInitFormatS(&format[3], L".store");
+        count = 4;
+    }
+    else if (PartId == EN_PACKAGE_PART_SMALL)
+    {
+        PhInitFormatS(&format[3], L".small");
+        count = 4;
+    }
+    else
+    {
+        // The second compressed part is .1.7z, the third is .2.7z, and so on.
+        PhInitFormatC(&format[3], '.');
+        PhInitFormatU(&format[4], PartId - EN_PACKAGE_PART_STORE);
+        count = 5;
+    }
+
+    PhInitFormatS(&format[count], L".7z");
+
+    return PhFormat(format, count + 1, Config->DestinationDirectory->Length + 26 * sizeof(WCHAR));
+}
+
+VOID EnpDeletePackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    )
+{
+    NTSTATUS status;
+    PPH_STRING packageFileName;
+    ULONG partId;
+
+    for (partId = 0; partId < EN_MAXIMUM_PACKAGE_PARTS; partId++)
+    {
+        packageFileName = EnpFormatPackagePartName(Config, RevisionId, partId);
+        status = PhDeleteFileWin32(packageFileName->Buffer);
+
+        // It's OK if the file didn't exist.
+        if (!NT_SUCCESS(status) && status != STATUS_OBJECT_PATH_NOT_FOUND && status != STATUS_OBJECT_NAME_NOT_FOUND)
+            MessageHandler(EN_MESSAGE_WARNING, PhFormatString(L"Unable to delete %s", packageFileName->Buffer));
+
+        PhDereferenceObject(packageFileName);
+    }
+}
+
+VOID EnpInitializePartCompression(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_COMPRESSION_SETTINGS Base,
+    _In_ ULONG PartId,
+    _Out_ PPK_COMPRESSION_SETTINGS Settings
+    )
+{
+    *Settings = *Base;
+
+    if (PartId == EN_PACKAGE_PART_STORE)
+    {
+        Settings->Level = 0;
+        Settings->Method = PkCopyMethod;
+        Settings->DictionarySize = PK_COMPRESSION_DEFAULT;
+    }
+    else if (PartId == EN_PACKAGE_PART_SMALL)
+    {
+        // Small solid blocks give most of the ratio of a fully solid package, while restoring a
+        // single file only decompresses the block that contains it. This is used instead of a
+        // trained dictionary, which 7-Zip doesn't support.
+        if (Config->SmallFileBlockSize != 0)
+            Settings->SolidBlockSize = Config->SmallFileBlockSize;
+        else
+            Settings->SolidBlockSize = EN_DEFAULT_SMALL_FILE_BLOCK_SIZE;
+
+        // Small files of the same type compress much better next to each other.
+        if (Settings->SortByType == PK_COMPRESSION_DEFAULT)
+            Settings->SortByType = 1;
+    }
+}
+
 PPH_STRING EnpFormatTempDatabaseFileName(
     _In_ PBK_CONFIG Config,
     _In_ BOOLEAN SameDirectory
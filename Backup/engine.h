@@ -49,6 +49,28 @@ NTSTATUS EnTrimToRevision(
     _Out_opt_ PULONGLONG FirstRevisionId
     );
 
+typedef struct _EN_REVISION_RANGE
+{
+    ULONGLONG FirstRevisionId;
+    ULONGLONG LastRevisionId;
+} EN_REVISION_RANGE, *PEN_REVISION_RANGE;
+
+NTSTATUS EnSquashRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_opt_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_opt_ PULONGLONG RevisionId
+    );
+
+NTSTATUS EnRecompressRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ ULONGLONG LastRevisionId,
+    _In_opt_ PLARGE_INTEGER MaximumTimeStamp,
+    _In_opt_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_opt_ PULONG NumberOfPackages
+    );
+
 #define EN_RESTORE_OVERWRITE_FILES 0x1
 
 NTSTATUS EnRestoreFromRevision(
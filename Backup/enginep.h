@@ -10,42 +10,172 @@ typedef enum _EN_FILEINFO_STATE
 
 #define EN_DIFF_SWITCHED 0x1 // this file or a parent was switched from a file to a directory
 
+#define EN_SCAN_STATE_NONE 0
+#define EN_SCAN_STATE_PENDING 1 // waiting to be listed in advance
+#define EN_SCAN_STATE_QUEUED 2 // being listed by EnpScanDirectoryWorker
+#define EN_SCAN_STATE_LISTED 3 // listed in advance, not yet reached by the walk
+
+#define EN_SCAN_LOOKAHEAD_PER_THREAD 16 // directories listed ahead of the walk for each scan thread
+
+#define EN_FILEINFO_MINIMUM_BLOCK_SIZE 4096
+#define EN_FILEINFO_MAXIMUM_BLOCK_SIZE (1024 * 1024)
+
+typedef struct _EN_FILEINFO_BLOCK
+{
+    struct _EN_FILEINFO_BLOCK *Next;
+    SIZE_T Size;
+    SIZE_T Used;
+} EN_FILEINFO_BLOCK, *PEN_FILEINFO_BLOCK;
+
+// The files in a directory are allocated in blocks owned by the directory, so they can be freed
+// as soon as the directory has been processed. Full file names are not stored; use
+// EnpGetFullFileName and EnpGetFullSourceFileName.
 typedef struct _EN_FILEINFO
 {
     SINGLE_LIST_ENTRY ListEntry;
     struct _EN_FILEINFO *Parent;
+    struct _EN_FILEINFO *Next; // next file in the parent directory
     BOOLEAN Directory;
     BOOLEAN FsExpand; // fill in file list from file system
     BOOLEAN NeedFsInfo; // fill in FileInformation
     UCHAR DiffFlags; // inherited diff flags
-    PH_STRINGREF Key;
-    PPH_STRING Name; // example.txt
-    PPH_STRING FullFileName; // mapping:\folder\example.txt (file name in database)
-    PPH_STRING FullSourceFileName; // D:\folder\example.txt (file name in file system)
+    BOOLEAN FsChanged; // everything below this directory must be compared
+    UCHAR ScanState; // EN_SCAN_STATE_*
+    NTSTATUS FsStatus; // result of filling in the file list
+    ULONGLONG FsStamp; // fingerprint of the directory and its list of files, 0 if unknown
+    PH_STRINGREF Name; // example.txt (component of the file name in database)
+    PH_STRINGREF SourceName; // same as Name, except for base names (D:\folder)
     FILE_NETWORK_OPEN_INFORMATION FileInformation;
 
-    PPH_HASHTABLE Files;
+    struct _EN_FILEINFO *Files; // first file in this directory
+    ULONG NumberOfFiles;
+    PEN_FILEINFO_BLOCK Blocks; // memory for the files in this directory
+    struct _EN_FILEINFO *ScanNext; // next directory waiting to be listed in advance
 
     // State
-    PH_HASHTABLE_ENUM_CONTEXT EnumContext;
+    struct _EN_FILEINFO *EnumFile; // next file to process
     EN_FILEINFO_STATE State;
     PDBF_FILE DbFile;
-    PPH_FILE_STREAM FileStream;
-    BOOLEAN FileStreamAttempted;
 } EN_FILEINFO, *PEN_FILEINFO;
 
+// A file that is added to a package. Only these are kept until the package is created, not the
+// file info tree. There is no limit on their total size and they are never written to disk:
+// 7-Zip reads the properties of every item before it compresses any of them, so the names are
+// needed in memory when the package is created anyway.
+typedef struct _EN_PACKAGE_FILE
+{
+    PPH_STRING FileName; // mapping\folder\example.txt
+    PEN_FILEINFO BaseFileInfo; // file info for "mapping", which is kept with the root
+    FILE_NETWORK_OPEN_INFORMATION FileInformation;
+    BOOLEAN Directory;
+    BOOLEAN FileStreamAttempted;
+    PPH_FILE_STREAM FileStream;
+} EN_PACKAGE_FILE, *PEN_PACKAGE_FILE;
+
+// Package parts
+#define EN_PACKAGE_PART_MAIN 0
+#define EN_PACKAGE_PART_STORE 1 // uncompressed, for files that don't compress
+#define EN_MAXIMUM_PACKAGE_PARTS 16
+#define EN_PACKAGE_PART_SMALL (EN_MAXIMUM_PACKAGE_PARTS - 1) // small solid blocks, for small files
+#define EN_MAXIMUM_COMPRESSED_PARTS (EN_MAXIMUM_PACKAGE_PARTS - 2)
+
+// Compressed parts after the first one come after the store part.
+#define EN_COMPRESSED_PART_ID(Index) ((Index) == 0 ? EN_PACKAGE_PART_MAIN : EN_PACKAGE_PART_STORE + (Index))
+
+// Files larger than ChunkSize are stored as separate items named <file>:<offset>, where the
+// offset is 16 hexadecimal digits.
+#define EN_CHUNK_SIZE(Config) ((ULONGLONG)(Config)->ChunkSize * 1024 * 1024)
+#define EN_CHUNK_SEPARATOR ':'
+
+#define EN_DEFAULT_SMALL_FILE_BLOCK_SIZE 1 // in MB
+
+// With UnbufferedReads, two blocks are allocated for each file that is being compressed.
+#define EN_UNBUFFERED_READ_SIZE (1024 * 1024)
+
+#define EN_STORE_SAMPLE_SIZE (64 * 1024)
+#define EN_STORE_ENTROPY_THRESHOLD 7.9 // bits per byte
+
+typedef struct _EN_PACKAGE_PROGRESS
+{
+    PH_QUEUED_LOCK Lock;
+    ULONGLONG Value[EN_MAXIMUM_PACKAGE_PARTS];
+    ULONGLONG Total[EN_MAXIMUM_PACKAGE_PARTS];
+} EN_PACKAGE_PROGRESS, *PEN_PACKAGE_PROGRESS;
+
+// Read-ahead
+// Small files are read into memory on I/O threads before the compressor asks for them. Larger
+// files and chunks are read by the compressor.
+#define EN_READ_AHEAD_MAXIMUM_FILE_SIZE (8 * 1024 * 1024)
+#define EN_READ_AHEAD_MAXIMUM_FILES 64 // files that have been read but not compressed
+#define EN_READ_AHEAD_THREADS 2 // for each part
+
+typedef enum _EN_READ_AHEAD_STATE
+{
+    ReadAheadNone,
+    ReadAheadQueued,
+    ReadAheadCompleted,
+    ReadAheadTaken
+} EN_READ_AHEAD_STATE;
+
+typedef struct _EN_READ_AHEAD_ENTRY
+{
+    struct _EN_READ_AHEAD *ReadAhead;
+    PEN_PACKAGE_FILE File;
+    EN_READ_AHEAD_STATE State;
+    ULONG Position; // in Order, or -1 if the file is not read ahead
+    SIZE_T Size; // counted against the budget
+
+    // Results
+    NTSTATUS Status;
+    PVOID Buffer;
+    SIZE_T Length;
+} EN_READ_AHEAD_ENTRY, *PEN_READ_AHEAD_ENTRY;
+
+typedef struct _EN_READ_AHEAD_ORDER_ENTRY
+{
+    PH_STRINGREF Name;
+    PH_STRINGREF Extension; // only used when sorting by type
+    ULONG Index;
+} EN_READ_AHEAD_ORDER_ENTRY, *PEN_READ_AHEAD_ORDER_ENTRY;
+
+typedef struct _EN_READ_AHEAD
+{
+    PH_QUEUED_LOCK Lock;
+    PH_QUEUED_LOCK Condition;
+    PH_WORK_QUEUE WorkQueue;
+    PBK_VSS_OBJECT Vss;
+    SIZE_T Budget;
+    SIZE_T BufferedSize; // memory for files that have not been given to the compressor
+    ULONG NumberOfBufferedFiles;
+
+    PPK_ACTION_LIST ActionList;
+    PEN_READ_AHEAD_ENTRY Entries; // one for each action
+    PULONG Order; // action indices in the order that the compressor asks for them
+    ULONG NumberOfOrderEntries;
+    ULONG NextPosition; // next entry in Order to read
+} EN_READ_AHEAD, *PEN_READ_AHEAD;
+
 typedef struct _EN_PACKAGE_CALLBACK_CONTEXT
 {
     PBK_CONFIG Config;
     PDB_DATABASE Database;
     PBK_VSS_OBJECT Vss;
-    PEN_MESSAGE_HANDLER MessageHandler;
+    PEN_MESSAGE_HANDLER MessageHandler; // NULL on threads that must not report messages
 
     union
     {
         struct
         {
-            PPH_HASHTABLE IgnoreFileNames;
+            ULONG PartId;
+            PEN_PACKAGE_PROGRESS Progress; // shared by parts that are compressed at the same time
+            PEN_READ_AHEAD ReadAhead;
+            struct _EN_PACKAGE_PIPELINE *Pipeline; // set if the part is compressed during the diff
+        } Backup;
+        struct
+        {
+            PPH_HASHTABLE PathTable;
+            PULONG IgnorePathIds;
+            ULONG NumberOfIgnorePathIds;
         } Merge;
         struct
         {
@@ -55,6 +185,7 @@ typedef struct _EN_PACKAGE_CALLBACK_CONTEXT
 
             PPH_STRINGREF BaseFileName;
             PPH_HASHTABLE FileNames;
+            PPH_HASHTABLE ChunkedFiles; // files that chunks have been written to
         } Restore;
     };
 } EN_PACKAGE_CALLBACK_CONTEXT, *PEN_PACKAGE_CALLBACK_CONTEXT;
@@ -64,8 +195,130 @@ typedef struct _EN_REVISION_ENTRY
     ULONGLONG RevisionId;
     PPH_HASHTABLE FileNames;
     PPH_HASHTABLE DirectoryNames;
+    PH_ARRAY PathIds; // sorted, used when merging
+    ULONG PartMask; // parts that contain FileNames, used when restoring
 } EN_REVISION_ENTRY, *PEN_REVISION_ENTRY;
 
+typedef struct _EN_PATH_ENTRY
+{
+    ULONG ParentId;
+    ULONG Id;
+    PPH_STRING Name;
+} EN_PATH_ENTRY, *PEN_PATH_ENTRY;
+
+typedef struct _EN_MERGE_PACKAGE_ENTRY
+{
+    ULONGLONG RevisionId;
+    PPH_STRING FileName;
+    BOOLEAN Filter;
+    EN_PACKAGE_CALLBACK_CONTEXT Context;
+
+    // Results
+    NTSTATUS Status;
+    HRESULT Result;
+    PPK_PACKAGE Package;
+    PPK_ACTION_LIST ActionList;
+} EN_MERGE_PACKAGE_ENTRY, *PEN_MERGE_PACKAGE_ENTRY;
+
+typedef struct _EN_PACKAGE_PART_ENTRY
+{
+    PPH_STRING FileName;
+    PPK_FILE_STREAM FileStream;
+    PPK_ACTION_LIST ActionList;
+    PK_COMPRESSION_SETTINGS Settings;
+    EN_PACKAGE_CALLBACK_CONTEXT Context;
+    SIZE_T ReadAheadSize;
+
+    // Results
+    HRESULT Result;
+} EN_PACKAGE_PART_ENTRY, *PEN_PACKAGE_PART_ENTRY;
+
+// Pipeline
+// With PipelineSize, new files are compressed in batches while the diff is still running. Each
+// batch is a separate compressed part, taken from the last part IDs so that the parts created
+// after the diff are not affected. Directories, small files and files that are stored without
+// compression are always packaged after the diff.
+#define EN_PIPELINE_SIZE(Config) ((ULONGLONG)(Config)->PipelineSize * 1024 * 1024)
+#define EN_PIPELINE_MAXIMUM_PENDING 2 // batches that are queued or being compressed
+
+typedef struct _EN_PACKAGE_PIPELINE
+{
+    PBK_CONFIG Config;
+    HANDLE TransactionHandle;
+    PDB_DATABASE Database;
+    PDBF_FILE HeadDirectory;
+    ULONGLONG RevisionId;
+    PPK_ACTION_LIST ActionList; // filled by the diff
+    PBK_VSS_OBJECT Vss;
+    PEN_MESSAGE_HANDLER MessageHandler;
+
+    ULONG FlushedIndex; // actions before this have been given to a batch or RemainingActionList
+    ULONG ScanIndex; // actions before this have been counted in PendingSize
+    ULONGLONG PendingSize;
+    ULONG MaximumBatches;
+    ULONG NumberOfBatches;
+    BOOLEAN Stopped;
+    NTSTATUS Status;
+
+    PH_QUEUED_LOCK Lock;
+    PH_QUEUED_LOCK Condition;
+    PH_WORK_QUEUE WorkQueue;
+    ULONG NumberOfPendingBatches; // protected by Lock
+    PPK_ACTION_LIST DeferredActionList; // protected by Lock, files that are stored without compression
+    LONG64 ElapsedTime; // time spent compressing batches
+
+    PPK_ACTION_LIST RemainingActionList; // packaged after the diff
+    EN_PACKAGE_PART_ENTRY PartEntries[EN_MAXIMUM_PACKAGE_PARTS];
+    EN_PACKAGE_PROGRESS Progress;
+} EN_PACKAGE_PIPELINE, *PEN_PACKAGE_PIPELINE;
+
+typedef struct _EN_PART_SIZE_ENTRY
+{
+    ULONGLONG Size;
+    ULONG Index;
+} EN_PART_SIZE_ENTRY, *PEN_PART_SIZE_ENTRY;
+
+typedef struct _EN_CHUNKED_FILE_ENTRY
+{
+    PPH_STRING FileName; // must be first, see EnpFileNameCompareFunction
+    FILE_NETWORK_OPEN_INFORMATION FileInformation;
+} EN_CHUNKED_FILE_ENTRY, *PEN_CHUNKED_FILE_ENTRY;
+
+// Skipped directories
+
+// Stores a hash of the settings that select the files to back up. A directory can only be skipped
+// if the settings are the same as when its files were last compared.
+#define EN_FILTER_HASH_NAME L"filters.bk"
+
+// Change sources
+
+#define EN_CHANGE_CURSOR_NAME L"cursor.bk"
+#define EN_MAXIMUM_CHANGE_CURSOR_SIZE 1024 // in bytes
+#define EN_MAXIMUM_CHANGE_JOURNAL_READ (64 * 1024 * 1024) // in bytes
+
+typedef struct _EN_CHANGE_SET
+{
+    PPH_HASHTABLE Subtrees; // changed files and directories
+    PPH_HASHTABLE Directories; // directories that contain changes
+    ULONG Count;
+} EN_CHANGE_SET, *PEN_CHANGE_SET;
+
+// Reports the files that changed after Cursor, and returns a cursor for the current position.
+// If Cursor is NULL, only the current position is returned. If Cursor is no longer valid, the
+// function must fail so that all files are compared instead.
+typedef NTSTATUS (*PEN_QUERY_CHANGES)(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PPH_STRINGREF Cursor,
+    _Inout_opt_ PEN_CHANGE_SET ChangeSet,
+    _Out_ PPH_STRING *NewCursor
+    );
+
+typedef struct _EN_CHANGE_SOURCE
+{
+    PWSTR Name;
+    PEN_QUERY_CHANGES QueryChanges;
+} EN_CHANGE_SOURCE, *PEN_CHANGE_SOURCE;
+
 // Backup
 
 NTSTATUS EnpBackupFirstRevision(
@@ -81,6 +334,7 @@ NTSTATUS EnpSyncTreeFirstRevision(
     _In_ PDBF_FILE Directory,
     _Inout_ PEN_FILEINFO Root,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PEN_PACKAGE_PIPELINE Pipeline,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
@@ -114,12 +368,27 @@ NTSTATUS EnpDiffTreeNewRevision(
     _In_ PDBF_FILE HeadDirectory,
     _In_opt_ PDBF_FILE DiffDirectory,
     _Inout_ PEN_FILEINFO Root,
+    _In_opt_ PEN_CHANGE_SET Changes,
     _In_opt_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PEN_PACKAGE_PIPELINE Pipeline,
     _Inout_ PULONGLONG NumberOfChanges,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
 
+ULONG EnpHashFilters(
+    _In_ PBK_CONFIG Config
+    );
+
+BOOLEAN EnpIsSameFilterHash(
+    _In_ PBK_CONFIG Config
+    );
+
+VOID EnpSaveFilterHash(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
 NTSTATUS EnpDiffDirectoryNewRevision(
     _In_ PBK_CONFIG Config,
     _In_ PDB_DATABASE Database,
@@ -127,6 +396,7 @@ NTSTATUS EnpDiffDirectoryNewRevision(
     _In_ PDBF_FILE HeadDirectory,
     _In_opt_ PDBF_FILE DiffDirectory,
     _In_ PEN_FILEINFO FileInfo,
+    _In_ BOOLEAN SkipUnchanged,
     _In_opt_ PPK_ACTION_LIST ActionList,
     _Inout_ PULONGLONG NumberOfChanges,
     _In_opt_ PBK_VSS_OBJECT Vss,
@@ -179,7 +449,7 @@ ULONG EnpDirectoryEntryHashFunction(
 
 PDB_FILE_DIRECTORY_INFORMATION EnpFindDirectoryEntry(
     _In_ PPH_HASHTABLE Hashtable,
-    _In_ PPH_STRING Name
+    _In_ PPH_STRINGREF Name
     );
 
 HRESULT EnpBackupPackageCallback(
@@ -189,12 +459,163 @@ HRESULT EnpBackupPackageCallback(
     _In_opt_ PVOID Context
     );
 
-HRESULT EnpOpenStreamForFile(
-    _In_ PEN_FILEINFO FileInfo,
+NTSTATUS EnpCreatePackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ ULONGLONG RevisionId,
+    _In_ PPK_ACTION_LIST ActionList,
     _In_opt_ PBK_VSS_OBJECT Vss,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
 
+VOID EnpReportPackagePartsCompression(
+    _In_opt_ HANDLE TransactionHandle,
+    _In_reads_(EN_MAXIMUM_PACKAGE_PARTS) PEN_PACKAGE_PART_ENTRY PartEntries,
+    _In_ PEN_PACKAGE_PROGRESS Progress,
+    _In_ LONG64 ElapsedTime,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+VOID EnpAssignPackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_ ULONG NumberOfCompressedParts,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_writes_(ActionList->NumberOfActions) PUCHAR PartIds
+    );
+
+int __cdecl EnpPartSizeCompareFunction(
+    _In_ const void *Entry1,
+    _In_ const void *Entry2
+    );
+
+VOID EnpSetPackagePartFile(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ ULONG PartId,
+    _In_ BOOLEAN Chunk
+    );
+
+PPK_ACTION_LIST EnpCreateChunkedActionList(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_ACTION_LIST ActionList
+    );
+
+PPH_STRING EnpFormatChunkName(
+    _In_ PPH_STRINGREF FileName,
+    _In_ ULONGLONG Offset
+    );
+
+BOOLEAN EnpSplitChunkName(
+    _In_ PPH_STRINGREF Name,
+    _Out_opt_ PPH_STRINGREF FileName,
+    _Out_opt_ PULONGLONG Offset
+    );
+
+ULONGLONG EnpQueryChunkLength(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ ULONGLONG Offset
+    );
+
+NTSTATUS NTAPI EnpCreatePackagePartWorker(
+    _In_ PVOID Parameter
+    );
+
+VOID EnpInitializePackagePipeline(
+    _Out_ PEN_PACKAGE_PIPELINE Pipeline,
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE HeadDirectory,
+    _In_ ULONGLONG RevisionId,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+VOID EnpDeletePackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
+    );
+
+BOOLEAN EnpIsPipelineFile(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File
+    );
+
+VOID EnpFlushPackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
+    );
+
+NTSTATUS NTAPI EnpPackagePipelineWorker(
+    _In_ PVOID Parameter
+    );
+
+NTSTATUS EnpCompletePackagePipeline(
+    _Inout_ PEN_PACKAGE_PIPELINE Pipeline
+    );
+
+BOOLEAN EnpIsIncompressibleFile(
+    _In_ PBK_CONFIG Config,
+    _In_ PEN_PACKAGE_FILE File,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _Out_writes_bytes_(EN_STORE_SAMPLE_SIZE) PVOID Buffer
+    );
+
+BOOLEAN EnpMatchStoreExtension(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRINGREF FileName
+    );
+
+NTSTATUS EnpOpenSourceFile(
+    _In_ PPH_STRING SourceFileName,
+    _In_ BOOLEAN Unbuffered,
+    _Out_ PHANDLE FileHandle
+    );
+
+NTSTATUS EnpOpenStreamForFile(
+    _In_ PEN_PACKAGE_FILE File,
+    _In_ BOOLEAN Unbuffered,
+    _In_opt_ PBK_VSS_OBJECT Vss,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PPH_FILE_STREAM *FileStream
+    );
+
+VOID EnpInitializeReadAhead(
+    _Out_ PEN_READ_AHEAD ReadAhead,
+    _In_ PPK_ACTION_LIST ActionList,
+    _In_ PPK_COMPRESSION_SETTINGS Settings,
+    _In_ SIZE_T Budget,
+    _In_opt_ PBK_VSS_OBJECT Vss
+    );
+
+VOID EnpDeleteReadAhead(
+    _Inout_ PEN_READ_AHEAD ReadAhead
+    );
+
+int __cdecl EnpReadAheadOrderCompareFunction(
+    _In_ const void *Entry1,
+    _In_ const void *Entry2
+    );
+
+VOID EnpFillReadAhead(
+    _Inout_ PEN_READ_AHEAD ReadAhead
+    );
+
+NTSTATUS NTAPI EnpReadAheadWorker(
+    _In_ PVOID Parameter
+    );
+
+BOOLEAN EnpTakeReadAheadStream(
+    _Inout_ PEN_READ_AHEAD ReadAhead,
+    _In_ PPK_ACTION Action,
+    _Out_ PPK_FILE_STREAM *FileStream
+    );
+
 // Merge
 
 NTSTATUS EnpRevertToRevision(
@@ -220,11 +641,26 @@ NTSTATUS EnpTrimToRevision(
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
 
+NTSTATUS EnpCreateMergeRevisionEntries(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG FirstRevisionId,
+    _In_ ULONGLONG LastRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PPH_HASHTABLE *RevisionEntries,
+    _Out_ PPH_HASHTABLE *PathTable
+    );
+
+VOID EnpDestroyMergeRevisionEntries(
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable
+    );
+
 NTSTATUS EnpAddMergeFileNamesFromDirectory(
     _In_ PDB_DATABASE Database,
     _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
     _In_ PDBF_FILE Directory,
-    _In_opt_ PPH_STRING DirectoryName
+    _In_ ULONG DirectoryPathId
     );
 
 NTSTATUS EnpMergePackages(
@@ -233,9 +669,25 @@ NTSTATUS EnpMergePackages(
     _In_ ULONGLONG OldFirstRevisionId,
     _In_ ULONGLONG NewFirstRevisionId,
     _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpMergePackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ ULONGLONG OldFirstRevisionId,
+    _In_ ULONGLONG NewFirstRevisionId,
+    _In_ ULONG PartId,
+    _In_ PPH_HASHTABLE RevisionEntries,
+    _In_ PPH_HASHTABLE PathTable,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
 
+NTSTATUS NTAPI EnpOpenMergePackageWorker(
+    _In_ PVOID Parameter
+    );
+
 HRESULT EnpMergePackageCallback(
     _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
     _In_opt_ PPK_ACTION Action,
@@ -265,6 +717,104 @@ ULONG EnpRevisionEntryHashFunction(
     _In_ PVOID Entry
     );
 
+// Squash
+
+NTSTATUS EnpSquashRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ HANDLE TransactionHandle,
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpUpdateDatabaseAfterSquash(
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpMergeDiffsToDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONGLONG TargetRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpDiffSquashedDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE NewerDirectory,
+    _In_ PDBF_FILE OlderDirectory,
+    _In_ PDBF_FILE DiffDirectory,
+    _In_opt_ PPH_STRING DirectoryName
+    );
+
+VOID EnpDeleteDiffDirectories(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG FirstRevisionId,
+    _In_ ULONGLONG LastRevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpCreateTemporaryDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PWSTR Name,
+    _Out_ PDBF_FILE *Directory
+    );
+
+VOID EnpDeleteTemporaryDirectory(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory
+    );
+
+NTSTATUS EnpRenumberRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpRemapDirectoryRevisionIds(
+    _In_ PDB_DATABASE Database,
+    _In_ PDBF_FILE Directory,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges
+    );
+
+ULONGLONG EnpMapSquashedRevisionId(
+    _In_ ULONGLONG RevisionId,
+    _In_reads_(NumberOfRanges) PEN_REVISION_RANGE Ranges,
+    _In_ ULONG NumberOfRanges
+    );
+
+// Recompress
+
+NTSTATUS EnpRecompressRevisions(
+    _In_ PBK_CONFIG Config,
+    _In_ PDB_DATABASE Database,
+    _In_opt_ ULONGLONG LastRevisionId,
+    _In_opt_ PLARGE_INTEGER MaximumTimeStamp,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PULONG NumberOfPackages
+    );
+
+NTSTATUS EnpRecompressPackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler,
+    _Out_ PBOOLEAN Recompressed
+    );
+
+VOID EnpSetRevisionRecompressed(
+    _In_ PDB_DATABASE Database,
+    _In_ ULONGLONG RevisionId,
+    _In_ BOOLEAN Recompressed
+    );
+
 // Restore
 
 NTSTATUS EnpRestoreFromRevision(
@@ -284,6 +834,7 @@ NTSTATUS EnpRestoreSingleFileFromRevision(
     _In_ ULONG Flags,
     _In_ PPH_STRINGREF FileName,
     _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartMask,
     _In_ PPH_STRINGREF RestoreToDirectory,
     _In_opt_ PPH_STRINGREF RestoreToName,
     _In_ PEN_MESSAGE_HANDLER MessageHandler
@@ -325,6 +876,7 @@ NTSTATUS EnpExtractFromPackage(
     _In_ PBK_CONFIG Config,
     _In_ ULONG Flags,
     _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartMask,
     _In_opt_ PPH_STRINGREF BaseFileName,
     _In_ PPH_HASHTABLE FileNames,
     _In_ PPH_STRINGREF RestoreToDirectory,
@@ -332,6 +884,28 @@ NTSTATUS EnpExtractFromPackage(
     _In_ PEN_MESSAGE_HANDLER MessageHandler
     );
 
+NTSTATUS EnpExtractFromPackagePart(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONG Flags,
+    _In_ PPH_STRING PackageFileName,
+    _In_opt_ PPH_STRINGREF BaseFileName,
+    _In_ PPH_HASHTABLE FileNames,
+    _In_ PPH_HASHTABLE ChunkedFiles,
+    _In_ PPH_STRINGREF RestoreToDirectory,
+    _In_opt_ PPH_STRINGREF RestoreToName,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+VOID EnpCompleteChunkedFiles(
+    _In_ PPH_HASHTABLE ChunkedFiles,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpSetRestoredFileInformation(
+    _In_ HANDLE FileHandle,
+    _In_ PFILE_NETWORK_OPEN_INFORMATION FileInformation
+    );
+
 HRESULT EnpRestorePackageCallback(
     _In_ PK_PACKAGE_CALLBACK_MESSAGE Message,
     _In_opt_ PPK_ACTION Action,
@@ -403,52 +977,161 @@ ULONG EnpFileNameHashFunction(
     _In_ PVOID Entry
     );
 
+// Path IDs
+
+PPH_HASHTABLE EnpCreatePathTable(
+    VOID
+    );
+
+VOID EnpDestroyPathTable(
+    _In_ PPH_HASHTABLE PathTable
+    );
+
+ULONG EnpAddToPathTable(
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ ULONG ParentId,
+    _In_ PPH_STRING Name
+    );
+
+ULONG EnpFindInPathTable(
+    _In_ PPH_HASHTABLE PathTable,
+    _In_ PPH_STRINGREF FileName
+    );
+
+BOOLEAN EnpPathEntryCompareFunction(
+    _In_ PVOID Entry1,
+    _In_ PVOID Entry2
+    );
+
+ULONG EnpPathEntryHashFunction(
+    _In_ PVOID Entry
+    );
+
+VOID EnpSortPathIds(
+    _Inout_ PPH_ARRAY PathIds
+    );
+
+int __cdecl EnpPathIdCompareFunction(
+    _In_ const void *Elem1,
+    _In_ const void *Elem2
+    );
+
+BOOLEAN EnpFindPathId(
+    _In_reads_(NumberOfPathIds) PULONG PathIds,
+    _In_ ULONG NumberOfPathIds,
+    _In_ ULONG PathId
+    );
+
 // File info
 
+#define EN_CACHEDIR_TAG_NAME L"CACHEDIR.TAG"
+#define EN_CACHEDIR_TAG_SIGNATURE "Signature: 8a477f597d28d172789f06886806bc55"
+
+#define EN_SOURCE_STAMP_BASIS 0xcbf29ce484222325
+
 typedef struct _EN_POPULATE_FS_CONTEXT
 {
     PBK_CONFIG Config;
     PEN_FILEINFO FileInfo;
+    PEN_FILEINFO ExistingFiles; // files added before the directory was listed
+    ULONG NumberOfExistingFiles;
+    PH_STRING_BUILDER FileName; // full source file name of the current file
+    SIZE_T DirectoryNameLength;
+    PPH_LIST Markers; // ExcludeMarker files found in the directory
+    ULONGLONG Stamp;
 } EN_POPULATE_FS_CONTEXT, *PEN_POPULATE_FS_CONTEXT;
 
+typedef struct _EN_SCAN_CONTEXT
+{
+    PBK_CONFIG Config;
+    PBK_VSS_OBJECT Vss;
+    PEN_CHANGE_SET Changes;
+    BOOLEAN Parallel;
+    PH_WORK_QUEUE WorkQueue;
+
+    // Walk thread only
+    PEN_FILEINFO PendingDirectories; // in walk order
+    ULONG Lookahead; // directories queued or listed but not yet reached by the walk
+    ULONG MaximumLookahead;
+
+    PH_QUEUED_LOCK Lock; // protects ScanState while a directory is queued
+    PH_QUEUED_LOCK Condition;
+} EN_SCAN_CONTEXT, *PEN_SCAN_CONTEXT;
+
+typedef struct _EN_SCAN_DIRECTORY_ITEM
+{
+    PEN_SCAN_CONTEXT Context;
+    PEN_FILEINFO FileInfo;
+} EN_SCAN_DIRECTORY_ITEM, *PEN_SCAN_DIRECTORY_ITEM;
+
 PEN_FILEINFO EnpCreateFileInfo(
-    _In_opt_ PEN_FILEINFO Parent,
-    _In_opt_ PPH_STRINGREF Name,
+    _Inout_ PEN_FILEINFO Parent,
+    _In_ PPH_STRINGREF Name,
     _In_opt_ PPH_STRINGREF SourceName
     );
 
-BOOLEAN EnpFileInfoCompareFunction(
-    _In_ PVOID Entry1,
-    _In_ PVOID Entry2
+VOID EnpAddFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo,
+    _In_ PEN_FILEINFO ChildFileInfo
     );
 
-ULONG EnpFileInfoHashFunction(
-    _In_ PVOID Entry
+VOID EnpClearFileInfo(
+    _Inout_ PEN_FILEINFO FileInfo
     );
 
-VOID EnpCreateHashtableFileInfo(
-    _Inout_ PEN_FILEINFO FileInfo
+PEN_FILEINFO EnpFindFileInfo(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ PPH_STRINGREF Name
     );
 
-VOID EnpDestroyFileInfo(
-    _In_ PEN_FILEINFO FileInfo
+PEN_FILEINFO EnpCreateRootFileInfo(
+    VOID
     );
 
-VOID EnpClearFileInfo(
+VOID EnpDestroyRootFileInfo(
+    _In_ PEN_FILEINFO Root
+    );
+
+PVOID EnpAllocateFileInfo(
+    _Inout_ PEN_FILEINFO Directory,
+    _In_ SIZE_T Size
+    );
+
+VOID EnpCopyStringRefFileInfo(
+    _Inout_ PEN_FILEINFO Directory,
+    _In_ PPH_STRINGREF String,
+    _Out_ PPH_STRINGREF NewString
+    );
+
+PPH_STRING EnpFormatFullFileName(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ BOOLEAN Source
+    );
+
+PPH_STRING EnpGetFullFileName(
     _In_ PEN_FILEINFO FileInfo
     );
 
-VOID EnpFreeFileInfo(
+PPH_STRING EnpGetFullSourceFileName(
     _In_ PEN_FILEINFO FileInfo
     );
 
-PEN_FILEINFO EnpFindFileInfo(
+PPH_STRING EnpGetVssSourceFileName(
     _In_ PEN_FILEINFO FileInfo,
-    _In_ PPH_STRINGREF Name
+    _In_opt_ PBK_VSS_OBJECT Vss
     );
 
-PEN_FILEINFO EnpCreateRootFileInfo(
-    VOID
+PEN_PACKAGE_FILE EnpCreatePackageFile(
+    _In_ PEN_FILEINFO FileInfo,
+    _In_ PPH_STRING FileName
+    );
+
+VOID EnpDestroyPackageFiles(
+    _In_ PPK_ACTION_LIST ActionList
+    );
+
+PPH_STRING EnpGetPackageFileSourceName(
+    _In_ PEN_PACKAGE_FILE File
     );
 
 VOID EnpMapBaseNamesFileInfo(
@@ -456,6 +1139,10 @@ VOID EnpMapBaseNamesFileInfo(
     _Inout_ PEN_FILEINFO FileInfo
     );
 
+VOID EnpTrimTrailingBackslashes(
+    _Inout_ PPH_STRINGREF String
+    );
+
 VOID EnpAddSourceToRoot(
     _In_ PBK_CONFIG Config,
     _In_ PEN_FILEINFO Root,
@@ -473,12 +1160,57 @@ BOOLEAN NTAPI EnpEnumDirectoryFile(
     _In_opt_ PVOID Context
     );
 
+ULONGLONG EnpHashSourceStamp(
+    _In_ ULONGLONG Stamp,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    );
+
+VOID EnpInitializeScanContext(
+    _Out_ PEN_SCAN_CONTEXT Context,
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PEN_CHANGE_SET Changes,
+    _In_opt_ PBK_VSS_OBJECT Vss
+    );
+
+VOID EnpDeleteScanContext(
+    _Inout_ PEN_SCAN_CONTEXT Context
+    );
+
+VOID EnpScanDirectory(
+    _Inout_ PEN_SCAN_CONTEXT Context,
+    _Inout_ PEN_FILEINFO FileInfo
+    );
+
+VOID EnpQueueScanDirectories(
+    _Inout_ PEN_SCAN_CONTEXT Context
+    );
+
+VOID EnpWaitForScanDirectory(
+    _Inout_ PEN_SCAN_CONTEXT Context,
+    _Inout_ PEN_FILEINFO FileInfo
+    );
+
+NTSTATUS NTAPI EnpScanDirectoryWorker(
+    _In_ PVOID Parameter
+    );
+
 NTSTATUS EnpPopulateFsFileInfo(
     _In_ PBK_CONFIG Config,
     _Inout_ PEN_FILEINFO FileInfo,
     _In_opt_ PBK_VSS_OBJECT Vss
     );
 
+BOOLEAN EnpMatchExcludedSubtree(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING DirectoryName
+    );
+
+BOOLEAN EnpIsValidExcludeMarker(
+    _In_ PPH_STRINGREF DirectoryName,
+    _In_ PPH_STRING Marker
+    );
+
 NTSTATUS EnpUpdateFsFileInfo(
     _Inout_ PEN_FILEINFO FileInfo,
     _In_opt_ PBK_VSS_OBJECT Vss
@@ -489,6 +1221,58 @@ VOID EnpSetDiffFlagsFileInfo(
     _In_ UCHAR DiffFlags
     );
 
+// Change sources
+
+PEN_CHANGE_SOURCE EnpGetChangeSource(
+    _In_ PBK_CONFIG Config
+    );
+
+VOID EnpQueryChanges(
+    _In_ PBK_CONFIG Config,
+    _Out_ PEN_CHANGE_SET *ChangeSet,
+    _Out_ PPH_STRING *NewCursor,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+NTSTATUS EnpReadChangeCursor(
+    _In_ PBK_CONFIG Config,
+    _Out_ PPH_STRING *Cursor
+    );
+
+NTSTATUS EnpWriteChangeCursor(
+    _In_ PBK_CONFIG Config,
+    _In_ PPH_STRING Cursor
+    );
+
+VOID EnpDeleteChangeCursor(
+    _In_ PBK_CONFIG Config
+    );
+
+PEN_CHANGE_SET EnpCreateChangeSet(
+    VOID
+    );
+
+VOID EnpDestroyChangeSet(
+    _In_ PEN_CHANGE_SET ChangeSet
+    );
+
+VOID EnpAddToChangeSet(
+    _Inout_ PEN_CHANGE_SET ChangeSet,
+    _In_ PPH_STRINGREF FileName
+    );
+
+BOOLEAN EnpIsChangedFileInfo(
+    _In_opt_ PEN_CHANGE_SET Changes,
+    _Inout_ PEN_FILEINFO FileInfo
+    );
+
+NTSTATUS EnpQueryJournalChanges(
+    _In_ PBK_CONFIG Config,
+    _In_opt_ PPH_STRINGREF Cursor,
+    _Inout_opt_ PEN_CHANGE_SET ChangeSet,
+    _Out_ PPH_STRING *NewCursor
+    );
+
 // Misc.
 
 NTSTATUS EnpCreateTransaction(
@@ -527,16 +1311,6 @@ BOOLEAN EnpMatchFileSize(
     _In_ PLARGE_INTEGER Size
     );
 
-BOOLEAN EnpMatchFileSizeAgainstExpression(
-    _In_ PPH_STRING String,
-    _In_ PPH_STRING FileName,
-    _In_ PLARGE_INTEGER Size
-    );
-
-ULONG64 EnpStringToSize(
-    _In_ PPH_STRINGREF String
-    );
-
 PPH_STRING EnpMapFileName(
     _In_ PBK_CONFIG Config,
     _In_opt_ PPH_STRINGREF FileName,
@@ -556,7 +1330,8 @@ NTSTATUS EnpQueryFullAttributesFileWin32(
 NTSTATUS EnpRenameFileWin32(
     _In_opt_ HANDLE FileHandle,
     _In_opt_ PWSTR FileName,
-    _In_ PWSTR NewFileName
+    _In_ PWSTR NewFileName,
+    _In_ BOOLEAN ReplaceIfExists
     );
 
 NTSTATUS EnpCopyFileWin32(
@@ -576,6 +1351,25 @@ PPH_STRING EnpFormatPackageName(
     _In_ ULONGLONG RevisionId
     );
 
+PPH_STRING EnpFormatPackagePartName(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ ULONG PartId
+    );
+
+VOID EnpDeletePackageParts(
+    _In_ PBK_CONFIG Config,
+    _In_ ULONGLONG RevisionId,
+    _In_ PEN_MESSAGE_HANDLER MessageHandler
+    );
+
+VOID EnpInitializePartCompression(
+    _In_ PBK_CONFIG Config,
+    _In_ PPK_COMPRESSION_SETTINGS Base,
+    _In_ ULONG PartId,
+    _Out_ PPK_COMPRESSION_SETTINGS Settings
+    );
+
 PPH_STRING EnpFormatTempDatabaseFileName(
     _In_ PBK_CONFIG Config,
     _In_ BOOLEAN SameDirectory
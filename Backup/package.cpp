@@ -23,7 +23,7 @@
 #include "backup.h"
 #include "package.h"
 #include "packagep.h"
-#include <workqueue.h>
+#include <algorithm>
 
 static GUID IID_ISequentialInStream_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00 } };
 static GUID IID_ISequentialOutStream_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00 } };
@@ -34,6 +34,7 @@ static GUID IID_IInArchive_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00,
 static GUID IID_IOutArchive_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x06, 0x00, 0xa0, 0x00, 0x00 } };
 static GUID IID_IArchiveExtractCallback_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x06, 0x00, 0x20, 0x00, 0x00 } };
 static GUID IID_IArchiveUpdateCallback_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x06, 0x00, 0x80, 0x00, 0x00 } };
+static GUID IID_ISetProperties_I = { 0x23170f69, 0x40c1, 0x278a, { 0x00, 0x00, 0x00, 0x06, 0x00, 0x03, 0x00, 0x00 } };
 static GUID SevenZipHandlerGuid = { 0x23170f69, 0x40c1, 0x278a, { 0x10, 0x00, 0x00, 0x01, 0x10, 0x07, 0x00, 0x00 } };
 
 static PH_INITONCE SevenZipInitOnce = PH_INITONCE_INIT;
@@ -63,61 +64,78 @@ HRESULT PkFileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
     {
         PkFileStream *parentPipe;
         PCHAR currentData;
-        ULONG remainingSize;
-        ULONG availableSize;
+        SIZE_T remainingSize;
+        SIZE_T availableSize;
+        SIZE_T offset;
+        SIZE_T firstSize;
+        BOOLEAN endOfStream;
 
         parentPipe = Parent->ParentPipe;
         currentData = (PCHAR)data;
         remainingSize = size;
 
-        PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
-
         while (remainingSize != 0 && parentPipe->RemainingStreamSize != 0)
         {
-            if (parentPipe->ReadPosition == parentPipe->ReadableSize)
+            availableSize = parentPipe->WriteCount - parentPipe->ReadCount;
+            MemoryBarrier();
+
+            if (availableSize == 0)
             {
-                if (parentPipe->RemainingStreamSize == 0 || parentPipe->WriteReferenceCount == 0)
+                // The buffer is empty. Wait for the writer to fill it up.
+
+                PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
+                parentPipe->ReaderWaiting = TRUE;
+                MemoryBarrier();
+
+                while (parentPipe->WriteCount == parentPipe->ReadCount && parentPipe->WriteReferenceCount != 0)
+                    PhWaitForCondition(&parentPipe->PipeCondition, &parentPipe->PipeLock, NULL);
+
+                parentPipe->ReaderWaiting = FALSE;
+                endOfStream = parentPipe->WriteCount == parentPipe->ReadCount;
+                PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
+
+                if (endOfStream)
                     break;
 
-                PhPulseCondition(&parentPipe->PipeCondition);
-                // Wait for the writer to fill up our buffer.
-                PhWaitForCondition(&parentPipe->PipeCondition, &parentPipe->PipeLock, NULL);
                 continue;
             }
 
-            availableSize = (ULONG)(parentPipe->ReadableSize - parentPipe->ReadPosition);
+            if (availableSize > remainingSize)
+                availableSize = remainingSize;
+            if (availableSize > parentPipe->RemainingStreamSize)
+                availableSize = (SIZE_T)parentPipe->RemainingStreamSize;
 
-            if (remainingSize >= availableSize)
-            {
-                memcpy(currentData, (PCHAR)parentPipe->Buffer + parentPipe->ReadPosition, availableSize);
-                currentData += availableSize;
-                parentPipe->ReadPosition += availableSize;
+            offset = parentPipe->ReadCount & (parentPipe->BufferSize - 1);
+            firstSize = parentPipe->BufferSize - offset;
 
-                if (parentPipe->RemainingStreamSize >= availableSize)
-                    parentPipe->RemainingStreamSize -= availableSize;
-                else
-                    parentPipe->RemainingStreamSize = 0;
-
-                remainingSize -= availableSize;
+            if (firstSize >= availableSize)
+            {
+                memcpy(currentData, (PCHAR)parentPipe->Buffer + offset, availableSize);
             }
             else
             {
-                memcpy(currentData, (PCHAR)parentPipe->Buffer + parentPipe->ReadPosition, remainingSize);
-                currentData += availableSize;
-                parentPipe->ReadPosition += remainingSize;
+                memcpy(currentData, (PCHAR)parentPipe->Buffer + offset, firstSize);
+                memcpy(currentData + firstSize, parentPipe->Buffer, availableSize - firstSize);
+            }
+
+            currentData += availableSize;
+            remainingSize -= availableSize;
+            parentPipe->RemainingStreamSize -= availableSize;
 
-                if (parentPipe->RemainingStreamSize >= remainingSize)
-                    parentPipe->RemainingStreamSize -= remainingSize;
-                else
-                    parentPipe->RemainingStreamSize = 0;
+            // Make sure we're done with the data before giving the space back to the writer.
+            MemoryBarrier();
+            parentPipe->ReadCount += availableSize;
+            MemoryBarrier();
 
-                remainingSize = 0;
+            if (parentPipe->WriterWaiting)
+            {
+                PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
+                PhPulseAllCondition(&parentPipe->PipeCondition);
+                PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
             }
         }
 
-        PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
-
-        *processedSize = size - remainingSize;
+        *processedSize = (UInt32)(size - remainingSize);
 
         return S_OK;
     }
@@ -125,6 +143,21 @@ HRESULT PkFileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
     {
         return E_FAIL;
     }
+    else if (Parent->Mode == PkUnbufferedFileStream)
+    {
+        return Parent->ReadUnbuffered(data, size, processedSize);
+    }
+    else if (Parent->Mode == PkBufferFileStream)
+    {
+        if (size > Parent->RemainingStreamSize)
+            size = (UInt32)Parent->RemainingStreamSize;
+
+        memcpy(data, (PCHAR)Parent->Buffer + (SIZE_T)(Parent->StreamSize - Parent->RemainingStreamSize), size);
+        Parent->RemainingStreamSize -= size;
+        *processedSize = size;
+
+        return S_OK;
+    }
 
     if (!Parent->FileStream)
     {
@@ -133,6 +166,16 @@ HRESULT PkFileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
     }
 
     *processedSize = 0;
+
+    if (Parent->Mode == PkRangeFileStream)
+    {
+        if (size > Parent->RemainingStreamSize)
+            size = (UInt32)Parent->RemainingStreamSize;
+
+        if (size == 0)
+            return S_OK;
+    }
+
     status = PhReadFileStream(Parent->FileStream, data, size, (PULONG)processedSize);
 
     if (status == STATUS_END_OF_FILE)
@@ -142,9 +185,16 @@ HRESULT PkFileInStream::Read(void *data, UInt32 size, UInt32 *processedSize)
     }
 
     if (NT_SUCCESS(status))
+    {
+        if (Parent->Mode == PkRangeFileStream)
+            Parent->RemainingStreamSize -= *processedSize;
+
         return S_OK;
+    }
     else
+    {
         return E_FAIL;
+    }
 }
 
 HRESULT PkFileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
@@ -152,6 +202,81 @@ HRESULT PkFileInStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPositio
     return Parent->Seek(offset, seekOrigin, newPosition);
 }
 
+HRESULT PkFileStream::ReadUnbuffered(void *data, UInt32 size, UInt32 *processedSize)
+{
+    SIZE_T availableSize;
+
+    *processedSize = 0;
+
+    if (!ReadEvent)
+        return E_OUTOFMEMORY;
+
+    while (DataPosition == DataLength)
+    {
+        if (!ReadStarted || RemainingStreamSize == 0)
+            return S_OK;
+
+        if (ReadStatus == STATUS_PENDING)
+        {
+            NtWaitForSingleObject(ReadEvent, FALSE, NULL);
+            ReadStatus = ReadIosb.Status;
+        }
+
+        ReadStarted = FALSE;
+
+        if (ReadStatus == STATUS_END_OF_FILE)
+            return S_OK;
+        if (!NT_SUCCESS(ReadStatus))
+            return E_FAIL;
+
+        ActiveBuffer ^= 1;
+        DataPosition = 0;
+        DataLength = ReadIosb.Information;
+        ReadOffset += BufferSize;
+
+        // A short read means that this is the last block.
+        if (DataLength == BufferSize && DataLength < RemainingStreamSize)
+            StartUnbufferedRead();
+    }
+
+    availableSize = DataLength - DataPosition;
+
+    if (availableSize > size)
+        availableSize = size;
+    if (availableSize > RemainingStreamSize)
+        availableSize = (SIZE_T)RemainingStreamSize;
+
+    memcpy(data, (PCHAR)Buffer + ActiveBuffer * BufferSize + DataPosition, availableSize);
+    DataPosition += availableSize;
+    RemainingStreamSize -= availableSize;
+    *processedSize = (UInt32)availableSize;
+
+    return S_OK;
+}
+
+VOID PkFileStream::StartUnbufferedRead()
+{
+    LARGE_INTEGER offset;
+
+    offset.QuadPart = ReadOffset;
+    ReadStarted = TRUE;
+    ReadStatus = NtReadFile(
+        FileStream->FileHandle,
+        ReadEvent,
+        NULL,
+        NULL,
+        &ReadIosb,
+        (PCHAR)Buffer + (ActiveBuffer ^ 1) * BufferSize,
+        (ULONG)BufferSize,
+        &offset,
+        NULL
+        );
+
+    // If the read finished immediately, ReadIosb already has the result.
+    if (NT_SUCCESS(ReadStatus) && ReadStatus != STATUS_PENDING)
+        ReadStatus = ReadIosb.Status;
+}
+
 HRESULT PkFileOutStream::QueryInterface(REFIID Riid, void **ppvObject)
 {
     return Parent->QueryInterface(Riid, ppvObject);
@@ -176,51 +301,78 @@ HRESULT PkFileOutStream::Write(const void *data, UInt32 size, UInt32 *processedS
         PkFileStream *parentPipe;
         PCHAR currentData;
         SIZE_T remainingSize;
+        SIZE_T freeSize;
+        SIZE_T offset;
+        SIZE_T firstSize;
+        BOOLEAN readerGone;
 
         parentPipe = Parent->ParentPipe;
         currentData = (PCHAR)data;
         remainingSize = size;
 
-        PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
-
         while (remainingSize != 0)
         {
-            if (parentPipe->ReadPosition != parentPipe->ReadableSize)
+            freeSize = parentPipe->BufferSize - (parentPipe->WriteCount - parentPipe->ReadCount);
+            MemoryBarrier();
+
+            if (freeSize == 0)
             {
-                if (parentPipe->ReadReferenceCount == 0)
+                // The buffer is full. Wait for the reader to read some data.
+
+                PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
+                parentPipe->WriterWaiting = TRUE;
+                MemoryBarrier();
+
+                while (parentPipe->WriteCount - parentPipe->ReadCount == parentPipe->BufferSize && parentPipe->ReadReferenceCount != 0)
+                    PhWaitForCondition(&parentPipe->PipeCondition, &parentPipe->PipeLock, NULL);
+
+                parentPipe->WriterWaiting = FALSE;
+                readerGone = parentPipe->ReadReferenceCount == 0;
+                PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
+
+                if (readerGone)
                     break;
 
-                // Wait for the reader to read everything.
-                PhWaitForCondition(&parentPipe->PipeCondition, &parentPipe->PipeLock, NULL);
                 continue;
             }
 
-            if (remainingSize >= parentPipe->BufferSize)
+            if (freeSize > remainingSize)
+                freeSize = remainingSize;
+
+            offset = parentPipe->WriteCount & (parentPipe->BufferSize - 1);
+            firstSize = parentPipe->BufferSize - offset;
+
+            if (firstSize >= freeSize)
             {
-                memcpy(parentPipe->Buffer, currentData, parentPipe->BufferSize);
-                currentData += parentPipe->BufferSize;
-                parentPipe->ReadableSize = parentPipe->BufferSize;
-                remainingSize -= parentPipe->BufferSize;
+                memcpy((PCHAR)parentPipe->Buffer + offset, currentData, freeSize);
             }
             else
             {
-                memcpy(parentPipe->Buffer, currentData, remainingSize);
-                currentData += remainingSize;
-                parentPipe->ReadableSize = remainingSize;
-                remainingSize = 0;
+                memcpy((PCHAR)parentPipe->Buffer + offset, currentData, firstSize);
+                memcpy(parentPipe->Buffer, currentData + firstSize, freeSize - firstSize);
             }
 
-            parentPipe->ReadPosition = 0;
-            PhPulseCondition(&parentPipe->PipeCondition);
-        }
+            currentData += freeSize;
+            remainingSize -= freeSize;
+
+            // Make sure the data is visible before publishing it to the reader.
+            MemoryBarrier();
+            parentPipe->WriteCount += freeSize;
+            MemoryBarrier();
 
-        PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
+            if (parentPipe->ReaderWaiting)
+            {
+                PhAcquireQueuedLockExclusive(&parentPipe->PipeLock);
+                PhPulseAllCondition(&parentPipe->PipeCondition);
+                PhReleaseQueuedLockExclusive(&parentPipe->PipeLock);
+            }
+        }
 
         *processedSize = size;
 
         return S_OK;
     }
-    else if (Parent->Mode == PkPipeReaderFileStream)
+    else if (Parent->Mode == PkPipeReaderFileStream || Parent->Mode == PkBufferFileStream || Parent->Mode == PkUnbufferedFileStream)
     {
         return E_FAIL;
     }
@@ -250,7 +402,8 @@ HRESULT PkFileOutStream::SetSize(Int64 newSize)
     NTSTATUS status;
     LARGE_INTEGER size;
 
-    if (Parent->Mode == PkPipeFileStream || Parent->Mode == PkPipeWriterFileStream || Parent->Mode == PkPipeReaderFileStream)
+    if (Parent->Mode == PkPipeFileStream || Parent->Mode == PkPipeWriterFileStream || Parent->Mode == PkPipeReaderFileStream ||
+        Parent->Mode == PkBufferFileStream || Parent->Mode == PkUnbufferedFileStream)
         return E_FAIL;
     if (!Parent->FileStream)
         return E_FAIL;
@@ -284,7 +437,7 @@ HRESULT PkFileStreamGetSize::GetSize(UInt64 *size)
 {
     LARGE_INTEGER fileSize;
 
-    if (Parent->Mode == PkPipeFileStream)
+    if (Parent->Mode == PkPipeFileStream || Parent->Mode == PkRangeFileStream || Parent->Mode == PkBufferFileStream)
     {
         *size = Parent->StreamSize;
         return S_OK;
@@ -294,6 +447,11 @@ HRESULT PkFileStreamGetSize::GetSize(UInt64 *size)
         *size = Parent->ParentPipe->StreamSize;
         return S_OK;
     }
+    else if (Parent->Mode == PkUnbufferedFileStream && Parent->StreamSize != -1)
+    {
+        *size = Parent->StreamSize;
+        return S_OK;
+    }
 
     if (!Parent->FileStream)
     {
@@ -315,7 +473,8 @@ HRESULT PkFileStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition)
     LARGE_INTEGER offsetLi;
     PH_SEEK_ORIGIN origin;
 
-    if (Mode == PkPipeFileStream || Mode == PkPipeWriterFileStream || Mode == PkPipeReaderFileStream)
+    if (Mode == PkPipeFileStream || Mode == PkPipeWriterFileStream || Mode == PkPipeReaderFileStream || Mode == PkRangeFileStream ||
+        Mode == PkBufferFileStream || Mode == PkUnbufferedFileStream)
         return E_FAIL;
 
     if (!FileStream)
@@ -526,46 +685,17 @@ HRESULT PkArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream **i
 
     if (action->Type == PkAddFromPackageType)
     {
-        IInArchive *package;
-        PROPVARIANT sizeValue;
-        PkFileStream *pipe;
-        IOutStream *writer;
-        IInStream *reader;
-
-        package = (IInArchive *)action->u.AddFromPackage.Package;
+        std::unordered_map<IInArchive *, PkUpdateArchiveExtractCallback *>::iterator it;
+        PkUpdateArchiveExtractCallback *extractCallback;
 
-        PropVariantInit(&sizeValue);
-        result = package->GetProperty(action->u.AddFromPackage.IndexInPackage, kpidSize, &sizeValue);
-
-        if (!SUCCEEDED(result))
-            return result;
-
-        pipe = new PkFileStream(PkPipeFileStream, NULL, sizeValue.hVal.QuadPart);
-        pipe->InitializePipe(&writer, &reader);
-        pipe->Release();
-
-        if (pipe->Buffer)
-        {
-            if (!ExtractCallback)
-            {
-                ExtractCallback = new PkUpdateArchiveExtractCallback();
-                ExtractCallback->Owner = this;
-                ExtractCallback->StartThread();
-            }
+        it = ExtractCallbacks.find((IInArchive *)action->u.AddFromPackage.Package);
 
-            ExtractCallback->SetNewJob(package, action->u.AddFromPackage.IndexInPackage, writer);
-            writer->Release();
-            *inStream = reader;
-        }
-        else
-        {
-            writer->Release();
-            reader->Release();
+        if (it == ExtractCallbacks.end())
+            return E_ABORT;
 
-            return E_OUTOFMEMORY;
-        }
+        extractCallback = it->second;
 
-        return S_OK;
+        return extractCallback->GetItemStream(action->u.AddFromPackage.IndexInPackage, inStream);
     }
     else if (action->Type == PkUpdateType)
     {
@@ -597,37 +727,97 @@ HRESULT PkArchiveUpdateCallback::SetOperationResult(Int32 operationResult)
     return S_OK;
 }
 
-VOID PkArchiveUpdateCallback::CreateActionMap()
+VOID PkArchiveUpdateCallback::CreateExtractCallbacks()
 {
-    PPK_ACTION_SEGMENT segment;
     ULONG i;
-    ULONG index;
+    PPK_ACTION action;
+    IInArchive *package;
+    PkUpdateArchiveExtractCallback *extractCallback;
+    std::unordered_map<IInArchive *, PkUpdateArchiveExtractCallback *>::iterator it;
 
-    segment = ActionList->FirstSegment;
-    index = 0;
+    ExtractorUseCount = 0;
 
-    while (segment)
+    for (i = 0; i < ActionList->NumberOfActions; i++)
     {
-        for (i = 0; i < segment->Count; i++)
+        action = &ActionList->Actions[i];
+
+        if (action->Type == PkAddFromPackageType)
         {
-            ActionMap[index] = &segment->Actions[i];
-            index++;
+            package = (IInArchive *)action->u.AddFromPackage.Package;
+            it = ExtractCallbacks.find(package);
+
+            if (it != ExtractCallbacks.end())
+            {
+                extractCallback = it->second;
+            }
+            else
+            {
+                extractCallback = new PkUpdateArchiveExtractCallback(package);
+                extractCallback->Owner = this;
+                ExtractCallbacks[package] = extractCallback;
+            }
+
+            extractCallback->Items.push_back(action->u.AddFromPackage.IndexInPackage);
         }
+    }
+
+    // Each source package is extracted in one pass, so the items must be in archive order.
+    for (it = ExtractCallbacks.begin(); it != ExtractCallbacks.end(); ++it)
+    {
+        std::vector<UInt32> &items = it->second->Items;
 
-        segment = segment->Next;
+        std::sort(items.begin(), items.end());
+        items.erase(std::unique(items.begin(), items.end()), items.end());
     }
 }
 
-PPK_ACTION PkArchiveUpdateCallback::GetAction(ULONG index)
+VOID PkArchiveUpdateCallback::LimitExtractors()
 {
-    std::unordered_map<ULONG, PPK_ACTION>::iterator it;
+    std::unordered_map<IInArchive *, PkUpdateArchiveExtractCallback *>::iterator it;
+    PkUpdateArchiveExtractCallback *extractCallback;
+    PkUpdateArchiveExtractCallback *oldestExtractCallback;
+    ULONG numberOfLiveExtractors;
+    BOOLEAN threadFinished;
 
-    it = ActionMap.find(index);
+    // 7-Zip asks for items sorted by type and name, so the requests for different packages are
+    // interleaved. When a new extractor would go over the limit, the one that was used least
+    // recently spools its remaining items to temporary files and exits.
 
-    if (it == ActionMap.end())
-        return NULL;
+    numberOfLiveExtractors = 0;
+    oldestExtractCallback = NULL;
 
-    return it->second;
+    for (it = ExtractCallbacks.begin(); it != ExtractCallbacks.end(); ++it)
+    {
+        extractCallback = it->second;
+
+        if (!extractCallback->ThreadStarted || extractCallback->Draining)
+            continue;
+
+        PhAcquireQueuedLockExclusive(&extractCallback->Lock);
+        threadFinished = extractCallback->ThreadFinished;
+        PhReleaseQueuedLockExclusive(&extractCallback->Lock);
+
+        if (threadFinished)
+            continue;
+
+        numberOfLiveExtractors++;
+
+        if (!oldestExtractCallback || extractCallback->LastUse < oldestExtractCallback->LastUse)
+            oldestExtractCallback = extractCallback;
+    }
+
+    if (numberOfLiveExtractors < PK_MAXIMUM_LIVE_EXTRACTORS)
+        return;
+
+    // The updater has read all of the items it asked for, so the extractor isn't blocked on a pipe
+    // and will finish once everything is spooled.
+    oldestExtractCallback->StartDraining();
+    oldestExtractCallback->WaitForThread();
+}
+
+PPK_ACTION PkArchiveUpdateCallback::GetAction(ULONG index)
+{
+    return PkIndexInActionList(ActionList, index);
 }
 
 HRESULT PkUpdateArchiveExtractCallback::QueryInterface(REFIID Riid, void **ppvObject)
@@ -646,17 +836,22 @@ HRESULT PkUpdateArchiveExtractCallback::QueryInterface(REFIID Riid, void **ppvOb
 
 ULONG PkUpdateArchiveExtractCallback::AddRef()
 {
-    return ++this->ReferenceCount;
+    return _InterlockedIncrement(&this->ReferenceCount);
 }
 
 ULONG PkUpdateArchiveExtractCallback::Release()
 {
-    if (--this->ReferenceCount == 0)
+    LONG referenceCount;
+
+    // The extractor is referenced by both the updater thread and its own thread.
+    referenceCount = _InterlockedDecrement(&this->ReferenceCount);
+
+    if (referenceCount == 0)
     {
         delete this;
     }
 
-    return this->ReferenceCount;
+    return referenceCount;
 }
 
 HRESULT PkUpdateArchiveExtractCallback::SetTotal(UInt64 total)
@@ -671,41 +866,58 @@ HRESULT PkUpdateArchiveExtractCallback::SetCompleted(const UInt64 *completeValue
 
 HRESULT PkUpdateArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStream **outStream, Int32 askExtractMode)
 {
-    IInArchive *currentArchive;
-
-    // This code executes with the lock held.
+    HRESULT result;
+    PkFileStream *spoolStream;
 
-    currentArchive = InArchive;
+    PhAcquireQueuedLockExclusive(&Lock);
 
-    // Wait until we get a job or the archive has changed.
-    while (!ThreadStopping && InArchive == currentArchive && ItemIndex == -1)
-    {
+    // Wait until the updater asks for an item from this package.
+    while (!ThreadStopping && !Draining && ItemIndex == -1)
         PhWaitForCondition(&Condition, &Lock, NULL);
-    }
-
-    if (InArchive != currentArchive)
-        return E_ABORT;
 
-    if (index < ItemIndex)
+    if (ThreadStopping)
     {
-        // Keep searching.
-        *outStream = &(new PkFileStream(PkZeroFileStream, NULL))->OutStream;
-        return S_OK;
+        PhReleaseQueuedLockExclusive(&Lock);
+        return E_ABORT;
     }
-    else if (index == ItemIndex)
+
+    if (index == ItemIndex)
     {
         *outStream = OutStream;
         OutStream = NULL;
         ItemIndex = -1;
-        PhPulseCondition(&Condition);
+        PhPulseAllCondition(&Condition);
+        PhReleaseQueuedLockExclusive(&Lock);
 
         return S_OK;
     }
-    else
+    else if (index > ItemIndex)
     {
-        // We've gone past the item.
+        // We've gone past the item. This can't happen because every item before the requested
+        // one is spooled.
+        PhReleaseQueuedLockExclusive(&Lock);
         return E_ABORT;
     }
+
+    PhReleaseQueuedLockExclusive(&Lock);
+
+    // The updater wants a later item first, or the extractor is being drained. Save this one so
+    // that we don't have to decode the solid block again when the updater gets to it.
+
+    result = PkpCreateSpoolFileStream(&spoolStream);
+
+    if (!SUCCEEDED(result))
+        return result;
+
+    PhAcquireQueuedLockExclusive(&Lock);
+    SpoolItemIndex = index;
+    SpoolStream = spoolStream;
+    PhReleaseQueuedLockExclusive(&Lock);
+
+    spoolStream->AddRef();
+    *outStream = &spoolStream->OutStream;
+
+    return S_OK;
 }
 
 HRESULT PkUpdateArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
@@ -715,103 +927,187 @@ HRESULT PkUpdateArchiveExtractCallback::PrepareOperation(Int32 askExtractMode)
 
 HRESULT PkUpdateArchiveExtractCallback::SetOperationResult(Int32 resultEOperationResult)
 {
+    PhAcquireQueuedLockExclusive(&Lock);
+
     if (!SUCCEEDED(resultEOperationResult))
         Result = resultEOperationResult;
 
+    if (SpoolStream)
+    {
+        // Make the spooled item available to the updater.
+        if (resultEOperationResult == NArchive::NExtract::NOperationResult::kOK)
+            SpooledStreams[SpoolItemIndex] = SpoolStream;
+        else
+            SpoolStream->Release();
+
+        SpoolItemIndex = -1;
+        SpoolStream = NULL;
+        PhPulseAllCondition(&Condition);
+    }
+
+    PhReleaseQueuedLockExclusive(&Lock);
+
     return S_OK;
 }
 
 VOID PkUpdateArchiveExtractCallback::StartThread()
 {
+    HANDLE threadHandle;
+
+    // Each extractor blocks until the updater has taken all of its items or it is drained, so it
+    // needs its own thread instead of a work queue item.
     ThreadStarted = TRUE;
-    PhQueueItemWorkQueue(PhGetGlobalWorkQueue(), ThreadStart, this);
+    threadHandle = PhCreateThread(0, ThreadStart, this);
+
+    if (threadHandle)
+    {
+        NtClose(threadHandle);
+    }
+    else
+    {
+        ThreadStarted = FALSE;
+        ThreadFinished = TRUE;
+        Result = E_OUTOFMEMORY;
+    }
 }
 
 VOID PkUpdateArchiveExtractCallback::StopThread()
 {
-    SetNewJob(NULL, -1, NULL);
-
     PhAcquireQueuedLockExclusive(&Lock);
     ThreadStopping = TRUE;
-    PhPulseCondition(&Condition);
+    PhPulseAllCondition(&Condition);
+    PhReleaseQueuedLockExclusive(&Lock);
+}
+
+VOID PkUpdateArchiveExtractCallback::StartDraining()
+{
+    PhAcquireQueuedLockExclusive(&Lock);
+    Draining = TRUE;
+    PhPulseAllCondition(&Condition);
     PhReleaseQueuedLockExclusive(&Lock);
 }
 
 BOOLEAN PkUpdateArchiveExtractCallback::WaitForThread()
 {
+    if (!ThreadStarted)
+        return TRUE;
+
     if (NtWaitForSingleObject(ThreadFinishEvent, FALSE, NULL) == STATUS_WAIT_0)
         return TRUE;
     else
         return FALSE;
 }
 
-VOID PkUpdateArchiveExtractCallback::SetNewJob(IInArchive *NewInArchive, ULONG NewItemIndex, IOutStream *NewOutStream)
+HRESULT PkUpdateArchiveExtractCallback::GetItemStream(ULONG NewItemIndex, ISequentialInStream **InStream)
 {
+    HRESULT result;
+    std::unordered_map<ULONG, PkFileStream *>::iterator it;
+    PkFileStream *spoolStream;
+    PROPVARIANT sizeValue;
+    PkFileStream *pipe;
+    IOutStream *writer;
+    IInStream *reader;
+
+    PropVariantInit(&sizeValue);
+    result = InArchive->GetProperty(NewItemIndex, kpidSize, &sizeValue);
+
+    if (!SUCCEEDED(result))
+        return result;
+
+    if (!ThreadStarted && !ThreadFinished)
+        Owner->LimitExtractors();
+
+    LastUse = ++Owner->ExtractorUseCount;
+
     PhAcquireQueuedLockExclusive(&Lock);
 
-    // Wait for the current job to finish.
-    while (!ThreadStopping && ItemIndex != -1)
+    if (!ThreadStarted && !ThreadFinished)
+        StartThread();
+
+    // Wait for the previous job to be picked up, and for the item itself if it is being spooled.
+    while (!ThreadStopping && !ThreadFinished && (ItemIndex != -1 || SpoolItemIndex == NewItemIndex))
         PhWaitForCondition(&Condition, &Lock, NULL);
 
-    if (ThreadStopping)
-        return;
+    it = SpooledStreams.find(NewItemIndex);
 
-    if (NewInArchive)
-        NewInArchive->AddRef();
-    if (InArchive)
-        InArchive->Release();
+    if (it != SpooledStreams.end())
+    {
+        spoolStream = it->second;
+        SpooledStreams.erase(it);
+        PhReleaseQueuedLockExclusive(&Lock);
 
-    InArchive = NewInArchive;
+        result = spoolStream->Seek(0, STREAM_SEEK_SET, NULL);
 
-    ItemIndex = NewItemIndex;
+        if (!SUCCEEDED(result))
+        {
+            spoolStream->Release();
+            return result;
+        }
 
-    if (NewOutStream)
-        NewOutStream->AddRef();
-    if (OutStream)
-        OutStream->Release();
+        *InStream = &spoolStream->InStream;
+
+        return S_OK;
+    }
 
-    OutStream = NewOutStream;
+    if (ThreadStopping || ThreadFinished)
+    {
+        PhReleaseQueuedLockExclusive(&Lock);
+        return E_FAIL;
+    }
 
-    PhPulseCondition(&Condition);
+    pipe = new PkFileStream(PkPipeFileStream, NULL, sizeValue.hVal.QuadPart);
+    pipe->InitializePipe(&writer, &reader, Owner->PipeBufferSize);
+    pipe->Release();
 
-    PhReleaseQueuedLockExclusive(&Lock);
-}
+    if (!pipe->Buffer)
+    {
+        PhReleaseQueuedLockExclusive(&Lock);
+        writer->Release();
+        reader->Release();
 
-VOID PkUpdateArchiveExtractCallback::WaitForJob()
-{
-    PhAcquireQueuedLockExclusive(&Lock);
+        return E_OUTOFMEMORY;
+    }
 
-    while (InArchive && ItemIndex != -1)
-        PhWaitForCondition(&Condition, &Lock, NULL);
+    ItemIndex = NewItemIndex;
+    OutStream = writer;
+    PhPulseAllCondition(&Condition);
 
     PhReleaseQueuedLockExclusive(&Lock);
+
+    *InStream = reader;
+
+    return S_OK;
 }
 
 VOID PkUpdateArchiveExtractCallback::Run()
 {
     HRESULT result;
-    IInArchive *currentArchive;
 
-    PhAcquireQueuedLockExclusive(&Lock);
+    result = InArchive->Extract(&Items[0], (UInt32)Items.size(), FALSE, this);
 
-    while (!ThreadStopping)
-    {
-        if (!InArchive)
-        {
-            PhWaitForCondition(&Condition, &Lock, NULL);
-            continue;
-        }
+    PhAcquireQueuedLockExclusive(&Lock);
 
-        currentArchive = InArchive;
+    if (result != E_ABORT && !SUCCEEDED(result))
+        Result = result;
 
-        currentArchive->AddRef();
-        result = currentArchive->Extract(NULL, -1, FALSE, this);
-        currentArchive->Release();
+    if (ItemIndex != -1 && !ThreadStopping)
+    {
+        // The updater asked for an item that we never reached.
+        if (SUCCEEDED(Result))
+            Result = E_FAIL;
+    }
 
-        if (result != E_ABORT && !SUCCEEDED(result))
-            Result = result;
+    // Release the pipe writer (if any) so that the reader doesn't block forever.
+    if (OutStream)
+    {
+        OutStream->Release();
+        OutStream = NULL;
     }
 
+    ItemIndex = -1;
+    ThreadFinished = TRUE;
+    PhPulseAllCondition(&Condition);
+
     PhReleaseQueuedLockExclusive(&Lock);
 }
 
@@ -871,6 +1167,7 @@ HRESULT PkArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStream *
     PK_ACTION localAction;
     PK_PARAMETER_GET_STREAM getStream;
     PROPVARIANT value;
+    PROPVARIANT pathValue;
 
     if (ActionList)
     {
@@ -926,8 +1223,17 @@ HRESULT PkArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStream *
     }
 
     PropVariantClear(&value);
+    PropVariantInit(&pathValue);
+    InArchive->GetProperty(index, kpidPath, &pathValue);
+
+    if (pathValue.vt == VT_BSTR)
+    {
+        getStream.Path.Length = wcslen(pathValue.bstrVal) * sizeof(WCHAR);
+        getStream.Path.Buffer = pathValue.bstrVal;
+    }
 
     result = Callback(PkGetStreamMessage, action, &getStream, Context);
+    PropVariantClear(&pathValue);
 
     if (!SUCCEEDED(result))
         return result;
@@ -952,19 +1258,11 @@ HRESULT PkArchiveExtractCallback::SetOperationResult(Int32 resultEOperationResul
 
 VOID PkArchiveExtractCallback::CreateActionMap()
 {
-    PPK_ACTION_SEGMENT segment;
     ULONG i;
 
-    segment = ActionList->FirstSegment;
-
-    while (segment)
+    for (i = 0; i < ActionList->NumberOfActions; i++)
     {
-        for (i = 0; i < segment->Count; i++)
-        {
-            ActionMap[segment->Actions[i].u.Update.Index] = &segment->Actions[i];
-        }
-
-        segment = segment->Next;
+        ActionMap[ActionList->Actions[i].u.Update.Index] = &ActionList->Actions[i];
     }
 }
 
@@ -991,6 +1289,52 @@ PPK_FILE_STREAM PkCreateFileStream(
     return fileStream;
 }
 
+PPK_FILE_STREAM PkCreateFileStreamRange(
+    _In_ PPH_FILE_STREAM FileStream,
+    _In_ ULONGLONG Length
+    )
+{
+    PkFileStream *fileStream;
+
+    // Reads start at the current position of FileStream and stop after Length bytes.
+    fileStream = new PkFileStream(PkRangeFileStream, FileStream, Length);
+    fileStream->RemainingStreamSize = Length;
+
+    return fileStream;
+}
+
+PPK_FILE_STREAM PkCreateFileStreamBuffer(
+    _In_ _Post_invalid_ PVOID Buffer,
+    _In_ SIZE_T Length
+    )
+{
+    PkFileStream *fileStream;
+
+    // The buffer must be allocated with PhAllocate, and is freed with the stream.
+    fileStream = new PkFileStream(PkZeroFileStream, NULL);
+    fileStream->InitializeBuffer(Buffer, Length);
+
+    return fileStream;
+}
+
+PPK_FILE_STREAM PkCreateFileStreamUnbuffered(
+    _In_ PPH_FILE_STREAM FileStream,
+    _In_ ULONGLONG Offset,
+    _In_ ULONGLONG Length,
+    _In_ SIZE_T BlockSize
+    )
+{
+    PkFileStream *fileStream;
+
+    // The file must be opened for asynchronous I/O with FILE_NO_INTERMEDIATE_BUFFERING, so Offset
+    // and BlockSize must be multiples of the sector size. Length can be -1 to read to the end of
+    // the file.
+    fileStream = new PkFileStream(PkNormalFileStream, FileStream);
+    fileStream->InitializeUnbuffered(Offset, Length, BlockSize);
+
+    return fileStream;
+}
+
 VOID PkReferenceFileStream(
     _In_ PPK_FILE_STREAM FileStream
     )
@@ -1011,6 +1355,155 @@ VOID PkDereferenceFileStream(
     fileStream->Release();
 }
 
+SIZE_T PkpGetMaximumPipeBufferSize(
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings
+    )
+{
+    SIZE_T bufferSize;
+
+    if (!Settings || Settings->PipeBufferSize == PK_COMPRESSION_DEFAULT)
+        return PK_DEFAULT_PIPE_BUFFER_SIZE;
+
+    // The pipe uses the buffer size as a mask, so it must be a power of two.
+
+    bufferSize = PK_MINIMUM_PIPE_BUFFER_SIZE;
+
+    while (bufferSize < (SIZE_T)Settings->PipeBufferSize * 1024 * 1024 && bufferSize < PK_MAXIMUM_PIPE_BUFFER_SIZE)
+        bufferSize *= 2;
+
+    return bufferSize;
+}
+
+SIZE_T PkpGetPipeBufferSize(
+    _In_ ULONGLONG StreamSize,
+    _In_ SIZE_T MaximumBufferSize
+    )
+{
+    SIZE_T bufferSize;
+
+    // Small items don't need the entire buffer.
+
+    bufferSize = PAGE_SIZE * 4;
+
+    while (bufferSize < StreamSize && bufferSize < MaximumBufferSize)
+        bufferSize *= 2;
+
+    return bufferSize;
+}
+
+NTSTATUS NTAPI PkpPipeBenchmarkWriterThreadStart(
+    _In_ PVOID Parameter
+    )
+{
+    PPK_PIPE_BENCHMARK_WRITER context = (PPK_PIPE_BENCHMARK_WRITER)Parameter;
+    PUCHAR data;
+    ULONGLONG remainingSize;
+    UInt32 size;
+    UInt32 processedSize;
+    ULONG i;
+
+    // The writer and the reader both use blocks of this size.
+    data = (PUCHAR)PhAllocate(PK_PIPE_BENCHMARK_BLOCK_SIZE);
+
+    for (i = 0; i < PK_PIPE_BENCHMARK_BLOCK_SIZE; i++)
+        data[i] = (UCHAR)i;
+
+    remainingSize = context->StreamSize;
+
+    while (remainingSize != 0)
+    {
+        size = (UInt32)min(remainingSize, PK_PIPE_BENCHMARK_BLOCK_SIZE);
+
+        if (!SUCCEEDED(context->Writer->Write(data, size, &processedSize)))
+            break;
+
+        remainingSize -= size;
+    }
+
+    PhFree(data);
+    context->Writer->Release();
+
+    return STATUS_SUCCESS;
+}
+
+HRESULT PkBenchmarkPipe(
+    _In_ ULONGLONG StreamSize,
+    _In_ ULONG BufferSize,
+    _Out_ PLARGE_INTEGER Duration
+    )
+{
+    PK_COMPRESSION_SETTINGS settings;
+    PkFileStream *pipe;
+    IOutStream *writer;
+    IInStream *reader;
+    PK_PIPE_BENCHMARK_WRITER writerContext;
+    HANDLE threadHandle;
+    PUCHAR data;
+    ULONGLONG totalSize;
+    UInt32 processedSize;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
+    HRESULT result;
+
+    // Moves StreamSize bytes through a pipe, the same way items are copied between packages
+    // during a merge. The reader runs on the calling thread.
+
+    PkInitializeCompressionSettings(&settings);
+    settings.PipeBufferSize = BufferSize;
+
+    pipe = new PkFileStream(PkPipeFileStream, NULL, StreamSize);
+    pipe->InitializePipe(&writer, &reader, PkpGetMaximumPipeBufferSize(&settings));
+    pipe->Release();
+
+    if (!pipe->Buffer)
+    {
+        writer->Release();
+        reader->Release();
+        return E_OUTOFMEMORY;
+    }
+
+    data = (PUCHAR)PhAllocate(PK_PIPE_BENCHMARK_BLOCK_SIZE);
+    writerContext.Writer = writer;
+    writerContext.StreamSize = StreamSize;
+    totalSize = 0;
+    result = S_OK;
+
+    PhQuerySystemTime(&startTime);
+    threadHandle = PhCreateThread(0, PkpPipeBenchmarkWriterThreadStart, &writerContext);
+
+    if (!threadHandle)
+    {
+        writer->Release();
+        reader->Release();
+        PhFree(data);
+        return E_OUTOFMEMORY;
+    }
+
+    while (TRUE)
+    {
+        result = reader->Read(data, PK_PIPE_BENCHMARK_BLOCK_SIZE, &processedSize);
+
+        if (!SUCCEEDED(result) || processedSize == 0)
+            break;
+
+        totalSize += processedSize;
+    }
+
+    NtWaitForSingleObject(threadHandle, FALSE, NULL);
+    NtClose(threadHandle);
+    PhQuerySystemTime(&endTime);
+
+    reader->Release();
+    PhFree(data);
+
+    if (SUCCEEDED(result) && totalSize != StreamSize)
+        result = E_FAIL;
+
+    Duration->QuadPart = endTime.QuadPart - startTime.QuadPart;
+
+    return result;
+}
+
 PPK_ACTION_LIST PkCreateActionList(
     VOID
     )
@@ -1018,9 +1511,9 @@ PPK_ACTION_LIST PkCreateActionList(
     PPK_ACTION_LIST list;
 
     list = (PPK_ACTION_LIST)PhAllocate(sizeof(PK_ACTION_LIST));
-    list->FirstSegment = NULL;
-    list->LastSegment = NULL;
+    list->Actions = NULL;
     list->NumberOfActions = 0;
+    list->AllocatedActions = 0;
 
     return list;
 }
@@ -1029,24 +1522,16 @@ VOID PkDestroyActionList(
     _In_ PPK_ACTION_LIST List
     )
 {
-    PPK_ACTION_SEGMENT segment;
-    PPK_ACTION_SEGMENT nextSegment;
     ULONG i;
 
-    segment = List->FirstSegment;
-
-    while (segment)
+    for (i = 0; i < List->NumberOfActions; i++)
     {
-        for (i = 0; i < segment->Count; i++)
-        {
-            PkpDeleteAction(&segment->Actions[i]);
-        }
-
-        nextSegment = segment->Next;
-        PhFree(segment);
-        segment = nextSegment;
+        PkpDeleteAction(&List->Actions[i]);
     }
 
+    if (List->Actions)
+        PhFree(List->Actions);
+
     PhFree(List);
 }
 
@@ -1083,7 +1568,7 @@ VOID PkAppendAddFromPackageToActionList(
 {
     PK_ACTION action;
 
-    ((IInArchive *)Package)->AddRef();
+    PkReferencePackage(Package);
     action.Type = PkAddFromPackageType;
     action.u.AddFromPackage.Package = Package;
     action.u.AddFromPackage.IndexInPackage = IndexInPackage;
@@ -1107,66 +1592,13 @@ VOID PkAppendUpdateToActionList(
 
 PPK_ACTION PkIndexInActionList(
     _In_ PPK_ACTION_LIST List,
-    _In_ ULONG Index,
-    _Out_opt_ PPK_ACTION_SEGMENT *Segment
+    _In_ ULONG Index
     )
 {
-    ULONG segmentIndex;
-    ULONG indexInSegment;
-    PPK_ACTION_SEGMENT segment;
-
-    segmentIndex = Index >> PK_ACTION_SEGMENT_SHIFT;
-    indexInSegment = Index & (PK_ACTION_SEGMENT_SIZE - 1);
-    segment = List->FirstSegment;
-
-    while (segment)
-    {
-        if (segment->SegmentIndex == segmentIndex)
-        {
-            if (indexInSegment >= segment->Count)
-                return NULL;
-
-            if (Segment)
-                *Segment = segment;
-
-            return &segment->Actions[indexInSegment];
-        }
-
-        segment = segment->Next;
-    }
-
-    return NULL;
-}
-
-PPK_ACTION PkGetNextAction(
-    _In_ PPK_ACTION Action,
-    _In_ ULONG Index,
-    _In_ PPK_ACTION_SEGMENT Segment,
-    _Out_opt_ PPK_ACTION_SEGMENT *NewSegment
-    )
-{
-    if (Index == PK_ACTION_SEGMENT_SIZE)
-    {
-        if (Segment->Next && Segment->Next->Count != 0)
-        {
-            if (NewSegment)
-                *NewSegment = Segment->Next;
-
-            return &Segment->Next->Actions[0];
-        }
-
+    if (Index >= List->NumberOfActions)
         return NULL;
-    }
-
-    if (Index + 1 < Segment->Count)
-    {
-        if (NewSegment)
-            *NewSegment = Segment;
-
-        return &Segment->Actions[Index + 1];
-    }
 
-    return NULL;
+    return &List->Actions[Index];
 }
 
 VOID PkpDeleteAction(
@@ -1179,51 +1611,31 @@ VOID PkpDeleteAction(
         PhDereferenceObject(Action->u.Add.Destination);
         break;
     case PkAddFromPackageType:
-        ((IInArchive *)Action->u.AddFromPackage.Package)->Release();
+        PkDereferencePackage(Action->u.AddFromPackage.Package);
         break;
     }
 }
 
-PPK_ACTION_SEGMENT PkpAllocateActionSegment(
-    _In_ ULONG SegmentIndex
-    )
-{
-    PPK_ACTION_SEGMENT segment;
-
-    segment = (PPK_ACTION_SEGMENT)PhAllocate(sizeof(PK_ACTION_SEGMENT));
-    segment->Next = NULL;
-    segment->SegmentIndex = SegmentIndex;
-    segment->Count = 0;
-
-    return segment;
-}
-
 VOID PkpAddToActionList(
     _In_ PPK_ACTION_LIST List,
     _In_ PPK_ACTION Action
     )
 {
-    PPK_ACTION_SEGMENT segment;
-
-    if (!List->LastSegment)
+    if (List->NumberOfActions == List->AllocatedActions)
     {
-        List->LastSegment = PkpAllocateActionSegment(0);
-        List->FirstSegment = List->LastSegment;
-        List->NumberOfSegments = 1;
-    }
-
-    segment = List->LastSegment;
-
-    if (segment->Count == PK_ACTION_SEGMENT_SIZE)
-    {
-        segment = PkpAllocateActionSegment(List->NumberOfSegments);
-        List->NumberOfSegments++;
-        List->LastSegment->Next = segment;
-        List->LastSegment = segment;
+        if (List->AllocatedActions == 0)
+        {
+            List->AllocatedActions = 64;
+            List->Actions = (PPK_ACTION)PhAllocate(sizeof(PK_ACTION) * List->AllocatedActions);
+        }
+        else
+        {
+            List->AllocatedActions *= 2;
+            List->Actions = (PPK_ACTION)PhReAllocate(List->Actions, sizeof(PK_ACTION) * List->AllocatedActions);
+        }
     }
 
-    segment->Actions[segment->Count] = *Action;
-    segment->Count++;
+    List->Actions[List->NumberOfActions] = *Action;
     List->NumberOfActions++;
 }
 
@@ -1251,29 +1663,218 @@ HRESULT PkpCreateSevenZipObject(
     return CreateObject_I(ClassId, InterfaceId, Object);
 }
 
+HRESULT PkpSetCompressionProperties(
+    _In_ IOutArchive *OutArchive,
+    _In_ PPK_COMPRESSION_SETTINGS Settings
+    )
+{
+    static PWSTR methodNames[PkMaximumMethod] = { NULL, L"LZMA2", L"LZMA", L"PPMd", L"Copy" };
+
+    HRESULT result;
+    ISetProperties *setProperties;
+    const wchar_t *names[7];
+    PROPVARIANT values[7];
+    ULONG numberOfProperties;
+    PPH_STRING string;
+    ULONG i;
+
+    numberOfProperties = 0;
+
+    // The level must come first because it resets the other properties to the defaults for that level.
+
+    if (Settings->Level != PK_COMPRESSION_DEFAULT)
+    {
+        names[numberOfProperties] = L"x";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_UI4;
+        values[numberOfProperties].ulVal = Settings->Level;
+        numberOfProperties++;
+    }
+
+    if (Settings->Method != PkDefaultMethod && Settings->Method < PkMaximumMethod)
+    {
+        names[numberOfProperties] = L"0";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_BSTR;
+        values[numberOfProperties].bstrVal = SysAllocString(methodNames[Settings->Method]);
+        numberOfProperties++;
+    }
+
+    if (Settings->DictionarySize != PK_COMPRESSION_DEFAULT && Settings->Method != PkCopyMethod)
+    {
+        // PPMd calls its model size "mem" instead of "d".
+        string = PhFormatString(L"%lum", Settings->DictionarySize);
+        names[numberOfProperties] = Settings->Method == PkPpmdMethod ? L"0mem" : L"0d";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_BSTR;
+        values[numberOfProperties].bstrVal = SysAllocString(string->Buffer);
+        numberOfProperties++;
+        PhDereferenceObject(string);
+    }
+
+    if (Settings->SolidBlockSize != PK_COMPRESSION_DEFAULT)
+    {
+        if (Settings->SolidBlockSize != 0)
+            string = PhFormatString(L"%lum", Settings->SolidBlockSize);
+        else
+            string = PhCreateString(L"off");
+
+        names[numberOfProperties] = L"s";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_BSTR;
+        values[numberOfProperties].bstrVal = SysAllocString(string->Buffer);
+        numberOfProperties++;
+        PhDereferenceObject(string);
+    }
+
+    if (Settings->NumberOfThreads != PK_COMPRESSION_DEFAULT)
+    {
+        names[numberOfProperties] = L"mt";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_UI4;
+        values[numberOfProperties].ulVal = Settings->NumberOfThreads;
+        numberOfProperties++;
+    }
+
+    if (Settings->HeaderCompression != PK_COMPRESSION_DEFAULT)
+    {
+        names[numberOfProperties] = L"hc";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_BSTR;
+        values[numberOfProperties].bstrVal = SysAllocString(Settings->HeaderCompression ? L"on" : L"off");
+        numberOfProperties++;
+    }
+
+    if (Settings->SortByType != PK_COMPRESSION_DEFAULT)
+    {
+        // 7-Zip orders the items itself when it builds solid blocks, so this is the only
+        // ordering that reaches the compressor.
+        names[numberOfProperties] = L"qs";
+        PropVariantInit(&values[numberOfProperties]);
+        values[numberOfProperties].vt = VT_BSTR;
+        values[numberOfProperties].bstrVal = SysAllocString(Settings->SortByType ? L"on" : L"off");
+        numberOfProperties++;
+    }
+
+    if (numberOfProperties == 0)
+        return S_OK;
+
+    result = OutArchive->QueryInterface(IID_ISetProperties_I, (void **)&setProperties);
+
+    if (SUCCEEDED(result))
+    {
+        result = setProperties->SetProperties(names, values, numberOfProperties);
+        setProperties->Release();
+    }
+
+    for (i = 0; i < numberOfProperties; i++)
+        PropVariantClear(&values[i]);
+
+    return result;
+}
+
+HRESULT PkpCreateSpoolFileStream(
+    _Out_ PkFileStream **FileStream
+    )
+{
+    NTSTATUS status;
+    WCHAR tempPathBuffer[MAX_PATH + 1];
+    WCHAR tempNameBuffer[16];
+    PH_STRINGREF tempPathSr;
+    PH_STRINGREF tempNameSr;
+    PPH_STRING fileName;
+    HANDLE fileHandle;
+    PPH_FILE_STREAM fileStream;
+
+    if (GetTempPath(MAX_PATH + 1, tempPathBuffer) == 0)
+        return E_FAIL;
+
+    tempNameBuffer[0] = 'p';
+    tempNameBuffer[1] = 'k';
+    tempNameBuffer[2] = '.';
+    PhGenerateRandomAlphaString(tempNameBuffer + 3, 9);
+    tempNameBuffer[11] = '.';
+    tempNameBuffer[12] = 't';
+    tempNameBuffer[13] = 'm';
+    tempNameBuffer[14] = 'p';
+    tempNameSr.Buffer = tempNameBuffer;
+    tempNameSr.Length = 15 * sizeof(WCHAR);
+    PhInitializeStringRef(&tempPathSr, tempPathBuffer);
+    fileName = PhConcatStringRef2(&tempPathSr, &tempNameSr);
+
+    status = PhCreateFileWin32(
+        &fileHandle,
+        fileName->Buffer,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE | DELETE,
+        FILE_ATTRIBUTE_TEMPORARY,
+        0,
+        FILE_CREATE,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_DELETE_ON_CLOSE
+        );
+    PhDereferenceObject(fileName);
+
+    if (!NT_SUCCESS(status))
+        return E_FAIL;
+
+    status = PhCreateFileStream2(&fileStream, fileHandle, 0, PAGE_SIZE);
+
+    if (!NT_SUCCESS(status))
+    {
+        NtClose(fileHandle);
+        return E_FAIL;
+    }
+
+    *FileStream = new PkFileStream(PkNormalFileStream, fileStream);
+    PhDereferenceObject(fileStream);
+
+    return S_OK;
+}
+
 HRESULT PkpCloseExtractCallback(
     _In_ PkArchiveUpdateCallback *UpdateCallback
     )
 {
     HRESULT result;
+    std::unordered_map<IInArchive *, PkUpdateArchiveExtractCallback *>::iterator it;
+    PkUpdateArchiveExtractCallback *extractCallback;
 
     result = S_OK;
 
-    if (UpdateCallback->ExtractCallback)
+    for (it = UpdateCallback->ExtractCallbacks.begin(); it != UpdateCallback->ExtractCallbacks.end(); ++it)
     {
-        UpdateCallback->ExtractCallback->StopThread();
-        UpdateCallback->ExtractCallback->WaitForThread();
-        result = UpdateCallback->ExtractCallback->Result;
-        UpdateCallback->ExtractCallback->Release();
-        UpdateCallback->ExtractCallback = NULL;
+        extractCallback = it->second;
+        extractCallback->StopThread();
+        extractCallback->WaitForThread();
+
+        if (SUCCEEDED(result))
+            result = extractCallback->Result;
+
+        extractCallback->Release();
     }
 
+    UpdateCallback->ExtractCallbacks.clear();
+
     return result;
 }
 
+VOID PkInitializeCompressionSettings(
+    _Out_ PPK_COMPRESSION_SETTINGS Settings
+    )
+{
+    Settings->Level = PK_COMPRESSION_DEFAULT;
+    Settings->Method = PkDefaultMethod;
+    Settings->DictionarySize = PK_COMPRESSION_DEFAULT;
+    Settings->SolidBlockSize = PK_COMPRESSION_DEFAULT;
+    Settings->NumberOfThreads = PK_COMPRESSION_DEFAULT;
+    Settings->HeaderCompression = PK_COMPRESSION_DEFAULT;
+    Settings->SortByType = PK_COMPRESSION_DEFAULT;
+    Settings->PipeBufferSize = PK_COMPRESSION_DEFAULT;
+}
+
 HRESULT PkCreatePackage(
     _In_ PPK_FILE_STREAM FileStream,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings,
     _In_ PPK_PACKAGE_CALLBACK Callback,
     _In_opt_ PVOID Context
     )
@@ -1292,13 +1893,25 @@ HRESULT PkCreatePackage(
     if (!SUCCEEDED(result))
         return result;
 
+    if (Settings)
+    {
+        result = PkpSetCompressionProperties(outArchive, Settings);
+
+        if (!SUCCEEDED(result))
+        {
+            outArchive->Release();
+            return result;
+        }
+    }
+
     updateCallback = new PkArchiveUpdateCallback;
     updateCallback->ReferenceCount = 1;
     updateCallback->ActionList = ActionList;
     updateCallback->Callback = Callback;
     updateCallback->Context = Context;
     updateCallback->InArchive = NULL;
-    updateCallback->CreateActionMap();
+    updateCallback->PipeBufferSize = PkpGetMaximumPipeBufferSize(Settings);
+    updateCallback->CreateExtractCallbacks();
 
     result = outArchive->UpdateItems(&fileStream->OutStream, ActionList->NumberOfActions, updateCallback);
 
@@ -1431,6 +2044,7 @@ HRESULT PkUpdatePackage(
     _In_ PPK_FILE_STREAM FileStream,
     _In_ PPK_PACKAGE Package,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings,
     _In_ PPK_PACKAGE_CALLBACK Callback,
     _In_opt_ PVOID Context
     )
@@ -1448,13 +2062,25 @@ HRESULT PkUpdatePackage(
     if (!SUCCEEDED(result))
         return result;
 
+    if (Settings)
+    {
+        result = PkpSetCompressionProperties(outArchive, Settings);
+
+        if (!SUCCEEDED(result))
+        {
+            outArchive->Release();
+            return result;
+        }
+    }
+
     updateCallback = new PkArchiveUpdateCallback;
     updateCallback->ReferenceCount = 1;
     updateCallback->ActionList = ActionList;
     updateCallback->Callback = Callback;
     updateCallback->Context = Context;
     updateCallback->InArchive = inArchive;
-    updateCallback->CreateActionMap();
+    updateCallback->PipeBufferSize = PkpGetMaximumPipeBufferSize(Settings);
+    updateCallback->CreateExtractCallbacks();
 
     result = outArchive->UpdateItems(&fileStream->OutStream, ActionList->NumberOfActions, updateCallback);
 
@@ -1481,10 +2107,8 @@ HRESULT PkExtractPackage(
     PkArchiveExtractCallback *extractCallback;
     PULONG items;
     ULONG numberOfItems;
-    PPK_ACTION_SEGMENT segment;
     ULONG i;
 
-    result = S_OK;
     inArchive = (IInArchive *)Package;
 
     extractCallback = new PkArchiveExtractCallback;
@@ -1497,27 +2121,15 @@ HRESULT PkExtractPackage(
     if (ActionList)
     {
         items = (PULONG)PhAllocate(sizeof(ULONG) * ActionList->NumberOfActions);
-        segment = ActionList->FirstSegment;
         numberOfItems = 0;
 
-        while (segment)
+        for (i = 0; i < ActionList->NumberOfActions; i++)
         {
-            for (i = 0; i < segment->Count; i++)
+            if (ActionList->Actions[i].Type == PkUpdateType)
             {
-                if (numberOfItems >= ActionList->NumberOfActions)
-                {
-                    result = E_INVALIDARG;
-                    break;
-                }
-
-                if (segment->Actions[i].Type == PkUpdateType)
-                {
-                    items[numberOfItems] = segment->Actions[i].u.Update.Index;
-                    numberOfItems++;
-                }
+                items[numberOfItems] = ActionList->Actions[i].u.Update.Index;
+                numberOfItems++;
             }
-
-            segment = segment->Next;
         }
 
         extractCallback->CreateActionMap();
@@ -1528,9 +2140,6 @@ HRESULT PkExtractPackage(
         numberOfItems = -1;
     }
 
-    if (!SUCCEEDED(result))
-        return result;
-
     result = inArchive->Extract((UInt32 *)items, numberOfItems, FALSE, extractCallback);
 
     if (items)
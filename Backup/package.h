@@ -15,6 +15,23 @@ PPK_FILE_STREAM PkCreateFileStream(
     _In_opt_ PPH_FILE_STREAM FileStream
     );
 
+PPK_FILE_STREAM PkCreateFileStreamRange(
+    _In_ PPH_FILE_STREAM FileStream,
+    _In_ ULONGLONG Length
+    );
+
+PPK_FILE_STREAM PkCreateFileStreamBuffer(
+    _In_ _Post_invalid_ PVOID Buffer,
+    _In_ SIZE_T Length
+    );
+
+PPK_FILE_STREAM PkCreateFileStreamUnbuffered(
+    _In_ PPH_FILE_STREAM FileStream,
+    _In_ ULONGLONG Offset,
+    _In_ ULONGLONG Length,
+    _In_ SIZE_T BlockSize
+    );
+
 VOID PkReferenceFileStream(
     _In_ PPK_FILE_STREAM FileStream
     );
@@ -23,6 +40,17 @@ VOID PkDereferenceFileStream(
     _In_ PPK_FILE_STREAM FileStream
     );
 
+#define PK_MINIMUM_PIPE_BUFFER_SIZE (1024 * 1024)
+#define PK_DEFAULT_PIPE_BUFFER_SIZE (4 * 1024 * 1024)
+#define PK_MAXIMUM_PIPE_BUFFER_SIZE (64 * 1024 * 1024)
+#define PK_PIPE_BENCHMARK_BLOCK_SIZE (1024 * 1024)
+
+HRESULT PkBenchmarkPipe(
+    _In_ ULONGLONG StreamSize,
+    _In_ ULONG BufferSize,
+    _Out_ PLARGE_INTEGER Duration
+    );
+
 // Action list
 
 typedef enum _PK_ACTION_TYPE
@@ -58,23 +86,13 @@ typedef struct _PK_ACTION
     PVOID Context;
 } PK_ACTION, *PPK_ACTION;
 
-#define PK_ACTION_SEGMENT_SHIFT 6
-#define PK_ACTION_SEGMENT_SIZE (1 << PK_ACTION_SEGMENT_SHIFT)
-
-typedef struct _PK_ACTION_SEGMENT
-{
-    struct _PK_ACTION_SEGMENT *Next;
-    ULONG SegmentIndex;
-    ULONG Count;
-    PK_ACTION Actions[PK_ACTION_SEGMENT_SIZE];
-} PK_ACTION_SEGMENT, *PPK_ACTION_SEGMENT;
-
+// Actions are stored contiguously, so a pointer to an action is only valid until the next
+// append.
 typedef struct _PK_ACTION_LIST
 {
-    PPK_ACTION_SEGMENT FirstSegment;
-    PPK_ACTION_SEGMENT LastSegment;
-    ULONG NumberOfSegments;
+    PPK_ACTION Actions;
     ULONG NumberOfActions;
+    ULONG AllocatedActions;
 } PK_ACTION_LIST, *PPK_ACTION_LIST;
 
 PPK_ACTION_LIST PkCreateActionList(
@@ -111,15 +129,40 @@ VOID PkAppendUpdateToActionList(
 
 PPK_ACTION PkIndexInActionList(
     _In_ PPK_ACTION_LIST List,
-    _In_ ULONG Index,
-    _Out_opt_ PPK_ACTION_SEGMENT *Segment
+    _In_ ULONG Index
     );
 
-PPK_ACTION PkGetNextAction(
-    _In_ PPK_ACTION Action,
-    _In_ ULONG Index,
-    _In_ PPK_ACTION_SEGMENT Segment,
-    _Out_opt_ PPK_ACTION_SEGMENT *NewSegment
+// Compression
+
+#define PK_COMPRESSION_DEFAULT ((ULONG)-1)
+
+typedef enum _PK_COMPRESSION_METHOD
+{
+    PkDefaultMethod,
+    PkLzma2Method,
+    PkLzmaMethod,
+    PkPpmdMethod,
+    PkCopyMethod,
+    PkMaximumMethod
+} PK_COMPRESSION_METHOD;
+
+// Any field can be PK_COMPRESSION_DEFAULT (or PkDefaultMethod) to use the default. For
+// PipeBufferSize, the default is PK_DEFAULT_PIPE_BUFFER_SIZE; the other fields use the 7-Zip
+// defaults.
+typedef struct _PK_COMPRESSION_SETTINGS
+{
+    ULONG Level; // 0 to 9
+    PK_COMPRESSION_METHOD Method;
+    ULONG DictionarySize; // in MB
+    ULONG SolidBlockSize; // in MB, 0 for non-solid
+    ULONG NumberOfThreads;
+    ULONG HeaderCompression; // 1 or 0
+    ULONG SortByType; // 1 to sort solid blocks by extension, 0 to keep directories together
+    ULONG PipeBufferSize; // in MB, for items copied from other packages
+} PK_COMPRESSION_SETTINGS, *PPK_COMPRESSION_SETTINGS;
+
+VOID PkInitializeCompressionSettings(
+    _Out_ PPK_COMPRESSION_SETTINGS Settings
     );
 
 // Package
@@ -141,6 +184,7 @@ typedef struct _PK_PARAMETER_GET_STREAM
 {
     PPK_FILE_STREAM FileStream;
     FILE_NETWORK_OPEN_INFORMATION FileInformation;
+    PH_STRINGREF Path; // extraction only
 } PK_PARAMETER_GET_STREAM, *PPK_PARAMETER_GET_STREAM;
 
 typedef struct _PK_PARAMETER_FILTER_ITEM
@@ -167,6 +211,7 @@ typedef HRESULT (NTAPI *PPK_PACKAGE_CALLBACK)(
 HRESULT PkCreatePackage(
     _In_ PPK_FILE_STREAM FileStream,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings,
     _In_ PPK_PACKAGE_CALLBACK Callback,
     _In_opt_ PVOID Context
     );
@@ -191,6 +236,7 @@ HRESULT PkUpdatePackage(
     _In_ PPK_FILE_STREAM FileStream,
     _In_ PPK_PACKAGE Package,
     _In_ PPK_ACTION_LIST ActionList,
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings,
     _In_ PPK_PACKAGE_CALLBACK Callback,
     _In_opt_ PVOID Context
     );
@@ -2,6 +2,7 @@
 #define PACKAGEP_H
 
 #include <unordered_map>
+#include <vector>
 #include "lzma/CPP/7zip/Archive/IArchive.h"
 #include "lzma/CPP/7zip/ICoder.h"
 
@@ -12,6 +13,15 @@ typedef HRESULT (STDAPICALLTYPE *_CreateObject)(const GUID *clsid, const GUID *i
 class PkFileStream;
 class PkUpdateArchiveExtractCallback;
 
+SIZE_T PkpGetMaximumPipeBufferSize(
+    _In_opt_ PPK_COMPRESSION_SETTINGS Settings
+    );
+
+SIZE_T PkpGetPipeBufferSize(
+    _In_ ULONGLONG StreamSize,
+    _In_ SIZE_T MaximumBufferSize
+    );
+
 extern GUID IID_ISequentialInStream_I;
 extern GUID IID_ISequentialOutStream_I;
 extern GUID IID_IInStream_I;
@@ -63,7 +73,10 @@ enum PkFileStreamMode
     PkNormalFileStream,
     PkPipeFileStream,
     PkPipeWriterFileStream,
-    PkPipeReaderFileStream
+    PkPipeReaderFileStream,
+    PkRangeFileStream,
+    PkBufferFileStream,
+    PkUnbufferedFileStream
 };
 
 class PkFileStream
@@ -99,20 +112,27 @@ public:
 
     ULONG STDMETHODCALLTYPE AddRef()
     {
-        return ++ReferenceCount;
+        return _InterlockedIncrement(&ReferenceCount);
     }
 
     ULONG STDMETHODCALLTYPE Release()
     {
-        if (--ReferenceCount == 0)
+        LONG referenceCount;
+
+        // The two ends of a pipe are released on different threads, and both reference the pipe.
+        referenceCount = _InterlockedDecrement(&ReferenceCount);
+
+        if (referenceCount == 0)
         {
             delete this;
         }
 
-        return ReferenceCount;
+        return referenceCount;
     }
 
     HRESULT STDMETHODCALLTYPE Seek(Int64 offset, UInt32 seekOrigin, UInt64 *newPosition);
+    HRESULT ReadUnbuffered(void *data, UInt32 size, UInt32 *processedSize);
+    VOID StartUnbufferedRead();
 
 public:
     PkFileStreamMode Mode;
@@ -121,21 +141,40 @@ public:
     PkFileOutStream OutStream;
     PkFileStreamGetSize StreamGetSize;
 
-    // Pipe
+    // Pipe and buffer
+    // A buffer stream reads StreamSize bytes from Buffer, which it owns.
+    // The pipe is a single-producer/single-consumer ring buffer. ReadCount is only modified by the
+    // reader and WriteCount is only modified by the writer, so neither side needs to take the lock
+    // unless the buffer is empty or full.
     PkFileStream *ParentPipe;
     ULONGLONG StreamSize;
     ULONGLONG RemainingStreamSize;
     PVOID Buffer;
-    SIZE_T BufferSize;
+    SIZE_T BufferSize; // power of two
+    volatile SIZE_T ReadCount;
+    volatile SIZE_T WriteCount;
+    volatile BOOLEAN ReaderWaiting;
+    volatile BOOLEAN WriterWaiting;
     PH_QUEUED_LOCK PipeLock;
     PH_QUEUED_LOCK PipeCondition;
-    SIZE_T ReadPosition;
-    SIZE_T ReadableSize;
     ULONG WriteReferenceCount;
     ULONG ReadReferenceCount;
 
+    // Unbuffered
+    // Blocks of BufferSize bytes are read into the two halves of Buffer. The next block is read
+    // in the background while the caller copies data out of the current one.
+    HANDLE ReadEvent;
+    IO_STATUS_BLOCK ReadIosb;
+    NTSTATUS ReadStatus; // STATUS_PENDING while the read is in progress
+    BOOLEAN ReadStarted;
+    ULONGLONG ReadOffset; // file offset of the next block
+    ULONG ActiveBuffer;
+    SIZE_T DataPosition;
+    SIZE_T DataLength;
+
     PkFileStream(PkFileStreamMode mode, PPH_FILE_STREAM fileStream, ULONGLONG streamSize = 0)
-        : ReferenceCount(1), FileStream(fileStream), ParentPipe(NULL), StreamSize(streamSize), Buffer(NULL), WriteReferenceCount(0), ReadReferenceCount(0)
+        : ReferenceCount(1), FileStream(fileStream), ParentPipe(NULL), StreamSize(streamSize), Buffer(NULL), ReadCount(0), WriteCount(0),
+        ReaderWaiting(FALSE), WriterWaiting(FALSE), WriteReferenceCount(0), ReadReferenceCount(0), ReadEvent(NULL), ReadStarted(FALSE)
     {
         if (FileStream)
             PhReferenceObject(FileStream);
@@ -165,6 +204,7 @@ public:
             }
 
             PhReleaseQueuedLockExclusive(&ParentPipe->PipeLock);
+            ParentPipe->Release();
         }
         else if (Mode == PkPipeReaderFileStream)
         {
@@ -176,15 +216,30 @@ public:
             }
 
             PhReleaseQueuedLockExclusive(&ParentPipe->PipeLock);
+            ParentPipe->Release();
+        }
+        else if (Mode == PkUnbufferedFileStream)
+        {
+            // The buffer can't be freed while it is being read into.
+            if (ReadStarted && ReadStatus == STATUS_PENDING)
+                NtWaitForSingleObject(ReadEvent, FALSE, NULL);
         }
 
+        if (ReadEvent)
+            NtClose(ReadEvent);
         if (FileStream)
             PhDereferenceObject(FileStream);
+
         if (Buffer)
-            PhFreePage(Buffer);
+        {
+            if (Mode == PkBufferFileStream)
+                PhFree(Buffer);
+            else
+                PhFreePage(Buffer);
+        }
     }
 
-    VOID InitializePipe(IOutStream **Writer, IInStream **Reader)
+    VOID InitializePipe(IOutStream **Writer, IInStream **Reader, SIZE_T MaximumBufferSize)
     {
         PkFileStream *writer;
         PkFileStream *reader;
@@ -192,9 +247,9 @@ public:
         Mode = PkPipeFileStream;
 
         RemainingStreamSize = StreamSize;
-        Buffer = PhAllocatePage(PAGE_SIZE * 4, &BufferSize);
-        ReadPosition = 0;
-        ReadableSize = 0;
+        Buffer = PhAllocatePage(PkpGetPipeBufferSize(StreamSize, MaximumBufferSize), &BufferSize);
+        ReadCount = 0;
+        WriteCount = 0;
 
         writer = new PkFileStream(PkPipeWriterFileStream, NULL);
         writer->InitializePipeWriter(this);
@@ -205,6 +260,31 @@ public:
         *Reader = &reader->InStream;
     }
 
+    VOID InitializeBuffer(PVOID Buffer, SIZE_T Length)
+    {
+        Mode = PkBufferFileStream;
+        this->Buffer = Buffer;
+        BufferSize = Length;
+        StreamSize = Length;
+        RemainingStreamSize = Length;
+    }
+
+    VOID InitializeUnbuffered(ULONGLONG Offset, ULONGLONG Length, SIZE_T BlockSize)
+    {
+        Mode = PkUnbufferedFileStream;
+        StreamSize = Length;
+        RemainingStreamSize = Length;
+        Buffer = PhAllocatePage(BlockSize * 2, NULL);
+        BufferSize = BlockSize;
+        ReadOffset = Offset;
+        ActiveBuffer = 1; // the first block is read into the other buffer
+        DataPosition = 0;
+        DataLength = 0;
+
+        if (NT_SUCCESS(NtCreateEvent(&ReadEvent, EVENT_ALL_ACCESS, NULL, NotificationEvent, FALSE)))
+            StartUnbufferedRead();
+    }
+
     VOID InitializePipeWriter(PkFileStream *Parent)
     {
         Mode = PkPipeWriterFileStream;
@@ -222,9 +302,12 @@ public:
     }
 
 private:
-    ULONG ReferenceCount;
+    volatile LONG ReferenceCount;
 };
 
+// Each live extractor has its own thread and decoder, and the decoder holds a full dictionary.
+#define PK_MAXIMUM_LIVE_EXTRACTORS 8
+
 class PkArchiveUpdateCallback : public IArchiveUpdateCallback
 {
 public:
@@ -241,15 +324,14 @@ public:
     ULONGLONG ProgressValue;
     ULONGLONG ProgressTotal;
     IInArchive *InArchive;
-    std::unordered_map<ULONG, PPK_ACTION> ActionMap;
-
-    PkUpdateArchiveExtractCallback *ExtractCallback;
+    SIZE_T PipeBufferSize; // maximum buffer size for items copied from other packages
 
-    PkArchiveUpdateCallback()
-        : ExtractCallback(NULL)
-    { }
+    // One extractor per source package, so that each package is decoded in a single pass.
+    std::unordered_map<IInArchive *, PkUpdateArchiveExtractCallback *> ExtractCallbacks;
+    ULONG ExtractorUseCount; // for finding the least recently used extractor
 
-    VOID CreateActionMap();
+    VOID CreateExtractCallbacks();
+    VOID LimitExtractors();
 
 private:
     PPK_ACTION GetAction(ULONG index);
@@ -264,23 +346,30 @@ public:
     INTERFACE_IArchiveExtractCallback(;)
 
 public:
-    ULONG ReferenceCount;
+    volatile LONG ReferenceCount;
     PkArchiveUpdateCallback *Owner;
     IInArchive *InArchive;
-    ULONG ItemIndex;
+    std::vector<UInt32> Items; // sorted indices of the items we need from InArchive
+    ULONG ItemIndex; // item currently requested by the updater
     IOutStream *OutStream;
+    ULONG SpoolItemIndex; // item currently being written to SpoolStream
+    PkFileStream *SpoolStream;
+    std::unordered_map<ULONG, PkFileStream *> SpooledStreams;
     HRESULT Result;
+    ULONG LastUse; // value of Owner->ExtractorUseCount when an item was last requested
+    BOOLEAN Draining; // spool all remaining items without waiting for the updater
     BOOLEAN ThreadStarted;
     BOOLEAN ThreadStopping;
+    BOOLEAN ThreadFinished;
     HANDLE ThreadFinishEvent;
     PH_QUEUED_LOCK Lock;
     PH_QUEUED_LOCK Condition;
 
     VOID StartThread();
     VOID StopThread();
+    VOID StartDraining();
     BOOLEAN WaitForThread();
-    VOID SetNewJob(IInArchive *NewInArchive, ULONG NewItemIndex, IOutStream *NewOutStream);
-    VOID WaitForJob();
+    HRESULT GetItemStream(ULONG NewItemIndex, ISequentialInStream **InStream);
     VOID Run();
 
     static NTSTATUS NTAPI ThreadStart(PVOID Parameter)
@@ -295,15 +384,22 @@ public:
         return STATUS_SUCCESS;
     }
 
-    PkUpdateArchiveExtractCallback()
+    PkUpdateArchiveExtractCallback(IInArchive *Package)
     {
         ReferenceCount = 1;
-        InArchive = NULL;
+        Owner = NULL;
+        InArchive = Package;
+        InArchive->AddRef();
         ItemIndex = -1;
         OutStream = NULL;
+        SpoolItemIndex = -1;
+        SpoolStream = NULL;
         Result = S_OK;
+        LastUse = 0;
+        Draining = FALSE;
         ThreadStarted = FALSE;
         ThreadStopping = FALSE;
+        ThreadFinished = FALSE;
         PhInitializeQueuedLock(&Lock);
         PhInitializeQueuedLock(&Condition);
         ThreadFinishEvent = NULL;
@@ -312,10 +408,17 @@ public:
 
     ~PkUpdateArchiveExtractCallback()
     {
+        std::unordered_map<ULONG, PkFileStream *>::iterator it;
+
+        for (it = SpooledStreams.begin(); it != SpooledStreams.end(); ++it)
+            it->second->Release();
+
         if (InArchive)
             InArchive->Release();
         if (OutStream)
             OutStream->Release();
+        if (SpoolStream)
+            SpoolStream->Release();
         if (ThreadFinishEvent)
             NtClose(ThreadFinishEvent);
     }
@@ -351,10 +454,6 @@ VOID PkpDeleteAction(
     _In_ PPK_ACTION Action
     );
 
-PPK_ACTION_SEGMENT PkpAllocateActionSegment(
-    _In_ ULONG SegmentIndex
-    );
-
 VOID PkpAddToActionList(
     _In_ PPK_ACTION_LIST List,
     _In_ PPK_ACTION Action
@@ -368,7 +467,16 @@ HRESULT PkpCreateSevenZipObject(
     _Out_ PVOID *Object
     );
 
-HRESULT PkpWaitForExtractCallback(
+HRESULT PkpSetCompressionProperties(
+    _In_ IOutArchive *OutArchive,
+    _In_ PPK_COMPRESSION_SETTINGS Settings
+    );
+
+HRESULT PkpCreateSpoolFileStream(
+    _Out_ PkFileStream **FileStream
+    );
+
+HRESULT PkpCloseExtractCallback(
     _In_ PkArchiveUpdateCallback *UpdateCallback
     );
 